@@ -4,12 +4,16 @@
  * Use of this source code is governed by an MIT-style
  * license that can be found in the LICENSE file.
  */
+#include <algorithm>
+#include <atomic>
 #include <cinttypes>
 #include <cstdint>
 #include <cstring>
+#include <exception>
 #include <fstream>
 #include <limits>
 #include <memory>
+#include <mutex>
 #include <vector>
 
 #ifdef JXLAZY_DEBUG
@@ -103,8 +107,105 @@ typename enable_if<is_unsigned<T>::value, bool>::type safeMul(T a, T b, T* produ
   return (a == 0 || a == 1 || b == 1 || *product / a == b);
 }
 
+// Identifies a file written by Decoder::saveIndex
+constexpr char kIndexMagic[8] = {'J', 'X', 'L', 'A', 'Z', 'Y', 'I', 'X'};
+constexpr uint32_t kIndexVersion = 1;
+// Number of bytes at the start of the input used to check that an index matches.
+constexpr size_t kFingerprintBytes = 4096;
+
+// Index fields are always stored little-endian.
+void writeU32(ostream& out, uint32_t v) {
+  char bytes[4];
+  for (int i = 0; i < 4; ++i) {
+    bytes[i] = static_cast<char>((v >> (8 * i)) & 0xff);
+  }
+  out.write(bytes, sizeof bytes);
+}
+
+void writeU64(ostream& out, uint64_t v) {
+  writeU32(out, static_cast<uint32_t>(v));
+  writeU32(out, static_cast<uint32_t>(v >> 32));
+}
+
+bool readU32(istream& in, uint32_t* v) {
+  unsigned char bytes[4];
+  if (!in.read(reinterpret_cast<char*>(bytes), sizeof bytes)) {
+    return false;
+  }
+  *v = 0;
+  for (int i = 0; i < 4; ++i) {
+    *v |= static_cast<uint32_t>(bytes[i]) << (8 * i);
+  }
+  return true;
+}
+
+bool readU64(istream& in, uint64_t* v) {
+  uint32_t lo, hi;
+  if (!readU32(in, &lo) || !readU32(in, &hi)) {
+    return false;
+  }
+  *v = (static_cast<uint64_t>(hi) << 32) | lo;
+  return true;
+}
+
+void writeBlendInfo(ostream& out, const JxlBlendInfo& bi) {
+  writeU32(out, static_cast<uint32_t>(bi.blendmode));
+  writeU32(out, bi.source);
+  writeU32(out, bi.alpha);
+  writeU32(out, static_cast<uint32_t>(bi.clamp));
+}
+
+bool readBlendInfo(istream& in, JxlBlendInfo* bi) {
+  uint32_t blendmode, clamp;
+  if (!readU32(in, &blendmode) || !readU32(in, &bi->source) ||
+      !readU32(in, &bi->alpha) || !readU32(in, &clamp)) {
+    return false;
+  }
+  bi->blendmode = static_cast<JxlBlendMode>(blendmode);
+  bi->clamp = static_cast<JXL_BOOL>(clamp);
+  return true;
+}
+
+TraceHandler traceHandler{};
+
+std::atomic<uint64_t> rewindCount{0};
+std::atomic<uint64_t> refillCount{0};
+std::atomic<uint64_t> inputByteCount{0};
+std::atomic<uint64_t> pixelCount{0};
+
+/**
+ * Reports an operation to the installed TraceHandler for the lifetime of this object.
+ */
+class TraceSpan {
+ public:
+  explicit TraceSpan(const char* name) : active_(traceHandler.begin != nullptr) {
+    if (active_) traceHandler.begin(name);
+  }
+  TraceSpan(const TraceSpan&) = delete;
+  TraceSpan& operator=(const TraceSpan&) = delete;
+  ~TraceSpan() {
+    if (active_ && traceHandler.end) traceHandler.end();
+  }
+
+ private:
+  bool active_;
+};
+
 }  // namespace
 
+void setTraceHandler(const TraceHandler& handler) {
+  traceHandler = handler;
+}
+
+DecoderCounters getDecoderCounters() {
+  return {
+    .rewinds = rewindCount.load(std::memory_order_relaxed),
+    .refills = refillCount.load(std::memory_order_relaxed),
+    .inputBytes = inputByteCount.load(std::memory_order_relaxed),
+    .pixelsDecoded = pixelCount.load(std::memory_order_relaxed),
+  };
+}
+
 Decoder::Decoder(size_t numThreads/* = 0*/,
                  const JxlMemoryManager* memManager/* = nullptr*/,
                  JxlParallelRunner parallelRunner/* = nullptr*/,
@@ -135,7 +236,8 @@ Code shared by several open functions.
 
 Before calling this, the caller must:
 - Call `close_(true)`.
-- Set `inStreamPtr_` appropriately (to nullptr in the case of openMemory).
+- Set `inStreamPtr_` appropriately (to nullptr in the case of openMemory or a mapped
+  file).
 @param[in] bufferB Max buffer size to use for JXL bytes.  If `fromMemory`
                    != `nullptr`, this is the exact size of the existing buffer.
                    Not validated.
@@ -162,9 +264,10 @@ void Decoder::open_(uint32_t flags, uint32_t hints, size_t bufferB,
       JxlDecoderSetCoalescing(dec_.get(), JXL_FALSE) != JXL_DEC_SUCCESS) {
     throw LibraryError("Failed to disable coalescing.");
   }
-  if ((flags & DecoderFlag::KeepOrientation) &&
-      JxlDecoderSetKeepOrientation(dec_.get(), JXL_TRUE) != JXL_DEC_SUCCESS) {
-    throw LibraryError("Failed to set Keep Orientation flags.");
+  if ((flags & DecoderFlag::KeepOrientation)) {
+    if (JxlDecoderSetKeepOrientation(dec_.get(), JXL_TRUE) != JXL_DEC_SUCCESS)
+      throw LibraryError("Failed to set Keep Orientation flags.");
+    stateFlags_ |= StateFlag::KeepsOrientation;
   }
 
   if ((flags & DecoderFlag::UnpremultiplyAlpha) &&
@@ -179,7 +282,9 @@ void Decoder::open_(uint32_t flags, uint32_t hints, size_t bufferB,
     inBufferLength_ = bufferB;
     inBufferPtr_ = fromMemory;
     stateFlags_ |= StateFlag::WholeFileBuffered;
+    inputByteCount.fetch_add(bufferB, std::memory_order_relaxed);
   } else {
+    TraceSpan span("jxlazy::refill");
     inBufferPrivate_.resize(inBufferCap_);
     uint8_t* inBufferMutable = inBufferPrivate_.data();
     inBufferPtr_ = inBufferMutable;
@@ -188,6 +293,8 @@ void Decoder::open_(uint32_t flags, uint32_t hints, size_t bufferB,
       throw ReadError("Failed to read from input.");
     }
     inBufferLength_ = inStreamPtr_->gcount();
+    refillCount.fetch_add(1, std::memory_order_relaxed);
+    inputByteCount.fetch_add(inBufferLength_, std::memory_order_relaxed);
     inStreamPtr_->peek(); // ensure eofbit is set if we read the exact size.
     if (inStreamPtr_->eof()) {
       stateFlags_ |= StateFlag::WholeFileBuffered;
@@ -211,6 +318,11 @@ void Decoder::open_(uint32_t flags, uint32_t hints, size_t bufferB,
     // There won't be any boxes
     stateFlags_ |= StateFlag::SeenAllBoxes;
   }
+  fingerprintLength_ = std::min(inBufferLength_, kFingerprintBytes);
+  fingerprint_ = fnv1a(inBufferPtr_, fingerprintLength_);
+  if ((stateFlags_ & StateFlag::WholeFileBuffered)) {
+    inputSize_ = inBufferLength_;
+  }
 
   if (JxlDecoderSetInput(dec_.get(), inBufferPtr_, inBufferLength_) != JXL_DEC_SUCCESS)
     throw ReadError("Failed to set first %zu bytes of input", inBufferLength_);
@@ -271,6 +383,22 @@ void Decoder::openFile(const char* filename, uint32_t flags, uint32_t hints,
   // Close and reset (almost) everything
   close_(true);
 
+  if ((hints & DecoderHint::MapFile)) {
+    size_t mappedSize = 0;
+    inMapping_ = mapFile(filename, &mappedSize);
+    if (inMapping_) {
+      JXLAZY_DPRINTF("[%p] Mapped %zu bytes of %s.", static_cast<void*>(this),
+                     mappedSize, filename);
+      inStreamPrivate_.reset();
+      inStreamPtr_ = nullptr;
+      open_(flags, hints, mappedSize, false, inMapping_.get());
+      inBufferPrivate_.shrink_to_fit();
+      return;
+    }
+    JXLAZY_DPRINTF("[%p] Can't map %s - falling back to buffered reads.",
+                   static_cast<void*>(this), filename);
+  }
+
   if (!inStreamPrivate_) {
     inStreamPrivate_ = std::make_unique<std::ifstream>(filename, ios::binary);
   } else {
@@ -305,11 +433,15 @@ void Decoder::close_(bool reopening) {
   inBufferDecOffset_ = 0;
   inBufferPrivate_.clear();
   inBufferPtr_ = nullptr;
+  inMapping_.reset();
   JxlDecoderReset(dec_.get());
   eventsSubbed_ = 0;
   status_ = JXL_DEC_ERROR;
   boxes_.clear();
   nextBoxIndex_ = 0;
+  fingerprint_ = 0;
+  fingerprintLength_ = 0;
+  inputSize_ = 0;
   frames_.clear();
   nextFrameIndex_ = 0;
   jpegCount_ = 0;
@@ -532,6 +664,7 @@ size_t Decoder::frameCount() {
 }
 
 void Decoder::rewind_(int resubscribeTo) {
+  rewindCount.fetch_add(1, std::memory_order_relaxed);
   JxlDecoder* dec = dec_.get();
   JxlDecoderRewind(dec);
 #ifdef JXLAZY_DEBUG
@@ -615,20 +748,37 @@ size_t Decoder::getFrameBufferSize(size_t index, const JxlPixelFormat& pixelForm
 
 void Decoder::suggestPixelFormat(uint32_t bitsPerSample, uint32_t exponentBitsPerSample,
                                  uint32_t numChannels, JxlPixelFormat* format) {
-  format->data_type = (exponentBitsPerSample > 0 || bitsPerSample > 16) ? JXL_TYPE_FLOAT :
+  // Half floats hold anything with up to 5 exponent bits and 10 mantissa bits
+  const bool fitsHalf = exponentBitsPerSample > 0 && exponentBitsPerSample <= 5 &&
+                        bitsPerSample <= exponentBitsPerSample + 11;
+  format->data_type = fitsHalf ? JXL_TYPE_FLOAT16 :
+                      (exponentBitsPerSample > 0 || bitsPerSample > 16) ? JXL_TYPE_FLOAT :
                       bitsPerSample > 8 ? JXL_TYPE_UINT16 : JXL_TYPE_UINT8;
   format->num_channels = numChannels;
   format->endianness = JXL_NATIVE_ENDIAN;
   format->align = 0;
 }
 
+void Decoder::suggestPixelFormat(const JxlBasicInfo& info, JxlPixelFormat* format) {
+  const uint32_t numChannels = info.num_color_channels + (info.alpha_bits > 0);
+  suggestPixelFormat(info.bits_per_sample, info.exponent_bits_per_sample, numChannels,
+                     format);
+  if (info.alpha_bits == 0) return;
+  JxlPixelFormat alphaFormat;
+  suggestPixelFormat(info.alpha_bits, info.alpha_exponent_bits, 1, &alphaFormat);
+  if (format->data_type == alphaFormat.data_type) return;
+  // Color and alpha share one buffer, so mixed types need one that holds both.
+  // Halves are only used if both are halves: they can't hold 12+ bit integers.
+  auto isFloat = [](JxlDataType t) {
+    return t == JXL_TYPE_FLOAT || t == JXL_TYPE_FLOAT16;
+  };
+  format->data_type = isFloat(format->data_type) || isFloat(alphaFormat.data_type) ?
+                          JXL_TYPE_FLOAT : JXL_TYPE_UINT16;
+}
+
 void Decoder::suggestPixelFormat(JxlPixelFormat* pixelFormat) {
   ensureBasicInfo_();
-  suggestPixelFormat(std::max(basicInfo_.bits_per_sample, basicInfo_.alpha_bits),
-                     std::max(basicInfo_.exponent_bits_per_sample,
-                              basicInfo_.alpha_exponent_bits),
-                     basicInfo_.num_color_channels + (basicInfo_.alpha_bits > 0),
-                     pixelFormat);
+  suggestPixelFormat(basicInfo_, pixelFormat);
 }
 
 /**
@@ -698,6 +848,7 @@ void Decoder::getFramePixels(size_t frameIndex, const JxlPixelFormat& pixelForma
                              void* buffer, size_t max,
                              const std::vector<ExtraChannelRequest>& extraChannels) {
   JXLAZY_DPRINTF("[%p] frameIndex[%zu]", static_cast<void*>(this), frameIndex);
+  TraceSpan span("jxlazy::getFramePixels");
 
   if (!buffer && extraChannels.empty()) {
     return;
@@ -714,43 +865,7 @@ void Decoder::getFramePixels(size_t frameIndex, const JxlPixelFormat& pixelForma
   goToFrame_(frameIndex);
   const JxlLayerInfo& layerInfo = frames_.at(frameIndex).header.layer_info;
 
-  if (!extraChannels.empty()) {
-    ensureExtraChannelInfo_();
-    for (const ExtraChannelRequest& req : extraChannels) {
-      if (req.channelIndex >= extra_.size()) {
-        throw IndexOutOfRange("%s: Extra channel index %zu doesn't exist - "
-                              "image only has %zu extra channels.",
-                              __func__, req.channelIndex, extra_.size());
-      }
-      JxlPixelFormat realFormat = {
-        .num_channels = 1,
-        .data_type = req.format.data_type,
-        .endianness = req.format.endianness,
-        .align = req.format.align,
-      };
-      size_t requiredBytes = getFrameBufferSize(layerInfo.xsize, layerInfo.ysize,
-                                                realFormat);
-      if (req.capacity < requiredBytes) {
-        throw ReadError("Buffer of %zu bytes isn't large to store extra channel %zu - "
-                        "require at least %zu.", req.capacity, req.channelIndex,
-                        requiredBytes);
-      }
-    }
-    for (const ExtraChannelRequest& req : extraChannels) {
-      JxlPixelFormat realFormat = {
-        .num_channels = 1,
-        .data_type = req.format.data_type,
-        .endianness = req.format.endianness,
-        .align = req.format.align,
-      };
-      if (JxlDecoderSetExtraChannelBuffer(dec_.get(), &realFormat, req.target,
-                                          req.capacity, req.channelIndex) !=
-          JXL_DEC_SUCCESS) {
-        throw LibraryError("Failed to set image output buffer for frame %zu "
-                           "extra channel %zu.", frameIndex, req.channelIndex);
-      }
-    }
-  }
+  setExtraChannelBuffers_(frameIndex, extraChannels);
 
   // Block any changes to output color profile
   stateFlags_ |= StateFlag::DecodedSomePixels;
@@ -787,10 +902,198 @@ void Decoder::getFramePixels(size_t frameIndex, const JxlPixelFormat& pixelForma
     }
   }
 
+  decodeFrame_(frameIndex);
+}
+
+namespace {
+
+/**
+ * Adapts a PixelRowHandler to JxlDecoderSetMultithreadedImageOutCallback.
+ */
+struct PixelRowState {
+  const PixelRowHandler* handler;
+  std::mutex mutex{};
+  std::exception_ptr error{};
+  std::atomic<bool> failed{false};
+
+  void fail() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!error) {
+      error = std::current_exception();
+    }
+    failed = true;
+  }
+
+  static void* init(void* opaque, size_t numThreads, size_t numPixelsPerThread) {
+    PixelRowState* state = static_cast<PixelRowState*>(opaque);
+    if (state->handler->init) {
+      try {
+        state->handler->init(numThreads, numPixelsPerThread);
+      } catch (...) {
+        state->fail();
+      }
+    }
+    return state;
+  }
+
+  static void run(void* opaque, size_t threadId, size_t x, size_t y, size_t numPixels,
+                  const void* pixels) {
+    PixelRowState* state = static_cast<PixelRowState*>(opaque);
+    if (state->failed.load(std::memory_order_relaxed)) {
+      return;
+    }
+    try {
+      state->handler->row(threadId, x, y, numPixels, pixels);
+    } catch (...) {
+      state->fail();
+    }
+  }
+
+  static void destroy(void*) {}
+};
+
+}  // namespace
+
+void Decoder::getFramePixelRows(size_t frameIndex, const JxlPixelFormat& pixelFormat,
+                                const PixelRowHandler& handler,
+                                const std::vector<ExtraChannelRequest>& extraChannels) {
+  JXLAZY_DPRINTF("[%p] frameIndex[%zu]", static_cast<void*>(this), frameIndex);
+  TraceSpan span("jxlazy::getFramePixelRows");
+
+  if (!handler.row) {
+    throw UsageError("%s: No row callback provided.", __func__);
+  }
+
+  if ((stateFlags_ & StateFlag::SeenAllFrames) && frameIndex >= frames_.size()) {
+    throw IndexOutOfRange("%s: Frame at index %zu doesn't exist - image only "
+                          "has %zu frames.", __func__, frameIndex, frames_.size());
+  }
+
+  if (!(eventsSubbed_ & JXL_DEC_FULL_IMAGE))
+    rewind_(eventsSubbed_ | JXL_DEC_FULL_IMAGE);
+  goToFrame_(frameIndex);
+
+  setExtraChannelBuffers_(frameIndex, extraChannels);
+
+  // Block any changes to output color profile
+  stateFlags_ |= StateFlag::DecodedSomePixels;
+
+  PixelRowState state{.handler = &handler};
+  JxlPixelFormat rowFormat = pixelFormat;
+  rowFormat.align = 0;
+  if (JxlDecoderSetMultithreadedImageOutCallback(dec_.get(), &rowFormat,
+                                                 PixelRowState::init, PixelRowState::run,
+                                                 PixelRowState::destroy, &state)
+      != JXL_DEC_SUCCESS) {
+    throw LibraryError("Failed to set image output callback for frame %zu.", frameIndex);
+  }
+
+  decodeFrame_(frameIndex);
+  if (state.error) {
+    std::rethrow_exception(state.error);
+  }
+}
+
+void Decoder::getFramePixelRegion(size_t frameIndex, const JxlPixelFormat& pixelFormat,
+                                  uint32_t x0, uint32_t y0, uint32_t xsize,
+                                  uint32_t ysize, void* buffer, size_t capacity) {
+  JXLAZY_DPRINTF("[%p] frameIndex[%zu] region[%" PRIu32 "x%" PRIu32 "+%" PRIu32
+                 "+%" PRIu32 "]", static_cast<void*>(this), frameIndex, xsize, ysize,
+                 x0, y0);
+  TraceSpan span("jxlazy::getFramePixelRegion");
+  const JxlLayerInfo layerInfo = getFrameInfo(frameIndex).header.layer_info;
+  if (xsize == 0 || ysize == 0 ||
+      x0 > layerInfo.xsize || xsize > layerInfo.xsize - x0 ||
+      y0 > layerInfo.ysize || ysize > layerInfo.ysize - y0) {
+    throw UsageError("%s: Region %" PRIu32 "x%" PRIu32 "+%" PRIu32 "+%" PRIu32
+                     " isn't within the %" PRIu32 "x%" PRIu32 " frame.", __func__,
+                     xsize, ysize, x0, y0, layerInfo.xsize, layerInfo.ysize);
+  }
+  size_t requiredBytes = getFrameBufferSize(xsize, ysize, pixelFormat);
+  if (capacity < requiredBytes) {
+    throw ReadError("Buffer of %zu bytes isn't large to store this region - require at "
+                    "least %zu.", capacity, requiredBytes);
+  }
+
+  const size_t pixelSize =
+      bytesPerSample(pixelFormat.data_type) * pixelFormat.num_channels;
+  const size_t stride = getRowStride(xsize, pixelFormat, nullptr);
+  uint8_t* const out = static_cast<uint8_t*>(buffer);
+  PixelRowHandler handler;
+  handler.row = [=](size_t, size_t x, size_t y, size_t numPixels, const void* pixels) {
+    if (y < y0 || y >= static_cast<size_t>(y0) + ysize) {
+      return;
+    }
+    size_t start = std::max<size_t>(x, x0);
+    size_t end = std::min<size_t>(x + numPixels, static_cast<size_t>(x0) + xsize);
+    if (start >= end) {
+      return;
+    }
+    memcpy(out + (y - y0) * stride + (start - x0) * pixelSize,
+           static_cast<const uint8_t*>(pixels) + (start - x) * pixelSize,
+           (end - start) * pixelSize);
+  };
+  getFramePixelRows(frameIndex, pixelFormat, handler);
+}
+
+/**
+ * Validate @p extraChannels against the current frame, and give their buffers to the
+ * decoder.
+ */
+void Decoder::setExtraChannelBuffers_(
+    size_t frameIndex, const std::vector<ExtraChannelRequest>& extraChannels) {
+  if (extraChannels.empty()) {
+    return;
+  }
+  const JxlLayerInfo& layerInfo = frames_.at(frameIndex).header.layer_info;
+  ensureExtraChannelInfo_();
+  for (const ExtraChannelRequest& req : extraChannels) {
+    if (req.channelIndex >= extra_.size()) {
+      throw IndexOutOfRange("%s: Extra channel index %zu doesn't exist - "
+                            "image only has %zu extra channels.",
+                            __func__, req.channelIndex, extra_.size());
+    }
+    JxlPixelFormat realFormat = {
+      .num_channels = 1,
+      .data_type = req.format.data_type,
+      .endianness = req.format.endianness,
+      .align = req.format.align,
+    };
+    size_t requiredBytes = getFrameBufferSize(layerInfo.xsize, layerInfo.ysize,
+                                              realFormat);
+    if (req.capacity < requiredBytes) {
+      throw ReadError("Buffer of %zu bytes isn't large to store extra channel %zu - "
+                      "require at least %zu.", req.capacity, req.channelIndex,
+                      requiredBytes);
+    }
+  }
+  for (const ExtraChannelRequest& req : extraChannels) {
+    JxlPixelFormat realFormat = {
+      .num_channels = 1,
+      .data_type = req.format.data_type,
+      .endianness = req.format.endianness,
+      .align = req.format.align,
+    };
+    if (JxlDecoderSetExtraChannelBuffer(dec_.get(), &realFormat, req.target,
+                                        req.capacity, req.channelIndex) !=
+        JXL_DEC_SUCCESS) {
+      throw LibraryError("Failed to set image output buffer for frame %zu "
+                         "extra channel %zu.", frameIndex, req.channelIndex);
+    }
+  }
+}
+
+/**
+ * Process input until the current frame's pixels have been output.
+ */
+void Decoder::decodeFrame_(size_t frameIndex) {
   if (processInput_(JXL_DEC_FULL_IMAGE, StopAtIndex::None, 0, StopAtIndex::None, 0) !=
       JXL_DEC_FULL_IMAGE || nextFrameIndex_-1 != frameIndex) {
     throw ReadError("Failed to read pixels for frame %zu.", frameIndex);
   }
+  const JxlLayerInfo& layerInfo = frames_.at(frameIndex).header.layer_info;
+  pixelCount.fetch_add(uint64_t{layerInfo.xsize} * layerInfo.ysize,
+                       std::memory_order_relaxed);
 }
 
 
@@ -881,12 +1184,79 @@ void Decoder::goToBox_(size_t index) {
     throw IndexOutOfRange("%s: Failed to find box %zu.", __func__, index);
 }
 
+/**
+Copy the content of an uncompressed box straight from the input, using its known offset
+instead of running the decoder up to it.
+
+@return @c true if @p written bytes were copied to @p destination.  @c false if the box's
+position isn't known, it can't be read directly, or the bytes found at its offset don't
+look like the expected box - in that case, @p destination may have been modified.
+*/
+bool Decoder::readBoxDirect_(size_t index, uint8_t* destination, size_t max,
+                             size_t* written) {
+  if (index >= boxes_.size()) {
+    return false;
+  }
+  const BoxInfo& boxInfo = boxes_[index];
+  if (boxInfo.compressed || boxInfo.unbounded || boxInfo.headerSize < 8 ||
+      boxInfo.size > SIZE_MAX) {
+    return false;
+  }
+  // The box type is the last 4 bytes of the header before the content.
+  const uint64_t typeOffset = boxInfo.offset + boxInfo.headerSize - 4;
+  const size_t count = std::min<size_t>(max, boxInfo.size);
+
+  if ((stateFlags_ & StateFlag::WholeFileBuffered) && inBufferOffset_ == 0) {
+    if (typeOffset + 4 + boxInfo.size > inBufferLength_ ||
+        memcmp(inBufferPtr_ + typeOffset, boxInfo.type, 4) != 0) {
+      return false;
+    }
+    if (count > 0) {
+      memcpy(destination, inBufferPtr_ + typeOffset + 4, count);
+    }
+    *written = count;
+    return true;
+  }
+
+  if (!inStreamPtr_) {
+    return false;
+  }
+  // Temporarily move the stream, then put it back where the decoder expects it.
+  istream& in = *inStreamPtr_;
+  const istream::pos_type resumePos = in.tellg();
+  if (resumePos == istream::pos_type(-1)) {
+    return false;
+  }
+  const ios::iostate resumeState = in.rdstate();
+  char type[4];
+  in.seekg(inStreamStart_ + static_cast<streamoff>(typeOffset));
+  bool ok = in.read(type, sizeof type) && memcmp(type, boxInfo.type, 4) == 0 &&
+            in.read(reinterpret_cast<char*>(destination), static_cast<streamsize>(count));
+  in.clear();
+  in.seekg(resumePos);
+  in.setstate(resumeState);
+  if (!ok) {
+    return false;
+  }
+  JXLAZY_DPRINTF("[%p] Read %zu bytes of box %zu directly from offset %" PRIu64,
+                 static_cast<void*>(this), count, index, typeOffset + 4);
+  *written = count;
+  return true;
+}
+
 bool Decoder::getBoxContent(size_t index, uint8_t* destination, size_t max,
                             size_t* written, bool decompress) {
   if (written)
     *written = 0;
   checkOpen_();
 
+  size_t directWritten;
+  if (readBoxDirect_(index, destination, max, &directWritten)) {
+    if (written)
+      *written = directWritten;
+    return directWritten == boxes_[index].size;
+  }
+
   goToBox_(index);
 
   JxlDecoder* dec = dec_.get();
@@ -920,6 +1290,17 @@ bool Decoder::getBoxContent(size_t index, vector<uint8_t>* destination,
                             size_t max, bool decompress) {
   destination->clear();
   checkOpen_();
+
+  if (index < boxes_.size() && !boxes_[index].compressed && !boxes_[index].unbounded) {
+    size_t directWritten;
+    destination->resize(std::min<uint64_t>(max, boxes_[index].size));
+    if (readBoxDirect_(index, destination->data(), destination->size(),
+                       &directWritten)) {
+      return directWritten == boxes_[index].size;
+    }
+    destination->clear();
+  }
+
   goToBox_(index);
   BoxInfo& boxInfo = boxes_.at(index);
   bool isCompressed = boxInfo.compressed;
@@ -1173,6 +1554,165 @@ bool Decoder::jxlIsFullyBuffered() const {
   return (stateFlags_ & StateFlag::WholeFileBuffered);
 }
 
+/*
+Index format (all integers little-endian):
+
+  magic[8] version:u32 flags:u32 fingerprintLength:u32 fingerprint:u64 inputSize:u64
+  xsize:u32 ysize:u32 jpegCount:u64
+  frameCount:u64 { frame }*
+  boxCount:u64 { box }*
+
+where flags are a subset of the StateFlag bits.
+*/
+void Decoder::saveIndex(ostream& out, bool complete) {
+  ensureBasicInfo_();
+  if (complete) {
+    frameCount();
+    boxCount();
+  }
+
+  constexpr uint16_t savedFlags = StateFlag::IsCoalescing | StateFlag::KeepsOrientation |
+                                  StateFlag::SeenAllFrames | StateFlag::SeenAllBoxes |
+                                  StateFlag::SeenAllJpeg;
+  out.write(kIndexMagic, sizeof kIndexMagic);
+  writeU32(out, kIndexVersion);
+  writeU32(out, stateFlags_ & savedFlags);
+  writeU32(out, static_cast<uint32_t>(fingerprintLength_));
+  writeU64(out, fingerprint_);
+  writeU64(out, inputSize_);
+  writeU32(out, basicInfo_.xsize);
+  writeU32(out, basicInfo_.ysize);
+  writeU64(out, jpegCount_);
+
+  writeU64(out, frames_.size());
+  for (const FrameInfo& frame : frames_) {
+    const JxlFrameHeader& h = frame.header;
+    writeU32(out, h.duration);
+    writeU32(out, h.timecode);
+    writeU32(out, static_cast<uint32_t>(h.is_last));
+    writeU32(out, static_cast<uint32_t>(h.layer_info.have_crop));
+    writeU32(out, static_cast<uint32_t>(h.layer_info.crop_x0));
+    writeU32(out, static_cast<uint32_t>(h.layer_info.crop_y0));
+    writeU32(out, h.layer_info.xsize);
+    writeU32(out, h.layer_info.ysize);
+    writeBlendInfo(out, h.layer_info.blend_info);
+    writeU32(out, h.layer_info.save_as_reference);
+    writeU32(out, static_cast<uint32_t>(frame.ecBlendInfo.size()));
+    for (const JxlBlendInfo& ecBlendInfo : frame.ecBlendInfo) {
+      writeBlendInfo(out, ecBlendInfo);
+    }
+    writeU32(out, static_cast<uint32_t>(frame.name.size()));
+    out.write(frame.name.data(), static_cast<streamsize>(frame.name.size()));
+  }
+
+  writeU64(out, boxes_.size());
+  for (const BoxInfo& box : boxes_) {
+    out.write(box.type, sizeof box.type);
+    writeU32(out, (box.compressed ? 1 : 0) | (box.unbounded ? 2 : 0));
+    writeU64(out, box.size);
+    writeU64(out, box.offset);
+    writeU32(out, box.headerSize);
+  }
+
+  if (!out) {
+    throw JxlazyException("%s: Failed to write index.", __func__);
+  }
+}
+
+bool Decoder::loadIndex(istream& in) {
+  ensureBasicInfo_();
+
+  char magic[sizeof kIndexMagic];
+  uint32_t version, flags, fingerprintLength, xsize, ysize;
+  uint64_t fingerprint, inputSize, jpegCount, count;
+  if (!in.read(magic, sizeof magic) || memcmp(magic, kIndexMagic, sizeof magic) != 0 ||
+      !readU32(in, &version) || version != kIndexVersion || !readU32(in, &flags) ||
+      !readU32(in, &fingerprintLength) || !readU64(in, &fingerprint) ||
+      !readU64(in, &inputSize) || !readU32(in, &xsize) || !readU32(in, &ysize) ||
+      !readU64(in, &jpegCount)) {
+    JXLAZY_DPRINTF("[%p] Not a valid index.", static_cast<void*>(this));
+    return false;
+  }
+  constexpr uint16_t modeFlags = StateFlag::IsCoalescing | StateFlag::KeepsOrientation;
+  if (fingerprintLength != fingerprintLength_ || fingerprint != fingerprint_ ||
+      (inputSize > 0 && inputSize_ > 0 && inputSize != inputSize_) ||
+      xsize != basicInfo_.xsize || ysize != basicInfo_.ysize ||
+      (flags & modeFlags) != (stateFlags_ & modeFlags)) {
+    JXLAZY_DPRINTF("[%p] Index doesn't match this file.", static_cast<void*>(this));
+    return false;
+  }
+
+  vector<FrameInfo> frames;
+  if (!readU64(in, &count)) {
+    return false;
+  }
+  for (uint64_t i = 0; i < count; ++i) {
+    FrameInfo& frame = frames.emplace_back();
+    JxlFrameHeader& h = frame.header;
+    uint32_t isLast, haveCrop, cropX0, cropY0, ecCount, nameLength;
+    if (!readU32(in, &h.duration) || !readU32(in, &h.timecode) ||
+        !readU32(in, &isLast) || !readU32(in, &haveCrop) || !readU32(in, &cropX0) ||
+        !readU32(in, &cropY0) || !readU32(in, &h.layer_info.xsize) ||
+        !readU32(in, &h.layer_info.ysize) ||
+        !readBlendInfo(in, &h.layer_info.blend_info) ||
+        !readU32(in, &h.layer_info.save_as_reference) || !readU32(in, &ecCount) ||
+        ecCount > basicInfo_.num_extra_channels) {
+      return false;
+    }
+    h.is_last = static_cast<JXL_BOOL>(isLast);
+    h.layer_info.have_crop = static_cast<JXL_BOOL>(haveCrop);
+    h.layer_info.crop_x0 = static_cast<int32_t>(cropX0);
+    h.layer_info.crop_y0 = static_cast<int32_t>(cropY0);
+    frame.ecBlendInfo.resize(ecCount);
+    for (JxlBlendInfo& ecBlendInfo : frame.ecBlendInfo) {
+      if (!readBlendInfo(in, &ecBlendInfo)) {
+        return false;
+      }
+    }
+    if (!readU32(in, &nameLength) || nameLength > 1071) { // Max name length in the spec
+      return false;
+    }
+    h.name_length = nameLength;
+    frame.name.resize(nameLength);
+    if (!in.read(frame.name.data(), nameLength)) {
+      return false;
+    }
+  }
+
+  vector<BoxInfo> boxes;
+  if (!readU64(in, &count)) {
+    return false;
+  }
+  for (uint64_t i = 0; i < count; ++i) {
+    BoxInfo& box = boxes.emplace_back();
+    uint32_t boxFlags;
+    if (!in.read(box.type, sizeof box.type) || !readU32(in, &boxFlags) ||
+        !readU64(in, &box.size) || !readU64(in, &box.offset) ||
+        !readU32(in, &box.headerSize)) {
+      return false;
+    }
+    box.compressed = (boxFlags & 1);
+    box.unbounded = (boxFlags & 2);
+  }
+
+  // Everything's valid - merge it with what we already know.
+  if (frames.size() > frames_.size()) {
+    frames_ = std::move(frames);
+  }
+  if (boxes.size() > boxes_.size()) {
+    boxes_ = std::move(boxes);
+  }
+  jpegCount_ = std::max<size_t>(jpegCount_, jpegCount);
+  stateFlags_ |= flags & (StateFlag::SeenAllFrames | StateFlag::SeenAllBoxes |
+                          StateFlag::SeenAllJpeg);
+  if (inputSize_ == 0) {
+    inputSize_ = inputSize;
+  }
+  JXLAZY_DPRINTF("[%p] Loaded index with %zu frames, %zu boxes.",
+                 static_cast<void*>(this), frames_.size(), boxes_.size());
+  return true;
+}
+
 /**
 Run the decoder until the specified condition is met.
 
@@ -1246,6 +1786,7 @@ JxlDecoderStatus Decoder::processInput_(int untilStatus,
                  oss.str().c_str());
 #endif
 
+  TraceSpan span("jxlazy::processInput");
   JxlDecoder* dec = dec_.get();
 
   while ((status_ = JxlDecoderProcessInput(dec)) != JXL_DEC_SUCCESS) {
@@ -1273,6 +1814,7 @@ JxlDecoderStatus Decoder::processInput_(int untilStatus,
 
     else if (status_ == JXL_DEC_NEED_MORE_INPUT) {
       // Refill the input buffer
+      TraceSpan refillSpan("jxlazy::refill");
       uint8_t* inBufferData = inBufferPrivate_.data();
       size_t unprocessedCount = JxlDecoderReleaseInput(dec);
       if (unprocessedCount == inBufferLength_ && inBufferLength_ > 0) {
@@ -1309,6 +1851,8 @@ JxlDecoderStatus Decoder::processInput_(int untilStatus,
                         inBufferOffset_ + inBufferLength_);
       }
       size_t got = inStreamPtr_->gcount();
+      refillCount.fetch_add(1, std::memory_order_relaxed);
+      inputByteCount.fetch_add(got, std::memory_order_relaxed);
       JXLAZY_DPRINTF("[%p] Read next %zu bytes from disk", static_cast<void*>(this),
                        got);
       inBufferLength_ += got;
@@ -1322,6 +1866,7 @@ JxlDecoderStatus Decoder::processInput_(int untilStatus,
         if (inBufferOffset_ == 0) {
           stateFlags_ |= StateFlag::WholeFileBuffered;
         }
+        inputSize_ = inBufferOffset_ + inBufferLength_;
         JXLAZY_DPRINTF("[%p] Reached EOF, wholeFileBuffered_[%d]",
                        static_cast<void*>(this), static_cast<int>(wholeFileBuffered_));
         JxlDecoderCloseInput(dec);
@@ -1387,13 +1932,22 @@ JxlDecoderStatus Decoder::processInput_(int untilStatus,
         }
         if (JxlDecoderGetBoxSizeContents(dec, &boxInfo.size) != JXL_DEC_SUCCESS)
           throw LibraryError("Failed to get box content size.");
-        if (boxInfo.size == 0) {
-          // Is it actually empty, or just unbounded?
-          size_t rawSize;
-          if (JxlDecoderGetBoxSizeRaw(dec, &rawSize) == JXL_DEC_SUCCESS &&
-              rawSize == 0) {
-            boxInfo.unbounded = true;
-          }
+        uint64_t rawSize;
+        if (JxlDecoderGetBoxSizeRaw(dec, &rawSize) != JXL_DEC_SUCCESS)
+          throw LibraryError("Failed to get raw box size.");
+        if (rawSize == 0) {
+          // Runs to the end of the file, with a minimal 8-byte header
+          boxInfo.unbounded = true;
+          boxInfo.headerSize = 8;
+        } else {
+          boxInfo.headerSize = static_cast<uint32_t>(rawSize - boxInfo.size);
+        }
+        // Boxes are contiguous, starting at the beginning of the file.
+        if (nextBoxIndex_ == 0) {
+          boxInfo.offset = 0;
+        } else {
+          const BoxInfo& prevBox = boxes_[nextBoxIndex_ - 1];
+          boxInfo.offset = prevBox.offset + prevBox.headerSize + prevBox.size;
         }
         boxes_.push_back(boxInfo);
       }
@@ -4,10 +4,12 @@
  * Use of this source code is governed by an MIT-style
  * license that can be found in the LICENSE file.
 */
+#include <algorithm>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
 #include <sstream>
+#include <string>
 #include <vector>
 
 #include <gtest/gtest.h>
@@ -52,6 +54,34 @@ TEST(Decoder, OpenFile) {
   EXPECT_NO_THROW(jxl.getBasicInfo());
 }
 
+TEST(Decoder, OpenFileMapped) {
+  jxlazy::Decoder jxl;
+  constexpr uint32_t hints = jxlazy::DecoderHint::MapFile;
+  EXPECT_THROW(jxl.openFile(getPath("file-that-does-not-exist").c_str(), 0, hints),
+               jxlazy::ReadError);
+  EXPECT_THROW(jxl.openFile(getPath("not_a_jxl.png").c_str(), 0, hints),
+               jxlazy::ReadError);
+
+  // Buffer size is ignored when the file is mapped
+  EXPECT_NO_THROW(jxl.openFile(getPath("generated.jxl").c_str(),
+                               jxlazy::DecoderFlag::NoCoalesce, hints, 1));
+  EXPECT_TRUE(jxl.jxlIsFullyBuffered());
+  EXPECT_EQ(jxl.frameCount(), 3);
+  // Going back to an earlier frame rewinds within the mapping
+  auto mapped = jxl.getFramePixels<float>(0, 4);
+
+  vector<uint8_t> jxlBytes = loadFile(getPath("generated.jxl"));
+  jxlazy::Decoder jxlMem;
+  jxlMem.openMemory(jxlBytes.data(), jxlBytes.size(), jxlazy::DecoderFlag::NoCoalesce);
+  EXPECT_EQ(mapped, jxlMem.getFramePixels<float>(0, 4));
+
+  // Reopening releases the old mapping
+  EXPECT_NO_THROW(jxl.openFile(getPath("frame0.jxl").c_str(), 0, hints));
+  EXPECT_NO_THROW(jxl.getBasicInfo());
+  EXPECT_NO_THROW(jxl.close());
+  EXPECT_THROW(jxl.getBasicInfo(), jxlazy::UsageError);
+}
+
 TEST(Decoder, OpenStream) {
   jxlazy::Decoder jxl;
   ifstream frame0(getPath("frame0.jxl").c_str(), ios::in|ios::binary);
@@ -632,6 +662,188 @@ TEST(Decoder, CanGetColorAndExtra) {
 }
 
 
+TEST(Decoder, GetFramePixelRows) {
+  jxlazy::Decoder jxl;
+  jxl.openFile(getPath("generated.jxl").c_str(), jxlazy::DecoderFlag::NoCoalesce);
+  JxlPixelFormat format {
+    .num_channels = 4,
+    .data_type = JXL_TYPE_UINT16,
+    .endianness = JXL_NATIVE_ENDIAN,
+    .align = 0,
+  };
+  JxlPixelFormat depthFormat {
+    .num_channels = 1,
+    .data_type = JXL_TYPE_UINT8,
+    .endianness = JXL_NATIVE_ENDIAN,
+    .align = 0,
+  };
+
+  for (size_t frameIndex = 0; frameIndex < jxl.frameCount(); ++frameIndex) {
+    vector<uint8_t> expect(jxl.getFrameBufferSize(frameIndex, format));
+    vector<uint8_t> expectDepth(jxl.getFrameBufferSize(frameIndex, depthFormat));
+    jxl.getFramePixels(frameIndex, format, expect.data(), expect.size(),
+                       {{ 1, depthFormat, expectDepth.data(), expectDepth.size() }});
+
+    // Reassemble the frame from rows
+    const JxlLayerInfo layerInfo = jxl.getFrameInfo(frameIndex).header.layer_info;
+    const size_t pixelSize = format.num_channels * sizeof(uint16_t);
+    vector<uint8_t> rows(expect.size());
+    vector<uint8_t> depth(expectDepth.size());
+    size_t numThreads = 0;
+    size_t maxPixels = 0;
+    jxlazy::PixelRowHandler handler;
+    handler.init = [&](size_t threads, size_t pixels) {
+      numThreads = threads;
+      maxPixels = pixels;
+    };
+    handler.row = [&](size_t threadId, size_t x, size_t y, size_t numPixels,
+                      const void* pixels) {
+      EXPECT_LT(threadId, numThreads);
+      EXPECT_LE(numPixels, maxPixels);
+      EXPECT_LE(x + numPixels, layerInfo.xsize);
+      EXPECT_LT(y, layerInfo.ysize);
+      memcpy(rows.data() + (y * layerInfo.xsize + x) * pixelSize, pixels,
+             numPixels * pixelSize);
+    };
+    jxl.getFramePixelRows(frameIndex, format, handler,
+                          {{ 1, depthFormat, depth.data(), depth.size() }});
+    EXPECT_GT(numThreads, 0);
+    EXPECT_EQ(rows, expect) << "frame " << frameIndex;
+    EXPECT_EQ(depth, expectDepth) << "frame " << frameIndex;
+  }
+
+  // Exceptions from the callback come back to the caller
+  jxlazy::PixelRowHandler throwingHandler;
+  throwingHandler.row = [](size_t, size_t, size_t, size_t, const void*) {
+    throw std::runtime_error("stop");
+  };
+  EXPECT_THROW(jxl.getFramePixelRows(0, format, throwingHandler), std::runtime_error);
+  EXPECT_THROW(jxl.getFramePixelRows(0, format, {}), jxlazy::UsageError);
+}
+
+TEST(Decoder, GetFramePixelRegion) {
+  jxlazy::Decoder jxl;
+  jxl.openFile(getPath("generated.jxl").c_str(), jxlazy::DecoderFlag::NoCoalesce);
+  JxlPixelFormat format {
+    .num_channels = 3,
+    .data_type = JXL_TYPE_UINT8,
+    .endianness = JXL_NATIVE_ENDIAN,
+    .align = 0,
+  };
+  const JxlLayerInfo layerInfo = jxl.getFrameInfo(0).header.layer_info;
+  ASSERT_GE(layerInfo.xsize, 4);
+  ASSERT_GE(layerInfo.ysize, 4);
+  vector<uint8_t> full(jxl.getFrameBufferSize(0, format));
+  jxl.getFramePixels(0, format, full.data(), full.size());
+
+  const uint32_t x0 = 1, y0 = 2;
+  const uint32_t xsize = layerInfo.xsize - 3, ysize = layerInfo.ysize - 2;
+  vector<uint8_t> expect;
+  for (uint32_t y = y0; y < y0 + ysize; ++y) {
+    auto rowStart = full.begin() + (y * layerInfo.xsize + x0) * format.num_channels;
+    expect.insert(expect.end(), rowStart, rowStart + xsize * format.num_channels);
+  }
+  vector<uint8_t> region(expect.size());
+  jxl.getFramePixelRegion(0, format, x0, y0, xsize, ysize, region.data(), region.size());
+  EXPECT_EQ(region, expect);
+
+  EXPECT_THROW(jxl.getFramePixelRegion(0, format, x0, y0, xsize, ysize, region.data(),
+                                       region.size() - 1), jxlazy::ReadError);
+  EXPECT_THROW(jxl.getFramePixelRegion(0, format, x0 + 3, y0, xsize, ysize,
+                                       region.data(), region.size()),
+               jxlazy::UsageError);
+}
+
+namespace {
+vector<string> traceEvents;
+}
+
+TEST(Decoder, TraceHandler) {
+  traceEvents.clear();
+  jxlazy::setTraceHandler({
+    .begin = [](const char* name) { traceEvents.emplace_back(name); },
+    .end = []() { traceEvents.emplace_back("end"); },
+  });
+  {
+    jxlazy::Decoder jxl;
+    jxl.openFile(getPath("generated.jxl").c_str(), jxlazy::DecoderFlag::NoCoalesce);
+    JxlPixelFormat format = {3, JXL_TYPE_UINT8, JXL_NATIVE_ENDIAN, 0};
+    vector<uint8_t> pixels(jxl.getFrameBufferSize(0, format));
+    jxl.getFramePixels(0, format, pixels.data(), pixels.size());
+  }
+  jxlazy::setTraceHandler({});
+
+  ASSERT_FALSE(traceEvents.empty());
+  EXPECT_NE(std::find(traceEvents.begin(), traceEvents.end(), "jxlazy::getFramePixels"),
+            traceEvents.end());
+  EXPECT_NE(std::find(traceEvents.begin(), traceEvents.end(), "jxlazy::processInput"),
+            traceEvents.end());
+  // Spans are properly nested
+  int depth = 0;
+  for (const string& event : traceEvents) {
+    depth += event == "end" ? -1 : 1;
+    ASSERT_GE(depth, 0);
+  }
+  EXPECT_EQ(depth, 0);
+}
+
+TEST(Decoder, Counters) {
+  const jxlazy::DecoderCounters before = jxlazy::getDecoderCounters();
+  jxlazy::Decoder jxl;
+  std::ifstream in(getPath("generated.jxl"), std::ios::binary);
+  jxl.openStream(in, jxlazy::DecoderFlag::NoCoalesce);
+  JxlPixelFormat format = {3, JXL_TYPE_UINT8, JXL_NATIVE_ENDIAN, 0};
+  vector<uint8_t> pixels(jxl.getFrameBufferSize(0, format));
+  jxl.getFramePixels(0, format, pixels.data(), pixels.size());
+  const JxlLayerInfo layerInfo = jxl.getFrameInfo(0).header.layer_info;
+
+  const jxlazy::DecoderCounters after = jxlazy::getDecoderCounters();
+  EXPECT_GE(after.refills, before.refills + 1);
+  EXPECT_GE(after.inputBytes, before.inputBytes + 1);
+  EXPECT_GE(after.pixelsDecoded,
+            before.pixelsDecoded + uint64_t{layerInfo.xsize} * layerInfo.ysize);
+}
+
+TEST(Decoder, GetFramePixelsCustomAllocator) {
+  struct Counts {
+    size_t allocs{0};
+    size_t frees{0};
+  } counts;
+  const JxlMemoryManager mm = {
+    .opaque = &counts,
+    .alloc = [](void* opaque, size_t size) {
+      ++static_cast<Counts*>(opaque)->allocs;
+      return malloc(size);
+    },
+    .free = [](void* opaque, void* address) {
+      if (address) ++static_cast<Counts*>(opaque)->frees;
+      free(address);
+    },
+  };
+  using Alloc = jxlazy::MemoryManagerAllocator<float>;
+
+  jxlazy::Decoder jxl;
+  jxl.openFile(getPath("generated.jxl").c_str(), jxlazy::DecoderFlag::NoCoalesce);
+  const jxlazy::FramePixels<float> expected =
+      jxl.getFramePixels<float>(0, 4, std::span<const int>({-1}));
+  {
+    jxlazy::FramePixels<float, Alloc> framePixels =
+        jxl.getFramePixels<float>(0, 4, std::span<const int>({-1}), Alloc(&mm));
+    EXPECT_EQ(framePixels.color.get_allocator().memManager, &mm);
+    ASSERT_EQ(framePixels.ecs.size(), expected.ecs.size());
+    EXPECT_TRUE(std::equal(framePixels.color.begin(), framePixels.color.end(),
+                           expected.color.begin(), expected.color.end()));
+    EXPECT_EQ(counts.allocs, 1 + expected.ecs.size());
+
+    // Reused objects give new extra channel buffers the same allocator
+    framePixels.ecs.clear();
+    jxl.getFramePixels(&framePixels, 1, 4, std::span<const int>({0}));
+    EXPECT_EQ(framePixels.ecs.at(0).get_allocator().memManager, &mm);
+  }
+  EXPECT_GT(counts.allocs, 0);
+  EXPECT_EQ(counts.frees, counts.allocs);
+}
+
 TEST(Decoder, GetFramePixelsTypesafeErrors) {
   jxlazy::Decoder jxl;
   jxl.openFile(getPath("generated.jxl").c_str(), jxlazy::DecoderFlag::NoCoalesce);
@@ -729,6 +941,88 @@ TEST(Decoder, GetsBoxes) {
   }
 }
 
+TEST(Decoder, BoxOffsets) {
+  vector<uint8_t> file = loadFile(getPath("generated.jxl"));
+  jxlazy::Decoder jxl;
+  jxl.openFile(getPath("generated.jxl").c_str(), 0, jxlazy::DecoderHint::WantBoxes);
+  size_t boxCount = jxl.boxCount();
+  ASSERT_EQ(boxCount, 8);
+  uint64_t expectOffset = 0;
+  for (size_t i = 0; i < boxCount; ++i) {
+    jxlazy::BoxInfo boxInfo = jxl.getBoxInfo(i);
+    EXPECT_EQ(boxInfo.offset, expectOffset);
+    ASSERT_LE(boxInfo.offset + boxInfo.headerSize, file.size());
+    const char* rawType = boxInfo.compressed ? "brob" : boxInfo.type;
+    EXPECT_EQ(memcmp(file.data() + boxInfo.offset + boxInfo.headerSize - 4, rawType, 4),
+              0);
+    expectOffset = boxInfo.offset + boxInfo.headerSize + boxInfo.size;
+  }
+  EXPECT_EQ(expectOffset, file.size());
+}
+
+TEST(Decoder, SaveAndLoadIndex) {
+  const string path = getPath("generated.jxl");
+  stringstream index;
+  vector<jxlazy::FrameInfo> frames;
+  vector<jxlazy::BoxInfo> boxes;
+  {
+    jxlazy::Decoder jxl;
+    jxl.openFile(path.c_str(), jxlazy::DecoderFlag::NoCoalesce,
+                 jxlazy::DecoderHint::WantBoxes);
+    jxl.saveIndex(index);
+    for (size_t i = 0; i < jxl.frameCount(); ++i) {
+      frames.push_back(jxl.getFrameInfo(i));
+    }
+    for (size_t i = 0; i < jxl.boxCount(); ++i) {
+      boxes.push_back(jxl.getBoxInfo(i));
+    }
+  }
+  const string indexBytes = index.str();
+
+  jxlazy::Decoder jxl;
+  // Different file
+  jxl.openFile(getPath("frame0.jxl").c_str(), jxlazy::DecoderFlag::NoCoalesce);
+  index.str(indexBytes);
+  EXPECT_FALSE(jxl.loadIndex(index));
+  // Same file, but coalesced
+  jxl.openFile(path.c_str());
+  index.clear();
+  index.str(indexBytes);
+  EXPECT_FALSE(jxl.loadIndex(index));
+  // Truncated index
+  jxl.openFile(path.c_str(), jxlazy::DecoderFlag::NoCoalesce);
+  index.clear();
+  index.str(indexBytes.substr(0, indexBytes.size() - 1));
+  EXPECT_FALSE(jxl.loadIndex(index));
+
+  jxl.openFile(path.c_str(), jxlazy::DecoderFlag::NoCoalesce,
+               jxlazy::DecoderHint::NoPixels);
+  index.clear();
+  index.str(indexBytes);
+  ASSERT_TRUE(jxl.loadIndex(index));
+  ASSERT_EQ(jxl.frameCount(), frames.size());
+  for (size_t i = frames.size(); i > 0; --i) {
+    jxlazy::FrameInfo frame = jxl.getFrameInfo(i - 1);
+    EXPECT_EQ(memcmp(&frame.header, &frames[i - 1].header, sizeof frame.header), 0);
+    EXPECT_EQ(frame.name, frames[i - 1].name);
+    EXPECT_EQ(frame.ecBlendInfo.size(), frames[i - 1].ecBlendInfo.size());
+  }
+  ASSERT_EQ(jxl.boxCount(), boxes.size());
+  for (size_t i = boxes.size(); i > 0; --i) {
+    jxlazy::BoxInfo box = jxl.getBoxInfo(i - 1);
+    EXPECT_EQ(memcmp(box.type, boxes[i - 1].type, 4), 0);
+    EXPECT_EQ(box.offset, boxes[i - 1].offset);
+    EXPECT_EQ(box.size, boxes[i - 1].size);
+    vector<uint8_t> content;
+    EXPECT_TRUE(jxl.getBoxContent(i - 1, &content, SIZE_MAX, false));
+    EXPECT_EQ(content.size(), box.size);
+  }
+  // Pixels are still available after skipping straight to the last frame
+  EXPECT_EQ(jxl.getFramePixels<float>(frames.size() - 1, 4).color.size(),
+            size_t{4} * frames.back().header.layer_info.xsize *
+                        frames.back().header.layer_info.ysize);
+}
+
 static const uint8_t JXL_ftyp[] = {  0,    0,    0,    0xc,  0x4a, 0x58, 0x4c, 0x20,
                                      0xd,  0xa,  0x87, 0xa,
                                      0,    0,    0,    0x14, 0x66, 0x74, 0x79, 0x70,
@@ -1006,7 +1300,6 @@ TEST(Decoder, SetPreferredOutputColorProfile) {
 }
 
 TEST(Decoder, SuggestPixelFormatStatic) {
-  // Note, float16 isn't supported
   struct {
     uint32_t bitsPerSample;
     uint32_t exponentBitsPerSample;
@@ -1018,7 +1311,11 @@ TEST(Decoder, SuggestPixelFormatStatic) {
     { 9, 0, 4, JXL_TYPE_UINT16 },
     { 16, 0, 5, JXL_TYPE_UINT16 },
     { 17, 0, 5, JXL_TYPE_FLOAT },
-    { 8, 2, 1, JXL_TYPE_FLOAT },
+    { 8, 2, 1, JXL_TYPE_FLOAT16 },
+    { 16, 5, 4, JXL_TYPE_FLOAT16 },
+    { 16, 4, 3, JXL_TYPE_FLOAT },
+    { 16, 8, 3, JXL_TYPE_FLOAT },
+    { 32, 8, 3, JXL_TYPE_FLOAT },
   };
   for (const auto& test : tests) {
     JxlPixelFormat result;
@@ -1030,3 +1327,40 @@ TEST(Decoder, SuggestPixelFormatStatic) {
     EXPECT_EQ(result.align, 0);
   }
 }
+
+TEST(Decoder, SuggestPixelFormatBasicInfo) {
+  struct {
+    uint32_t bitsPerSample;
+    uint32_t exponentBitsPerSample;
+    uint32_t alphaBits;
+    uint32_t alphaExponentBits;
+    JxlDataType expectType;
+  } tests[] = {
+    { 8, 0, 0, 0, JXL_TYPE_UINT8 },
+    { 8, 0, 8, 0, JXL_TYPE_UINT8 },
+    { 8, 0, 16, 0, JXL_TYPE_UINT16 },
+    { 16, 5, 0, 0, JXL_TYPE_FLOAT16 },
+    { 16, 5, 16, 5, JXL_TYPE_FLOAT16 },
+    { 16, 5, 8, 0, JXL_TYPE_FLOAT },
+    { 16, 5, 32, 8, JXL_TYPE_FLOAT },
+    // Integer color with half float alpha: a half can't hold 12 or 16 bit integers
+    { 12, 0, 16, 5, JXL_TYPE_FLOAT },
+    { 16, 0, 16, 5, JXL_TYPE_FLOAT },
+  };
+  for (const auto& test : tests) {
+    JxlBasicInfo info{};
+    info.num_color_channels = 3;
+    info.bits_per_sample = test.bitsPerSample;
+    info.exponent_bits_per_sample = test.exponentBitsPerSample;
+    info.alpha_bits = test.alphaBits;
+    info.alpha_exponent_bits = test.alphaExponentBits;
+    JxlPixelFormat result;
+    jxlazy::Decoder::suggestPixelFormat(info, &result);
+    EXPECT_EQ(result.num_channels, test.alphaBits > 0 ? 4 : 3);
+    EXPECT_EQ(result.data_type, test.expectType)
+        << test.bitsPerSample << "/" << test.exponentBitsPerSample << " "
+        << test.alphaBits << "/" << test.alphaExponentBits;
+    EXPECT_EQ(result.endianness, JXL_NATIVE_ENDIAN);
+    EXPECT_EQ(result.align, 0);
+  }
+}
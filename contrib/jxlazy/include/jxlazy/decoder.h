@@ -18,12 +18,17 @@
 /// \cond
 #include <cstddef>
 #include <cstdint>
+#include <cstdlib>
 #include <cstring>
 #include <fstream>
+#include <functional>
 #include <iostream>
 #include <iterator>
+#include <memory>
+#include <new>
 #include <span>
 #include <string>
+#include <type_traits>
 #include <vector>
 
 #include <jxl/decode_cxx.h>
@@ -50,6 +55,12 @@ struct BoxInfo {
    * If @c unbounded is true and @c size is 0, the box content could be any length.
    */
   uint64_t size;
+
+  /// Offset of the start of this box (its size field) from the start of the file.
+  uint64_t offset;
+
+  /// Size of the box header, so the box content starts at `offset + headerSize`.
+  uint32_t headerSize;
 };
 
 /**
@@ -81,6 +92,120 @@ struct ExtraChannelRequest {
   size_t capacity; // max bytes to write to @c target
 };
 
+/**
+ * Callbacks that receive the main (color + optional interleaved alpha) pixels of a
+ * frame as they're decoded, used by Decoder::getFramePixelRows.
+ */
+struct PixelRowHandler {
+  /**
+   * Optional.  Called once before any pixels are delivered.  @p numThreads is the number
+   * of distinct thread IDs that may be passed to @c row, and @p maxPixels is the most
+   * pixels that will be passed to a single call.  Use this to set up per-thread state.
+   */
+  std::function<void(size_t numThreads, size_t maxPixels)> init{};
+  /**
+   * Called with @p numPixels consecutive pixels from row @p y of the frame, starting at
+   * column @p x, in the requested pixel format.  Calls may come from several threads at
+   * once, each identified by a @p threadId in [0, numThreads), and in any order.  The
+   * @p pixels pointer is only valid for the duration of the call.
+   */
+  std::function<void(size_t threadId, size_t x, size_t y, size_t numPixels,
+                     const void* pixels)> row{};
+};
+
+/**
+ * Callbacks that mark the start and end of potentially slow decoder operations, for
+ * profiling.  See setTraceHandler.
+ */
+struct TraceHandler {
+  /**
+   * Called on the thread that starts an operation.  @p name is a string literal.
+   */
+  void (*begin)(const char* name){nullptr};
+  /**
+   * Called on the same thread when the innermost operation started there finishes,
+   * whether or not it succeeded.
+   */
+  void (*end)(){nullptr};
+};
+
+/**
+ * Report decoder operations to @p handler, for every Decoder in the process.  Pass `{}`
+ * to stop.  This must not be called while any Decoder is in use.
+ *
+ * The operations reported are input refills, each run of the libjxl decoder
+ * (`processInput`), and each call to getFramePixels, getFramePixelRows and
+ * getFramePixelRegion.
+ */
+void setTraceHandler(const TraceHandler& handler);
+
+/**
+ * Running totals for every Decoder in the process.  See getDecoderCounters.
+ */
+struct DecoderCounters {
+  /** Number of times a decoder went back to the start of its input. */
+  uint64_t rewinds{0};
+  /** Number of chunks read from input streams. */
+  uint64_t refills{0};
+  /** Bytes read from input streams, plus the size of inputs in memory or mapped. */
+  uint64_t inputBytes{0};
+  /** Total pixels in the frames decoded by getFramePixels and related functions. */
+  uint64_t pixelsDecoded{0};
+};
+
+/**
+ * Return the totals for all Decoders since the process started.  Safe to call at any
+ * time from any thread.
+ */
+DecoderCounters getDecoderCounters();
+
+/**
+ * Standard allocator that gets memory from a JxlMemoryManager, so the same arena, pool
+ * or huge-page allocator can be used for libjxl and for FramePixels buffers.  A null
+ * manager means `malloc` and `free`.  Memory is only aligned as well as the manager's
+ * `alloc` aligns it.
+ */
+template<class T>
+struct MemoryManagerAllocator {
+  using value_type = T;
+  using propagate_on_container_move_assignment = std::true_type;
+  using propagate_on_container_swap = std::true_type;
+
+  const JxlMemoryManager* memManager{nullptr};
+
+  MemoryManagerAllocator() = default;
+  explicit MemoryManagerAllocator(const JxlMemoryManager* memManager) noexcept :
+    memManager(memManager) {}
+  template<class U>
+  MemoryManagerAllocator(const MemoryManagerAllocator<U>& other) noexcept :
+    memManager(other.memManager) {}
+
+  T* allocate(size_t n) {
+    if (n > SIZE_MAX / sizeof(T)) {
+      throw std::bad_array_new_length();
+    }
+    void* p = memManager ? memManager->alloc(memManager->opaque, n * sizeof(T))
+                         : malloc(n * sizeof(T));
+    if (!p) {
+      throw std::bad_alloc();
+    }
+    return static_cast<T*>(p);
+  }
+
+  void deallocate(T* p, size_t /*n*/) noexcept {
+    if (memManager) {
+      memManager->free(memManager->opaque, p);
+    } else {
+      free(p);
+    }
+  }
+
+  template<class U>
+  bool operator==(const MemoryManagerAllocator<U>& other) const noexcept {
+    return memManager == other.memManager;
+  }
+};
+
 template<class T, class Alloc = std::allocator<T>>
 struct FramePixels {
   /**
@@ -140,7 +265,20 @@ enum DecoderHint : uint32_t {
    * Use this if you're planning to call `getReconstructedJpeg` or
    * `haveJpegReconstruction`.
    */
-  WantJpeg = 0x8
+  WantJpeg = 0x8,
+
+  /**
+   * Hint to `openFile` that the file should be memory-mapped rather than read into an
+   * internal buffer.
+   *
+   * The decoder reads directly from the mapping, so the file is never copied, and
+   * rewinding never needs to re-read anything from disk.  The `bufferKiB` argument is
+   * ignored. If the file can't be mapped, we quietly fall back to normal buffered reads.
+   *
+   * The file must not be truncated while it's open, otherwise the process may crash.
+   * Ignored by `openStream` and `openMemory`.
+   */
+  MapFile = 0x10,
 };
 
 /**
@@ -454,6 +592,13 @@ public:
   static void suggestPixelFormat(uint32_t bitsPerSample, uint32_t exponentBitsPerSample,
                                  uint32_t numChannels, JxlPixelFormat* format);
 
+  /**
+   * Suggest an appropriate pixel format for decoding the color and main alpha channels
+   * of an image with the given Basic Info.  Color and alpha are considered separately,
+   * and FLOAT16 is only suggested if both fit in half floats.
+   */
+  static void suggestPixelFormat(const JxlBasicInfo& info, JxlPixelFormat* format);
+
   /**
    * Get information about the frame at index @p index.
    *
@@ -565,6 +710,42 @@ public:
                       void* buffer, size_t capacity,
                       const std::vector<ExtraChannelRequest>& extraChannels = {});
 
+  /**
+   * Decode the pixels of the frame at position @p index, passing the main channels to
+   * callbacks as they're produced, instead of writing them to a buffer.
+   *
+   * This avoids holding a whole frame in memory, and lets the caller process pixels in
+   * parallel with decoding.  @p handler.row is called from the decoder's worker
+   * threads; see PixelRowHandler for details.  The `align` field of @p pixelFormat is
+   * ignored.
+   *
+   * Extra channels, if requested, are still written to complete planar buffers, exactly
+   * as with @ref getFramePixels.
+   *
+   * If a callback throws, no further rows are delivered, and the first exception is
+   * rethrown from this function once the frame has been decoded.
+   */
+  void getFramePixelRows(size_t frameIndex, const JxlPixelFormat& pixelFormat,
+                         const PixelRowHandler& handler,
+                         const std::vector<ExtraChannelRequest>& extraChannels = {});
+
+  /**
+   * Decode the main channels of the frame at position @p index, keeping only the pixels
+   * inside a rectangular region.
+   *
+   * libjxl always decodes the whole frame, but only the requested region is ever stored,
+   * so @p buffer only needs `getFrameBufferSize(xsize, ysize, pixelFormat)` bytes.
+   *
+   * @param[in] x0,y0 Position of the region's top-left pixel within the frame.
+   * @param[in] xsize,ysize Dimensions of the region, which must lie entirely within the
+   *   frame.
+   * @param[out] buffer Target buffer for the region's pixels, in @p pixelFormat.
+   * @param[in] capacity Maximum number of bytes to write to @p buffer.
+   */
+  void getFramePixelRegion(size_t frameIndex, const JxlPixelFormat& pixelFormat,
+                           uint32_t x0, uint32_t y0, uint32_t xsize, uint32_t ysize,
+                           void* buffer, size_t capacity);
+
   template<class T>
   static constexpr JxlDataType getJxlDataType() {
     if constexpr (std::is_same_v<T, float>) {
@@ -609,14 +790,16 @@ public:
    * skip all extra channels. Note, it's possible (and probably undesirable) to decode
    * alpha to a planar extra channel buffer AND the interleaved color buffer at the same
    * time.)  If the span is exactly {-1}, all extra channels are decoded.
+   * @param alloc Allocator for the returned buffers (see MemoryManagerAllocator).
    * @return A FramePixels object containing an interleaved color(+alpha) buffer, `color`,
    * and a dictionary of extra channel buffers, indexed by the extra channel index.
    */
   template<class T, class Alloc = std::allocator<T>>
   FramePixels<T, Alloc> getFramePixels(size_t frameIndex, uint32_t numColorChannels,
-                                       std::span<const int> ecsWanted = {}) {
-    FramePixels<T> framePixels {
-      .color{},
+                                       std::span<const int> ecsWanted = {},
+                                       const Alloc& alloc = Alloc()) {
+    FramePixels<T, Alloc> framePixels {
+      .color = std::vector<T, Alloc>(alloc),
       .ecs{},
     };
     getFramePixels(&framePixels, frameIndex, numColorChannels, ecsWanted);
@@ -628,7 +811,7 @@ public:
    *
    * @param[in,out] framePixels Pointer to a valid FramePixels object, which may or
    * may not be empty.  Its contents are replaced, possibly re-using some of its
-   * existing buffers.
+   * existing buffers.  New extra channel buffers use the color buffer's allocator.
    */
   template<class T, class Alloc = std::allocator<T>>
   void getFramePixels(FramePixels<T, Alloc>* framePixels, size_t frameIndex,
@@ -683,7 +866,8 @@ public:
         pos = framePixels->ecs.emplace_hint(framePixels->ecs.end(), ec,
                                             std::move(oldSamples));
       } else {
-        pos = framePixels->ecs.emplace_hint(framePixels->ecs.end(), ec, Samples());
+        pos = framePixels->ecs.emplace_hint(framePixels->ecs.end(), ec,
+                                            Samples(framePixels->color.get_allocator()));
       }
       pos->second.resize(ecSampleCount);
       thisEcReq.target = pos->second.data();
@@ -832,6 +1016,39 @@ public:
    */
   bool jxlIsFullyBuffered() const;
 
+  /**
+   * Write an index of the image's frames and boxes to @p out.
+   *
+   * The index records the metadata of every frame and box (including the byte offset of
+   * each box) that has been seen so far, so a later Decoder reading the same file can
+   * load it with `loadIndex` and skip the scanning that would otherwise be needed to
+   * count or locate them.  Typically this is stored as a "sidecar" file next to the JXL.
+   *
+   * @param[in,out] out Binary output stream.
+   * @param[in] complete If true, scan the whole file first (if that hasn't been done
+   * already) so the index covers all frames and boxes.
+   *
+   * Throws JxlazyException if the index can't be written.
+   */
+  void saveIndex(std::ostream& out, bool complete = true);
+
+  /**
+   * Load an index previously written by `saveIndex` for the same file.
+   *
+   * This must be called after opening the file, and before accessing anything else
+   * if you want the maximum benefit.  Frames and boxes already known to this Decoder
+   * are kept if the index has fewer of them.
+   *
+   * The index is checked against the first few KiB of the open file, its size (if
+   * known) and the coalescing mode.  It's not possible to detect every modification to
+   * the file, so an index should be discarded whenever its JXL changes.
+   *
+   * @param[in,out] in Binary input stream positioned at the start of the index.
+   * @return @c true if the index was loaded, @c false if it doesn't match the open file
+   * or couldn't be parsed - in that case, nothing is changed.
+   */
+  bool loadIndex(std::istream& in);
+
 protected:
   Decoder(size_t numThreads, const JxlMemoryManager* memManager,
           JxlParallelRunner parallelRunner, void* parallelRunnerOpaque);
@@ -841,7 +1058,9 @@ private:
   std::istream* inStreamPtr_{nullptr}; // &*inStreamPrivate_ or user stream or nullptr
   std::istream::pos_type inStreamStart_{}; // position we'll rewind to if reading a stream
   std::vector<uint8_t> inBufferPrivate_{};
-  const uint8_t* inBufferPtr_{nullptr}; // inBufferPrivate_.data() or user buffer
+  std::shared_ptr<const uint8_t> inMapping_{}; // only used with DecoderHint::MapFile
+  // inBufferPrivate_.data(), inMapping_.get() or user buffer
+  const uint8_t* inBufferPtr_{nullptr};
   size_t inBufferLength_{0};
   size_t inBufferCap_{0};
   size_t inBufferMax_{0};  // inBufferCap_ may grow to this limit
@@ -866,6 +1085,7 @@ private:
     DecodedSomePixels = 1 << 9,
     WholeFileBuffered = 1 << 10,
     HaveCms =           1 << 11,
+    KeepsOrientation =  1 << 12,
   };
   uint16_t stateFlags_{0};
 
@@ -882,6 +1102,11 @@ private:
   std::vector<BoxInfo> boxes_{};
   size_t nextBoxIndex_{0};
 
+  // Identifies the input for saveIndex/loadIndex
+  uint64_t fingerprint_{0};
+  size_t fingerprintLength_{0};
+  uint64_t inputSize_{0}; // Total size of the input, or 0 if not known yet
+
   std::vector<FrameInfo> frames_{};
   size_t nextFrameIndex_{0}; // Updated immediately when we see JXL_DEC_FRAME
 
@@ -903,6 +1128,9 @@ private:
   void goToFrame_(size_t);
   void goToBox_(size_t);
   void goToJpeg_(size_t);
+  bool readBoxDirect_(size_t,uint8_t*,size_t,size_t*);
+  void setExtraChannelBuffers_(size_t,const std::vector<ExtraChannelRequest>&);
+  void decodeFrame_(size_t);
 };
 
 
@@ -7,6 +7,26 @@
 #include <cstddef>
 #include <cstdint>
 #include <filesystem>
+#include <memory>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#define JXLAZY_HAVE_MMAP 1
+#elif defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define JXLAZY_HAVE_MMAP 1
+#endif
+
+#include "util.h"
 
 namespace jxlazy {
 
@@ -20,4 +40,75 @@ size_t getFileSize(const char* path) {
   return result;
 }
 
+#if defined(_WIN32)
+
+std::shared_ptr<const uint8_t> mapFile(const char* path, size_t* size) {
+  HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                            FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (file == INVALID_HANDLE_VALUE) {
+    return nullptr;
+  }
+  LARGE_INTEGER fileSize;
+  if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart <= 0 ||
+      static_cast<uint64_t>(fileSize.QuadPart) > SIZE_MAX) {
+    CloseHandle(file);
+    return nullptr;
+  }
+  HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  CloseHandle(file);
+  if (!mapping) {
+    return nullptr;
+  }
+  // The view keeps the mapping object alive.
+  void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+  CloseHandle(mapping);
+  if (!view) {
+    return nullptr;
+  }
+  *size = static_cast<size_t>(fileSize.QuadPart);
+  return {static_cast<const uint8_t*>(view),
+          [](const uint8_t* p) { UnmapViewOfFile(p); }};
+}
+
+#elif defined(JXLAZY_HAVE_MMAP)
+
+std::shared_ptr<const uint8_t> mapFile(const char* path, size_t* size) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return nullptr;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0 ||
+      static_cast<uintmax_t>(st.st_size) > SIZE_MAX) {
+    close(fd);
+    return nullptr;
+  }
+  size_t length = static_cast<size_t>(st.st_size);
+  // The mapping keeps its own reference to the file.
+  void* addr = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) {
+    return nullptr;
+  }
+  *size = length;
+  return {static_cast<const uint8_t*>(addr),
+          [length](const uint8_t* p) { munmap(const_cast<uint8_t*>(p), length); }};
+}
+
+#else
+
+std::shared_ptr<const uint8_t> mapFile(const char* /*path*/, size_t* /*size*/) {
+  return nullptr;
+}
+
+#endif
+
+uint64_t fnv1a(const void* data, size_t size, uint64_t hash) {
+  const uint8_t* bytes = static_cast<const uint8_t*>(data);
+  for (size_t i = 0; i < size; ++i) {
+    hash = (hash ^ bytes[i]) * 0x100000001b3;
+  }
+  return hash;
+}
+
 }  // namespace jxlazy
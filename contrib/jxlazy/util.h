@@ -8,6 +8,8 @@
 #define JXLAZY_UTIL_H_
 
 #include <cstddef>
+#include <cstdint>
+#include <memory>
 
 namespace jxlazy {
 
@@ -19,6 +21,27 @@ or is too large for a size_t.
  */
 size_t getFileSize(const char* path);
 
+/**
+Map the named file into memory, read-only.
+
+On success, returns a pointer to the first byte of the mapping and sets @p size to the
+length of the file.  The mapping remains valid until the last copy of the returned
+pointer is destroyed.
+
+Quietly returns nullptr if the file can't be mapped, including if it's empty, or if
+memory mapping isn't supported on this platform.
+ */
+std::shared_ptr<const uint8_t> mapFile(const char* path, size_t* size);
+
+/** Starting value for fnv1a(). */
+constexpr uint64_t kFnv1aOffset = 0xcbf29ce484222325;
+
+/**
+64-bit FNV-1a hash of @p size bytes at @p data, continuing from @p hash so that
+consecutive chunks can be hashed as if they were one buffer.
+ */
+uint64_t fnv1a(const void* data, size_t size, uint64_t hash = kFnv1aOffset);
+
 }  // namespace jxlazy
 
 #endif  // JXLAZY_UTIL_H_
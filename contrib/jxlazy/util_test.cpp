@@ -24,3 +24,10 @@ TEST(Util, GetFileSize) {
   size_t size = jxlazy::getFileSize(getPath("jpeg.jpg").c_str());
   EXPECT_TRUE(size == 517 || size == 0);
 }
+
+TEST(Util, Fnv1a) {
+  EXPECT_EQ(jxlazy::fnv1a("", 0), jxlazy::kFnv1aOffset);
+  EXPECT_EQ(jxlazy::fnv1a("a", 1), 0xaf63dc4c8601ec8cULL);
+  // Hashing in chunks gives the same result as hashing all at once
+  EXPECT_EQ(jxlazy::fnv1a("b", 1, jxlazy::fnv1a("a", 1)), jxlazy::fnv1a("ab", 2));
+}
@@ -19,6 +19,10 @@
 #include "enums.h"
 #include "log.h"
 #include "mergeconfig.h"
+#include "pixelalloc.h"
+#include "simd.h"
+#include "stats.h"
+#include "trace.h"
 #include "util.h"
 
 namespace jxltk {
@@ -60,7 +64,7 @@ int addOrSubtract(jxlazy::Decoder& leftImage, jxlazy::Decoder& rightImage, bool
   }
 
   // Prepare encoder for result
-  auto [encp, runner] = makeThreadedEncoder(nullptr, numThreads);
+  JxlEncoderPtr encp = makeThreadedEncoder(nullptr, numThreads);
   JxlEncoder* enc = encp.get();
   JxlBasicInfo encInfo = leftInfo;
   encInfo.uses_original_profile =
@@ -110,45 +114,63 @@ int addOrSubtract(jxlazy::Decoder& leftImage, jxlazy::Decoder& rightImage, bool
   auto outbuf = std::make_unique_for_overwrite<uint8_t[]>(kDefaultIOBufferSize);
 
   // Always decode to float, as we're likely to encounter/create samples outside [0,1].
-  jxlazy::FramePixels<float> leftFrame, rightFrame;
+  PixelFrame<float> leftFrame = makePixelFrame<float>();
+  std::vector<PixelVector<float> > rightEcs;
   JxlPixelFormat format = { .num_channels = leftInfo.num_color_channels,
                             .data_type = JXL_TYPE_FLOAT,
                             .endianness = JXL_NATIVE_ENDIAN,
                             .align = 0 };
+  JxlPixelFormat ecFormat = format;
+  ecFormat.num_channels = 1;
+
+  void (*arith)(float*, const float*, size_t) = adding ? addSamples : subtractSamples;
+  JXLTK_DEBUG("Using %s sample arithmetic.", simdLevelName(simdLevel()));
 
   for (size_t frameIdx = 0; frameIdx < frameCount; ++frameIdx) {
 
     JXLTK_TRACE("%s frame %zu.", opName, frameIdx);
-    // Get frames and update left in place
+    // Decode the left frame, then update it in place as the right frame's rows are
+    // decoded, so we never hold the whole of the right frame's color channels.
     jxlazy::FrameInfo frameInfo = leftImage.getFrameInfo(frameIdx);
+    const JxlLayerInfo& layerInfo = frameInfo.header.layer_info;
+    {
+      jxlazy::FrameInfo rightFrameInfo = rightImage.getFrameInfo(frameIdx);
+      if (rightFrameInfo.header.layer_info.xsize != layerInfo.xsize ||
+          rightFrameInfo.header.layer_info.ysize != layerInfo.ysize) {
+        JXLTK_ERROR("Can't %s frames of different dimensions (frame %zu).", opName,
+                    frameIdx);
+        return EXIT_FAILURE;
+      }
+    }
     leftImage.getFramePixels(&leftFrame, frameIdx, format.num_channels,
                              std::span<const int>({-1}));
-    rightImage.getFramePixels(&rightFrame, frameIdx, format.num_channels,
-                              std::span<const int>({-1}));
-    auto leftEcIter = leftFrame.ecs.begin();
-    auto rightEcIter = rightFrame.ecs.cbegin();
-    if (adding) {
-      for (size_t s = 0; s < leftFrame.color.size(); ++s) {
-        leftFrame.color[s] += rightFrame.color[s];
-      }
-      for (size_t ec = 0; ec < leftInfo.num_extra_channels; ++ec) {
-        std::vector<float>& leftEc = (leftEcIter++)->second;
-        const std::vector<float>& rightEc = (rightEcIter++)->second;
-        for (size_t s = 0; s < leftEc.size(); ++s) {
-          leftEc[s] += rightEc[s];
-        }
-      }
-    } else {
-      for (size_t s = 0; s < leftFrame.color.size(); ++s) {
-        leftFrame.color[s] -= rightFrame.color[s];
-      }
-      for (size_t ec = 0; ec < leftInfo.num_extra_channels; ++ec) {
-        std::vector<float>& leftEc = (leftEcIter++)->second;
-        const std::vector<float>& rightEc = (rightEcIter++)->second;
-        for (size_t s = 0; s < leftEc.size(); ++s) {
-          leftEc[s] -= rightEc[s];
-        }
-      }
+
+    // Extra channels are only available as whole planes
+    std::vector<jxlazy::ExtraChannelRequest> rightEcReqs;
+    rightEcReqs.reserve(leftInfo.num_extra_channels);
+    rightEcs.resize(leftInfo.num_extra_channels,
+                    PixelVector<float>(pixelAllocator<float>()));
+    for (size_t ec = 0; ec < leftInfo.num_extra_channels; ++ec) {
+      rightEcs[ec].resize(leftFrame.ecs.at(ec).size());
+      rightEcReqs.push_back({ .channelIndex = ec,
+                              .format = ecFormat,
+                              .target = rightEcs[ec].data(),
+                              .capacity = rightEcs[ec].size() * sizeof(float) });
+    }
+
+    float* leftColor = leftFrame.color.data();
+    const size_t rowStride = static_cast<size_t>(layerInfo.xsize) * format.num_channels;
+    jxlazy::PixelRowHandler rowHandler;
+    rowHandler.row = [&](size_t, size_t x, size_t y, size_t numPixels,
+                         const void* pixels) {
+      arith(leftColor + y * rowStride + x * format.num_channels,
+            static_cast<const float*>(pixels), numPixels * format.num_channels);
+    };
+    rightImage.getFramePixelRows(frameIdx, format, rowHandler, rightEcReqs);
+
+    for (size_t ec = 0; ec < leftInfo.num_extra_channels; ++ec) {
+      PixelVector<float>& leftEc = leftFrame.ecs.at(ec);
+      arith(leftEc.data(), rightEcs[ec].data(), leftEc.size());
     }
 
     // Send result to encoder
@@ -172,25 +194,29 @@ int addOrSubtract(jxlazy::Decoder& leftImage, jxlazy::Decoder& rightImage, bool
         return EXIT_FAILURE;
       }
     }
-    if (JxlEncoderAddImageFrame(settings, &format, leftFrame.color.data(),
-                                leftFrame.color.size() *
-                                    bytesPerSample(format.data_type))
-        != JXL_ENC_SUCCESS) {
-      JXLTK_ERROR("Failed to add image frame %zu.", frameIdx);
-      return EXIT_FAILURE;
-    }
-    for (const auto& ecNode : leftFrame.ecs) {
-      size_t ec = ecNode.first;
-      const std::vector<float>& ecData = ecNode.second;
-      if (JxlEncoderSetExtraChannelBuffer(settings, &format, ecData.data(),
-                                          ecData.size() *
-                                              bytesPerSample(format.data_type), ec)
+    {
+      TraceSpan addSpan("addFrame", static_cast<int64_t>(frameIdx));
+      if (JxlEncoderAddImageFrame(settings, &format, leftFrame.color.data(),
+                                  leftFrame.color.size() *
+                                      bytesPerSample(format.data_type))
           != JXL_ENC_SUCCESS) {
-        JXLTK_ERROR("Failed to set buffer for extra channel %zu in frame %zu.", ec,
-                  frameIdx);
+        JXLTK_ERROR("Failed to add image frame %zu.", frameIdx);
         return EXIT_FAILURE;
       }
+      for (const auto& ecNode : leftFrame.ecs) {
+        size_t ec = ecNode.first;
+        const PixelVector<float>& ecData = ecNode.second;
+        if (JxlEncoderSetExtraChannelBuffer(settings, &format, ecData.data(),
+                                            ecData.size() *
+                                                bytesPerSample(format.data_type), ec)
+            != JXL_ENC_SUCCESS) {
+          JXLTK_ERROR("Failed to set buffer for extra channel %zu in frame %zu.", ec,
+                    frameIdx);
+          return EXIT_FAILURE;
+        }
+      }
     }
+    countPixelsEncoded(uint64_t{layerInfo.xsize} * layerInfo.ysize);
     if (frameIdx == frameCount - 1) {
       JxlEncoderCloseInput(enc);
     }
@@ -24,7 +24,8 @@ namespace jxltk {
  * @param[in,out] fout Stream to write JXL bytes to, or nullptr to consume encoder output
  *   without writing it anywhere.
  * @param frameConfig Override encoding options for all frames.
- * @param numThreads Max number of threads to use for encoding, or 0 to pick a default.
+ * @param numThreads 1 to encode on the calling thread, or any other value to use the
+ *   shared thread pool (see setSharedThreadPoolSize).
  * @param[out] written Number of bytes output from the encoder, or nullptr if you don't
  *   care.
  * @return 0 on success.
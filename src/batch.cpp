@@ -0,0 +1,348 @@
+/*
+ * Copyright (c) Alistair Barrow. All rights reserved.
+ *
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file.
+ */
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <thread>
+
+#include "../contrib/nlohmann/json.hpp"
+#include "../contrib/jxlazy/include/jxlazy/decoder.h"
+
+#include "batch.h"
+#include "common.h"
+#include "except.h"
+#include "log.h"
+#include "mergeconfig.h"
+#include "util.h"
+
+namespace jxltk {
+
+namespace {
+
+/**
+ * Return the string value of @p key in @p job, which must be a non-empty path other
+ * than "-" (jobs can't share stdin or stdout).
+ */
+std::string getPath(const nlohmann::json& job, const char* key, size_t lineNo) {
+  auto it = job.find(key);
+  if (it == job.end()) {
+    throw JxltkError("Line %zu of the batch manifest: missing \"%s\".", lineNo, key);
+  }
+  if (!it->is_string() || it->get_ref<const std::string&>().empty()) {
+    throw JxltkError("Line %zu of the batch manifest: \"%s\" must be a file name.",
+                     lineNo, key);
+  }
+  const std::string& path = it->get_ref<const std::string&>();
+  if (path == "-") {
+    throw JxltkError("Line %zu of the batch manifest: jobs can't use stdin or stdout.",
+                     lineNo);
+  }
+  return path;
+}
+
+/**
+ * Return the "inputs" array of @p job, checking it has between @p minCount and
+ * @p maxCount elements.
+ */
+std::vector<std::string> getInputs(const nlohmann::json& job, size_t minCount,
+                                   size_t maxCount, size_t lineNo) {
+  auto it = job.find("inputs");
+  if (it == job.end() || !it->is_array() || it->size() < minCount ||
+      it->size() > maxCount) {
+    if (minCount == maxCount) {
+      throw JxltkError("Line %zu of the batch manifest: \"inputs\" must be an array of "
+                       "%zu file names.", lineNo, minCount);
+    }
+    throw JxltkError("Line %zu of the batch manifest: \"inputs\" must be an array of "
+                     "file names.", lineNo);
+  }
+  std::vector<std::string> inputs;
+  for (const auto& input : *it) {
+    if (!input.is_string() || input.get_ref<const std::string&>().empty() ||
+        input.get_ref<const std::string&>() == "-") {
+      throw JxltkError("Line %zu of the batch manifest: \"inputs\" must be an array of "
+                       "file names.", lineNo);
+    }
+    inputs.push_back(input.get<std::string>());
+  }
+  return inputs;
+}
+
+BatchJob jobFromJson(const nlohmann::json& job, const CmdlineOpts& defaults,
+                     size_t lineNo) {
+  if (!job.is_object()) {
+    throw JxltkError("Line %zu of the batch manifest is not a JSON object.", lineNo);
+  }
+  for (const auto& [key, val] : job.items()) {
+    if (key != "mode" && key != "id" && key != "inputs" && key != "input" &&
+        key != "output" && key != "config" && key != "coalesce") {
+      throw JxltkError("Line %zu of the batch manifest: unknown key %s.", lineNo,
+                       shellQuote(key, true).c_str());
+    }
+  }
+
+  BatchJob result;
+  result.opts = defaults;
+  CmdlineOpts& opts = result.opts;
+
+  auto id = job.find("id");
+  if (id == job.end()) {
+    result.id = std::to_string(lineNo);
+  } else if (id->is_string()) {
+    result.id = id->get<std::string>();
+  } else if (id->is_number_integer()) {
+    result.id = id->dump();
+  } else {
+    throw JxltkError("Line %zu of the batch manifest: \"id\" must be a string or "
+                     "integer.", lineNo);
+  }
+
+  auto mode = job.find("mode");
+  if (mode == job.end() || !mode->is_string()) {
+    throw JxltkError("Line %zu of the batch manifest: missing \"mode\".", lineNo);
+  }
+  opts.mode = mode->get<std::string>();
+  opts.positional.clear();
+  opts.mergeCfgFilename.clear();
+
+  if (opts.mode == "merge") {
+    if (job.contains("config")) {
+      if (job.contains("inputs")) {
+        throw JxltkError("Line %zu of the batch manifest: \"config\" and \"inputs\" "
+                         "are mutually exclusive.", lineNo);
+      }
+      opts.mergeCfgFilename = getPath(job, "config", lineNo);
+    } else {
+      opts.positional = getInputs(job, 1, SIZE_MAX, lineNo);
+    }
+    opts.positional.push_back(getPath(job, "output", lineNo));
+  } else if (opts.mode == "split" || opts.mode == "icc") {
+    opts.positional.push_back(getPath(job, "input", lineNo));
+    opts.positional.push_back(getPath(job, "output", lineNo));
+  } else if (opts.mode == "add" || opts.mode == "subtract") {
+    opts.positional = getInputs(job, 2, 2, lineNo);
+    opts.positional.push_back(getPath(job, "output", lineNo));
+  } else if (opts.mode == "compare") {
+    opts.positional = getInputs(job, 2, 2, lineNo);
+  } else {
+    throw JxltkError("Line %zu of the batch manifest: unsupported mode %s.", lineNo,
+                     shellQuote(opts.mode, true).c_str());
+  }
+
+  if (opts.mode != "merge" && job.contains("config")) {
+    throw JxltkError("Line %zu of the batch manifest: \"config\" is only used by merge "
+                     "jobs.", lineNo);
+  }
+  if (job.contains("input") && opts.mode != "split" && opts.mode != "icc") {
+    throw JxltkError("Line %zu of the batch manifest: %s jobs take \"inputs\", not "
+                     "\"input\".", lineNo, opts.mode.c_str());
+  }
+  if (opts.mode == "compare" && job.contains("output")) {
+    throw JxltkError("Line %zu of the batch manifest: compare jobs have no \"output\".",
+                     lineNo);
+  }
+
+  auto coalesce = job.find("coalesce");
+  if (coalesce != job.end()) {
+    if (!coalesce->is_boolean()) {
+      throw JxltkError("Line %zu of the batch manifest: \"coalesce\" must be true or "
+                       "false.", lineNo);
+    }
+    opts.coalesce = coalesce->get<bool>();
+  }
+  return result;
+}
+
+/**
+ * Return the size of the file at @p path plus the memory needed to hold its pixels as
+ * floats, or 0 if it can't be read.
+ */
+size_t estimateInputMemory(const std::string& path) {
+  std::error_code ec;
+  const uintmax_t fileSize = std::filesystem::file_size(path, ec);
+  if (ec) {
+    return 0;
+  }
+  size_t pixelBytes = 0;
+  try {
+    jxlazy::Decoder dec = makeDecoder(1);
+    dec.openFile(path.c_str(), 0,
+                 jxlazy::DecoderHint::NoPixels | jxlazy::DecoderHint::NoColorProfile |
+                 jxlazy::DecoderHint::MapFile);
+    const JxlBasicInfo info = dec.getBasicInfo();
+    pixelBytes = size_t{info.xsize} * info.ysize *
+                 (info.num_color_channels + info.num_extra_channels) * sizeof(float);
+  } catch (const std::exception& e) {
+    JXLTK_DEBUG("Can't estimate memory for %s: %s", shellQuote(path, true).c_str(),
+                e.what());
+  }
+  return static_cast<size_t>(fileSize) + pixelBytes;
+}
+
+}  // namespace
+
+std::vector<BatchJob> parseBatchManifest(std::istream& in, const CmdlineOpts& defaults) {
+  std::vector<BatchJob> jobs;
+  std::string line;
+  size_t lineNo = 0;
+  while (std::getline(in, line)) {
+    ++lineNo;
+    if (line.find_first_not_of(" \t\r") == std::string::npos) {
+      continue;
+    }
+    nlohmann::json job;
+    try {
+      job = nlohmann::json::parse(line);
+    } catch (const nlohmann::json::exception& e) {
+      throw JxltkError("Line %zu of the batch manifest is not valid JSON: %s", lineNo,
+                       e.what());
+    }
+    jobs.push_back(jobFromJson(job, defaults, lineNo));
+  }
+  if (in.bad()) {
+    throw JxltkError("Failed to read the batch manifest.");
+  }
+  return jobs;
+}
+
+size_t estimateJobMemory(const CmdlineOpts& opts) {
+  std::vector<std::string> inputs;
+  if (opts.mode == "merge") {
+    if (!opts.mergeCfgFilename.empty()) {
+      std::ifstream configFile(opts.mergeCfgFilename, std::ios::binary);
+      try {
+        MergeConfig config = MergeConfig::fromJson(configFile);
+        config.resolvePaths(
+            std::filesystem::path(opts.mergeCfgFilename).remove_filename().string());
+        for (const FrameConfig& frame : config.frames) {
+          if (frame.file && !frame.file->empty()) {
+            inputs.push_back(*frame.file);
+          }
+        }
+      } catch (const std::exception&) {
+        // The job itself will report the problem
+      }
+    } else if (!opts.positional.empty()) {
+      inputs.assign(opts.positional.begin(), opts.positional.end() - 1);
+    }
+  } else if (opts.mode == "split" || opts.mode == "icc") {
+    inputs.assign(opts.positional.begin(),
+                  opts.positional.begin() + std::min<size_t>(1, opts.positional.size()));
+  } else {
+    inputs.assign(opts.positional.begin(),
+                  opts.positional.begin() + std::min<size_t>(2, opts.positional.size()));
+  }
+
+  size_t total = 0;
+  for (const std::string& input : inputs) {
+    total += estimateInputMemory(input);
+  }
+  return total;
+}
+
+size_t runBatch(const std::vector<BatchJob>& jobs, const BatchOptions& options,
+                const BatchRunner& run, std::ostream& status,
+                const std::function<size_t(const CmdlineOpts&)>& estimate) {
+  size_t numWorkers = options.numJobs != 0 ? options.numJobs :
+                                             std::thread::hardware_concurrency();
+  numWorkers = std::clamp<size_t>(numWorkers, 1, std::max<size_t>(jobs.size(), 1));
+
+  std::mutex mutex;
+  std::condition_variable changed;
+  size_t claimed = 0;  // Jobs taken by a worker
+  size_t started = 0;  // Jobs that have started running
+  size_t running = 0;
+  size_t memoryInUse = 0;
+  size_t failures = 0;
+
+  auto worker = [&]() {
+    while (true) {
+      size_t index;
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (claimed == jobs.size()) {
+          return;
+        }
+        index = claimed++;
+      }
+      const BatchJob& job = jobs[index];
+      // Decoding headers can be slow, so it's done before taking the lock
+      const size_t bytes = options.maxMemory != 0 ? estimate(job.opts) : 0;
+      {
+        // Start jobs in order, so a big job isn't overtaken forever by small ones.
+        // A job that won't fit in the budget at all runs alone.
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [&]() {
+          return started == index &&
+                 (running == 0 || memoryInUse + bytes <= options.maxMemory ||
+                  options.maxMemory == 0);
+        });
+        ++started;
+        ++running;
+        memoryInUse += bytes;
+      }
+      changed.notify_all();
+
+      JXLTK_INFO("Starting batch job %s (%s).", job.id.c_str(), job.opts.mode.c_str());
+      const auto startTime = std::chrono::steady_clock::now();
+      int exitCode = EXIT_FAILURE;
+      std::string error;
+      try {
+        exitCode = run(job.opts);
+      } catch (const std::exception& e) {
+        error = e.what();
+      } catch (...) {
+        error = "Unknown exception";
+      }
+      const std::chrono::duration<double> elapsed =
+          std::chrono::steady_clock::now() - startTime;
+      if (!error.empty()) {
+        JXLTK_ERROR("Batch job %s failed: %s", job.id.c_str(), error.c_str());
+      }
+
+      nlohmann::ordered_json result;
+      result["id"] = job.id;
+      result["mode"] = job.opts.mode;
+      result["status"] = exitCode == EXIT_SUCCESS ? "ok" : "failed";
+      result["exitCode"] = exitCode;
+      result["seconds"] = elapsed.count();
+      if (!error.empty()) {
+        result["error"] = error;
+      }
+      const std::string line =
+          result.dump(-1, ' ', false, nlohmann::json::error_handler_t::replace);
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        --running;
+        memoryInUse -= bytes;
+        if (exitCode != EXIT_SUCCESS) {
+          ++failures;
+        }
+        status << line << '\n';
+        status.flush();
+      }
+      changed.notify_all();
+    }
+  };
+
+  std::vector<std::thread> threads;
+  threads.reserve(numWorkers - 1);
+  for (size_t i = 1; i < numWorkers; ++i) {
+    threads.emplace_back(worker);
+  }
+  worker();
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  return failures;
+}
+
+}  // namespace jxltk
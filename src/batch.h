@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) Alistair Barrow. All rights reserved.
+ *
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file.
+ */
+#ifndef JXLTK_BATCH_H_
+#define JXLTK_BATCH_H_
+
+#include <cstddef>
+#include <functional>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "cmdline.h"
+
+namespace jxltk {
+
+/**
+ * One operation from a batch manifest, expressed as the options it would have been
+ * given on the command line.
+ */
+struct BatchJob {
+  /* The manifest's "id" for this job, or its line number */
+  std::string id{};
+  CmdlineOpts opts{};
+};
+
+/**
+ * Parse a batch manifest: one JSON object per line, each describing a single
+ * merge, split, add, subtract, compare or icc operation.  Blank lines are ignored.
+ *
+ * Each job starts as a copy of @p defaults (so options given to batch mode apply to
+ * every job), then takes its mode and files from the manifest.
+ *
+ * Throws JxltkError, naming the line, if any job is invalid.
+ */
+std::vector<BatchJob> parseBatchManifest(std::istream& in, const CmdlineOpts& defaults);
+
+/**
+ * Return a rough estimate of the memory a job needs, in bytes: the size of each input
+ * file, plus its pixels as float samples.  Inputs that can't be read count as 0.
+ */
+size_t estimateJobMemory(const CmdlineOpts& opts);
+
+struct BatchOptions {
+  /* Maximum number of jobs to run at once, or 0 for the number of CPUs */
+  size_t numJobs{0};
+  /* Don't start a job if the estimated memory of the running jobs would exceed this
+   * many bytes, unless nothing else is running.  0 means no limit. */
+  size_t maxMemory{0};
+};
+
+/**
+ * Runs one job, returning its exit status.  Must be safe to call from several threads.
+ */
+using BatchRunner = std::function<int(const CmdlineOpts&)>;
+
+/**
+ * Run every job in @p jobs, up to BatchOptions::numJobs at a time.  Jobs start in
+ * manifest order.
+ *
+ * As each job finishes, a single line of JSON reporting its status is written to
+ * @p status.
+ *
+ * @param[in] estimate Returns the memory needed by a job; see @ref estimateJobMemory.
+ * @return The number of jobs that failed.
+ */
+size_t runBatch(const std::vector<BatchJob>& jobs, const BatchOptions& options,
+                const BatchRunner& run, std::ostream& status,
+                const std::function<size_t(const CmdlineOpts&)>& estimate =
+                    estimateJobMemory);
+
+}  // namespace jxltk
+
+#endif  // JXLTK_BATCH_H_
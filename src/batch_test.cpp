@@ -0,0 +1,283 @@
+/**
+ * Copyright (c) Alistair Barrow. All rights reserved.
+ *
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "../contrib/nlohmann/json.hpp"
+
+#include "batch.h"
+#include "except.h"
+
+using jxltk::BatchJob;
+using jxltk::BatchOptions;
+using jxltk::CmdlineOpts;
+using jxltk::JxltkError;
+
+namespace {
+
+std::vector<BatchJob> parse(const std::string& manifest,
+                            const CmdlineOpts& defaults = {}) {
+  std::istringstream in(manifest);
+  return jxltk::parseBatchManifest(in, defaults);
+}
+
+std::vector<BatchJob> makeJobs(size_t count) {
+  std::vector<BatchJob> jobs(count);
+  for (size_t i = 0; i < count; ++i) {
+    jobs[i].id = std::to_string(i);
+    jobs[i].opts.mode = "compare";
+  }
+  return jobs;
+}
+
+std::vector<nlohmann::json> parseStatus(const std::string& status) {
+  std::vector<nlohmann::json> lines;
+  std::istringstream in(status);
+  std::string line;
+  while (std::getline(in, line)) {
+    lines.push_back(nlohmann::json::parse(line));
+  }
+  return lines;
+}
+
+}  // namespace
+
+TEST(Batch, ParseManifest) {
+  CmdlineOpts defaults;
+  defaults.mode = "batch";
+  defaults.overrideFrameConfig.effort = 3;
+  defaults.positional = {"manifest.jsonl"};
+  const std::vector<BatchJob> jobs = parse(
+      R"({"mode": "merge", "inputs": ["a.jxl", "b.jxl"], "output": "ab.jxl"})" "\n"
+      "\n"
+      R"({"mode": "merge", "config": "dir/merge.json", "output": "m.jxl", "id": "x"})"
+      "\n"
+      R"({"mode": "split", "input": "in.jxl", "output": "out", "coalesce": true})" "\n"
+      R"({"mode": "subtract", "inputs": ["a.jxl", "b.jxl"], "output": "d.jxl"})" "\n"
+      R"({"mode": "compare", "inputs": ["a.jxl", "b.jxl"], "id": 7})" "\n"
+      R"({"mode": "icc", "input": "in.jxl", "output": "in.icc"})",
+      defaults);
+  ASSERT_EQ(jobs.size(), 6);
+
+  EXPECT_EQ(jobs[0].id, "1");
+  EXPECT_EQ(jobs[0].opts.mode, "merge");
+  EXPECT_EQ(jobs[0].opts.positional,
+            (std::vector<std::string>{"a.jxl", "b.jxl", "ab.jxl"}));
+  EXPECT_TRUE(jobs[0].opts.mergeCfgFilename.empty());
+  // Options given to batch mode apply to every job
+  EXPECT_EQ(jobs[0].opts.overrideFrameConfig.effort, 3);
+
+  EXPECT_EQ(jobs[1].id, "x");
+  EXPECT_EQ(jobs[1].opts.mergeCfgFilename, "dir/merge.json");
+  EXPECT_EQ(jobs[1].opts.positional, std::vector<std::string>{"m.jxl"});
+
+  EXPECT_EQ(jobs[2].id, "4");
+  EXPECT_EQ(jobs[2].opts.mode, "split");
+  EXPECT_EQ(jobs[2].opts.positional, (std::vector<std::string>{"in.jxl", "out"}));
+  EXPECT_TRUE(jobs[2].opts.coalesce);
+  EXPECT_FALSE(jobs[3].opts.coalesce);
+
+  EXPECT_EQ(jobs[3].opts.mode, "subtract");
+  EXPECT_EQ(jobs[3].opts.positional,
+            (std::vector<std::string>{"a.jxl", "b.jxl", "d.jxl"}));
+
+  EXPECT_EQ(jobs[4].id, "7");
+  EXPECT_EQ(jobs[4].opts.positional, (std::vector<std::string>{"a.jxl", "b.jxl"}));
+
+  EXPECT_EQ(jobs[5].opts.mode, "icc");
+  EXPECT_EQ(jobs[5].opts.positional, (std::vector<std::string>{"in.jxl", "in.icc"}));
+  EXPECT_EQ(jobs[5].opts.overrideFrameConfig.effort, 3);
+
+  EXPECT_TRUE(parse("").empty());
+}
+
+TEST(Batch, ParseManifestErrors) {
+  const char* badLines[] = {
+    R"({"mode": "merge", "inputs": ["a.jxl"]})",
+    R"({"mode": "merge", "inputs": [], "output": "o.jxl"})",
+    R"({"mode": "merge", "inputs": ["a.jxl"], "config": "m.json", "output": "o.jxl"})",
+    R"({"mode": "merge", "inputs": ["-"], "output": "o.jxl"})",
+    R"({"mode": "merge", "inputs": ["a.jxl"], "output": "-"})",
+    R"({"mode": "split", "inputs": ["a.jxl"], "output": "dir"})",
+    R"({"mode": "add", "inputs": ["a.jxl"], "output": "o.jxl"})",
+    R"({"mode": "compare", "inputs": ["a.jxl", "b.jxl"], "output": "o.jxl"})",
+    R"({"mode": "icc", "input": "a.jxl", "output": "b.icc", "coalesce": 1})",
+    R"({"mode": "icc", "input": "a.jxl", "output": "b.icc", "effort": 1})",
+    R"({"mode": "icc", "input": "a.jxl", "output": "b.icc", "id": [1]})",
+    R"({"mode": "synth", "output": "o.jxl"})",
+    R"({"mode": "batch", "input": "m.jsonl"})",
+    R"({"inputs": ["a.jxl", "b.jxl"]})",
+    R"(["compare", "a.jxl", "b.jxl"])",
+    R"({"mode": "compare", )",
+  };
+  for (const char* line : badLines) {
+    EXPECT_THROW(parse(line), JxltkError) << line;
+  }
+
+  // Errors name the line
+  try {
+    parse("\n" R"({"mode": "compare", "inputs": ["a.jxl", "b.jxl"]})" "\n{\n");
+    FAIL();
+  } catch (const JxltkError& e) {
+    EXPECT_NE(std::string(e.what()).find("Line 3 "), std::string::npos) << e.what();
+  }
+}
+
+TEST(Batch, RunJobs) {
+  std::vector<BatchJob> jobs = makeJobs(40);
+  for (BatchJob& job : jobs) {
+    job.opts.positional = {job.id};
+  }
+  std::atomic<int> running{0};
+  std::atomic<int> maxRunning{0};
+  std::mutex mutex;
+  std::vector<std::string> started;
+  auto run = [&](const CmdlineOpts& opts) {
+    EXPECT_EQ(opts.mode, "compare");
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      started.push_back(opts.positional.at(0));
+    }
+    int now = ++running;
+    int prev = maxRunning.load();
+    while (prev < now && !maxRunning.compare_exchange_weak(prev, now)) {}
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    --running;
+    return EXIT_SUCCESS;
+  };
+
+  BatchOptions options;
+  options.numJobs = 3;
+  std::ostringstream status;
+  EXPECT_EQ(jxltk::runBatch(jobs, options, run, status), 0);
+  EXPECT_EQ(started.size(), jobs.size());
+  EXPECT_LE(maxRunning.load(), 3);
+  EXPECT_GE(maxRunning.load(), 1);
+
+  const std::vector<nlohmann::json> lines = parseStatus(status.str());
+  ASSERT_EQ(lines.size(), jobs.size());
+  std::set<std::string> ids;
+  for (const nlohmann::json& line : lines) {
+    ids.insert(line.at("id").get<std::string>());
+    EXPECT_EQ(line.at("mode"), "compare");
+    EXPECT_EQ(line.at("status"), "ok");
+    EXPECT_EQ(line.at("exitCode"), EXIT_SUCCESS);
+    EXPECT_GE(line.at("seconds").get<double>(), 0);
+    EXPECT_FALSE(line.contains("error"));
+  }
+  EXPECT_EQ(ids.size(), jobs.size());
+
+  // One at a time, jobs run in manifest order
+  options.numJobs = 1;
+  started.clear();
+  status.str("");
+  EXPECT_EQ(jxltk::runBatch(jobs, options, run, status), 0);
+  ASSERT_EQ(started.size(), jobs.size());
+  for (size_t i = 0; i < jobs.size(); ++i) {
+    EXPECT_EQ(started[i], jobs[i].id);
+  }
+
+  // No jobs
+  status.str("");
+  EXPECT_EQ(jxltk::runBatch({}, options, run, status), 0);
+  EXPECT_TRUE(status.str().empty());
+}
+
+TEST(Batch, Failures) {
+  std::vector<BatchJob> jobs = makeJobs(10);
+  jobs[2].opts.positional = {"fail"};
+  jobs[5].opts.positional = {"throw"};
+  auto run = [](const CmdlineOpts& opts) {
+    if (!opts.positional.empty() && opts.positional[0] == "throw") {
+      throw JxltkError("Something broke");
+    }
+    return opts.positional.empty() ? EXIT_SUCCESS : EXIT_FAILURE;
+  };
+
+  BatchOptions options;
+  options.numJobs = 4;
+  std::ostringstream status;
+  EXPECT_EQ(jxltk::runBatch(jobs, options, run, status), 2);
+  const std::vector<nlohmann::json> lines = parseStatus(status.str());
+  ASSERT_EQ(lines.size(), jobs.size());
+  for (const nlohmann::json& line : lines) {
+    const std::string id = line.at("id").get<std::string>();
+    if (id == "2") {
+      EXPECT_EQ(line.at("status"), "failed");
+      EXPECT_EQ(line.at("exitCode"), EXIT_FAILURE);
+      EXPECT_FALSE(line.contains("error"));
+    } else if (id == "5") {
+      EXPECT_EQ(line.at("status"), "failed");
+      EXPECT_EQ(line.at("error"), "Something broke");
+    } else {
+      EXPECT_EQ(line.at("status"), "ok");
+    }
+  }
+}
+
+TEST(Batch, MemoryBudget) {
+  std::vector<BatchJob> jobs = makeJobs(12);
+  // Too big for the budget on its own, so it has to run alone
+  jobs[4].opts.positional = {"huge"};
+  auto estimate = [](const CmdlineOpts& opts) -> size_t {
+    return opts.positional.empty() ? 40 : 1000;
+  };
+  std::atomic<size_t> inUse{0};
+  std::atomic<size_t> maxInUse{0};
+  std::atomic<int> running{0};
+  std::atomic<bool> hugeShared{false};
+  auto run = [&](const CmdlineOpts& opts) {
+    const size_t bytes = opts.positional.empty() ? 40 : 1000;
+    const int others = running++;
+    size_t now = (inUse += bytes);
+    size_t prev = maxInUse.load();
+    while (prev < now && !maxInUse.compare_exchange_weak(prev, now)) {}
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    if (bytes == 1000 && (others != 0 || running.load() != 1)) {
+      hugeShared = true;
+    }
+    inUse -= bytes;
+    --running;
+    return EXIT_SUCCESS;
+  };
+
+  BatchOptions options;
+  options.numJobs = 8;
+  options.maxMemory = 100;
+  std::ostringstream status;
+  EXPECT_EQ(jxltk::runBatch(jobs, options, run, status, estimate), 0);
+  EXPECT_FALSE(hugeShared.load());
+  EXPECT_EQ(parseStatus(status.str()).size(), jobs.size());
+  // Apart from the huge job, no more than two 40 byte jobs ran at once
+  for (size_t i = 0; i < jobs.size(); ++i) {
+    jobs[i].opts.positional.clear();
+  }
+  maxInUse = 0;
+  status.str("");
+  EXPECT_EQ(jxltk::runBatch(jobs, options, run, status, estimate), 0);
+  EXPECT_LE(maxInUse.load(), 80);
+}
+
+TEST(Batch, EstimateMissingInputs) {
+  CmdlineOpts opts;
+  opts.mode = "merge";
+  opts.positional = {"/nonexistent/a.jxl", "/nonexistent/out.jxl"};
+  EXPECT_EQ(jxltk::estimateJobMemory(opts), 0);
+  opts.positional.clear();
+  opts.mergeCfgFilename = "/nonexistent/merge.json";
+  EXPECT_EQ(jxltk::estimateJobMemory(opts), 0);
+}
@@ -0,0 +1,122 @@
+/*
+ * Copyright (c) Alistair Barrow. All rights reserved.
+ *
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file.
+ */
+#include <filesystem>
+#include <limits>
+#include <random>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "bench_util.h"
+#include "common.h"
+#include "except.h"
+#include "mergeconfig.h"
+#include "simd.h"
+#include "synth.h"
+#include "util.h"
+
+using std::string;
+using std::vector;
+namespace fs = std::filesystem;
+
+namespace jxltk {
+
+namespace {
+
+template <typename T>
+void fillSynthetic(T* samples, const SynthConfig& config, size_t numChannels) {
+  for (uint32_t y = 0; y < config.ysize; ++y) {
+    for (uint32_t x = 0; x < config.xsize; ++x) {
+      for (size_t c = 0; c < numChannels; ++c) {
+        float value = synthSample(config, 0, c, x, y);
+        if constexpr (std::is_same_v<T, float>) {
+          *samples++ = value;
+        } else {
+          *samples++ = static_cast<T>(value * std::numeric_limits<T>::max() + .5f);
+        }
+      }
+    }
+  }
+}
+
+}  // namespace
+
+
+SynthConfig synthConfigFor(uint32_t xsize, uint32_t ysize, size_t numFrames,
+                           const JxlPixelFormat& format, uint32_t border) {
+  SynthConfig config;
+  config.xsize = xsize;
+  config.ysize = ysize;
+  config.numFrames = numFrames;
+  config.numColorChannels = format.num_channels >= 3 ? 3 : 1;
+  config.alpha = format.num_channels == 2 || format.num_channels == 4;
+  config.floatSamples = format.data_type == JXL_TYPE_FLOAT ||
+                        format.data_type == JXL_TYPE_FLOAT16;
+  config.bitsPerSample = static_cast<uint32_t>(bytesPerSample(format.data_type) * 8);
+  config.border = border;
+  return config;
+}
+
+vector<uint8_t> makeSyntheticPixels(uint32_t xsize, uint32_t ysize,
+                                    const JxlPixelFormat& format, uint32_t seed,
+                                    uint32_t border) {
+  SynthConfig config = synthConfigFor(xsize, ysize, 1, format, border);
+  config.seed = seed;
+  vector<uint8_t> pixels(static_cast<size_t>(xsize) * ysize *
+                         bytesPerPixel(format.data_type, format.num_channels));
+  switch (format.data_type) {
+  case JXL_TYPE_UINT8:
+    fillSynthetic(pixels.data(), config, format.num_channels);
+    break;
+  case JXL_TYPE_UINT16:
+    fillSynthetic(reinterpret_cast<uint16_t*>(pixels.data()), config,
+                  format.num_channels);
+    break;
+  case JXL_TYPE_FLOAT:
+    fillSynthetic(reinterpret_cast<float*>(pixels.data()), config, format.num_channels);
+    break;
+  case JXL_TYPE_FLOAT16: {
+    vector<float> floats(pixels.size() / sizeof(Float16));
+    fillSynthetic(floats.data(), config, format.num_channels);
+    floatToHalf(reinterpret_cast<Float16*>(pixels.data()), floats.data(), floats.size());
+    break;
+  }
+  default:
+    throw JxltkError("%s: Unsupported data type %d", __func__,
+                     static_cast<int>(format.data_type));
+  }
+  return pixels;
+}
+
+
+SyntheticCorpus::SyntheticCorpus() {
+  std::random_device rd;
+  fs::path dir = fs::temp_directory_path() / ("jxltk_bench_" + std::to_string(rd()));
+  fs::create_directories(dir);
+  dir_ = dir.string();
+}
+
+SyntheticCorpus::~SyntheticCorpus() {
+  std::error_code ec;
+  fs::remove_all(dir_, ec);
+}
+
+const string& SyntheticCorpus::get(const SynthConfig& config) {
+  string name = config.name() + ".jxl";
+  for (const auto& file : files_) {
+    if (file.first == name) return file.second;
+  }
+  string path = (fs::path(dir_) / name).string();
+  FrameConfig frameCfg;
+  frameCfg.effort = 1;
+  frameCfg.distance = 0.f;
+  EncoderOutput out(path.c_str());
+  synthesize(config, out, frameCfg);
+  return files_.emplace_back(name, path).second;
+}
+
+}  // namespace jxltk
@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) Alistair Barrow. All rights reserved.
+ *
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file.
+ */
+#ifndef JXLTK_BENCH_UTIL_H_
+#define JXLTK_BENCH_UTIL_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <jxl/types.h>
+
+#include "synth.h"
+#include "util.h"
+
+namespace jxltk {
+
+/**
+ * Return settings for a synthetic image whose samples have the layout of @p format: its
+ * channel count decides the color channels and alpha, and its data type decides the bit
+ * depth (8, 16 or 32-bit float).
+ */
+SynthConfig synthConfigFor(uint32_t xsize, uint32_t ysize, size_t numFrames,
+                           const JxlPixelFormat& format, uint32_t border = 0);
+
+/**
+ * Generate frame 0 of a synthetic image (see synth.h) in @p format, seeded with
+ * @p seed.  The buffer is native-endian with no row padding.
+ */
+std::vector<uint8_t> makeSyntheticPixels(uint32_t xsize, uint32_t ysize,
+                                         const JxlPixelFormat& format, uint32_t seed,
+                                         uint32_t border = 0);
+
+/**
+ * A set of synthetic JXL files in a temporary directory, deleted on destruction.
+ */
+class SyntheticCorpus {
+ public:
+  SyntheticCorpus();
+  SyntheticCorpus(const SyntheticCorpus&) = delete;
+  SyntheticCorpus& operator=(const SyntheticCorpus&) = delete;
+  ~SyntheticCorpus();
+
+  /**
+   * Return the path of a JXL generated from @p config, writing it on first use.
+   * Frames are encoded losslessly at effort 1.
+   */
+  const std::string& get(const SynthConfig& config);
+
+  const std::string& get(uint32_t xsize, uint32_t ysize, size_t numFrames,
+                         const JxlPixelFormat& format, uint32_t border = 0) {
+    return get(synthConfigFor(xsize, ysize, numFrames, format, border));
+  }
+
+  const std::string& dir() const { return dir_; }
+
+ private:
+  std::string dir_{};
+  std::vector<std::pair<std::string, std::string> > files_{};
+};
+
+}  // namespace jxltk
+
+#endif  // JXLTK_BENCH_UTIL_H_
@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) Alistair Barrow. All rights reserved.
+ *
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file.
+ */
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#include "bufferpool.h"
+
+namespace jxltk {
+
+namespace {
+
+// Each block starts with its size class, in a header that keeps the rest aligned.
+constexpr size_t kHeader = alignof(std::max_align_t);
+static_assert(kHeader >= sizeof(size_t));
+
+}  // namespace
+
+
+BufferPool::BufferPool(size_t maxRetainedBytes) :
+  memManager_{
+    .opaque = this,
+    .alloc = [](void* opaque, size_t size) {
+      return static_cast<BufferPool*>(opaque)->alloc(size);
+    },
+    .free = [](void* opaque, void* address) {
+      static_cast<BufferPool*>(opaque)->free(address);
+    },
+  },
+  maxRetainedBytes_(maxRetainedBytes) {}
+
+BufferPool::~BufferPool() {
+  trim();
+}
+
+/*static*/ size_t BufferPool::sizeClass(size_t size) {
+  if (size <= kMinPooledSize) {
+    return size;
+  }
+  // Quarter steps between powers of 2
+  const size_t step = std::bit_floor(size - 1) / 4;
+  if (size > SIZE_MAX - step) {
+    return size;
+  }
+  return (size + step - 1) / step * step;
+}
+
+void* BufferPool::alloc(size_t size) {
+  const size_t cls = sizeClass(size);
+  if (cls > SIZE_MAX - kHeader) {
+    return nullptr;
+  }
+  if (cls >= kMinPooledSize) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = free_.find(cls);
+    if (it != free_.end() && !it->second.empty()) {
+      uint8_t* block = static_cast<uint8_t*>(it->second.back());
+      it->second.pop_back();
+      counters_.retainedBytes -= cls;
+      ++counters_.reused;
+      return block + kHeader;
+    }
+    ++counters_.allocated;
+  }
+  uint8_t* block = static_cast<uint8_t*>(std::malloc(cls + kHeader));
+  if (!block) {
+    return nullptr;
+  }
+  memcpy(block, &cls, sizeof cls);
+  return block + kHeader;
+}
+
+void BufferPool::free(void* address) {
+  if (!address) {
+    return;
+  }
+  uint8_t* block = static_cast<uint8_t*>(address) - kHeader;
+  size_t cls;
+  memcpy(&cls, block, sizeof cls);
+  if (cls >= kMinPooledSize) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (counters_.retainedBytes + cls <= maxRetainedBytes_) {
+      try {
+        std::vector<void*>& list = free_[cls];
+        if (list.size() < kMaxFreePerClass) {
+          list.push_back(block);
+          counters_.retainedBytes += cls;
+          return;
+        }
+      } catch (const std::bad_alloc&) {
+        // Just don't keep it
+      }
+    }
+  }
+  std::free(block);
+}
+
+void BufferPool::trim() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (const auto& entry : free_) {
+    for (void* block : entry.second) {
+      std::free(block);
+    }
+  }
+  free_.clear();
+  counters_.retainedBytes = 0;
+}
+
+BufferPool::Counters BufferPool::getCounters() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return counters_;
+}
+
+}  // namespace jxltk
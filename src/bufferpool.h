@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) Alistair Barrow. All rights reserved.
+ *
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file.
+ */
+#ifndef JXLTK_BUFFERPOOL_H_
+#define JXLTK_BUFFERPOOL_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include <jxl/memory_manager.h>
+
+namespace jxltk {
+
+/**
+ * Keeps freed frame-sized buffers and hands them out again, so a long animation
+ * reaches a steady state where frames of similar sizes reuse memory instead of
+ * allocating and page-faulting fresh buffers for every frame.
+ *
+ * Requests are rounded up to a size class (at most 25% bigger than the request), and
+ * each class has its own free list.  Requests smaller than @ref kMinPooledSize go
+ * straight to `malloc`.  Use it through @ref memoryManager, typically with
+ * setPixelMemoryManager (see pixelalloc.h).  It's safe to allocate and free from any
+ * thread.
+ */
+class BufferPool {
+ public:
+  /** Smaller buffers aren't worth keeping. */
+  static constexpr size_t kMinPooledSize = size_t{64} * 1024;
+  /** Most free buffers kept in one size class. */
+  static constexpr size_t kMaxFreePerClass = 4;
+  static constexpr size_t kDefaultMaxRetainedBytes = size_t{1} << 30;  // 1 GiB
+
+  struct Counters {
+    /** Pooled allocations satisfied from a free list. */
+    uint64_t reused{0};
+    /** Pooled allocations that needed new memory. */
+    uint64_t allocated{0};
+    /** Bytes currently held on free lists. */
+    uint64_t retainedBytes{0};
+  };
+
+  /**
+   * @param[in] maxRetainedBytes Most bytes to hold on the free lists.  Buffers freed
+   *   beyond this are returned to the system.
+   */
+  explicit BufferPool(size_t maxRetainedBytes = kDefaultMaxRetainedBytes);
+  BufferPool(const BufferPool&) = delete;
+  BufferPool& operator=(const BufferPool&) = delete;
+
+  /**
+   * Release the free lists.  Every buffer from this pool must have been freed.
+   */
+  ~BufferPool();
+
+  /**
+   * Return a memory manager that allocates from this pool.  It's valid for the
+   * lifetime of the pool.
+   */
+  const JxlMemoryManager* memoryManager() const { return &memManager_; }
+
+  void* alloc(size_t size);
+  void free(void* address);
+
+  /**
+   * Return the free lists' memory to the system.
+   */
+  void trim();
+
+  Counters getCounters() const;
+
+  /**
+   * Return the size class that a request for @p size bytes is rounded up to.
+   */
+  static size_t sizeClass(size_t size);
+
+ private:
+  JxlMemoryManager memManager_;
+  size_t maxRetainedBytes_;
+  mutable std::mutex mutex_{};
+  std::map<size_t, std::vector<void*> > free_{};
+  Counters counters_{};
+};
+
+}  // namespace jxltk
+
+#endif  // JXLTK_BUFFERPOOL_H_
@@ -0,0 +1,103 @@
+/**
+ * Copyright (c) Alistair Barrow. All rights reserved.
+ *
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file.
+ */
+
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "bufferpool.h"
+#include "pixelalloc.h"
+
+using jxltk::BufferPool;
+
+TEST(BufferPool, SizeClass) {
+  EXPECT_EQ(BufferPool::sizeClass(0), 0);
+  EXPECT_EQ(BufferPool::sizeClass(1000), 1000);
+  EXPECT_EQ(BufferPool::sizeClass(BufferPool::kMinPooledSize),
+            BufferPool::kMinPooledSize);
+  EXPECT_EQ(BufferPool::sizeClass(1 << 20), 1 << 20);
+  EXPECT_EQ(BufferPool::sizeClass((1 << 20) + 1), (1 << 20) + (1 << 18));
+  EXPECT_EQ(BufferPool::sizeClass(1600 * 1200 * 4), 8 * 1024 * 1024);
+  for (size_t size = BufferPool::kMinPooledSize; size < (size_t{1} << 26);
+       size = size * 9 / 7) {
+    size_t cls = BufferPool::sizeClass(size);
+    EXPECT_GE(cls, size);
+    EXPECT_LE(cls, size + size / 4) << size;
+    EXPECT_EQ(BufferPool::sizeClass(cls), cls);
+  }
+}
+
+TEST(BufferPool, ReusesFreedBuffers) {
+  BufferPool pool;
+  constexpr size_t kSize = 1 << 20;
+  void* first = pool.alloc(kSize);
+  ASSERT_NE(first, nullptr);
+  memset(first, 1, kSize);
+  pool.free(first);
+  EXPECT_EQ(pool.getCounters().retainedBytes, kSize);
+
+  // Anything in the same size class gets the same buffer back
+  void* second = pool.alloc(kSize - 1000);
+  EXPECT_EQ(second, first);
+  EXPECT_EQ(pool.getCounters().reused, 1);
+  EXPECT_EQ(pool.getCounters().retainedBytes, 0);
+  void* third = pool.alloc(kSize);
+  EXPECT_NE(third, first);
+  pool.free(second);
+  pool.free(third);
+
+  // Small buffers aren't kept
+  void* small = pool.alloc(100);
+  pool.free(small);
+  EXPECT_EQ(pool.getCounters().retainedBytes, 2 * kSize);
+
+  pool.trim();
+  EXPECT_EQ(pool.getCounters().retainedBytes, 0);
+  pool.free(nullptr);
+}
+
+TEST(BufferPool, Limits) {
+  constexpr size_t kSize = 1 << 20;
+  BufferPool pool(3 * kSize);
+  std::vector<void*> buffers;
+  for (size_t i = 0; i < BufferPool::kMaxFreePerClass + 1; ++i) {
+    buffers.push_back(pool.alloc(kSize));
+  }
+  for (void* buffer : buffers) {
+    pool.free(buffer);
+  }
+  EXPECT_EQ(pool.getCounters().retainedBytes, 3 * kSize);
+
+  BufferPool unlimited(SIZE_MAX);
+  buffers.clear();
+  for (size_t i = 0; i < BufferPool::kMaxFreePerClass + 1; ++i) {
+    buffers.push_back(unlimited.alloc(kSize));
+  }
+  for (void* buffer : buffers) {
+    unlimited.free(buffer);
+  }
+  EXPECT_EQ(unlimited.getCounters().retainedBytes, BufferPool::kMaxFreePerClass * kSize);
+}
+
+TEST(BufferPool, PixelMemoryManager) {
+  BufferPool pool;
+  jxltk::setPixelMemoryManager(pool.memoryManager());
+  void* address;
+  {
+    jxltk::PixelPtr pixels = jxltk::allocPixels(1 << 20);
+    address = pixels.get();
+  }
+  jxltk::PixelPtr again = jxltk::allocPixels(1 << 20);
+  jxltk::setPixelMemoryManager(nullptr);
+  EXPECT_EQ(again.get(), address);
+
+  // Buffers can be freed on another thread
+  std::thread([p = std::move(again)]() mutable { p.reset(); }).join();
+  EXPECT_EQ(pool.getCounters().retainedBytes, 1 << 20);
+}
@@ -4,6 +4,7 @@
  * Use of this source code is governed by an MIT-style
  * license that can be found in the LICENSE file.
  */
+#include <cinttypes>
 #include <cmath>
 #include <cstring>
 #include <filesystem>
@@ -34,8 +35,10 @@ enum HelpSection : uint32_t {
   Icc =   8,
   AddSubtract = 16,
   Compare = 32,
+  Synth = 64,
+  Batch = 128,
 
-  EncodeOptions = 23,
+  EncodeOptions = 215,
   All =   0xFFFFFFFF,
 };
 
@@ -66,9 +69,11 @@ constexpr CommandLineOption commandLineOptions[] = {
    "Encoding effort.  Default is whatever libjxl decides." },
   {"faster-decoding", '\0', HelpSection::EncodeOptions, "0-4",
    "Produce files that decode faster (higher values inflate the file size more)." },
-  {"compress-boxes", '\0', HelpSection::Merge|HelpSection::Gen, "0|1",
+  {"compress-boxes", '\0',
+   HelpSection::Merge|HelpSection::Gen|HelpSection::Synth|HelpSection::Batch, "0|1",
    "Globally disable (0) or enable (1) Brotli compression of metadata boxes." },
-  {"brotli-effort", '\0', HelpSection::Merge|HelpSection::Gen, "0-11",
+  {"brotli-effort", '\0',
+   HelpSection::Merge|HelpSection::Gen|HelpSection::Synth|HelpSection::Batch, "0-11",
    "Effort for Brotli compression of metadata." },
   {"best", '\0', HelpSection::EncodeOptions|HelpSection::AddSubtract, nullptr,
    "Equivalent to `--effort=" JXLTK_ITOA(JXLTK_MAX_EFFORT)
@@ -80,28 +85,33 @@ constexpr CommandLineOption commandLineOptions[] = {
   {"iterations", 'I', HelpSection::EncodeOptions, "0-100",
    "Percentage of pixels used to learn MA trees in modular mode.\n"
    "\tDefault is whatever libjxl decides."},
-  {"optimize", '\0', HelpSection::Merge, "X,Y,Z,...",
-   "Enable the specified optimizations. Currently the only supported value is 'c',\n"
-   "\twhich allows frames to be automatically cropped when this has no visible effect\n"
-   "\ton the coalesced result."},
+  {"optimize", '\0', HelpSection::Merge|HelpSection::Batch, "X,Y,Z,...",
+   "Enable the specified optimizations. 'c' allows frames to be automatically\n"
+   "\tcropped when this has no visible effect on the coalesced result.  'd' encodes\n"
+   "\tframes that repeat the previous frame exactly as empty frames.  'i' crops frames\n"
+   "\tto the region that changed since the previous frame."},
   {"patches", '\0', HelpSection::EncodeOptions, "0|1",
    "Enable (1) or disable (0) automatic patch generation for all frames.\n"
    "\tDefault is whatever libjxl decides."},
   {"duration-ms", '\0', HelpSection::Merge|HelpSection::Gen, "INT",
    "Duration of each frame in milliseconds." },
-  {"duration-ticks", '\0', HelpSection::Merge|HelpSection::Gen, "INT",
+  {"duration-ticks", '\0', HelpSection::Merge|HelpSection::Gen|HelpSection::Synth, "INT",
    "Duration of each frame in ticks." },
   {"ticks-per-second", 'r', HelpSection::Merge|HelpSection::Gen, "N[/D]",
    "Number of animation ticks per second, given as an integer or rational.\n"
    "\tDefault is 100 if processing an animation."},
   {"blend-mode", '\0', HelpSection::Merge|HelpSection::Gen, "REPLACE/BLEND/ADD/MUL/MULADD",
    "Blend mode for all frames. Default is REPLACE."},
-  {"data-type", '\0', HelpSection::Merge|HelpSection::Split, "u8|u16|f32",
-   "Force processing samples as uint8, uint16, or float type."},
+  {"data-type", '\0', HelpSection::Merge|HelpSection::Split|HelpSection::Batch,
+   "u8|u16|f16|f32",
+   "Force processing samples as uint8, uint16, half float, or float type."},
   {"ms", '\0', HelpSection::Split, nullptr,
    "Output frame durations in (possibly rounded) milliseconds instead of ticks."},
   {"full", '\0', HelpSection::Split|HelpSection::Gen, nullptr,
    "Generate \"full\" merge config, with fewer implied defaults."},
+  {"encoders", '\0', HelpSection::Split|HelpSection::Batch, "N",
+   "Encode up to N frames at once, each with its own encoder.  --threads is shared\n"
+   "\tbetween the encoders.  Default is 1."},
   {"overwrite", 'Y', HelpSection::All, nullptr,
    "Overwrite existing files without asking."},
   {"color-from", '\0', HelpSection::Merge|HelpSection::Gen, "FILE",
@@ -111,8 +121,52 @@ constexpr CommandLineOption commandLineOptions[] = {
    "Explicitly set the codestream conformance level." },
   {"threads", '\0', HelpSection::All, "N", "Maximum number of threads to use. Default is"
    " '0', meaning choose automatically." },
-  {"unpremultiply", '\0', HelpSection::Merge, nullptr,
+  {"trace-file", '\0', HelpSection::All, "FILE",
+   "Record a timeline of decoding, frame processing and encoding in FILE, in Chrome\n"
+   "\ttrace event format (open it with https://ui.perfetto.dev or chrome://tracing)."},
+  {"stats", '\0', HelpSection::All, "FILE",
+   "On exit, write timings, throughput and memory use as JSON to FILE ('-' for\n"
+   "\tstdout)."},
+  {"prefetch", '\0', HelpSection::Merge|HelpSection::Batch, "N",
+   "Decode up to N upcoming input frames in the background while encoding the current\n"
+   "\tone.  Uses more memory, as prefetched frames are held fully decoded. Default is 0."},
+  {"chunked", '\0', HelpSection::Merge|HelpSection::Batch, nullptr,
+   "Let the encoder read each frame a region at a time, which avoids a full-size float\n"
+   "\tcopy of every frame inside libjxl.  Requires libjxl 0.10 or later."},
+  {"max-memory", '\0', HelpSection::Merge|HelpSection::Batch, "BYTES[K|M|G]",
+   "Approximate limit on memory used to hold inputs.  Inputs over the limit are closed\n"
+   "\tand reopened when needed.  In batch mode, jobs also wait to start until their\n"
+   "\testimated memory fits.  Default is 0, meaning no limit."},
+  {"jobs", '\0', HelpSection::Batch, "N",
+   "Run up to N jobs at once.  --threads is shared between the jobs.  Default is 0,\n"
+   "\tmeaning one per CPU."},
+  {"cache-dir", '\0', HelpSection::Merge|HelpSection::Batch, "DIR",
+   "Keep decoded and cropped input frames in DIR, and reuse them in later merges of\n"
+   "\tthe same inputs with the same settings."},
+  {"unpremultiply", '\0', HelpSection::Merge|HelpSection::Batch, nullptr,
    "Convert premultiplied (associated) alpha to straight alpha."},
+  {"size", '\0', HelpSection::Synth, "WxH",
+   "Dimensions of the generated image. Default is 256x256."},
+  {"frames", '\0', HelpSection::Synth, "N",
+   "Number of frames to generate. More than one makes an animation. Default is 1."},
+  {"bits", '\0', HelpSection::Synth, "N",
+   "Bits per sample: 1-16, or 16 or 32 with --float. Default is 8, or 32 with --float."},
+  {"float", '\0', HelpSection::Synth, nullptr,
+   "Generate floating point samples."},
+  {"gray", '\0', HelpSection::Synth, nullptr,
+   "Generate a grayscale image instead of RGB."},
+  {"alpha", '\0', HelpSection::Synth, nullptr,
+   "Add an alpha channel."},
+  {"extra-channels", '\0', HelpSection::Synth, "N",
+   "Number of extra channels to add, not counting alpha. Default is 0."},
+  {"border", '\0', HelpSection::Synth, "N",
+   "Width of an all-zero (transparent, with --alpha) border around each frame."},
+  {"boxes", '\0', HelpSection::Synth, "N",
+   "Number of XML metadata boxes to add. Default is 0."},
+  {"box-size", '\0', HelpSection::Synth, "BYTES[K|M|G]",
+   "Size of each metadata box. Default is 4K."},
+  {"seed", '\0', HelpSection::Synth, "N",
+   "Vary the generated pixels and boxes. Default is 0."},
   {"no-754", '\0', HelpSection::All, nullptr, nullptr },
 };
 
@@ -159,7 +213,7 @@ static void printHelp(HelpSection sec) {
   if ((sec & HelpSection::EncodeOptions)) {
     cerr << "COMMON ENCODING OPTIONS\n\n"
             "  These options are common to the `split`, `merge`, `gen`, `add`,\n"
-            "  and `subtract` modes.\n\n";
+            "  `subtract`, `synth` and `batch` modes.\n\n";
     printSection(HelpSection::EncodeOptions, HelpSection::All);
   }
   if ((sec & HelpSection::Split)) {
@@ -214,6 +268,37 @@ static void printHelp(HelpSection sec) {
             "  Options for compare mode:\n\n";
     printSection(HelpSection::Compare, HelpSection::All);
   }
+  if ((sec & HelpSection::Synth)) {
+    cerr << "\nSYNTH MODE\n\n"
+            "\tjxltk synth [opts] output.jxl\n\n"
+            "  Generate a reproducible synthetic JXL for benchmarking and testing.\n"
+            "  The same options always produce the same pixels and boxes.  Frames\n"
+            "  are generated a region at a time, so very large images don't need to\n"
+            "  fit in memory.\n\n"
+            "  Options for synth mode:\n\n";
+    printSection(HelpSection::Synth, HelpSection::EncodeOptions);
+  }
+  if ((sec & HelpSection::Batch)) {
+    cerr << "\nBATCH MODE\n\n"
+            "\tjxltk batch [opts] manifest.jsonl\n\n"
+            "  Run many operations in one process, several at a time, sharing one\n"
+            "  thread pool.  Each line of the manifest (\"-\" for stdin) is a JSON\n"
+            "  object describing a job, for example:\n\n"
+            "\t{\"mode\":\"merge\",\"inputs\":[\"a.jxl\",\"b.jxl\"],"
+            "\"output\":\"c.jxl\"}\n"
+            "\t{\"mode\":\"merge\",\"config\":\"merge.json\",\"output\":\"out.jxl\"}\n"
+            "\t{\"mode\":\"split\",\"input\":\"in.jxl\",\"output\":\"outdir\"}\n"
+            "\t{\"mode\":\"add\",\"inputs\":[\"a.jxl\",\"b.jxl\"],\"output\":\"c.jxl\"}\n"
+            "\t{\"mode\":\"compare\",\"inputs\":[\"a.jxl\",\"b.jxl\"],\"id\":\"check\"}\n"
+            "\t{\"mode\":\"icc\",\"input\":\"in.jxl\",\"output\":\"in.icc\"}\n\n"
+            "  `subtract` works like `add`.  \"coalesce\": true is equivalent to `-c`.\n"
+            "  Options given to batch mode apply to every job.  Existing outputs are\n"
+            "  overwritten.  As each job finishes, a line of JSON with its \"id\"\n"
+            "  (default: its line number), \"status\" and \"exitCode\" is written to\n"
+            "  stdout.  The exit status is 0 if every job succeeded.\n\n"
+            "  Options for batch mode:\n\n";
+    printSection(HelpSection::Batch, HelpSection::EncodeOptions);
+  }
 }
 
 /**
@@ -312,6 +397,10 @@ CmdlineOpts parseArgs(int argc, char** argv) {
       sec = HelpSection::AddSubtract;
     } else if (opts.mode == "compare") {
       sec = HelpSection::Compare;
+    } else if (opts.mode == "synth") {
+      sec = HelpSection::Synth;
+    } else if (opts.mode == "batch") {
+      sec = HelpSection::Batch;
     } else  {
       if (opts.mode != "-h" && opts.mode != "--help") {
         JXLTK_ERROR("Invalid mode %s.", shellQuote(opts.mode, true).c_str());
@@ -332,6 +421,7 @@ CmdlineOpts parseArgs(int argc, char** argv) {
   bool usedStdin = false;
   bool usedStdout = false;
   bool overwriteFiles = false;
+  std::optional<uint32_t> synthBits;
 
   int longidx;
   int option;
@@ -482,11 +572,13 @@ CmdlineOpts parseArgs(int argc, char** argv) {
         opts.overrideDataType = JXL_TYPE_UINT8;
       } else if (strcmp(options.optarg, "u16") == 0) {
         opts.overrideDataType = JXL_TYPE_UINT16;
+      } else if (strcmp(options.optarg, "f16") == 0) {
+        opts.overrideDataType = JXL_TYPE_FLOAT16;
       } else if (strcmp(options.optarg, "f32") == 0) {
         opts.overrideDataType = JXL_TYPE_FLOAT;
       } else {
         JXLTK_ERROR("Invalid argument to --data-type: %s;\n"
-                    "Options are: u8, u16, f32",
+                    "Options are: u8, u16, f16, f32",
                     shellQuote(options.optarg, true).c_str());
         exit(EXIT_FAILURE);
       }
@@ -516,13 +608,128 @@ CmdlineOpts parseArgs(int argc, char** argv) {
     } else if (strcmp(longName, "threads") == 0) {
       opts.numThreads = stoi(options.optarg);
 
-    } else if (strcmp(longName, "optimize") == 0) {
-      if (strcmp(options.optarg, "c") != 0) {
-        JXLTK_ERROR("Unsupported optimization flag: %s",
+    } else if (strcmp(longName, "trace-file") == 0) {
+      opts.traceFile = options.optarg;
+
+    } else if (strcmp(longName, "stats") == 0) {
+      opts.statsFile = options.optarg;
+
+    } else if (strcmp(longName, "prefetch") == 0) {
+      int prefetch = atoi(options.optarg);
+      if (prefetch < 0) {
+        JXLTK_ERROR("Invalid argument to --%s: %s", longName,
+                    shellQuote(options.optarg, true).c_str());
+        exit(EXIT_FAILURE);
+      }
+      opts.prefetchFrames = prefetch;
+
+    } else if (strcmp(longName, "encoders") == 0) {
+      int encoders = atoi(options.optarg);
+      if (encoders < 1) {
+        JXLTK_ERROR("Invalid argument to --%s: %s", longName,
+                    shellQuote(options.optarg, true).c_str());
+        exit(EXIT_FAILURE);
+      }
+      opts.numEncoders = encoders;
+
+    } else if (strcmp(longName, "jobs") == 0) {
+      int jobs = atoi(options.optarg);
+      if (jobs < 0) {
+        JXLTK_ERROR("Invalid argument to --%s: %s", longName,
+                    shellQuote(options.optarg, true).c_str());
+        exit(EXIT_FAILURE);
+      }
+      opts.numJobs = jobs;
+
+    } else if (strcmp(longName, "chunked") == 0) {
+      opts.chunked = true;
+
+    } else if (strcmp(longName, "cache-dir") == 0) {
+      opts.cacheDir = options.optarg;
+
+    } else if (strcmp(longName, "max-memory") == 0) {
+      std::optional<size_t> maxMemory = parseByteSize(options.optarg);
+      if (!maxMemory) {
+        JXLTK_ERROR("Invalid argument to --%s: %s", longName,
+                    shellQuote(options.optarg, true).c_str());
+        exit(EXIT_FAILURE);
+      }
+      opts.maxMemory = *maxMemory;
+
+    } else if (strcmp(longName, "size") == 0) {
+      char* end;
+      unsigned long xsize = strtoul(options.optarg, &end, 10);
+      unsigned long ysize = *end == 'x' ? strtoul(end + 1, &end, 10) : 0;
+      if (*end != '\0' || xsize == 0 || ysize == 0 || xsize > UINT32_MAX ||
+          ysize > UINT32_MAX) {
+        JXLTK_ERROR("Invalid argument to --%s: %s", longName,
                     shellQuote(options.optarg, true).c_str());
         exit(EXIT_FAILURE);
       }
-      opts.autoCrop = true;
+      opts.synth.xsize = static_cast<uint32_t>(xsize);
+      opts.synth.ysize = static_cast<uint32_t>(ysize);
+
+    } else if (strcmp(longName, "frames") == 0 ||
+               strcmp(longName, "bits") == 0 ||
+               strcmp(longName, "extra-channels") == 0 ||
+               strcmp(longName, "border") == 0 ||
+               strcmp(longName, "boxes") == 0 ||
+               strcmp(longName, "seed") == 0) {
+      char* end;
+      unsigned long value = strtoul(options.optarg, &end, 10);
+      if (*end != '\0' || options.optarg[0] == '-' || value > UINT32_MAX ||
+          (value == 0 && (strcmp(longName, "frames") == 0 ||
+                          strcmp(longName, "bits") == 0))) {
+        JXLTK_ERROR("Invalid argument to --%s: %s", longName,
+                    shellQuote(options.optarg, true).c_str());
+        exit(EXIT_FAILURE);
+      }
+      if (strcmp(longName, "frames") == 0) {
+        opts.synth.numFrames = value;
+      } else if (strcmp(longName, "bits") == 0) {
+        synthBits = static_cast<uint32_t>(value);
+      } else if (strcmp(longName, "extra-channels") == 0) {
+        opts.synth.numExtraChannels = static_cast<uint32_t>(value);
+      } else if (strcmp(longName, "border") == 0) {
+        opts.synth.border = static_cast<uint32_t>(value);
+      } else if (strcmp(longName, "boxes") == 0) {
+        opts.synth.numBoxes = value;
+      } else {
+        opts.synth.seed = static_cast<uint32_t>(value);
+      }
+
+    } else if (strcmp(longName, "float") == 0) {
+      opts.synth.floatSamples = true;
+
+    } else if (strcmp(longName, "gray") == 0) {
+      opts.synth.numColorChannels = 1;
+
+    } else if (strcmp(longName, "alpha") == 0) {
+      opts.synth.alpha = true;
+
+    } else if (strcmp(longName, "box-size") == 0) {
+      std::optional<size_t> boxSize = parseByteSize(options.optarg);
+      if (!boxSize) {
+        JXLTK_ERROR("Invalid argument to --%s: %s", longName,
+                    shellQuote(options.optarg, true).c_str());
+        exit(EXIT_FAILURE);
+      }
+      opts.synth.boxSize = *boxSize;
+
+    } else if (strcmp(longName, "optimize") == 0) {
+      for (std::string_view flag : splitString(options.optarg, ',')) {
+        if (flag == "c") {
+          opts.autoCrop = true;
+        } else if (flag == "d") {
+          opts.elideDuplicates = true;
+        } else if (flag == "i") {
+          opts.deltaCrop = true;
+        } else {
+          JXLTK_ERROR("Unsupported optimization flag: %s",
+                      shellQuote(flag, true).c_str());
+          exit(EXIT_FAILURE);
+        }
+      }
 
 #ifndef JXLTK_FLOATS_ARE_IEEE754
     } else if (strcmp(longName, "no-754") == 0) {
@@ -619,6 +826,25 @@ CmdlineOpts parseArgs(int argc, char** argv) {
     if (!overwriteFiles && opts.positional[2] != "-") {
       confirmOverwrite(opts.positional[2], usedStdin, false);
     }
+  } else if (opts.mode == "synth") {
+    if (opts.positional.size() != 1) {
+      JXLTK_ERROR("%s mode requires a single output file.", opts.mode.c_str());
+      exit(EXIT_FAILURE);
+    }
+    opts.synth.bitsPerSample = synthBits.value_or(opts.synth.floatSamples ? 32 : 8);
+    if (opts.synth.floatSamples ? (opts.synth.bitsPerSample != 16 &&
+                                   opts.synth.bitsPerSample != 32)
+                                : opts.synth.bitsPerSample > 16) {
+      JXLTK_ERROR("Unsupported bit depth: %" PRIu32 "%s", opts.synth.bitsPerSample,
+                  opts.synth.floatSamples ? " (float)" : "");
+      exit(EXIT_FAILURE);
+    }
+    if (opts.overrideBoxConfig.compress) {
+      opts.synth.compressBoxes = *opts.overrideBoxConfig.compress;
+    }
+    if (!overwriteFiles && opts.positional[0] != "-") {
+      confirmOverwrite(opts.positional[0], usedStdin, false);
+    }
   } else if (opts.mode == "compare") {
     if (opts.positional.size() != 2) {
       JXLTK_ERROR("%s mode requires 2 arguments.", opts.mode.c_str());
@@ -627,6 +853,11 @@ CmdlineOpts parseArgs(int argc, char** argv) {
       JXLTK_ERROR("Can't read both inputs from stdin.");
       exit(EXIT_FAILURE);
     }
+  } else if (opts.mode == "batch") {
+    if (opts.positional.size() != 1) {
+      JXLTK_ERROR("%s mode requires a single manifest file.", opts.mode.c_str());
+      exit(EXIT_FAILURE);
+    }
   }
 
   return opts;
@@ -13,6 +13,7 @@
 #include <jxl/types.h>
 
 #include "mergeconfig.h"
+#include "synth.h"
 #include "util.h"
 
 namespace jxltk {
@@ -20,6 +21,8 @@ namespace jxltk {
 struct CmdlineOpts {
   std::string mode{};
   bool autoCrop{false};
+  bool elideDuplicates{false};
+  bool deltaCrop{false};
   bool coalesce{false};
   int codestreamLevel{-1};
   bool configOnly{false};
@@ -27,8 +30,17 @@ struct CmdlineOpts {
   bool useMilliseconds{false};
   bool fullConfig{false};
   size_t numThreads{0};
+  size_t prefetchFrames{0};
+  size_t numEncoders{1};
+  size_t numJobs{0};
+  size_t maxMemory{0};
+  bool chunked{false};
+  std::string cacheDir{};
+  std::string traceFile{};
+  std::string statsFile{};
   std::string mergeCfgFilename{};
   std::vector<std::string> positional{};
+  SynthConfig synth{};
 
   /* Global encode settings - overrides per-frame settings */
   FrameConfig overrideFrameConfig{};
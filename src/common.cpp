@@ -4,21 +4,90 @@
  * Use of this source code is governed by an MIT-style
  * license that can be found in the LICENSE file.
  */
+#include <algorithm>
+#include <cerrno>
 #include <cinttypes>
+#include <climits>
 #include <cmath>
 #include <cstring>
 #include <iostream>
 #include <string>
 #include <vector>
 
+#if defined(_WIN32)
+#include <fcntl.h>
+#include <io.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 #include <jxl/encode_cxx.h>
 
 #include "common.h"
 #include "except.h"
 #include "mergeconfig.h"
+#include "stats.h"
+#include "threadpool.h"
+#include "trace.h"
 
 namespace jxltk {
 
+namespace {
+
+int openForWriting(const char* path) {
+#if defined(_WIN32)
+  return _open(path, _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY,
+               _S_IREAD | _S_IWRITE);
+#else
+  return open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+#endif
+}
+
+void closeFd(int fd) {
+#if defined(_WIN32)
+  _close(fd);
+#else
+  close(fd);
+#endif
+}
+
+/**
+ * Move @p fd by @p delta bytes relative to its current position.
+ * @return 0 on success, else errno.
+ */
+int seekFd(int fd, int64_t delta) {
+#if defined(_WIN32)
+  return _lseeki64(fd, delta, SEEK_CUR) < 0 ? errno : 0;
+#else
+  return lseek(fd, static_cast<off_t>(delta), SEEK_CUR) < 0 ? errno : 0;
+#endif
+}
+
+/**
+ * Write all of @p data to @p fd, retrying after partial writes.
+ * @return 0 on success, else errno.
+ */
+int writeFd(int fd, const uint8_t* data, size_t size) {
+  while (size > 0) {
+#if defined(_WIN32)
+    int chunk = _write(fd, data, static_cast<unsigned>(std::min<size_t>(size, INT_MAX)));
+#else
+    ssize_t chunk = write(fd, data, size);
+#endif
+    if (chunk < 0) {
+      if (errno == EINTR) continue;
+      return errno;
+    }
+    data += chunk;
+    size -= static_cast<size_t>(chunk);
+  }
+  return 0;
+}
+
+}  // namespace
+
 bool isReservedBoxType(const char* t) {
   return (toupper(static_cast<unsigned char>(t[0])) == 'J' &&
           toupper(static_cast<unsigned char>(t[1])) == 'X' &&
@@ -157,6 +226,7 @@ JxlEncoderFrameSettings* frameConfigToJxlEncoderFrameSettings(
 
 JxlEncoderStatus encodeUntilSuccess(JxlEncoder* enc, uint8_t* buffer, size_t bufferSize,
                                     std::ostream* fout, size_t* written) {
+  TraceSpan span("encodeUntilSuccess");
   uint8_t* nextOut = buffer;
   size_t availOut = bufferSize;
   size_t lWritten = 0;
@@ -181,6 +251,7 @@ JxlEncoderStatus encodeUntilSuccess(JxlEncoder* enc, uint8_t* buffer, size_t buf
                 static_cast<std::streamsize>(buffered));
   }
   lWritten += buffered;
+  countBytesWritten(lWritten);
   if (written) {
     *written = lWritten;
   }
@@ -188,6 +259,132 @@ JxlEncoderStatus encodeUntilSuccess(JxlEncoder* enc, uint8_t* buffer, size_t buf
 }
 
 
+EncoderOutput::EncoderOutput(std::ostream* out, size_t bufferSize)
+  : out_(out), buffer_(bufferSize) {}
+
+EncoderOutput::EncoderOutput(int fd, size_t bufferSize)
+  : fd_(fd), buffer_(bufferSize) {}
+
+EncoderOutput::EncoderOutput(const char* path, size_t bufferSize)
+  : fd_(openForWriting(path)), ownsFd_(true), buffer_(bufferSize) {
+  if (fd_ < 0) {
+    throw JxltkError("%s: Failed to open %s for writing: %s", __func__, path,
+                     strerror(errno));
+  }
+}
+
+EncoderOutput::~EncoderOutput() {
+  if (ownsFd_ && fd_ >= 0) {
+    closeFd(fd_);
+  }
+}
+
+void EncoderOutput::attach(JxlEncoder* enc) {
+#ifdef JXLTK_HAVE_OUTPUT_PROCESSOR
+  if (fd_ >= 0) {
+    JxlEncoderOutputProcessor processor = {
+      .opaque = this,
+      .get_buffer = getBuffer_,
+      .release_buffer = releaseBuffer_,
+      .seek = seek_,
+      .set_finalized_position = setFinalizedPosition_,
+    };
+    if (JxlEncoderSetOutputProcessor(enc, processor) != JXL_ENC_SUCCESS) {
+      throw JxltkError("%s: Failed to set encoder output processor", __func__);
+    }
+    direct_ = true;
+  }
+#else
+  (void)enc;
+#endif
+}
+
+JxlEncoderStatus EncoderOutput::flush(JxlEncoder* enc, size_t* written) {
+  TraceSpan span("EncoderOutput::flush");
+  JxlEncoderStatus st;
+  size_t lWritten = 0;
+  if (direct_) {
+#ifdef JXLTK_HAVE_OUTPUT_PROCESSOR
+    uint64_t releasedBefore = released_;
+    st = JxlEncoderFlushInput(enc);
+    lWritten = static_cast<size_t>(released_ - releasedBefore);
+#else
+    st = JXL_ENC_ERROR;
+#endif
+  } else if (out_) {
+    // Counted by encodeUntilSuccess.
+    st = encodeUntilSuccess(enc, buffer_.data(), buffer_.size(), out_, &lWritten);
+  } else {
+    uint8_t* nextOut = buffer_.data();
+    size_t availOut = buffer_.size();
+    while ((st = JxlEncoderProcessOutput(enc, &nextOut, &availOut))
+             == JXL_ENC_NEED_MORE_OUTPUT) {
+      write_(buffer_.data(), buffer_.size() - availOut);
+      lWritten += buffer_.size() - availOut;
+      nextOut = buffer_.data();
+      availOut = buffer_.size();
+    }
+    if (st == JXL_ENC_SUCCESS) {
+      write_(buffer_.data(), buffer_.size() - availOut);
+      lWritten += buffer_.size() - availOut;
+    }
+  }
+  if (!out_) {
+    countBytesWritten(lWritten);
+  }
+  if (error_ != 0) {
+    throw JxltkError("%s: Failed writing encoder output: %s", __func__,
+                     strerror(error_));
+  }
+  if (written) {
+    *written = lWritten;
+  }
+  return st;
+}
+
+void EncoderOutput::write_(const uint8_t* data, size_t size) {
+  if (error_ != 0 || size == 0) {
+    return;
+  }
+  if (filePosition_ != position_) {
+    error_ = seekFd(fd_, static_cast<int64_t>(position_) -
+                            static_cast<int64_t>(filePosition_));
+    if (error_ != 0) {
+      return;
+    }
+    filePosition_ = position_;
+  }
+  error_ = writeFd(fd_, data, size);
+  position_ += size;
+  filePosition_ = position_;
+}
+
+#ifdef JXLTK_HAVE_OUTPUT_PROCESSOR
+
+/*static */void* EncoderOutput::getBuffer_(void* opaque, size_t* size) {
+  EncoderOutput* self = static_cast<EncoderOutput*>(opaque);
+  // Smaller than requested is allowed - libjxl will ask again for the rest.
+  *size = std::min(*size, self->buffer_.size());
+  return self->buffer_.data();
+}
+
+/*static */void EncoderOutput::releaseBuffer_(void* opaque, size_t writtenBytes) {
+  EncoderOutput* self = static_cast<EncoderOutput*>(opaque);
+  self->write_(self->buffer_.data(), writtenBytes);
+  self->released_ += writtenBytes;
+}
+
+/*static */void EncoderOutput::seek_(void* opaque, uint64_t position) {
+  // Takes effect on the next write.
+  static_cast<EncoderOutput*>(opaque)->position_ = position;
+}
+
+/*static */void EncoderOutput::setFinalizedPosition_(void*, uint64_t) {
+  // We never need to go back and read what's been written, so nothing to do.
+}
+
+#endif
+
 /**
  * Return (index,info) pairs for all non-JXL-reserved ISO BMFF boxes.
  */
@@ -207,20 +404,35 @@ std::vector<std::pair<size_t, jxlazy::BoxInfo> > getNonReservedBoxes(
   return boxes;
 }
 
-std::pair<JxlEncoderPtr,JxlThreadParallelRunnerPtr> makeThreadedEncoder(
-    const JxlMemoryManager* memManager, size_t numThreads) {
-  std::pair<JxlEncoderPtr,JxlThreadParallelRunnerPtr> result{JxlEncoderMake(memManager), nullptr};
-  numThreads = numThreads > 0 ? numThreads :
-               JxlThreadParallelRunnerDefaultNumWorkerThreads();
-  if (numThreads > 1) {
-    result.second = JxlThreadParallelRunnerMake(memManager, numThreads);
-    if (JxlEncoderSetParallelRunner(result.first.get(), JxlThreadParallelRunner,
-                                    result.second.get())
-        != JXL_ENC_SUCCESS) {
-      throw JxltkError("%s: Failed to set parallel runner for encoder", __func__);
-    }
+JxlEncoderPtr makeThreadedEncoder(const JxlMemoryManager* memManager,
+                                  size_t numThreads) {
+  JxlEncoderPtr enc = JxlEncoderMake(memManager ? memManager : statsMemoryManager());
+  if (!enc) {
+    throw JxltkError("%s: Failed to create encoder", __func__);
+  }
+  if (numThreads != 1) {
+    setSharedParallelRunner(enc.get());
+  }
+  return enc;
+}
+
+void setSharedParallelRunner(JxlEncoder* enc) {
+  ThreadPool& pool = sharedThreadPool();
+  if (pool.numWorkers() > 0 &&
+      JxlEncoderSetParallelRunner(enc, ThreadPool::run, &pool) != JXL_ENC_SUCCESS) {
+    throw JxltkError("%s: Failed to set parallel runner for encoder", __func__);
+  }
+}
+
+jxlazy::Decoder makeDecoder(size_t numThreads) {
+  if (numThreads == 1) {
+    return jxlazy::Decoder(1, statsMemoryManager());
+  }
+  ThreadPool& pool = sharedThreadPool();
+  if (pool.numWorkers() == 0) {
+    return jxlazy::Decoder(1, statsMemoryManager());
   }
-  return result;
+  return jxlazy::Decoder(ThreadPool::run, &pool, statsMemoryManager());
 }
 
 size_t countNonReservedBoxes(jxlazy::Decoder& dec) {
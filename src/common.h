@@ -8,8 +8,10 @@
 #define JXLTK_COMMON_H_
 
 #include <iostream>
+#include <vector>
 
 #include <jxl/encode_cxx.h>
+#include <jxl/version.h>
 
 #include "../contrib/jxlazy/include/jxlazy/decoder.h"
 #include "mergeconfig.h"
@@ -40,6 +42,87 @@ constexpr size_t kDefaultIOBufferSize = size_t{128} * 1024;
 JxlEncoderStatus encodeUntilSuccess(JxlEncoder* enc, uint8_t* buffer, size_t bufferSize,
                                     std::ostream* fout, size_t* written = nullptr);
 
+// Whether libjxl lets us supply a JxlEncoderOutputProcessor and
+// JxlChunkedFrameInputSource
+#if JPEGXL_NUMERIC_VERSION >= JPEGXL_COMPUTE_NUMERIC_VERSION(0, 10, 0)
+#define JXLTK_HAVE_OUTPUT_PROCESSOR 1
+#define JXLTK_HAVE_CHUNKED_FRAMES 1
+#endif
+
+/**
+ * Destination for encoder output.
+ *
+ * When writing to a std::ostream, output is pulled from the encoder through a scratch
+ * buffer, exactly like encodeUntilSuccess.  When writing to a file, the encoder is given
+ * a JxlEncoderOutputProcessor that writes its output straight to the file descriptor,
+ * with no intermediate stream, and lets libjxl seek back to fill in sizes and headers.
+ * (If libjxl is too old to support that, file output falls back to the scratch buffer.)
+ */
+class EncoderOutput {
+ public:
+  /**
+   * Write to @p out, which must outlive this object.
+   */
+  explicit EncoderOutput(std::ostream* out, size_t bufferSize = kDefaultIOBufferSize);
+  /**
+   * Write to the open file descriptor @p fd, starting at its current position.  The
+   * descriptor must be seekable, and isn't closed by this object.
+   */
+  explicit EncoderOutput(int fd, size_t bufferSize = kDefaultIOBufferSize);
+  /**
+   * Create or truncate the named file and write to it.  Throws JxltkError if the file
+   * can't be opened.
+   */
+  explicit EncoderOutput(const char* path, size_t bufferSize = kDefaultIOBufferSize);
+  EncoderOutput(const EncoderOutput&) = delete;
+  EncoderOutput& operator=(const EncoderOutput&) = delete;
+  ~EncoderOutput();
+
+  /**
+   * Prepare @p enc to write to this output.  This must be called before any input is
+   * added to the encoder.
+   */
+  void attach(JxlEncoder* enc);
+
+  /**
+   * Encode everything passed to the encoder so far and write out the result.
+   *
+   * @param[out] written Number of bytes output from the encoder, or nullptr if you don't
+   *   care.
+   * @return JXL_ENC_SUCCESS, or the unexpected encoder status.  Throws JxltkError if
+   *   writing fails.
+   */
+  JxlEncoderStatus flush(JxlEncoder* enc, size_t* written = nullptr);
+
+  /**
+   * Return whether the encoder writes to the file directly (i.e. attach() installed an
+   * output processor).
+   */
+  bool isDirect() const { return direct_; }
+
+ private:
+  std::ostream* out_{nullptr};
+  int fd_{-1};
+  bool ownsFd_{false};
+  bool direct_{false};
+  std::vector<uint8_t> buffer_;
+  // Offset where the next released bytes belong, relative to where we started.
+  uint64_t position_{0};
+  // Actual offset of fd_, relative to where we started.
+  uint64_t filePosition_{0};
+  uint64_t released_{0};
+  // errno from the first failed write/seek.
+  int error_{0};
+
+  void write_(const uint8_t* data, size_t size);
+#ifdef JXLTK_HAVE_OUTPUT_PROCESSOR
+  static void* getBuffer_(void* opaque, size_t* size);
+  static void releaseBuffer_(void* opaque, size_t writtenBytes);
+  static void seek_(void* opaque, uint64_t position);
+  static void setFinalizedPosition_(void* opaque, uint64_t finalizedPosition);
+#endif
+};
+
 /**
  * Initialise frame settings for the next frame based on a FrameConfig.
  *
@@ -70,16 +153,26 @@ std::vector<std::pair<size_t, jxlazy::BoxInfo> >
   getNonReservedBoxes(jxlazy::Decoder& dec);
 
 /**
- * Allocate a new encoder and (if multiple threads requested) parallel runner
- *
- * If the encoder is single threaded, the parallel runner will be an empty unique_ptr.
- * Otherwise, the parallel runner must remain valid for the lifetime of the encoder.
+ * Allocate a new encoder that runs on the shared thread pool (see threadpool.h).
  *
- * @param memManager Memory manager, or nullptr to use standard allocation.
- * @param numThreads Max number of encoding threads, or 0 to choose automatically.
+ * @param memManager Memory manager, or nullptr to use standard allocation (or the
+ *   counting one from statsMemoryManager(), when stats are enabled).
+ * @param numThreads 1 for a single threaded encoder, or any other value to use the
+ *   shared pool.  The size of the pool is set separately.
+ */
+JxlEncoderPtr makeThreadedEncoder(const JxlMemoryManager* memManager,
+                                  size_t numThreads = 0);
+
+/**
+ * Make @p enc use the shared thread pool.  This is needed again after JxlEncoderReset.
+ */
+void setSharedParallelRunner(JxlEncoder* enc);
+
+/**
+ * Create a Decoder that runs on the shared thread pool, or a single threaded one if
+ * @p numThreads is 1.  It uses statsMemoryManager().
  */
-std::pair<JxlEncoderPtr,JxlThreadParallelRunnerPtr> makeThreadedEncoder(
-    const JxlMemoryManager* memManager, size_t numThreads = 0);
+jxlazy::Decoder makeDecoder(size_t numThreads = 0);
 
 /**
  * Return the number of non-reserved metadata boxes in the JXL.
@@ -0,0 +1,235 @@
+/*
+ * Copyright (c) Alistair Barrow. All rights reserved.
+ *
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file.
+ */
+#include <atomic>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include <jxl/decode.h>
+
+#include "../contrib/jxlazy/util.h"
+
+#include "except.h"
+#include "framecache.h"
+#include "log.h"
+#include "pixmap.h"
+#include "util.h"
+
+using std::ifstream;
+using std::ofstream;
+using std::string;
+namespace fs = std::filesystem;
+
+namespace jxltk {
+
+namespace {
+
+constexpr char kEntryMagic[8] = {'j', 'x', 'l', 't', 'k', 'F', 'C', '1'};
+string hexHash(uint64_t hash) {
+  char hex[17];
+  snprintf(hex, sizeof hex, "%016" PRIx64, hash);
+  return hex;
+}
+
+/** Hash the contents of @p file, returning the number of bytes read in @p size. */
+uint64_t hashFile(const string& file, uint64_t* size) {
+  ifstream in(file, std::ios::binary);
+  if (!in) throw JxltkError("%s: Can't read %s", __func__, file.c_str());
+  std::vector<char> chunk(size_t{1} << 20);
+  uint64_t hash = jxlazy::kFnv1aOffset;
+  *size = 0;
+  while (in) {
+    in.read(chunk.data(), chunk.size());
+    size_t got = static_cast<size_t>(in.gcount());
+    hash = jxlazy::fnv1a(chunk.data(), got, hash);
+    *size += got;
+  }
+  if (in.bad()) throw JxltkError("%s: Error reading %s", __func__, file.c_str());
+  return hash;
+}
+
+template <typename T>
+void writeValue(ofstream& out, const T& value) {
+  out.write(reinterpret_cast<const char*>(&value), sizeof value);
+}
+
+template <typename T>
+bool readValue(ifstream& in, T* value) {
+  return static_cast<bool>(in.read(reinterpret_cast<char*>(value), sizeof *value));
+}
+
+}  // namespace
+
+
+FrameCache::FrameCache(fs::path dir) : dir_(std::move(dir)) {
+  std::error_code ec;
+  fs::create_directories(dir_, ec);
+  if (ec) {
+    throw JxltkError("%s: Can't create cache directory %s: %s", __func__,
+                     dir_.c_str(), ec.message().c_str());
+  }
+}
+
+FrameCache::FileHash FrameCache::hashFile_(const string& file) {
+  std::error_code sizeEc, timeEc;
+  FileHash stat;
+  stat.size = fs::file_size(file, sizeEc);
+  stat.mtime = fs::last_write_time(file, timeEc);
+  bool haveStat = !sizeEc && !timeEc;
+  if (haveStat) {
+    std::lock_guard<std::mutex> lock(fileHashesMutex_);
+    auto it = fileHashes_.find(file);
+    if (it != fileHashes_.end() && it->second.size == stat.size &&
+        it->second.mtime == stat.mtime) {
+      return it->second;
+    }
+  }
+
+  // Hash outside the lock, so different files can be hashed concurrently
+  FileHash result = stat;
+  result.hash = hashFile(file, &result.size);
+  // Only remember the hash if the file didn't change size while it was read
+  if (haveStat && result.size == stat.size) {
+    std::lock_guard<std::mutex> lock(fileHashesMutex_);
+    fileHashes_[file] = result;
+  }
+  return result;
+}
+
+string FrameCache::describe(const FrameCacheKey& key) {
+  FileHash file = hashFile_(key.file);
+  string desc = "jxltk-frame-cache 1\n";
+  desc += "libjxl " + std::to_string(JxlDecoderVersion()) + "\n";
+  desc += "input " + std::to_string(file.size) + " " + hexHash(file.hash) + "\n";
+  desc += "frame " + std::to_string(key.frameIndex) + "\n";
+  desc += "format " + std::to_string(key.format.num_channels) + " " +
+          std::to_string(static_cast<int>(key.format.data_type)) + "\n";
+  desc += "decoderFlags " + std::to_string(key.decoderFlags) + "\n";
+  desc += "alphaFill " + (key.alphaFill ? std::to_string(*key.alphaFill) : "-") + "\n";
+  desc += "blendMode " +
+          (key.blendMode ? std::to_string(static_cast<int>(*key.blendMode)) : "-") + "\n";
+  desc += "outputHasAlpha " + std::to_string(key.outputHasAlpha) + "\n";
+  desc += "autoCrop " + std::to_string(key.autoCrop) + "\n";
+  return desc;
+}
+
+fs::path FrameCache::entryPath_(const string& description) const {
+  uint64_t hash = jxlazy::fnv1a(description.data(), description.size());
+  return dir_ / (hexHash(hash) + ".jxltkfc");
+}
+
+bool FrameCache::load(const string& description, Pixmap* pixmap, CropRegion* crop,
+                      bool* cropped) const {
+  fs::path path = entryPath_(description);
+  ifstream in(path, std::ios::binary);
+  if (!in) {
+    JXLTK_TRACE("Frame cache miss: %s", path.c_str());
+    return false;
+  }
+
+  char magic[sizeof kEntryMagic];
+  uint32_t descSize;
+  if (!in.read(magic, sizeof magic) || memcmp(magic, kEntryMagic, sizeof magic) != 0 ||
+      !readValue(in, &descSize) || descSize != description.size()) {
+    JXLTK_WARNING("Ignoring unrecognized frame cache entry %s", path.c_str());
+    return false;
+  }
+  string storedDesc(descSize, '\0');
+  if (!in.read(storedDesc.data(), descSize) || storedDesc != description) {
+    JXLTK_DEBUG("Frame cache entry %s belongs to a different frame.", path.c_str());
+    return false;
+  }
+
+  uint32_t xsize, ysize, numChannels, dataType, wasCropped;
+  CropRegion region;
+  uint64_t pixelBytes;
+  if (!readValue(in, &xsize) || !readValue(in, &ysize) ||
+      !readValue(in, &numChannels) || !readValue(in, &dataType) ||
+      !readValue(in, &wasCropped) || !readValue(in, &region) ||
+      !readValue(in, &pixelBytes)) {
+    JXLTK_WARNING("Ignoring truncated frame cache entry %s", path.c_str());
+    return false;
+  }
+  JxlPixelFormat format = {numChannels, static_cast<JxlDataType>(dataType),
+                           JXL_NATIVE_ENDIAN, 0};
+  if (xsize == 0 || ysize == 0 || numChannels == 0 || numChannels > 4 ||
+      pixelBytes != jxlazy::Decoder::getFrameBufferSize(xsize, ysize, format)) {
+    JXLTK_WARNING("Ignoring corrupt frame cache entry %s", path.c_str());
+    return false;
+  }
+  PixelPtr pixels = makePixelPtr(xsize, ysize, format);
+  if (!in.read(static_cast<char*>(pixels.get()),
+               static_cast<std::streamsize>(pixelBytes))) {
+    JXLTK_WARNING("Ignoring truncated frame cache entry %s", path.c_str());
+    return false;
+  }
+
+  pixmap->setPixelsMove(xsize, ysize, format, std::move(pixels));
+  *crop = region;
+  *cropped = wasCropped != 0;
+  JXLTK_TRACE("Frame cache hit: %s", path.c_str());
+  return true;
+}
+
+void FrameCache::store(const string& description, const Pixmap& pixmap,
+                       const CropRegion& crop, bool cropped) const {
+  // Random per process, then counting, so concurrent writers never share a temp file.
+  static std::atomic<uint64_t> nextTemp{
+      (uint64_t{std::random_device{}()} << 32) | std::random_device{}()};
+  fs::path path = entryPath_(description);
+  fs::path tempPath = path;
+  tempPath += ".tmp" + hexHash(nextTemp++);
+
+  const JxlPixelFormat& format = pixmap.getPixelFormat();
+  uint32_t xsize = pixmap.getXsize(), ysize = pixmap.getYsize();
+  uint32_t numChannels = format.num_channels;
+  uint32_t dataType = static_cast<uint32_t>(format.data_type);
+  uint32_t wasCropped = cropped ? 1 : 0;
+  uint64_t pixelBytes = pixmap.getBufferSize();
+  uint32_t descSize = static_cast<uint32_t>(description.size());
+  {
+    ofstream out(tempPath, std::ios::binary | std::ios::trunc);
+    out.write(kEntryMagic, sizeof kEntryMagic);
+    writeValue(out, descSize);
+    out.write(description.data(), description.size());
+    writeValue(out, xsize);
+    writeValue(out, ysize);
+    writeValue(out, numChannels);
+    writeValue(out, dataType);
+    writeValue(out, wasCropped);
+    writeValue(out, crop);
+    writeValue(out, pixelBytes);
+    out.write(static_cast<const char*>(pixmap.data()),
+              static_cast<std::streamsize>(pixelBytes));
+    out.close();
+    if (!out) {
+      JXLTK_WARNING("Failed to write frame cache entry %s", tempPath.c_str());
+      std::error_code ec;
+      fs::remove(tempPath, ec);
+      return;
+    }
+  }
+  std::error_code ec;
+  fs::rename(tempPath, path, ec);
+  if (ec) {
+    JXLTK_WARNING("Failed to store frame cache entry %s: %s", path.c_str(),
+                  ec.message().c_str());
+    fs::remove(tempPath, ec);
+    return;
+  }
+  JXLTK_TRACE("Stored frame cache entry %s", path.c_str());
+}
+
+}  // namespace jxltk
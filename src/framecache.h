@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) Alistair Barrow. All rights reserved.
+ *
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file.
+ */
+#ifndef JXLTK_FRAMECACHE_H_
+#define JXLTK_FRAMECACHE_H_
+
+#include <cstdint>
+#include <filesystem>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+
+#include <jxl/types.h>
+
+#include "mergeconfig.h"
+#include "pixmap.h"
+#include "util.h"
+
+namespace jxltk {
+
+/**
+ * Everything that decides how an input frame is prepared for merging.
+ */
+struct FrameCacheKey {
+  std::string file{};
+  size_t frameIndex{0};
+  JxlPixelFormat format{};
+  uint32_t decoderFlags{0};
+  std::optional<float> alphaFill{};
+  std::optional<JxlBlendMode> blendMode{};
+  bool outputHasAlpha{false};
+  bool autoCrop{false};
+};
+
+/**
+ * On-disk cache of frames that have been decoded, alpha-filled and cropped, ready to
+ * pass to the encoder.
+ *
+ * Entries are named after a hash of the input file's contents and the settings in a
+ * FrameCacheKey, so editing an input or changing how it's merged simply misses the
+ * cache.  Each entry also stores the full description it was created from, which is
+ * compared on lookup, so a hash collision can't return the wrong pixels.
+ *
+ * Lookups and stores for different frames may run concurrently.  Entries are written
+ * to a temporary file and renamed into place, so concurrent runs sharing a cache
+ * directory never see partial entries.
+ */
+class FrameCache {
+ public:
+  /**
+   * Use @p dir for the cache, creating it if necessary.
+   */
+  explicit FrameCache(std::filesystem::path dir);
+
+  /**
+   * Return the full description of @p key, including a hash of the input file's
+   * contents.
+   *
+   * Each file is only hashed once per FrameCache, as long as its size and
+   * modification time don't change.  Safe to call concurrently.
+   */
+  std::string describe(const FrameCacheKey& key);
+
+  /**
+   * Look up a prepared frame.
+   *
+   * @param[in] description Result of describe().
+   * @param[out] pixmap On success, receives the prepared pixels.
+   * @param[out] crop On success, the crop that was applied when the entry was stored, if
+   *   any.
+   * @param[out] cropped On success, whether @p crop is meaningful.
+   * @return true if a matching entry was found.  Unreadable entries are treated as
+   *   misses.
+   */
+  bool load(const std::string& description, Pixmap* pixmap, CropRegion* crop,
+            bool* cropped) const;
+
+  /**
+   * Store a prepared frame.  Failures are logged and otherwise ignored.
+   */
+  void store(const std::string& description, const Pixmap& pixmap,
+             const CropRegion& crop, bool cropped) const;
+
+ private:
+  struct FileHash {
+    uint64_t size{0};
+    std::filesystem::file_time_type mtime{};
+    uint64_t hash{0};
+  };
+
+  std::filesystem::path dir_;
+  std::mutex fileHashesMutex_;
+  std::unordered_map<std::string, FileHash> fileHashes_;
+
+  FileHash hashFile_(const std::string& file);
+
+  std::filesystem::path entryPath_(const std::string& description) const;
+};
+
+}  // namespace jxltk
+
+#endif  // JXLTK_FRAMECACHE_H_
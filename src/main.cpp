@@ -5,13 +5,17 @@
  * license that can be found in the LICENSE file.
  */
 
+#include <algorithm>
+#include <cinttypes>
 #include <cmath>
 #include <cstring>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <memory>
 #include <regex>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include <jxl/encode_cxx.h>
@@ -19,13 +23,21 @@
 #include "../contrib/jxlazy/include/jxlazy/decoder.h"
 
 #include "add.h"
+#include "batch.h"
+#include "bufferpool.h"
 #include "cmdline.h"
 #include "common.h"
 #include "enums.h"
+#include "except.h"
 #include "log.h"
 #include "merge.h"
 #include "mergeconfig.h"
+#include "pixelalloc.h"
 #include "split.h"
+#include "stats.h"
+#include "synth.h"
+#include "threadpool.h"
+#include "trace.h"
 #include "util.h"
 
 using std::optional;
@@ -34,21 +46,90 @@ using std::vector;
 
 namespace jxltk {
 
-int main_(int argc, char** argv) {
+namespace {
 
-  CmdlineOpts opts = parseArgs(argc, argv);
-  JXLTK_TRACE("Finished parsing command line.");
+/**
+ * Return whether the selected mode writes its main output to stdout.
+ */
+bool writesToStdout(const CmdlineOpts& opts) {
+  if (opts.mode == "gen" || opts.mode == "batch") {
+    return true;
+  }
+  if (opts.positional.empty()) {
+    return false;
+  }
+  if (opts.mode == "merge") {
+    return opts.positional.back() == "-";
+  }
+  if (opts.mode == "synth" || opts.mode == "icc") {
+    return opts.positional[0] == "-";
+  }
+  if (opts.mode == "split") {
+    return opts.configOnly;
+  }
+  if (opts.mode == "add" || opts.mode == "subtract") {
+    return opts.positional.size() > 2 && opts.positional[2] == "-";
+  }
+  return false;
+}
 
-#ifndef JXLTK_FLOATS_ARE_IEEE754
-  if (!opts.no754) {
-    JXLTK_WARNING("The compiler used to build jxltk has a `float` type that does not "
-                  "seem to conform to IEEE 754.\n"
-                  "Some operations on floating-point samples might give incorrect "
-                  "results.\n"
-                  "(Pass --no-754 to suppress this warning)");
+/**
+ * Writes the --stats report when it goes out of scope, however main_ returns.
+ */
+class StatsReport {
+ public:
+  StatsReport(std::string path, std::string mode) :
+    path_(std::move(path)), mode_(std::move(mode)) {
+    enableStats();
   }
-#endif
+  StatsReport(const StatsReport&) = delete;
+  StatsReport& operator=(const StatsReport&) = delete;
+  ~StatsReport() {
+    if (path_ == "-") {
+      writeStats(std::cout, mode_);
+      return;
+    }
+    std::ofstream file(path_, std::ios::binary);
+    if (!file) {
+      JXLTK_ERROR("Failed to open %s for writing.", shellQuote(path_, true).c_str());
+      return;
+    }
+    writeStats(file, mode_);
+  }
+
+ private:
+  std::string path_;
+  std::string mode_;
+};
 
+/**
+ * Recycles frame buffers through a BufferPool while it's in scope.
+ */
+class PixelPoolScope {
+ public:
+  explicit PixelPoolScope(size_t maxRetainedBytes) : pool_(maxRetainedBytes) {
+    setPixelMemoryManager(pool_.memoryManager());
+  }
+  PixelPoolScope(const PixelPoolScope&) = delete;
+  PixelPoolScope& operator=(const PixelPoolScope&) = delete;
+  ~PixelPoolScope() {
+    setPixelMemoryManager(nullptr);
+    BufferPool::Counters counters = pool_.getCounters();
+    JXLTK_DEBUG("Reused %" PRIu64 " of %" PRIu64 " pooled frame buffers.",
+                counters.reused, counters.reused + counters.allocated);
+  }
+
+ private:
+  BufferPool pool_;
+};
+
+/**
+ * Run the operation selected by @p opts.mode, returning the exit status.
+ *
+ * Batch mode calls this from several threads at once, for modes that don't use stdin
+ * or stdout.
+ */
+int runMode(const CmdlineOpts& opts) {
   if (opts.positional.empty()) {
     JXLTK_ERROR("No output file specified.");
     return EXIT_FAILURE;
@@ -71,19 +152,8 @@ int main_(int argc, char** argv) {
       }
 
       // Adjust paths so they're relative to the json directory.
-      auto jsonDir = std::filesystem::path(opts.mergeCfgFilename).remove_filename();
-      for (auto& box : mergeOp.boxes) {
-        if (!box.file || box.file->empty()) continue;
-        std::filesystem::path boxPath(*box.file);
-        if (boxPath.is_absolute()) continue;
-        *box.file = (jsonDir / boxPath).string();
-      }
-      for (auto& frameConfig : mergeOp.frames) {
-        if (!frameConfig.file || frameConfig.file->empty()) continue;
-        std::filesystem::path inpPath(*frameConfig.file);
-        if (inpPath.is_absolute()) continue;
-        frameConfig.file = (jsonDir / inpPath).string();
-      }
+      mergeOp.resolvePaths(
+          std::filesystem::path(opts.mergeCfgFilename).remove_filename().string());
 
     } else {
       // No JSON file
@@ -133,19 +203,60 @@ int main_(int argc, char** argv) {
 
     mergeOp.normalize();
 
-    std::ofstream fout(opts.positional.back().c_str(), std::ios::binary);
-    if (!fout) {
-      JXLTK_ERROR("Failed to open %s for writing",
-                  shellQuote(opts.positional.back(), true).c_str());
-      return EXIT_FAILURE;
+    // Files are written directly by the encoder, which avoids copying everything
+    // through a stream.
+    std::unique_ptr<EncoderOutput> out;
+    if (opts.positional.back() == "-") {
+      out = std::make_unique<EncoderOutput>(&std::cout);
+    } else {
+      try {
+        out = std::make_unique<EncoderOutput>(opts.positional.back().c_str());
+      } catch (const JxltkError&) {
+        JXLTK_ERROR("Failed to open %s for writing",
+                    shellQuote(opts.positional.back(), true).c_str());
+        return EXIT_FAILURE;
+      }
     }
 
-    merge(mergeOp, fout, opts.numThreads, opts.autoCrop, opts.unPremultiplyAlpha);
+    MergeOptions mergeOptions;
+    mergeOptions.numThreads = opts.numThreads;
+    mergeOptions.autoCrop = opts.autoCrop;
+    mergeOptions.elideDuplicates = opts.elideDuplicates;
+    mergeOptions.deltaCrop = opts.deltaCrop;
+    mergeOptions.unPremultiplyAlpha = opts.unPremultiplyAlpha;
+    mergeOptions.prefetchFrames = opts.prefetchFrames;
+    mergeOptions.maxMemory = opts.maxMemory;
+    mergeOptions.chunked = opts.chunked;
+    mergeOptions.cacheDir = opts.cacheDir;
+    merge(mergeOp, *out, mergeOptions);
     JXLTK_NOTICE("Finished writing %s.",
                  shellQuote(opts.positional.back(), true).c_str());
     return EXIT_SUCCESS;
   }
 
+  if (opts.mode == "synth") {
+    std::unique_ptr<EncoderOutput> out;
+    if (opts.positional[0] == "-") {
+      out = std::make_unique<EncoderOutput>(&std::cout);
+    } else {
+      try {
+        out = std::make_unique<EncoderOutput>(opts.positional[0].c_str());
+      } catch (const JxltkError&) {
+        JXLTK_ERROR("Failed to open %s for writing",
+                    shellQuote(opts.positional[0], true).c_str());
+        return EXIT_FAILURE;
+      }
+    }
+    optional<int16_t> brotliEffort;
+    if (opts.overrideBrotliEffort) {
+      brotliEffort = static_cast<int16_t>(*opts.overrideBrotliEffort);
+    }
+    synthesize(opts.synth, *out, opts.overrideFrameConfig, opts.numThreads,
+               brotliEffort);
+    JXLTK_NOTICE("Finished writing %s.", shellQuote(opts.positional[0], true).c_str());
+    return EXIT_SUCCESS;
+  }
+
   if (opts.mode == "split") {
 
     MergeConfig mergeCfg;
@@ -157,7 +268,7 @@ int main_(int argc, char** argv) {
           !opts.configOnly,
           !opts.configOnly,
           &mergeCfg, !opts.useMilliseconds,
-          opts.fullConfig);
+          opts.fullConfig, opts.numEncoders);
 
     if (opts.configOnly) {
       mergeCfg.toJson(std::cout, opts.fullConfig);
@@ -176,17 +287,19 @@ int main_(int argc, char** argv) {
   if (opts.mode == "subtract" || opts.mode == "add") {
     uint32_t decoderFlags = opts.coalesce ? 0 :
                                 static_cast<uint32_t>(jxlazy::DecoderFlag::NoCoalesce);
-    jxlazy::Decoder leftImage(opts.numThreads);
+    jxlazy::Decoder leftImage = makeDecoder(opts.numThreads);
     if (opts.positional[0] == "-") {
       leftImage.openStream(std::cin, decoderFlags);
     } else {
-      leftImage.openFile(opts.positional[0].c_str(), decoderFlags);
+      leftImage.openFile(opts.positional[0].c_str(), decoderFlags,
+                         jxlazy::DecoderHint::MapFile);
     }
-    jxlazy::Decoder rightImage(opts.numThreads);
+    jxlazy::Decoder rightImage = makeDecoder(opts.numThreads);
     if (opts.positional[1] == "-") {
       rightImage.openStream(std::cin, decoderFlags);
     } else {
-      rightImage.openFile(opts.positional[1].c_str(), decoderFlags);
+      rightImage.openFile(opts.positional[1].c_str(), decoderFlags,
+                          jxlazy::DecoderHint::MapFile);
     }
     std::ostream* outfile = &std::cout;
     std::ofstream loutfile;
@@ -273,7 +386,7 @@ int main_(int argc, char** argv) {
     }
     vector<uint8_t> icc;
     {
-      jxlazy::Decoder dec;
+      jxlazy::Decoder dec = makeDecoder();
       dec.openStream(*pifile, 0, jxlazy::DecoderHint::NoPixels, 16);
       icc = dec.getIccProfile(JXL_COLOR_PROFILE_TARGET_ORIGINAL);
       if (icc.empty()) {
@@ -301,11 +414,11 @@ int main_(int argc, char** argv) {
     }
     uint32_t flags = opts.coalesce ? 0 :
                          static_cast<uint32_t>(jxlazy::DecoderFlag::NoCoalesce);
-    jxlazy::Decoder dleft;
+    jxlazy::Decoder dleft = makeDecoder(opts.numThreads);
     dleft.openStream(*pleft, flags);
-    jxlazy::Decoder dright;
+    jxlazy::Decoder dright = makeDecoder(opts.numThreads);
     dright.openStream(*pright, flags);
-    if (haveSamePixels(dleft, dright)) {
+    if (haveSamePixels(dleft, dright, opts.numThreads)) {
       JXLTK_NOTICE("%s and %s have the same pixel values.",
                    shellQuote(opts.positional[0], true).c_str(),
                    shellQuote(opts.positional[1], true).c_str());
@@ -321,6 +434,85 @@ int main_(int argc, char** argv) {
   return EXIT_FAILURE;
 }
 
+/**
+ * Run each operation listed in the manifest named by the first positional argument.
+ */
+int runBatchMode(const CmdlineOpts& opts) {
+  std::vector<BatchJob> jobs;
+  try {
+    if (opts.positional[0] == "-") {
+      jobs = parseBatchManifest(std::cin, opts);
+    } else {
+      std::ifstream manifest(opts.positional[0], std::ios::binary);
+      if (!manifest) {
+        JXLTK_ERROR("Failed to open %s for reading.",
+                    shellQuote(opts.positional[0], true).c_str());
+        return EXIT_FAILURE;
+      }
+      jobs = parseBatchManifest(manifest, opts);
+    }
+  } catch (const JxltkError& e) {
+    JXLTK_ERROR("%s", e.what());
+    return EXIT_FAILURE;
+  }
+
+  BatchOptions batchOptions;
+  batchOptions.numJobs = opts.numJobs;
+  batchOptions.maxMemory = opts.maxMemory;
+  // Job status goes to stdout, one JSON object per line
+  const size_t failures = runBatch(jobs, batchOptions, runMode, std::cout);
+  if (failures > 0) {
+    JXLTK_ERROR("%zu of %zu batch jobs failed.", failures, jobs.size());
+    return EXIT_FAILURE;
+  }
+  JXLTK_NOTICE("Finished %zu batch jobs.", jobs.size());
+  return EXIT_SUCCESS;
+}
+
+}  // namespace
+
+int main_(int argc, char** argv) {
+
+  CmdlineOpts opts = parseArgs(argc, argv);
+  JXLTK_TRACE("Finished parsing command line.");
+  // Declared first so it outlives every frame buffer.  Don't keep more free buffers
+  // than the --max-memory budget.
+  PixelPoolScope pixelPool(opts.maxMemory != 0 ?
+                           std::min(opts.maxMemory, BufferPool::kDefaultMaxRetainedBytes) :
+                           BufferPool::kDefaultMaxRetainedBytes);
+  // Every encoder and decoder shares one pool, so --threads is a process-wide limit
+  setSharedThreadPoolSize(opts.numThreads);
+  std::optional<ScopedTrace> trace;
+  if (!opts.traceFile.empty()) {
+    trace.emplace(opts.traceFile);
+  }
+  // Before any encoders or decoders exist, so they all use the counting memory manager
+  std::optional<StatsReport> stats;
+  if (!opts.statsFile.empty()) {
+    if (opts.statsFile == "-" && writesToStdout(opts)) {
+      JXLTK_ERROR("--stats=- can't be used when %s mode is writing to stdout.",
+                  opts.mode.c_str());
+      return EXIT_FAILURE;
+    }
+    stats.emplace(opts.statsFile, opts.mode);
+  }
+
+#ifndef JXLTK_FLOATS_ARE_IEEE754
+  if (!opts.no754) {
+    JXLTK_WARNING("The compiler used to build jxltk has a `float` type that does not "
+                  "seem to conform to IEEE 754.\n"
+                  "Some operations on floating-point samples might give incorrect "
+                  "results.\n"
+                  "(Pass --no-754 to suppress this warning)");
+  }
+#endif
+
+  if (opts.mode == "batch") {
+    return runBatchMode(opts);
+  }
+  return runMode(opts);
+}
+
 }  // namespace jxltk
 
 
@@ -7,10 +7,17 @@
 #include <cinttypes>
 #include <cmath>
 #include <cstring>
+#include <deque>
+#include <filesystem>
 #include <fstream>
+#include <future>
 #include <iostream>
+#include <mutex>
+#include <new>
 #include <numeric>
+#include <optional>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include <jxl/encode_cxx.h>
@@ -19,9 +26,15 @@
 #include "common.h"
 #include "enums.h"
 #include "except.h"
+#include "framecache.h"
 #include "log.h"
+#include "merge.h"
 #include "mergeconfig.h"
+#include "pixelalloc.h"
 #include "pixmap.h"
+#include "stats.h"
+#include "threadpool.h"
+#include "trace.h"
 #include "util.h"
 
 using std::optional;
@@ -67,7 +80,7 @@ ColorProfile getColorProfile(const char* filename) {
   }
   if (sig == JXL_SIG_CODESTREAM || sig == JXL_SIG_CONTAINER) {
     JXLTK_TRACE("Getting color profile from existing JXL.");
-    jxlazy::Decoder dec;
+    jxlazy::Decoder dec = makeDecoder();
     inf.seekg(0);
     dec.openStream(inf, 0, jxlazy::DecoderHint::NoPixels);
     return getColorProfile(dec);
@@ -144,19 +157,213 @@ bool suggestTicksPerSecond(const MergeConfig& mergeCfg,
   return true;
 }
 
+/**
+ * Running estimate of the memory held by merge inputs (input buffers and decoded
+ * pixels), used to decide how many decoders to keep open and how far ahead to decode.
+ * Not thread safe.
+ */
+class MemoryBudget {
+ public:
+  /**
+   * @param[in] limit Maximum number of bytes, or 0 for no limit.
+   */
+  explicit MemoryBudget(size_t limit) : limit_(limit) {}
+
+  /**
+   * Return whether another @p bytes can be used without exceeding the limit.
+   */
+  bool fits(size_t bytes) const {
+    return limit_ == 0 || (bytes <= limit_ && used_ <= limit_ - bytes);
+  }
+  void acquire(size_t bytes) {
+    used_ += bytes;
+    peak_ = std::max(peak_, used_);
+  }
+  void release(size_t bytes) {
+    used_ -= std::min(used_, bytes);
+  }
+  size_t limit() const { return limit_; }
+  size_t peak() const { return peak_; }
+
+ private:
+  size_t limit_;
+  size_t used_{0};
+  size_t peak_{0};
+};
+
+#ifdef JXLTK_HAVE_CHUNKED_FRAMES
+/**
+ * Lets JxlEncoderAddChunkedFrame read rectangles from a fully-buffered Pixmap.
+ *
+ * Color (including interleaved alpha) is served straight from the Pixmap's buffer.
+ * If libjxl asks for alpha as a separate extra channel, that region is copied into a
+ * temporary planar buffer from allocPixels, owned by this object until libjxl releases
+ * it.  The callbacks may be called concurrently, so the buffers are guarded by a mutex.
+ */
+class PixmapChunkSource {
+ public:
+  explicit PixmapChunkSource(const Pixmap& pixmap)
+    : pixels_(static_cast<const uint8_t*>(pixmap.data())),
+      format_(pixmap.getPixelFormat()),
+      bytesPerPixel_(bytesPerPixel(format_.data_type, format_.num_channels)),
+      stride_(jxlazy::Decoder::getRowStride(pixmap.getXsize(), format_, nullptr)) {}
+  PixmapChunkSource(const PixmapChunkSource&) = delete;
+  PixmapChunkSource& operator=(const PixmapChunkSource&) = delete;
+
+  JxlChunkedFrameInputSource get() {
+    return {
+      .opaque = this,
+      .get_color_channels_pixel_format = getColorPixelFormat_,
+      .get_color_channel_data_at = getColorData_,
+      .get_extra_channel_pixel_format = getExtraPixelFormat_,
+      .get_extra_channel_data_at = getExtraData_,
+      .release_buffer = releaseBuffer_,
+    };
+  }
+
+ private:
+  const uint8_t* pixels_;
+  JxlPixelFormat format_;
+  size_t bytesPerPixel_;
+  size_t stride_;
+  std::mutex extraBuffersMutex_{};
+  // Planar alpha buffers handed to libjxl and not yet released, by address
+  std::unordered_map<const void*, PixelPtr> extraBuffers_{};
+
+  static void getColorPixelFormat_(void* opaque, JxlPixelFormat* pixelFormat) {
+    *pixelFormat = static_cast<PixmapChunkSource*>(opaque)->format_;
+  }
+
+  static const void* getColorData_(void* opaque, size_t xpos, size_t ypos,
+                                   size_t /*xsize*/, size_t /*ysize*/,
+                                   size_t* rowOffset) {
+    const PixmapChunkSource* self = static_cast<PixmapChunkSource*>(opaque);
+    *rowOffset = self->stride_;
+    return self->pixels_ + ypos * self->stride_ + xpos * self->bytesPerPixel_;
+  }
+
+  static void getExtraPixelFormat_(void* opaque, size_t /*ecIndex*/,
+                                   JxlPixelFormat* pixelFormat) {
+    const PixmapChunkSource* self = static_cast<PixmapChunkSource*>(opaque);
+    *pixelFormat = self->format_;
+    pixelFormat->num_channels = 1;
+    pixelFormat->align = 0;
+  }
+
+  static const void* getExtraData_(void* opaque, size_t /*ecIndex*/, size_t xpos,
+                                   size_t ypos, size_t xsize, size_t ysize,
+                                   size_t* rowOffset) {
+    // We only ever have one extra channel: alpha, interleaved last.
+    PixmapChunkSource* self = static_cast<PixmapChunkSource*>(opaque);
+    const size_t sampleSize = bytesPerSample(self->format_.data_type);
+    *rowOffset = xsize * sampleSize;
+    PixelPtr buffer;
+    try {
+      buffer = allocPixels(xsize * ysize * sampleSize);
+    } catch (const std::bad_alloc&) {
+      JXLTK_ERROR("Out of memory copying alpha for the encoder.");
+      return nullptr;
+    }
+    uint8_t* planar = static_cast<uint8_t*>(buffer.get());
+    const size_t alphaOffset = (self->format_.num_channels - 1) * sampleSize;
+    for (size_t y = 0; y < ysize; ++y) {
+      const uint8_t* inPixel = self->pixels_ + (ypos + y) * self->stride_ +
+                               xpos * self->bytesPerPixel_ + alphaOffset;
+      uint8_t* outSample = planar + y * *rowOffset;
+      for (size_t x = 0; x < xsize; ++x) {
+        memcpy(outSample, inPixel, sampleSize);
+        outSample += sampleSize;
+        inPixel += self->bytesPerPixel_;
+      }
+    }
+    std::lock_guard<std::mutex> lock(self->extraBuffersMutex_);
+    self->extraBuffers_.emplace(planar, std::move(buffer));
+    return planar;
+  }
+
+  static void releaseBuffer_(void* opaque, const void* buf) {
+    // Color is served from the Pixmap, so only planar alpha buffers are found here.
+    PixmapChunkSource* self = static_cast<PixmapChunkSource*>(opaque);
+    std::lock_guard<std::mutex> lock(self->extraBuffersMutex_);
+    self->extraBuffers_.erase(buf);
+  }
+};
+#endif
+
+bool hasZeroDuration(const FrameConfig& cfg) {
+  return cfg.durationMs.value_or(0) == 0 && cfg.durationTicks.value_or(0) == 0;
+}
+
+/**
+ * Return whether a frame would replace exactly the pixels that @p prev put on the canvas,
+ * so that only the pixels that differ from @p prev need encoding.  Both frames must be
+ * prepared (buffered, and cropped if they're going to be).
+ *
+ * @p prev must have been saved as reference @p prevSlot, which is what the reduced
+ * frame will be blended onto.
+ */
+bool replacesSameRegion(const Pixmap& prev, const FrameConfig& prevCfg, uint8_t prevSlot,
+                        const Pixmap& frame, const FrameConfig& frameCfg) {
+  auto replaces = [](const FrameConfig& cfg) {
+    return cfg.blendMode.value_or(JXL_BLEND_REPLACE) == JXL_BLEND_REPLACE;
+  };
+  // Blending anything else onto an old canvas depends on more than just the previous
+  // frame.
+  if (!replaces(prevCfg) || !replaces(frameCfg)) {
+    return false;
+  }
+  // Outside its region, the frame shows its blend source.  That matches what's in
+  // prevSlot if it's the same reference prev was blended onto, or prevSlot itself.
+  const uint8_t blendSource = frameCfg.blendSource.value_or(0);
+  if (blendSource != prevCfg.blendSource.value_or(0) && blendSource != prevSlot) {
+    return false;
+  }
+  // Saving any other reference would save the reduced frame's canvas somewhere that
+  // later frames might not expect.
+  const uint8_t saveSlot = frameCfg.saveAsReference.value_or(0);
+  if (saveSlot != 0 && saveSlot != prevSlot) {
+    return false;
+  }
+  const std::pair<int32_t, int32_t> origin{0, 0};
+  const JxlPixelFormat& format = frame.getPixelFormat();
+  const JxlPixelFormat& prevFormat = prev.getPixelFormat();
+  if (prevCfg.offset.value_or(origin) != frameCfg.offset.value_or(origin) ||
+      prev.getXsize() != frame.getXsize() || prev.getYsize() != frame.getYsize() ||
+      prevFormat.num_channels != format.num_channels ||
+      prevFormat.data_type != format.data_type) {
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Copy @p region of @p from into the same place in @p to, which must have the same size
+ * and format.
+ */
+void copyRegion(const Pixmap& from, Pixmap* to, const CropRegion& region) {
+  const JxlPixelFormat& format = from.getPixelFormat();
+  const size_t pixelSize = bytesPerPixel(format.data_type, format.num_channels);
+  const size_t stride = from.getXsize() * pixelSize;
+  const size_t start = region.y0 * stride + region.x0 * pixelSize;
+  const uint8_t* src = static_cast<const uint8_t*>(from.data()) + start;
+  uint8_t* dst = static_cast<uint8_t*>(to->data()) + start;
+  for (uint32_t y = 0; y < region.height; ++y) {
+    memcpy(dst + y * stride, src + y * stride, region.width * pixelSize);
+  }
+}
+
 /**
  * Add a box to the encoder, and run the encoder as far as it can go.
  */
 void writeBox(JxlEncoder* enc, const JxlBoxType boxType, const uint8_t* content,
-              size_t size, bool compress, bool isLast, uint8_t* buffer,
-              size_t bufferSize, std::ostream& fout) {
+              size_t size, bool compress, bool isLast, EncoderOutput& out) {
   if (JxlEncoderAddBox(enc, boxType, content, size, compress) != JXL_ENC_SUCCESS) {
     throw JxltkError("%s: Failed to add box to output", __func__);
   }
   if (isLast) {
     JxlEncoderCloseBoxes(enc);
   }
-  JxlEncoderStatus st = encodeUntilSuccess(enc, buffer, bufferSize, &fout);
+  JxlEncoderStatus st = out.flush(enc);
   if (st != JXL_ENC_SUCCESS) {
     throw JxltkError("%s: Unexpected encoder status while writing box: %s",
                      __func__, encoderStatusName(st));
@@ -167,7 +374,28 @@ void writeBox(JxlEncoder* enc, const JxlBoxType boxType, const uint8_t* content,
 
 
 void merge(const MergeConfig& mergeCfg, std::ostream& fout, size_t numThreads,
-           bool autoCrop, bool unPremultiplyAlpha) {
+           bool autoCrop, bool unPremultiplyAlpha, size_t prefetchFrames,
+           size_t maxMemory) {
+  MergeOptions options;
+  options.numThreads = numThreads;
+  options.autoCrop = autoCrop;
+  options.unPremultiplyAlpha = unPremultiplyAlpha;
+  options.prefetchFrames = prefetchFrames;
+  options.maxMemory = maxMemory;
+  merge(mergeCfg, fout, options);
+}
+
+void merge(const MergeConfig& mergeCfg, std::ostream& fout,
+           const MergeOptions& options) {
+  EncoderOutput out(&fout);
+  merge(mergeCfg, out, options);
+}
+
+void merge(const MergeConfig& mergeCfg, EncoderOutput& out,
+           const MergeOptions& options) {
+  const bool autoCrop = options.autoCrop;
+  const bool unPremultiplyAlpha = options.unPremultiplyAlpha;
+  const size_t prefetchFrames = options.prefetchFrames;
   JXLTK_TRACE("Entered %s", __func__);
   const vector<FrameConfig>& inputs = mergeCfg.frames;
 
@@ -236,6 +464,15 @@ void merge(const MergeConfig& mergeCfg, std::ostream& fout, size_t numThreads,
   frameDecoders.reserve(inputs.size());
   vector<FrameConfig> frameConfigs;
   frameConfigs.reserve(inputs.size());
+  // Per-input details that let us close decoders early and reopen them when needed.
+  vector<JxlPixelFormat> suggestedFormats(inputs.size());
+  vector<std::pair<uint32_t,uint32_t> > frameSizes(inputs.size(), {1, 1});
+  vector<size_t> inputBytes(inputs.size());
+  MemoryBudget budget(options.maxMemory);
+  uint32_t decoderFlags = 0;
+  if (unPremultiplyAlpha) {
+    decoderFlags |= jxlazy::DecoderFlag::UnpremultiplyAlpha;
+  }
 
   // First pass over inputs:
   // - Coalesce individual frame settings with frameDefaults.
@@ -269,16 +506,22 @@ void merge(const MergeConfig& mergeCfg, std::ostream& fout, size_t numThreads,
     if (!frameCfg.file || frameCfg.file->empty()) {
       frameDecoders.emplace_back();
     } else {
-      auto frameDecoder = std::make_unique<jxlazy::Decoder>();
+      auto frameDecoder = std::make_unique<jxlazy::Decoder>(
+          makeDecoder(options.numThreads));
       bool copyBoxes = frameCfg.copyBoxes.value_or(false);
-      uint32_t hints = copyBoxes ?
-                           static_cast<uint32_t>(jxlazy::DecoderHint::WantBoxes) : 0;
+      uint32_t hints = jxlazy::DecoderHint::MapFile;
+      if (copyBoxes) {
+        hints |= jxlazy::DecoderHint::WantBoxes;
+      }
       // TODO: allow control over buffering argument
-      frameDecoder->openFile(frameCfg.file->c_str(),
-                             unPremultiplyAlpha ?
-                                 jxlazy::DecoderFlag::UnpremultiplyAlpha :
-                                 static_cast<jxlazy::DecoderFlag>(0),
-                             hints);
+      frameDecoder->openFile(frameCfg.file->c_str(), decoderFlags, hints);
+      std::error_code ec;
+      inputBytes[frameIdx] = std::filesystem::file_size(*frameCfg.file, ec);
+      if (ec) {
+        inputBytes[frameIdx] = 0;
+      }
+      bool keepOpen = budget.fits(inputBytes[frameIdx]);
+      budget.acquire(inputBytes[frameIdx]);
       JxlBasicInfo bi = frameDecoder->getBasicInfo();
       // If this is the first JXL input (`!color`), inherit some details from the
       // basic info. If we're not unpremultiplying alpha, make sure this JXL input matches
@@ -333,6 +576,17 @@ void merge(const MergeConfig& mergeCfg, std::ostream& fout, size_t numThreads,
           checkColorProfiles = false;
         }
       }
+      frameDecoder->suggestPixelFormat(&suggestedFormats[frameIdx]);
+      jxlazy::FrameInfo frameInfo =
+          frameDecoder->getFrameInfo(frameCfg.frameIndex.value_or(0));
+      frameSizes[frameIdx] = {frameInfo.header.layer_info.xsize,
+                              frameInfo.header.layer_info.ysize};
+      if (!keepOpen) {
+        // Over budget - Pixmap will reopen this input when it's needed.
+        JXLTK_TRACE("Closing input %zu until it's needed.", frameIdx);
+        frameDecoder.reset();
+        budget.release(inputBytes[frameIdx]);
+      }
       frameDecoders.emplace_back(std::move(frameDecoder));
     }
   }
@@ -370,13 +624,13 @@ void merge(const MergeConfig& mergeCfg, std::ostream& fout, size_t numThreads,
   // Define (lazy-loaded) frame buffers we'll pass to the encoder
   vector<Pixmap> frameBuffers;
   frameBuffers.reserve(inputs.size());
+  // Estimated size of each frame once decoded
+  vector<size_t> pixelBytes(inputs.size());
   for (size_t i = 0; i < inputs.size(); i++) {
-    std::unique_ptr<jxlazy::Decoder>& frameDecPtr = frameDecoders.at(i);
-    if (frameDecPtr) {
+    const FrameConfig& frameCfg = frameConfigs[i];
+    if (frameCfg.file && !frameCfg.file->empty()) {
       // Decide the pixel format to use for this frame
-      const FrameConfig& frameCfg = frameConfigs[i];
-      JxlPixelFormat pixelFormat;
-      frameDecPtr->suggestPixelFormat(&pixelFormat);
+      JxlPixelFormat pixelFormat = suggestedFormats[i];
       if (encInfo.alpha_bits > 0 &&
           (pixelFormat.num_channels == 3 || pixelFormat.num_channels == 1)) {
         ++pixelFormat.num_channels;
@@ -389,8 +643,16 @@ void merge(const MergeConfig& mergeCfg, std::ostream& fout, size_t numThreads,
       }
       JXLTK_DEBUG("Frame %zu pixel format: %s", i, toString(pixelFormat).c_str());
 
-      frameBuffers.emplace_back(std::move(frameDecPtr), frameCfg.frameIndex.value_or(0),
-                                pixelFormat);
+      uint32_t hints = jxlazy::DecoderHint::MapFile;
+      if (frameCfg.copyBoxes.value_or(false)) {
+        hints |= jxlazy::DecoderHint::WantBoxes;
+      }
+      frameBuffers.emplace_back(std::move(frameDecoders.at(i)),
+                                frameCfg.frameIndex.value_or(0), pixelFormat,
+                                *frameCfg.file, decoderFlags, hints);
+      pixelBytes[i] = jxlazy::Decoder::getFrameBufferSize(frameSizes[i].first,
+                                                         frameSizes[i].second,
+                                                         pixelFormat);
     } else {
       // Missing decoders are inputs that had no filename.
       // Construct 1x1 black transparent frames for these.
@@ -400,13 +662,14 @@ void merge(const MergeConfig& mergeCfg, std::ostream& fout, size_t numThreads,
         .endianness = JXL_NATIVE_ENDIAN,
         .align = 0 };
       frameBuffers.push_back(Pixmap::blackPixel(minimalPixelFormat));
+      pixelBytes[i] = frameBuffers.back().getBufferSize();
     }
     if (autoSizeCanvas) {
-      const auto& optOffset = frameConfigs[i].offset;
+      const auto& optOffset = frameCfg.offset;
       int32_t cropX0 = optOffset ? optOffset->first : 0;
       int32_t cropY0 = optOffset ? optOffset->second : 0;
-      encInfo.xsize = std::max(encInfo.xsize, cropX0 + frameBuffers.back().getXsize());
-      encInfo.ysize = std::max(encInfo.ysize, cropY0 + frameBuffers.back().getYsize());
+      encInfo.xsize = std::max(encInfo.xsize, cropX0 + frameSizes[i].first);
+      encInfo.ysize = std::max(encInfo.ysize, cropY0 + frameSizes[i].second);
     }
   }
 
@@ -418,8 +681,14 @@ void merge(const MergeConfig& mergeCfg, std::ostream& fout, size_t numThreads,
   }
 
   // Init encoder
-  auto [encp, runner] = makeThreadedEncoder(nullptr, numThreads);
+#ifndef JXLTK_HAVE_CHUNKED_FRAMES
+  if (options.chunked) {
+    JXLTK_WARNING("This version of libjxl doesn't support chunked frames.");
+  }
+#endif
+  JxlEncoderPtr encp = makeThreadedEncoder(nullptr, options.numThreads);
   JxlEncoder* enc = encp.get();
+  out.attach(enc);
   if (mergeCfg.codestreamLevel && *mergeCfg.codestreamLevel >= 0 &&
       JxlEncoderSetCodestreamLevel(enc, *mergeCfg.codestreamLevel) != JXL_ENC_SUCCESS) {
     throw JxltkError("%s: Failed in JxlEncoderSetCodestreamLevel", __func__);
@@ -458,9 +727,6 @@ void merge(const MergeConfig& mergeCfg, std::ostream& fout, size_t numThreads,
     }
   }
 
-  std::unique_ptr<uint8_t[]> buffer =
-      JXLTK_MAKE_UNIQUE_FOR_OVERWRITE<uint8_t[]>(kDefaultIOBufferSize);
-
   // Write boxes from mergeCfg
   JXLTK_TRACE("Writing %zu boxes from mergeCfg.", mergeCfg.boxes.size());
   std::vector<uint8_t> boxContent;
@@ -482,7 +748,7 @@ void merge(const MergeConfig& mergeCfg, std::ostream& fout, size_t numThreads,
                compress ? "'brob'/" : "",
                shellQuote(simplifyString(boxCfg.type), true).c_str());
     writeBox(enc, boxCfg.type, boxContent.data(), boxContent.size(),
-             compress, nextBox == totalBoxes - 1, buffer.get(), kDefaultIOBufferSize, fout);
+             compress, nextBox == totalBoxes - 1, out);
     ++nextBox;
   }
   // Write boxes copied from input JXLs
@@ -491,11 +757,16 @@ void merge(const MergeConfig& mergeCfg, std::ostream& fout, size_t numThreads,
   for (size_t frameIdx = 0; frameIdx < frameConfigs.size(); ++frameIdx) {
     const FrameConfig& frameCfg = frameConfigs[frameIdx];
     // We've moved our Decoder object to the corresponding Pixmap; borrow it back.
+    // This reopens the input if it was closed to save memory.
+    Pixmap& frameBuffer = frameBuffers[frameIdx];
+    bool wasOpen = frameBuffer.hasOpenDecoder();
     jxlazy::Decoder* dec;
-    if (!frameCfg.copyBoxes.value_or(false) ||
-        !(dec = frameBuffers[frameIdx].getDecoder())) {
+    if (!frameCfg.copyBoxes.value_or(false) || !(dec = frameBuffer.getDecoder())) {
       continue;
     }
+    if (!wasOpen) {
+      budget.acquire(inputBytes[frameIdx]);
+    }
     auto nonReservedBoxes = getNonReservedBoxes(*dec);
     bool compress = mergeCfg.boxDefaults.compress.value_or(false);
     for (const std::pair<size_t,jxlazy::BoxInfo>& boxToCopy : nonReservedBoxes) {
@@ -505,16 +776,71 @@ void merge(const MergeConfig& mergeCfg, std::ostream& fout, size_t numThreads,
                  shellQuote(simplifyString(std::string_view(boxToCopy.second.type, 4)),
                             true).c_str());
       writeBox(enc, boxToCopy.second.type, boxContent.data(), boxContent.size(),
-               compress, nextBox == totalBoxes - 1, buffer.get(), kDefaultIOBufferSize, fout);
+               compress, nextBox == totalBoxes - 1, out);
       ++nextBox;
     }
+    if (!wasOpen) {
+      frameBuffer.closeDecoder();
+      budget.release(inputBytes[frameIdx]);
+    }
   }
 
-  // Write frames
-  for (size_t frameIdx = 0; frameIdx < inputs.size(); ++frameIdx) {
+  std::optional<FrameCache> frameCache;
+  if (!options.cacheDir.empty()) frameCache.emplace(options.cacheDir);
+
+  // Everything that needs to happen to a frame's pixels before they can be handed to the
+  // encoder.  Each call only touches frameBuffers[frameIdx] and frameConfigs[frameIdx],
+  // so calls for different frames can run concurrently.
+  auto prepareFrame = [&](size_t frameIdx) {
+    TraceSpan span("prepareFrame", static_cast<int64_t>(frameIdx));
     Pixmap& frameBuffer = frameBuffers.at(frameIdx);
     FrameConfig& frameCfg = frameConfigs[frameIdx];
 
+    bool cropThisFrame = autoCrop && frameCfg.blendMode &&
+        (*frameCfg.blendMode == JXL_BLEND_ADD ||
+         ((*frameCfg.blendMode == JXL_BLEND_BLEND ||
+           *frameCfg.blendMode == JXL_BLEND_MULADD) &&
+          encInfo.alpha_bits > 0));
+    bool cropped = false;
+    CropRegion cropRegion{};
+    auto applyCrop = [&]() {
+      if (!cropped) {
+        JXLTK_DEBUG("Nothing to crop for frame [%zu].", frameIdx);
+      } else if (cropRegion.width == 0) {
+        JXLTK_TRACE("Cropped frame %zu to nothing.", frameIdx);
+        frameCfg.blendMode = JXL_BLEND_ADD;
+        frameCfg.offset.reset();
+      } else {
+        JXLTK_DEBUG("Auto cropped frame [%zu].", frameIdx);
+        if (frameCfg.offset) {
+          frameCfg.offset->first += static_cast<int32_t>(cropRegion.x0);
+          frameCfg.offset->second += static_cast<int32_t>(cropRegion.y0);
+        } else {
+          frameCfg.offset = std::make_pair(static_cast<int32_t>(cropRegion.x0),
+                                           static_cast<int32_t>(cropRegion.y0));
+        }
+      }
+    };
+
+    std::string cacheDescription;
+    if (frameCache && frameCfg.file && !frameCfg.file->empty()) {
+      FrameCacheKey key;
+      key.file = *frameCfg.file;
+      key.frameIndex = frameCfg.frameIndex.value_or(0);
+      key.format = frameBuffer.getPixelFormat();
+      key.decoderFlags = decoderFlags;
+      key.alphaFill = frameCfg.alphaFill;
+      key.blendMode = frameCfg.blendMode;
+      key.outputHasAlpha = encInfo.alpha_bits > 0;
+      key.autoCrop = cropThisFrame;
+      cacheDescription = frameCache->describe(key);
+      if (frameCache->load(cacheDescription, &frameBuffer, &cropRegion, &cropped)) {
+        JXLTK_DEBUG("Loaded frame [%zu] from the frame cache.", frameIdx);
+        if (cropThisFrame) applyCrop();
+        return;
+      }
+    }
+
     // - If caller requested an alphaFill, set it now.
     // - Else if output requires alpha but input had none, try to set alpha to the
     //   "least surprising" value for the blend mode. (1.0 for kReplace, kBlend, and kMul;
@@ -529,34 +855,176 @@ void merge(const MergeConfig& mergeCfg, std::ostream& fout, size_t numThreads,
           *frameCfg.blendMode == JXL_BLEND_MULADD))) {
       float alphaFill = frameCfg.alphaFill ? *frameCfg.alphaFill : 0.f;
       JXLTK_TRACE("Set all alpha samples to %f for frame %zu.", alphaFill, frameIdx);
+      TraceSpan fillSpan("alphaFill", static_cast<int64_t>(frameIdx));
       frameBuffer.alphaFill(alphaFill);
     }
 
-    if (autoCrop && frameCfg.blendMode &&
-        (*frameCfg.blendMode == JXL_BLEND_ADD ||
-         ((*frameCfg.blendMode == JXL_BLEND_BLEND ||
-           *frameCfg.blendMode == JXL_BLEND_MULADD) &&
-          encInfo.alpha_bits > 0))) {
+    if (cropThisFrame) {
+      TraceSpan cropSpan("autoCrop", static_cast<int64_t>(frameIdx));
       bool alphaCrop = *frameCfg.blendMode != JXL_BLEND_ADD;
-      CropRegion cropRegion;
-      if (frameBuffer.autoCrop(alphaCrop, &cropRegion)) {
-        if (cropRegion.width == 0) {
-          JXLTK_TRACE("Cropped frame %zu to nothing.", frameIdx);
-          frameCfg.blendMode = JXL_BLEND_ADD;
-          frameCfg.offset.reset();
-        } else {
-          JXLTK_DEBUG("Auto cropped frame [%zu].", frameIdx);
-          if (frameCfg.offset) {
-            frameCfg.offset->first += static_cast<int32_t>(cropRegion.x0);
-            frameCfg.offset->second += static_cast<int32_t>(cropRegion.y0);
-          } else {
-            frameCfg.offset = std::make_pair(static_cast<int32_t>(cropRegion.x0),
-                                             static_cast<int32_t>(cropRegion.y0));
-          }
+      cropped = frameBuffer.autoCrop(alphaCrop, &cropRegion);
+      applyCrop();
+    }
+
+    frameBuffer.ensureBuffered();
+    if (!cacheDescription.empty()) {
+      frameCache->store(cacheDescription, frameBuffer, cropRegion, cropped);
+    }
+  };
+
+  // Frames being prepared in the background, in order, starting with the next frame to
+  // be encoded.  They're prepared one at a time by prefetcher; decoding itself uses the
+  // shared thread pool, so --threads still bounds the threads merge starts.  Declared
+  // after frameBuffers so that destroying the prefetcher (which waits for the frame it's
+  // preparing) happens before the Pixmaps are destroyed.
+  std::deque<std::future<void> > pendingFrames;
+  std::optional<BackgroundWorker> prefetcher;
+  if (prefetchFrames > 0) prefetcher.emplace();
+  size_t nextPrefetch = 0;
+  // With elideDuplicates or deltaCrop, the last kReplace frame encoded with its own
+  // pixels.  It stays buffered, updated to match the canvas, until a frame doesn't
+  // replace the same region.  The canvas it produced is saved as reference heldSlot,
+  // so reduced frames can be blended onto it.
+  std::optional<size_t> heldFrame;
+  uint8_t heldSlot = 0;
+  // A reference slot no frame uses, for frames that would otherwise not be saved.
+  // Slot 0 is saved implicitly by zero-duration frames, and slot 3 disables patches.
+  std::optional<uint8_t> spareSlot;
+  if (options.elideDuplicates || options.deltaCrop) {
+    bool slotUsed[4] = {true, false, false, true};
+    for (const FrameConfig& cfg : frameConfigs) {
+      if (cfg.saveAsReference && *cfg.saveAsReference < 4) {
+        slotUsed[*cfg.saveAsReference] = true;
+      }
+      if (cfg.blendSource && *cfg.blendSource < 4) {
+        slotUsed[*cfg.blendSource] = true;
+      }
+    }
+    for (uint8_t slot : {1, 2}) {
+      if (!slotUsed[slot]) {
+        spareSlot = slot;
+        break;
+      }
+    }
+    if (!spareSlot) {
+      JXLTK_DEBUG("No spare reference slot; only frames saved as references can be "
+                  "reused.");
+    }
+  }
+  auto releaseFrame = [&](size_t idx) {
+    // Frees the pixels and the Decoder
+    frameBuffers[idx].close();
+    budget.release(pixelBytes[idx] + inputBytes[idx]);
+  };
+
+  // Write frames
+  for (size_t frameIdx = 0; frameIdx < inputs.size(); ++frameIdx) {
+    Pixmap& frameBuffer = frameBuffers.at(frameIdx);
+    FrameConfig& frameCfg = frameConfigs[frameIdx];
+
+    // Schedule this frame, and up to prefetchFrames frames beyond it, as far as the
+    // memory budget allows.  The current frame is always scheduled.
+    for (; nextPrefetch < inputs.size() && nextPrefetch <= frameIdx + prefetchFrames;
+         ++nextPrefetch) {
+      size_t bytes = pixelBytes[nextPrefetch];
+      if (!frameBuffers[nextPrefetch].hasOpenDecoder()) {
+        bytes += inputBytes[nextPrefetch];
+      }
+      if (nextPrefetch > frameIdx && !budget.fits(bytes)) {
+        JXLTK_TRACE("Not prefetching frame %zu - over memory budget.", nextPrefetch);
+        break;
+      }
+      budget.acquire(bytes);
+      if (prefetchFrames > 0) {
+        JXLTK_TRACE("Prefetching frame %zu.", nextPrefetch);
+        pendingFrames.push_back(prefetcher->post([&prepareFrame, nextPrefetch]() {
+          prepareFrame(nextPrefetch);
+        }));
+      }
+    }
+    if (prefetchFrames > 0) {
+      // Rethrows anything thrown while preparing this frame.
+      std::future<void> current = std::move(pendingFrames.front());
+      pendingFrames.pop_front();
+      current.get();
+    } else {
+      prepareFrame(frameIdx);
+    }
+
+    // A frame can only be held if its canvas gets saved: either it's saved already, or
+    // it can use the spare slot without losing an implicit save to slot 0.
+    bool holdThisFrame = (options.elideDuplicates || options.deltaCrop) &&
+        frameCfg.blendMode.value_or(JXL_BLEND_REPLACE) == JXL_BLEND_REPLACE &&
+        (frameCfg.saveAsReference.value_or(0) != 0 ||
+         (!frameCfg.saveAsReference && spareSlot && !hasZeroDuration(frameCfg)));
+    if (heldFrame && replacesSameRegion(frameBuffers[*heldFrame],
+                                        frameConfigs[*heldFrame], heldSlot, frameBuffer,
+                                        frameCfg)) {
+      Pixmap& held = frameBuffers[*heldFrame];
+      const uint32_t xsize = frameBuffer.getXsize(), ysize = frameBuffer.getYsize();
+      CropRegion changed{0, 0, 0, 0};
+      if (options.deltaCrop) {
+        const JxlPixelFormat& format = frameBuffer.getPixelFormat();
+        if (findChangedRegion(held.data(), frameBuffer.data(), xsize, ysize,
+                              bytesPerPixel(format.data_type, format.num_channels),
+                              &changed) != 0) {
+          throw JxltkError("%s: Failed to compare frame %zu", __func__, frameIdx);
+        }
+      } else if (memcmp(held.data(), frameBuffer.data(),
+                        frameBuffer.getBufferSize()) != 0) {
+        changed = {xsize, ysize, 0, 0};
+      }
+
+      if (changed.width == 0) {
+        // The held frame's canvas is saved in heldSlot, and adding a transparent black
+        // pixel to it leaves it alone.  Keep holding the earlier frame, which is
+        // identical.
+        JXLTK_DEBUG("Frame [%zu] repeats frame [%zu]; replacing it with an empty frame.",
+                    frameIdx, *heldFrame);
+        frameBuffer = Pixmap::blackPixel(frameBuffer.getPixelFormat());
+        frameCfg.blendMode = JXL_BLEND_ADD;
+        frameCfg.blendSource = heldSlot;
+        frameCfg.offset.reset();
+        holdThisFrame = false;
+      } else if (changed.width < xsize || changed.height < ysize) {
+        // Bring the held frame up to date with the canvas, then encode only the pixels
+        // that changed.
+        JXLTK_DEBUG("Frame [%zu] differs from frame [%zu] in %" PRIu32 "x%" PRIu32
+                    "+%" PRIu32 "+%" PRIu32 "; cropping to that.", frameIdx, *heldFrame,
+                    changed.width, changed.height, changed.x0, changed.y0);
+        copyRegion(frameBuffer, &held, changed);
+        frameBuffer.crop(changed);
+        auto offset = frameCfg.offset.value_or(std::make_pair(0, 0));
+        frameCfg.offset = std::make_pair(offset.first + static_cast<int32_t>(changed.x0),
+                                         offset.second + static_cast<int32_t>(changed.y0));
+        // Everything outside the changed region comes from the held frame's canvas.
+        frameCfg.blendSource = heldSlot;
+        // The held frame now matches this frame, so the saved canvas has to as well.
+        // The spare slot is ours to update; a slot from the config only gets updated
+        // if this frame was going to save to it anyway.
+        if (!frameCfg.saveAsReference && spareSlot && heldSlot == *spareSlot &&
+            !hasZeroDuration(frameCfg)) {
+          frameCfg.saveAsReference = heldSlot;
         }
+        if (frameCfg.saveAsReference.value_or(0) != heldSlot) {
+          releaseFrame(*heldFrame);
+          heldFrame.reset();
+        }
+        holdThisFrame = false;
       } else {
-        JXLTK_DEBUG("Nothing to crop for frame [%zu].", frameIdx);
+        releaseFrame(*heldFrame);
+        heldFrame.reset();
       }
+    } else if (heldFrame) {
+      releaseFrame(*heldFrame);
+      heldFrame.reset();
+    }
+
+    if (holdThisFrame) {
+      if (!frameCfg.saveAsReference) {
+        frameCfg.saveAsReference = *spareSlot;
+      }
+      heldSlot = *frameCfg.saveAsReference;
     }
 
     JXLTK_INFO("Writing frame [%zu/%zu]: %s", frameIdx+1, inputs.size(),
@@ -570,24 +1038,54 @@ void merge(const MergeConfig& mergeCfg, std::ostream& fout, size_t numThreads,
                                                   frameBuffer.getXsize(),
                                                   frameBuffer.getYsize(),
                                                   mergeCfg.brotliEffort);
-    if (JxlEncoderAddImageFrame(settings, &frameBuffer.getPixelFormat(),
-                                frameBuffer.data(),
-                                frameBuffer.getBufferSize()) != JXL_ENC_SUCCESS) {
-      throw JxltkError("%s: Failed to add frame %zu", __func__, frameIdx);
+    bool isLastFrame = frameIdx == inputs.size() - 1;
+#ifdef JXLTK_HAVE_CHUNKED_FRAMES
+    // Without an output processor, libjxl only reads the frame through the source's
+    // callbacks when its output is collected, so the source has to outlive out.flush().
+    std::optional<PixmapChunkSource> chunkSource;
+#endif
+    {
+      TraceSpan addSpan("addFrame", static_cast<int64_t>(frameIdx));
+#ifdef JXLTK_HAVE_CHUNKED_FRAMES
+      if (options.chunked) {
+        chunkSource.emplace(frameBuffer);
+        if (JxlEncoderAddChunkedFrame(settings, isLastFrame ? JXL_TRUE : JXL_FALSE,
+                                      chunkSource->get()) != JXL_ENC_SUCCESS) {
+          throw JxltkError("%s: Failed to add frame %zu", __func__, frameIdx);
+        }
+        isLastFrame = false;  // Already closed
+      } else
+#endif
+      if (JxlEncoderAddImageFrame(settings, &frameBuffer.getPixelFormat(),
+                                  frameBuffer.data(),
+                                  frameBuffer.getBufferSize()) != JXL_ENC_SUCCESS) {
+        throw JxltkError("%s: Failed to add frame %zu", __func__, frameIdx);
+      }
     }
-    if (frameIdx == inputs.size() - 1) {
+    countPixelsEncoded(uint64_t{frameBuffer.getXsize()} * frameBuffer.getYsize());
+    if (isLastFrame) {
       JxlEncoderCloseFrames(enc);
     }
 
-    JxlEncoderStatus st = encodeUntilSuccess(enc, buffer.get(), kDefaultIOBufferSize,
-                                             &fout);
+    JxlEncoderStatus st = out.flush(enc);
     if (st != JXL_ENC_SUCCESS) {
       throw JxltkError("%s: Unexpected encoder status while writing frame %zu: %s",
                        __func__, frameIdx, encoderStatusName(st));
     }
 
-    // Frees the pixels and the Decoder
-    frameBuffer.close();
+    if (holdThisFrame) {
+      heldFrame = frameIdx;
+    } else {
+      releaseFrame(frameIdx);
+    }
+  }
+  if (heldFrame) releaseFrame(*heldFrame);
+
+  if (budget.limit() > 0) {
+    JXLTK_NOTICE("Peak estimated input memory: %zu MiB (limit %zu MiB).",
+                 budget.peak() >> 20, budget.limit() >> 20);
+  } else {
+    JXLTK_INFO("Peak estimated input memory: %zu MiB.", budget.peak() >> 20);
   }
 }
 
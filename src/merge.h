@@ -8,27 +8,104 @@
 #define JXLTK_MERGE_H_
 
 #include <iostream>
+#include <string>
 
 #include <jxl/types.h>
 
+#include "common.h"
 #include "mergeconfig.h"
 
 namespace jxltk {
 
+/**
+ * Processing options for merge() that don't affect the content of the result.
+ */
+struct MergeOptions {
+  /**
+   * 1 to encode and decode on the calling thread, or any other value to use the shared
+   * thread pool (see setSharedThreadPoolSize).
+   */
+  size_t numThreads{0};
+  /**
+   * Trim fully-transparent borders (for alpha-blended frames) and all-zero borders (for
+   * kAdded frames), reducing the number of pixels without altering the appearance of
+   * the result.
+   */
+  bool autoCrop{false};
+  /**
+   * Replace each frame that's identical to the previous frame (same pixels, size and
+   * offset, both using kReplace blending) with an empty frame that leaves the canvas
+   * unchanged.  Frame durations are kept, so the animation's timing is unaffected.
+   *
+   * The empty frame is blended onto the previous frame's canvas, so that frame must be
+   * saved as a reference.  Frames that aren't already saved use a reference slot that
+   * no frame in the config uses; if there isn't one, only saved frames are elided.
+   */
+  bool elideDuplicates{false};
+  /**
+   * Crop each kReplace frame to the pixels that differ from the previous frame, when both
+   * cover the same region.  The cropped frame is blended onto the previous frame's
+   * canvas, which is saved as a reference as for elideDuplicates, and saves its own
+   * canvas there in turn.  Frames with no differences are handled as for
+   * elideDuplicates.
+   */
+  bool deltaCrop{false};
+  /**
+   * Convert associated alpha to straight alpha. Required to be true if the inputs use a
+   * mixture of straight and associated alpha.
+   */
+  bool unPremultiplyAlpha{true};
+  /**
+   * Number of upcoming frames to decode in the background while the current frame is
+   * being encoded.  They're decoded in order on one extra thread, using the shared
+   * thread pool.  0 decodes each frame only when it's needed.  Each prefetched frame
+   * stays fully buffered in memory until it's encoded.
+   */
+  size_t prefetchFrames{0};
+  /**
+   * Approximate limit in bytes for the memory held by inputs (input files and decoded
+   * frames), or 0 for no limit.  Inputs that don't fit are closed after being inspected
+   * and reopened when needed, and prefetching stops early rather than exceed the limit.
+   * The current frame is always decoded, even if it exceeds the limit by itself.
+   */
+  size_t maxMemory{0};
+  /**
+   * Pass frames to the encoder with JxlEncoderAddChunkedFrame, so libjxl reads them a
+   * region at a time from our buffer instead of making its own full-size float copy.
+   * Ignored if libjxl is too old to support this.
+   */
+  bool chunked{false};
+  /**
+   * Directory for caching decoded, alpha-filled and cropped input frames between runs,
+   * or empty to disable the cache.  Entries are keyed on the input file's contents and
+   * the settings that affect preparation, so stale entries are never used.
+   */
+  std::string cacheDir{};
+};
+
 /**
  * Combine one or more JXLs into a single JXL.
  *
  * @param[in] mergeCfg Merge configuration, normally parsed from JSON file.
- * @param[in] fout Open stream where the result will be written.
- * @param[in] numThreads Number of threads to use, or 0 to decide automatically.
- * @param[in] autoCrop Trim fully-transparent borders (for alpha-blended frames) and
- *   all-zero borders (for kAdded frames), reducing the number of pixels without altering
- *   the appearance of the result.
- * @param[in] unPremultiplyAlpha Convert associated alpha to straight alpha. Required
- *   to be true if the inputs use a mixture of straight and associated alpha.
+ * @param[in] out Where the result will be written.
+ * @param[in] options Processing options.
+ */
+void merge(const MergeConfig& mergeCfg, EncoderOutput& out,
+           const MergeOptions& options = {});
+
+/**
+ * Identical to the EncoderOutput overload, but writes the result to @p fout.
+ */
+void merge(const MergeConfig& mergeCfg, std::ostream& fout,
+           const MergeOptions& options);
+
+/**
+ * Convenience overload taking the most common options individually.
+ * See MergeOptions for their meanings.
  */
 void merge(const MergeConfig& mergeCfg, std::ostream& fout, size_t numThreads = 0,
-           bool autoCrop = false, bool unPremultiplyAlpha = true);
+           bool autoCrop = false, bool unPremultiplyAlpha = true,
+           size_t prefetchFrames = 0, size_t maxMemory = 0);
 
 }  // namespace jxltk
 
@@ -5,6 +5,9 @@
  * license that can be found in the LICENSE file.
  */
 
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <filesystem>
 #include <fstream>
 #include <sstream>
@@ -14,14 +17,17 @@
 #include <jxlazy/decoder.h>
 
 #include "except.h"
+#include "framecache.h"
 #include "merge.h"
+#include "pixelalloc.h"
+#include "pixmap.h"
 #include "util.h"
 
 static std::string getPath(std::string_view s) {
   return std::string(JXLTK_TEST_DIR) + '/' + std::string(s);
 }
 
-TEST(Merge, AutoCrop) {
+static jxltk::MergeConfig loadCropTest() {
   jxltk::MergeConfig mergeCfg;
   {
     std::ifstream mergeJson(getPath("crop/croptest.json"), std::ios::binary);
@@ -35,6 +41,11 @@ TEST(Merge, AutoCrop) {
     if (inpPath.is_absolute()) continue;
     frameCfg.file = (jsonDir / inpPath).string();
   }
+  return mergeCfg;
+}
+
+TEST(Merge, AutoCrop) {
+  jxltk::MergeConfig mergeCfg = loadCropTest();
 
   std::string jxlBytes;
   {
@@ -92,6 +103,437 @@ TEST(Merge, AutoCrop) {
   EXPECT_EQ(frameInfo.header.layer_info.ysize, 32);
 }
 
+TEST(Pixmap, AutoCropStreaming) {
+  JxlPixelFormat format {
+    .num_channels = 4,
+    .data_type = JXL_TYPE_FLOAT,
+    .endianness = JXL_NATIVE_ENDIAN,
+    .align = 0,
+  };
+  // Decoding only the cropped region must give the same result as cropping in place
+  for (const char* name : {"crop/frame0_blend_+8+7.jxl", "crop/frame1_add_+0+0.jxl",
+                           "crop/frame2_add.jxl", "crop/frame3_blend.jxl"}) {
+    SCOPED_TRACE(name);
+    for (bool alphaCrop : {false, true}) {
+      jxltk::Pixmap inPlace(getPath(name), 0, format);
+      jxltk::Pixmap streamed(getPath(name), 0, format);
+      jxltk::CropRegion inPlaceCrop, streamedCrop;
+      bool inPlaceCropped = inPlace.autoCrop(alphaCrop, &inPlaceCrop, SIZE_MAX);
+      bool streamedCropped = streamed.autoCrop(alphaCrop, &streamedCrop, 0);
+      EXPECT_EQ(streamedCropped, inPlaceCropped);
+      EXPECT_EQ(streamedCrop.x0, inPlaceCrop.x0);
+      EXPECT_EQ(streamedCrop.y0, inPlaceCrop.y0);
+      EXPECT_EQ(streamedCrop.width, inPlaceCrop.width);
+      EXPECT_EQ(streamedCrop.height, inPlaceCrop.height);
+      ASSERT_EQ(streamed.getXsize(), inPlace.getXsize());
+      ASSERT_EQ(streamed.getYsize(), inPlace.getYsize());
+      ASSERT_EQ(streamed.getBufferSize(), inPlace.getBufferSize());
+      EXPECT_EQ(memcmp(streamed.data(), inPlace.data(), inPlace.getBufferSize()), 0);
+    }
+  }
+}
+
+TEST(Pixmap, LazyAlphaFill) {
+  JxlPixelFormat format {
+    .num_channels = 3,
+    .data_type = JXL_TYPE_FLOAT,
+    .endianness = JXL_NATIVE_ENDIAN,
+    .align = 0,
+  };
+  // Filling alpha before decoding must give the same result as filling it afterwards
+  for (const char* name : {"crop/frame0_blend_+8+7.jxl", "crop/frame2_add.jxl"}) {
+    SCOPED_TRACE(name);
+    for (float fill : {0.f, 0.5f, 1.f}) {
+      for (bool alphaCrop : {false, true}) {
+        jxltk::Pixmap lazy(getPath(name), 0, format);
+        jxltk::Pixmap eager(getPath(name), 0, format);
+        eager.ensureBuffered();
+        lazy.alphaFill(fill);
+        eager.alphaFill(fill);
+        EXPECT_EQ(lazy.getPixelFormat().num_channels, 4);
+        jxltk::CropRegion lazyCrop, eagerCrop;
+        EXPECT_EQ(lazy.autoCrop(alphaCrop, &lazyCrop),
+                  eager.autoCrop(alphaCrop, &eagerCrop));
+        EXPECT_EQ(lazyCrop.x0, eagerCrop.x0);
+        EXPECT_EQ(lazyCrop.y0, eagerCrop.y0);
+        EXPECT_EQ(lazyCrop.width, eagerCrop.width);
+        EXPECT_EQ(lazyCrop.height, eagerCrop.height);
+        ASSERT_EQ(lazy.getBufferSize(), eager.getBufferSize());
+        EXPECT_EQ(memcmp(lazy.data(), eager.data(), eager.getBufferSize()), 0);
+      }
+    }
+  }
+}
+
+TEST(Pixmap, PixelMemoryManager) {
+  struct Counts {
+    size_t allocs{0};
+    size_t frees{0};
+  } counts;
+  const JxlMemoryManager mm = {
+    .opaque = &counts,
+    .alloc = [](void* opaque, size_t size) {
+      ++static_cast<Counts*>(opaque)->allocs;
+      return malloc(size);
+    },
+    .free = [](void* opaque, void* address) {
+      if (address) ++static_cast<Counts*>(opaque)->frees;
+      free(address);
+    },
+  };
+  JxlPixelFormat format {
+    .num_channels = 3,
+    .data_type = JXL_TYPE_FLOAT,
+    .endianness = JXL_NATIVE_ENDIAN,
+    .align = 0,
+  };
+  {
+    jxltk::setPixelMemoryManager(&mm);
+    jxltk::Pixmap pixmap(getPath("crop/frame3_blend.jxl"), 0, format);
+    pixmap.ensureBuffered();
+    EXPECT_EQ(counts.allocs, 1);
+    // Changing the manager doesn't affect buffers that already exist
+    jxltk::setPixelMemoryManager(nullptr);
+    pixmap.addInterleavedAlpha();
+    EXPECT_EQ(counts.allocs, 1);
+    EXPECT_EQ(counts.frees, 1);
+  }
+  EXPECT_EQ(counts.frees, counts.allocs);
+}
+
+TEST(Merge, Prefetch) {
+  jxltk::MergeConfig mergeCfg = loadCropTest();
+
+  // Decoding frames ahead of time mustn't change the result, with or without autocrop
+  // (which modifies the frame settings while preparing each frame).
+  for (bool autoCrop : {false, true}) {
+    std::ostringstream sequential;
+    jxltk::merge(mergeCfg, sequential, 0, autoCrop);
+    for (size_t prefetch : {1, 2, 10}) {
+      std::ostringstream prefetched;
+      jxltk::merge(mergeCfg, prefetched, 0, autoCrop, true, prefetch);
+      EXPECT_EQ(sequential.str(), prefetched.str()) << "prefetch=" << prefetch
+                                                    << " autoCrop=" << autoCrop;
+    }
+  }
+}
+
+TEST(Merge, MaxMemory) {
+  jxltk::MergeConfig mergeCfg = loadCropTest();
+  // Copying boxes makes merge reopen closed inputs before the frames are written.
+  for (auto& frameCfg : mergeCfg.frames) {
+    frameCfg.copyBoxes = true;
+  }
+
+  std::ostringstream unlimited;
+  jxltk::merge(mergeCfg, unlimited, 0, true);
+  // A 1-byte budget forces every input to be closed and reopened on demand, and
+  // prevents any prefetching.
+  for (size_t prefetch : {0, 2}) {
+    std::ostringstream limited;
+    jxltk::merge(mergeCfg, limited, 0, true, true, prefetch, 1);
+    EXPECT_EQ(unlimited.str(), limited.str()) << "prefetch=" << prefetch;
+  }
+}
+
+TEST(Merge, DirectFileOutput) {
+  jxltk::MergeConfig mergeCfg = loadCropTest();
+  std::ostringstream viaStream;
+  jxltk::merge(mergeCfg, viaStream);
+
+  jxltk::TempFile tmp;
+  tmp.open();
+  tmp.close();
+  {
+    jxltk::EncoderOutput out(tmp.path.c_str());
+    jxltk::merge(mergeCfg, out);
+  }
+  std::vector<uint8_t> viaFile;
+  jxltk::loadFile(tmp.path, &viaFile);
+  EXPECT_EQ(viaStream.str(), std::string(viaFile.begin(), viaFile.end()));
+
+  EXPECT_THROW(jxltk::EncoderOutput("/nonexistent/dir/out.jxl"), jxltk::JxltkError);
+}
+
+TEST(Merge, Chunked) {
+  jxltk::MergeConfig mergeCfg = loadCropTest();
+  mergeCfg.frameDefaults.effort = 1;
+  jxltk::MergeOptions options;
+  options.chunked = true;
+  for (bool autoCrop : {false, true}) {
+    options.autoCrop = autoCrop;
+    std::string jxlBytes;
+    {
+      std::ostringstream oss;
+      jxltk::merge(mergeCfg, oss, options);
+      jxlBytes = oss.str();
+    }
+    // Chunked encoding may compress differently, but all the pixels must be intact.
+    jxlazy::Decoder chunked;
+    chunked.openMemory(reinterpret_cast<const uint8_t*>(jxlBytes.data()),
+                       jxlBytes.size(), jxlazy::DecoderFlag::NoCoalesce,
+                       jxlazy::DecoderHint::NoColorProfile);
+    std::ostringstream oss;
+    options.chunked = false;
+    jxltk::merge(mergeCfg, oss, options);
+    options.chunked = true;
+    std::string refBytes = oss.str();
+    jxlazy::Decoder reference;
+    reference.openMemory(reinterpret_cast<const uint8_t*>(refBytes.data()),
+                         refBytes.size(), jxlazy::DecoderFlag::NoCoalesce,
+                         jxlazy::DecoderHint::NoColorProfile);
+    EXPECT_TRUE(jxltk::haveSamePixels(chunked, reference)) << "autoCrop=" << autoCrop;
+  }
+}
+
+TEST(Merge, FrameCache) {
+  jxltk::MergeConfig mergeCfg = loadCropTest();
+  mergeCfg.frameDefaults.effort = 1;
+  jxltk::TempFile tmp;
+  tmp.open();
+  tmp.close();
+  const std::filesystem::path cacheDir = tmp.path + ".cache";
+  for (bool autoCrop : {false, true}) {
+    jxltk::MergeOptions options;
+    options.autoCrop = autoCrop;
+    std::ostringstream reference;
+    jxltk::merge(mergeCfg, reference, options);
+
+    // The first run fills the cache and the second reads from it; both must produce
+    // exactly what an uncached merge does.
+    options.cacheDir = cacheDir.string();
+    for (int run = 0; run < 2; ++run) {
+      std::ostringstream cached;
+      jxltk::merge(mergeCfg, cached, options);
+      EXPECT_EQ(cached.str(), reference.str()) << "autoCrop=" << autoCrop
+                                               << " run=" << run;
+      EXPECT_FALSE(std::filesystem::is_empty(cacheDir));
+    }
+  }
+  std::filesystem::remove_all(cacheDir);
+}
+
+TEST(Merge, FrameCacheDescribe) {
+  jxltk::TempFile tmp;
+  tmp.open();
+  tmp.file << "first";
+  tmp.close();
+  const std::filesystem::path cacheDir = tmp.path + ".cache";
+  {
+    jxltk::FrameCache cache(cacheDir);
+    jxltk::FrameCacheKey key;
+    key.file = tmp.path;
+    const std::string first = cache.describe(key);
+    EXPECT_EQ(cache.describe(key), first);
+    key.frameIndex = 1;
+    EXPECT_NE(cache.describe(key), first);
+    key.frameIndex = 0;
+
+    // A remembered hash isn't reused once the file changes
+    std::ofstream(tmp.path, std::ios::binary | std::ios::trunc) << "second";
+    EXPECT_NE(cache.describe(key), first);
+    EXPECT_EQ(cache.describe(key), jxltk::FrameCache(cacheDir).describe(key));
+  }
+  std::filesystem::remove_all(cacheDir);
+}
+
+TEST(Merge, ElideDuplicates) {
+  jxltk::MergeConfig mergeCfg;
+  mergeCfg.frameDefaults.effort = 1;
+  mergeCfg.frameDefaults.durationMs = 100;
+  for (const char* file : {"gray256_horizontal.jxl", "gray256_horizontal.jxl",
+                           "gray256_vertical.jxl", "gray256_vertical.jxl",
+                           "gray256_vertical.jxl", "gray256_horizontal.jxl"}) {
+    mergeCfg.frames.emplace_back().file = getPath(file);
+  }
+  jxltk::MergeOptions options;
+  std::string refBytes, elidedBytes;
+  {
+    std::ostringstream oss;
+    jxltk::merge(mergeCfg, oss, options);
+    refBytes = oss.str();
+  }
+  options.elideDuplicates = true;
+  {
+    std::ostringstream oss;
+    jxltk::merge(mergeCfg, oss, options);
+    elidedBytes = oss.str();
+  }
+  EXPECT_LT(elidedBytes.size(), refBytes.size());
+
+  jxlazy::Decoder elided;
+  elided.openMemory(reinterpret_cast<const uint8_t*>(elidedBytes.data()),
+                    elidedBytes.size(), jxlazy::DecoderFlag::NoCoalesce,
+                    jxlazy::DecoderHint::NoColorProfile);
+  ASSERT_EQ(elided.frameCount(), mergeCfg.frames.size());
+  for (size_t i = 0; i < elided.frameCount(); ++i) {
+    const JxlLayerInfo& layer = elided.getFrameInfo(i).header.layer_info;
+    bool repeat = i == 1 || i == 3 || i == 4;
+    EXPECT_EQ(layer.xsize, repeat ? 1 : 256) << "frame " << i;
+    EXPECT_EQ(layer.blend_info.blendmode, repeat ? JXL_BLEND_ADD : JXL_BLEND_REPLACE)
+        << "frame " << i;
+  }
+
+  // Coalesced, the animation is unchanged
+  jxlazy::Decoder reference, coalesced;
+  reference.openMemory(reinterpret_cast<const uint8_t*>(refBytes.data()),
+                       refBytes.size(), 0, jxlazy::DecoderHint::NoColorProfile);
+  coalesced.openMemory(reinterpret_cast<const uint8_t*>(elidedBytes.data()),
+                       elidedBytes.size(), 0, jxlazy::DecoderHint::NoColorProfile);
+  EXPECT_TRUE(jxltk::haveSamePixels(reference, coalesced));
+}
+
+/**
+ * Merge @p mergeCfg with default options and with @p options, check that both coalesce
+ * to the same pixels, and return the second file.
+ */
+static std::string mergeAndCompare(const jxltk::MergeConfig& mergeCfg,
+                                   const jxltk::MergeOptions& options) {
+  std::string refBytes, optBytes;
+  {
+    std::ostringstream oss;
+    jxltk::merge(mergeCfg, oss, jxltk::MergeOptions());
+    refBytes = oss.str();
+  }
+  {
+    std::ostringstream oss;
+    jxltk::merge(mergeCfg, oss, options);
+    optBytes = oss.str();
+  }
+  jxlazy::Decoder reference, coalesced;
+  reference.openMemory(reinterpret_cast<const uint8_t*>(refBytes.data()),
+                       refBytes.size(), 0, jxlazy::DecoderHint::NoColorProfile);
+  coalesced.openMemory(reinterpret_cast<const uint8_t*>(optBytes.data()),
+                       optBytes.size(), 0, jxlazy::DecoderHint::NoColorProfile);
+  EXPECT_TRUE(jxltk::haveSamePixels(reference, coalesced));
+  return optBytes;
+}
+
+TEST(Merge, ElideDuplicatesWithReferences) {
+  jxltk::MergeOptions options;
+  options.elideDuplicates = true;
+
+  // Reference 0 holds a different, zero-duration frame
+  jxltk::MergeConfig mergeCfg;
+  mergeCfg.frameDefaults.effort = 1;
+  mergeCfg.frameDefaults.durationMs = 100;
+  jxltk::FrameConfig& first = mergeCfg.frames.emplace_back();
+  first.file = getPath("gray256_vertical.jxl");
+  first.durationMs = 0;
+  for (int i = 0; i < 3; ++i) {
+    mergeCfg.frames.emplace_back().file = getPath("gray256_horizontal.jxl");
+  }
+  std::string bytes = mergeAndCompare(mergeCfg, options);
+  jxlazy::Decoder elided;
+  elided.openMemory(reinterpret_cast<const uint8_t*>(bytes.data()), bytes.size(),
+                    jxlazy::DecoderFlag::NoCoalesce, jxlazy::DecoderHint::NoColorProfile);
+  ASSERT_EQ(elided.frameCount(), mergeCfg.frames.size());
+  for (size_t i = 2; i < elided.frameCount(); ++i) {
+    const JxlLayerInfo& layer = elided.getFrameInfo(i).header.layer_info;
+    EXPECT_EQ(layer.xsize, 1) << "frame " << i;
+    EXPECT_NE(layer.blend_info.source, 0) << "frame " << i;
+  }
+
+  // Every frame is saved as reference 1 and blended onto it, as the command line does
+  mergeCfg.frames.erase(mergeCfg.frames.begin());
+  mergeCfg.frames.emplace_back().file = getPath("gray256_vertical.jxl");
+  mergeCfg.frames.emplace_back().file = getPath("gray256_vertical.jxl");
+  for (jxltk::FrameConfig& frameCfg : mergeCfg.frames) {
+    frameCfg.saveAsReference = 1;
+    frameCfg.blendSource = 1;
+  }
+  bytes = mergeAndCompare(mergeCfg, options);
+  elided.openMemory(reinterpret_cast<const uint8_t*>(bytes.data()), bytes.size(),
+                    jxlazy::DecoderFlag::NoCoalesce, jxlazy::DecoderHint::NoColorProfile);
+  ASSERT_EQ(elided.frameCount(), mergeCfg.frames.size());
+  for (size_t i = 0; i < elided.frameCount(); ++i) {
+    const JxlLayerInfo& layer = elided.getFrameInfo(i).header.layer_info;
+    bool repeat = i == 1 || i == 2 || i == 4;
+    EXPECT_EQ(layer.xsize, repeat ? 1 : 256) << "frame " << i;
+  }
+}
+
+TEST(Merge, DeltaCrop) {
+  jxltk::MergeConfig mergeCfg;
+  mergeCfg.frameDefaults.effort = 1;
+  mergeCfg.frameDefaults.durationMs = 100;
+  for (const char* file : {"gray256_horizontal.jxl", "gray256_h+v.jxl",
+                           "gray256_h+v.jxl", "gray256_h-v.jxl", "gray256_vertical.jxl",
+                           "gray256_v-h.jxl"}) {
+    mergeCfg.frames.emplace_back().file = getPath(file);
+  }
+  jxltk::MergeOptions options;
+  std::string refBytes, deltaBytes;
+  {
+    std::ostringstream oss;
+    jxltk::merge(mergeCfg, oss, options);
+    refBytes = oss.str();
+  }
+  options.deltaCrop = true;
+  {
+    std::ostringstream oss;
+    jxltk::merge(mergeCfg, oss, options);
+    deltaBytes = oss.str();
+  }
+
+  jxlazy::Decoder delta;
+  delta.openMemory(reinterpret_cast<const uint8_t*>(deltaBytes.data()),
+                   deltaBytes.size(), jxlazy::DecoderFlag::NoCoalesce,
+                   jxlazy::DecoderHint::NoColorProfile);
+  ASSERT_EQ(delta.frameCount(), mergeCfg.frames.size());
+  EXPECT_EQ(delta.getFrameInfo(0).header.layer_info.xsize, 256);
+  // An exact repeat is still elided
+  EXPECT_EQ(delta.getFrameInfo(2).header.layer_info.xsize, 1);
+
+  jxlazy::Decoder reference, coalesced;
+  reference.openMemory(reinterpret_cast<const uint8_t*>(refBytes.data()),
+                       refBytes.size(), 0, jxlazy::DecoderHint::NoColorProfile);
+  coalesced.openMemory(reinterpret_cast<const uint8_t*>(deltaBytes.data()),
+                       deltaBytes.size(), 0, jxlazy::DecoderHint::NoColorProfile);
+  EXPECT_TRUE(jxltk::haveSamePixels(reference, coalesced));
+}
+
+TEST(Merge, DeltaCropWithReferences) {
+  jxltk::MergeOptions options;
+  options.deltaCrop = true;
+
+  // Reference 0 holds a different, zero-duration frame
+  jxltk::MergeConfig mergeCfg;
+  mergeCfg.frameDefaults.effort = 1;
+  mergeCfg.frameDefaults.durationMs = 100;
+  jxltk::FrameConfig& first = mergeCfg.frames.emplace_back();
+  first.file = getPath("gray256_vertical.jxl");
+  first.durationMs = 0;
+  for (const char* file : {"gray256_horizontal.jxl", "gray256_h+v.jxl", "gray256_h+v.jxl",
+                           "gray256_h-v.jxl", "gray256_horizontal.jxl"}) {
+    mergeCfg.frames.emplace_back().file = getPath(file);
+  }
+  std::string bytes = mergeAndCompare(mergeCfg, options);
+  jxlazy::Decoder delta;
+  delta.openMemory(reinterpret_cast<const uint8_t*>(bytes.data()), bytes.size(),
+                   jxlazy::DecoderFlag::NoCoalesce, jxlazy::DecoderHint::NoColorProfile);
+  ASSERT_EQ(delta.frameCount(), mergeCfg.frames.size());
+  EXPECT_EQ(delta.getFrameInfo(3).header.layer_info.xsize, 1);
+  for (size_t i = 2; i < delta.frameCount(); ++i) {
+    const JxlLayerInfo& layer = delta.getFrameInfo(i).header.layer_info;
+    if (layer.xsize < 256 || layer.ysize < 256) {
+      EXPECT_NE(layer.blend_info.source, 0) << "frame " << i;
+    }
+  }
+
+  // Every frame is saved as reference 1 and blended onto it, as the command line does
+  mergeCfg.frames.erase(mergeCfg.frames.begin());
+  for (jxltk::FrameConfig& frameCfg : mergeCfg.frames) {
+    frameCfg.saveAsReference = 1;
+    frameCfg.blendSource = 1;
+  }
+  bytes = mergeAndCompare(mergeCfg, options);
+  delta.openMemory(reinterpret_cast<const uint8_t*>(bytes.data()), bytes.size(),
+                   jxlazy::DecoderFlag::NoCoalesce, jxlazy::DecoderHint::NoColorProfile);
+  ASSERT_EQ(delta.frameCount(), mergeCfg.frames.size());
+  EXPECT_EQ(delta.getFrameInfo(2).header.layer_info.xsize, 1);
+}
+
 template<class T>
 void assertLastChannelUniform(T* samples, uint32_t xsize, uint32_t ysize,
                               size_t numChannels, T expect) {
@@ -5,6 +5,7 @@
  * license that can be found in the LICENSE file.
  */
 #include <cinttypes>
+#include <filesystem>
 #include <iomanip>
 #include <sstream>
 
@@ -688,6 +689,22 @@ bool MergeConfig::toJson(ostream& to, bool full /*=false*/) const {
   return true;
 }
 
+void MergeConfig::resolvePaths(const std::string& dir) {
+  const std::filesystem::path base(dir);
+  for (auto& box : boxes) {
+    if (!box.file || box.file->empty()) continue;
+    std::filesystem::path boxPath(*box.file);
+    if (boxPath.is_absolute()) continue;
+    *box.file = (base / boxPath).string();
+  }
+  for (auto& frameConfig : frames) {
+    if (!frameConfig.file || frameConfig.file->empty()) continue;
+    std::filesystem::path inpPath(*frameConfig.file);
+    if (inpPath.is_absolute()) continue;
+    frameConfig.file = (base / inpPath).string();
+  }
+}
+
 void MergeConfig::normalize() {
   if (brotliEffort && *brotliEffort == -1) {
     brotliEffort.reset();
@@ -140,6 +140,12 @@ struct MergeConfig {
    */
   bool toJson(std::ostream& to, bool full = false) const;
 
+  /**
+   * Make relative frame and box file paths relative to @p dir instead of the current
+   * directory.  Used when the config was read from a file in @p dir.
+   */
+  void resolvePaths(const std::string& dir);
+
   /**
    * Find optional fields that are set to -1, meaning "use the library default",
    * and unset these fields, since passing -1 to the encoder doesn't work.
@@ -0,0 +1,153 @@
+/**
+ * Copyright (c) Alistair Barrow. All rights reserved.
+ *
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file.
+ */
+
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <numeric>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include <jxlazy/decoder.h>
+
+#include "add.h"
+#include "bench_util.h"
+#include "merge.h"
+#include "mergeconfig.h"
+#include "split.h"
+#include "util.h"
+
+// End-to-end operations on synthetic files, generated on first use in a temporary
+// directory.  Generating them isn't timed.
+
+static const JxlPixelFormat kRGBA8 = {4, JXL_TYPE_UINT8, JXL_NATIVE_ENDIAN, 0};
+static const JxlPixelFormat kRGBAFloat = {4, JXL_TYPE_FLOAT, JXL_NATIVE_ENDIAN, 0};
+
+static jxltk::SyntheticCorpus& corpus() {
+  static jxltk::SyntheticCorpus instance;
+  return instance;
+}
+
+enum class AccessOrder { Sequential, Reverse, Random };
+
+static void BM_DecoderFrameAccess(benchmark::State& state) {
+  const auto order = static_cast<AccessOrder>(state.range(0));
+  const size_t numFrames = static_cast<size_t>(state.range(1));
+  const uint32_t size = 256;
+  const std::string& file = corpus().get(size, size, numFrames, kRGBA8);
+  std::vector<size_t> frames(numFrames);
+  std::iota(frames.begin(), frames.end(), 0);
+  if (order == AccessOrder::Reverse) {
+    std::reverse(frames.begin(), frames.end());
+  } else if (order == AccessOrder::Random) {
+    std::shuffle(frames.begin(), frames.end(), std::mt19937(1234));
+  }
+  std::vector<uint8_t> buffer(jxlazy::Decoder::getFrameBufferSize(size, size, kRGBA8));
+
+  for (auto _ : state) {
+    jxlazy::Decoder dec;
+    dec.openFile(file.c_str(), jxlazy::DecoderFlag::NoCoalesce,
+                 jxlazy::DecoderHint::MapFile | jxlazy::DecoderHint::NoColorProfile);
+    for (size_t frame : frames) {
+      dec.getFramePixels(frame, kRGBA8, buffer.data(), buffer.size());
+    }
+    benchmark::ClobberMemory();
+  }
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations() * numFrames));
+}
+BENCHMARK(BM_DecoderFrameAccess)
+    ->ArgNames({"order", "frames"})
+    ->ArgsProduct({{0, 1, 2}, {8, 32}})
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+
+static void BM_Merge(benchmark::State& state) {
+  const uint32_t size = static_cast<uint32_t>(state.range(0));
+  const size_t numFrames = static_cast<size_t>(state.range(1));
+  const std::string& file = corpus().get(size, size, numFrames, kRGBA8, size / 8);
+  jxltk::MergeConfig mergeCfg;
+  mergeCfg.frameDefaults.effort = 1;
+  mergeCfg.frameDefaults.file = file;
+  mergeCfg.frameDefaults.durationTicks = 1;
+  for (size_t i = 0; i < numFrames; ++i) {
+    mergeCfg.frames.emplace_back().frameIndex = i;
+  }
+  jxltk::MergeOptions options;
+  options.autoCrop = state.range(2) != 0;
+  for (auto _ : state) {
+    std::ostringstream out;
+    jxltk::merge(mergeCfg, out, options);
+    benchmark::DoNotOptimize(out.tellp());
+  }
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations() * numFrames));
+}
+BENCHMARK(BM_Merge)
+    ->ArgNames({"size", "frames", "crop"})
+    ->ArgsProduct({{256, 1024}, {8}, {0, 1}})
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+
+static void BM_Split(benchmark::State& state) {
+  const uint32_t size = static_cast<uint32_t>(state.range(0));
+  const size_t numFrames = static_cast<size_t>(state.range(1));
+  const std::string& file = corpus().get(size, size, numFrames, kRGBA8);
+  const std::string outDir =
+      (std::filesystem::path(corpus().dir()) / "split_out").string();
+  jxltk::FrameConfig frameCfg;
+  frameCfg.effort = 1;
+  for (auto _ : state) {
+    jxltk::split(file, outDir, false, 0, frameCfg);
+    state.PauseTiming();
+    std::filesystem::remove_all(outDir);
+    state.ResumeTiming();
+  }
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations() * numFrames));
+}
+BENCHMARK(BM_Split)
+    ->ArgNames({"size", "frames"})
+    ->ArgsProduct({{256, 1024}, {8}})
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+
+static void BM_AddOrSubtract(benchmark::State& state) {
+  const uint32_t size = static_cast<uint32_t>(state.range(0));
+  const std::string& file = corpus().get(size, size, 1, kRGBAFloat);
+  jxltk::FrameConfig frameCfg;
+  frameCfg.effort = 1;
+  for (auto _ : state) {
+    jxlazy::Decoder left, right;
+    left.openFile(file.c_str(), 0, jxlazy::DecoderHint::MapFile);
+    right.openFile(file.c_str(), 0, jxlazy::DecoderHint::MapFile);
+    jxltk::addOrSubtract(left, right, false, nullptr, frameCfg);
+  }
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations() * size * size));
+}
+BENCHMARK(BM_AddOrSubtract)->Arg(256)->Arg(1024)->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+
+static void BM_HaveSamePixels(benchmark::State& state) {
+  const uint32_t size = static_cast<uint32_t>(state.range(0));
+  const size_t numFrames = static_cast<size_t>(state.range(1));
+  const std::string& file = corpus().get(size, size, numFrames, kRGBAFloat);
+  for (auto _ : state) {
+    jxlazy::Decoder left, right;
+    left.openFile(file.c_str(), 0, jxlazy::DecoderHint::MapFile);
+    right.openFile(file.c_str(), 0, jxlazy::DecoderHint::MapFile);
+    benchmark::DoNotOptimize(jxltk::haveSamePixels(left, right));
+  }
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations() * numFrames * size *
+                                               size));
+}
+BENCHMARK(BM_HaveSamePixels)
+    ->ArgNames({"size", "frames"})
+    ->ArgsProduct({{256, 1024}, {1, 8}})
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
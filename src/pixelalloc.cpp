@@ -0,0 +1,44 @@
+/*
+ * Copyright (c) Alistair Barrow. All rights reserved.
+ *
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file.
+ */
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+#include "pixelalloc.h"
+
+namespace jxltk {
+
+namespace {
+std::atomic<const JxlMemoryManager*> currentMemManager{nullptr};
+}  // namespace
+
+void setPixelMemoryManager(const JxlMemoryManager* memManager) {
+  currentMemManager.store(memManager);
+}
+
+const JxlMemoryManager* pixelMemoryManager() {
+  return currentMemManager.load(std::memory_order_relaxed);
+}
+
+void PixelDeleter::operator()(void* pixels) const noexcept {
+  if (memManager) {
+    memManager->free(memManager->opaque, pixels);
+  } else {
+    free(pixels);
+  }
+}
+
+PixelPtr allocPixels(size_t size) {
+  const JxlMemoryManager* memManager = pixelMemoryManager();
+  void* pixels = memManager ? memManager->alloc(memManager->opaque, size) : malloc(size);
+  if (!pixels && size != 0) {
+    throw std::bad_alloc();
+  }
+  return {pixels, PixelDeleter{memManager}};
+}
+
+}  // namespace jxltk
@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) Alistair Barrow. All rights reserved.
+ *
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file.
+ */
+#ifndef JXLTK_PIXELALLOC_H_
+#define JXLTK_PIXELALLOC_H_
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+#include <jxl/memory_manager.h>
+
+#include "../contrib/jxlazy/include/jxlazy/decoder.h"
+
+namespace jxltk {
+
+/**
+ * Set the memory manager used for frame-sized pixel buffers: Pixmap buffers (via
+ * makePixelPtr) and the decoded frames in `add`, `subtract` and `compare`.  This can
+ * be an arena, huge-page or pooling allocator.  nullptr (the default) means `malloc`
+ * and `free`.
+ *
+ * Buffers remember the manager that allocated them, so changing it later only affects
+ * new allocations.  The manager must outlive every buffer allocated from it.
+ */
+void setPixelMemoryManager(const JxlMemoryManager* memManager);
+
+/**
+ * Return the memory manager set by setPixelMemoryManager, or nullptr.
+ */
+const JxlMemoryManager* pixelMemoryManager();
+
+template<class T>
+using PixelAllocator = jxlazy::MemoryManagerAllocator<T>;
+
+template<class T>
+using PixelVector = std::vector<T, PixelAllocator<T> >;
+
+template<class T>
+using PixelFrame = jxlazy::FramePixels<T, PixelAllocator<T> >;
+
+/**
+ * Return an allocator that uses the current pixelMemoryManager().
+ */
+template<class T>
+PixelAllocator<T> pixelAllocator() {
+  return PixelAllocator<T>(pixelMemoryManager());
+}
+
+/**
+ * Return an empty PixelFrame whose buffers will use the current pixelMemoryManager().
+ */
+template<class T>
+PixelFrame<T> makePixelFrame() {
+  return {.color = PixelVector<T>(pixelAllocator<T>()), .ecs{}};
+}
+
+/**
+ * Frees a PixelPtr's buffer with the memory manager that allocated it.
+ */
+struct PixelDeleter {
+  const JxlMemoryManager* memManager{nullptr};
+  void operator()(void* pixels) const noexcept;
+};
+
+using PixelPtr = std::unique_ptr<void, PixelDeleter>;
+
+/**
+ * Allocate @p size bytes from the current pixelMemoryManager().  Throws std::bad_alloc
+ * on failure.
+ */
+PixelPtr allocPixels(size_t size);
+
+}  // namespace jxltk
+
+#endif  // JXLTK_PIXELALLOC_H_
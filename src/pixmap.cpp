@@ -4,6 +4,7 @@
  * Use of this source code is governed by an MIT-style
  * license that can be found in the LICENSE file.
  */
+#include <algorithm>
 #include <cassert>
 #include <cerrno>
 #include <cinttypes>
@@ -14,18 +15,22 @@
 #include <cstring>
 #include <fstream>
 #include <iostream>
+#include <optional>
 #include <span>
 #include <string>
 #include <vector>
 
+#include "common.h"
 #include "enums.h"
 #include "except.h"
 #include "pixmap.h"
+#include "simd.h"
 #include "util.h"
 
 using std::ifstream;
 using std::istream;
 using std::ofstream;
+using std::optional;
 using std::ostream;
 using std::pair;
 using std::span;
@@ -103,6 +108,12 @@ size_t addInterleavedChannel(const void* pOldSamples, void* pNewSamples, size_t
                                  init, format.num_channels, format.align,
                                  xsize, ysize, index);
   }
+  if (format.data_type == JXL_TYPE_FLOAT16) {
+    return addInterleavedChannel(static_cast<const Float16*>(pOldSamples),
+                                 static_cast<Float16*>(pNewSamples), outMax,
+                                 floatToHalf(init), format.num_channels, format.align,
+                                 xsize, ysize, index);
+  }
   throw JxltkError("Unsupported data type");
 }
 
@@ -130,11 +141,29 @@ void setInterleavedChannel(void* samples, uint32_t numChannels, JxlDataType data
   } else if (dataType == JXL_TYPE_FLOAT) {
     setInterleavedChannel<float>(static_cast<float*>(samples), numChannels, xsize,
                                  ysize, init, channelIndex);
+  } else if (dataType == JXL_TYPE_FLOAT16) {
+    setInterleavedChannel<Float16>(static_cast<Float16*>(samples), numChannels, xsize,
+                                   ysize, floatToHalf(init), channelIndex);
   } else {
     throw JxltkError("Unsupported data type");
   }
 }
 
+/**
+ * Return whether @p value is stored as 0 in samples of type @p dataType.
+ */
+bool isZeroSample(float value, JxlDataType dataType) {
+  if (dataType == JXL_TYPE_UINT8) {
+    return roundf(value * 255.f) == 0.f;
+  }
+  if (dataType == JXL_TYPE_UINT16) {
+    return roundf(value * 65535.f) == 0.f;
+  }
+  if (dataType == JXL_TYPE_FLOAT16) {
+    return (static_cast<uint16_t>(floatToHalf(value)) & 0x7fff) == 0;
+  }
+  return value == 0.f;
+}
 
 /**
  * Throw an exception if @p bytes is less than the minimum required buffer size.
@@ -155,10 +184,10 @@ bool isFullyOpaque(const T* inSamples, const JxlPixelFormat& format,
     return true;
   }
   size_t _;
-  const T* row = inSamples;
+  const char* row = reinterpret_cast<const char*>(inSamples);
   size_t stride = jxlazy::Decoder::getRowStride(xsize, format, &_);
   for (uint32_t y = 0; y < ysize; ++y) {
-    const T* sample = row + format.num_channels - 1;
+    const T* sample = reinterpret_cast<const T*>(row) + format.num_channels - 1;
     for (uint32_t x = 0; x < xsize; ++x) {
       if (*sample != fullOpacity)
         return false;
@@ -170,12 +199,28 @@ bool isFullyOpaque(const T* inSamples, const JxlPixelFormat& format,
 }
 
 
+/**
+ * Grow @p region, if set, to include @p add.  If @p region isn't set, set it to @p add.
+ */
+void unionCropRegion(std::optional<CropRegion>* region, const CropRegion& add) {
+  if (!*region) {
+    *region = add;
+    return;
+  }
+  CropRegion& r = **region;
+  uint32_t x1 = std::max(r.x0 + r.width, add.x0 + add.width);
+  uint32_t y1 = std::max(r.y0 + r.height, add.y0 + add.height);
+  r.x0 = std::min(r.x0, add.x0);
+  r.y0 = std::min(r.y0, add.y0);
+  r.width = x1 - r.x0;
+  r.height = y1 - r.y0;
+}
+
 }  // namespace
 
 
 PixelPtr makePixelPtr(uint32_t xsize, uint32_t ysize, const JxlPixelFormat &format) {
-  size_t size = jxlazy::Decoder::getFrameBufferSize(xsize, ysize, format);
-  return {malloc(size), free};
+  return allocPixels(jxlazy::Decoder::getFrameBufferSize(xsize, ysize, format));
 }
 
 /*static */Pixmap Pixmap::blackPixel(const JxlPixelFormat& format) {
@@ -193,22 +238,28 @@ Pixmap::Pixmap(uint32_t xsize, uint32_t ysize, const JxlPixelFormat& format,
   setPixelsMove(xsize, ysize, format, std::move(pixels));
 }
 
-Pixmap::Pixmap(std::string filename, size_t frameIdx, const JxlPixelFormat& format) {
-  setPixelsFile(std::move(filename), frameIdx, format);
+Pixmap::Pixmap(std::string filename, size_t frameIdx, const JxlPixelFormat& format,
+               uint32_t decoderFlags, uint32_t decoderHints) {
+  setPixelsFile(std::move(filename), frameIdx, format, decoderFlags, decoderHints);
 }
 
 Pixmap::Pixmap(std::unique_ptr<jxlazy::Decoder>&& decoder, size_t frameIdx,
-               const JxlPixelFormat& format) {
-  setPixelsDecoder(std::move(decoder), frameIdx, format);
+               const JxlPixelFormat& format, std::string filename,
+               uint32_t decoderFlags, uint32_t decoderHints) {
+  setPixelsDecoder(std::move(decoder), frameIdx, format, std::move(filename),
+                   decoderFlags, decoderHints);
 }
 
 void Pixmap::close_() {
   pixels_.reset();
+  alphaFill_.reset();
   xsize_ = 0;
   ysize_ = 0;
   pixelFormat_ = kDefaultPixelFormat;
   filename_.clear();
   decoderFrameIdx_ = 0;
+  decoderFlags_ = 0;
+  decoderHints_ = jxlazy::DecoderHint::MapFile;
 }
 
 void Pixmap::close() {
@@ -234,16 +285,44 @@ void Pixmap::alphaFill(float fill) {
       return;
     }
   } else {
+    // Decode straight into the format with alpha, and fill it when the pixels are
+    // decoded.  Until then, autoCrop can use the known alpha value.
     if (pixelFormat_.num_channels != 2 && pixelFormat_.num_channels != 4) {
       ++pixelFormat_.num_channels;
     }
-    ensureBuffered();
+    alphaFill_ = fill;
+    return;
   }
   setInterleavedChannel(pixels_.get(), pixelFormat_.num_channels, pixelFormat_.data_type,
                         xsize_, ysize_, fill, pixelFormat_.num_channels - 1);
 }
 
-bool Pixmap::autoCrop(bool alphaCrop, CropRegion* crop) {
+void Pixmap::applyAlphaFill_(void* pixels, uint32_t xsize, uint32_t ysize) const {
+  if (alphaFill_) {
+    setInterleavedChannel(pixels, pixelFormat_.num_channels, pixelFormat_.data_type,
+                          xsize, ysize, *alphaFill_, pixelFormat_.num_channels - 1);
+  }
+}
+
+bool Pixmap::autoCrop(bool alphaCrop, CropRegion* crop, size_t minStreamingBytes) {
+  if (!pixels_ && alphaFill_) {
+    // Every pixel will have the same alpha, so the crop might not depend on the pixels
+    const bool transparent = isZeroSample(*alphaFill_, pixelFormat_.data_type);
+    if (alphaCrop && transparent) {
+      *crop = {.width = 0, .height = 0, .x0 = 0, .y0 = 0};
+      pixels_ = makePixelPtr(1, 1, pixelFormat_);
+      memset(pixels_.get(), 0, jxlazy::Decoder::getFrameBufferSize(1, 1, pixelFormat_));
+      xsize_ = ysize_ = 1;
+      return true;
+    }
+    if (!transparent) {
+      *crop = {.width = getXsize(), .height = getYsize(), .x0 = 0, .y0 = 0};
+      return false;
+    }
+  }
+  if (!pixels_ && !alphaFill_ && getBufferSize() >= minStreamingBytes) {
+    return autoCropStreaming_(alphaCrop, crop);
+  }
   ensureBuffered();
   findCropRegion(pixels_.get(), xsize_, ysize_, pixelFormat_.data_type,
                  pixelFormat_.num_channels, alphaCrop, crop);
@@ -264,12 +343,97 @@ bool Pixmap::autoCrop(bool alphaCrop, CropRegion* crop) {
   return false;
 }
 
+void Pixmap::crop(const CropRegion& region) {
+  ensureBuffered();
+  if (cropInPlace(pixels_.get(), xsize_, ysize_, pixelFormat_.data_type,
+                  pixelFormat_.num_channels, region) != 0) {
+    throw JxltkError("%s: Invalid crop region", __func__);
+  }
+  xsize_ = region.width;
+  ysize_ = region.height;
+}
+
+bool Pixmap::autoCropStreaming_(bool alphaCrop, CropRegion* crop) {
+  ensureDecoder_();
+  const uint32_t xsize = getXsize();
+  const uint32_t ysize = getYsize();
+
+  // First pass: find the crop region one row at a time.  Each decoder thread grows its
+  // own region, and they're combined at the end.
+  vector<optional<CropRegion> > threadRegions;
+  jxlazy::PixelRowHandler handler;
+  handler.init = [&threadRegions](size_t numThreads, size_t) {
+    threadRegions.assign(numThreads, std::nullopt);
+  };
+  handler.row = [&](size_t threadId, size_t x, size_t y, size_t numPixels,
+                    const void* pixels) {
+    uint32_t begin, end;
+    if (findNonZeroSpan(pixels, static_cast<uint32_t>(numPixels), pixelFormat_.data_type,
+                        pixelFormat_.num_channels, alphaCrop, &begin, &end) != 0) {
+      throw JxltkError("%s: Failed to find crop region", __func__);
+    }
+    if (begin == end) {
+      return;
+    }
+    CropRegion rowRegion = {.width = end - begin, .height = 1,
+                            .x0 = static_cast<uint32_t>(x) + begin,
+                            .y0 = static_cast<uint32_t>(y)};
+    unionCropRegion(&threadRegions.at(threadId), rowRegion);
+  };
+  decoder_->getFramePixelRows(decoderFrameIdx_, pixelFormat_, handler);
+
+  optional<CropRegion> region;
+  for (const optional<CropRegion>& threadRegion : threadRegions) {
+    if (threadRegion) {
+      unionCropRegion(&region, *threadRegion);
+    }
+  }
+
+  if (!region) {
+    // Replace frame with 1x1 black pixel
+    *crop = {.width = 0, .height = 0, .x0 = 0, .y0 = 0};
+    pixels_ = makePixelPtr(1, 1, pixelFormat_);
+    memset(pixels_.get(), 0, getBufferSize());
+    xsize_ = ysize_ = 1;
+    return true;
+  }
+  *crop = *region;
+  if (crop->width == xsize && crop->height == ysize) {
+    // Nothing to crop; the pixels will be decoded normally when needed
+    return false;
+  }
+
+  // Second pass: keep only the pixels in the crop region.
+  PixelPtr cropped = makePixelPtr(crop->width, crop->height, pixelFormat_);
+  decoder_->getFramePixelRegion(decoderFrameIdx_, pixelFormat_, crop->x0, crop->y0,
+                                crop->width, crop->height, cropped.get(),
+                                jxlazy::Decoder::getFrameBufferSize(crop->width,
+                                                                    crop->height,
+                                                                    pixelFormat_));
+  applyAlphaFill_(cropped.get(), crop->width, crop->height);
+  pixels_ = std::move(cropped);
+  xsize_ = crop->width;
+  ysize_ = crop->height;
+  return true;
+}
 
 std::unique_ptr<jxlazy::Decoder> Pixmap::releaseDecoder() {
   close_();
   return std::move(decoder_);
 }
 
+bool Pixmap::closeDecoder() {
+  if (!decoder_ || filename_.empty()) {
+    return false;
+  }
+  decoder_.reset();
+  return true;
+}
+
+bool Pixmap::hasOpenDecoder() const {
+  return static_cast<bool>(decoder_);
+}
+
 void Pixmap::setPixelsCopy(uint32_t xsize, uint32_t ysize, const JxlPixelFormat& format,
                           const void* pixels, size_t size) {
   validateSize(xsize, ysize, format, size);
@@ -277,6 +441,7 @@ void Pixmap::setPixelsCopy(uint32_t xsize, uint32_t ysize, const JxlPixelFormat&
   xsize_ = xsize;
   ysize_ = ysize;
   pixelFormat_ = format;
+  alphaFill_.reset();
   filename_.clear();
   decoder_.reset();
   memcpy(pixels_.get(), pixels, size);
@@ -288,30 +453,41 @@ void Pixmap::setPixelsMove(uint32_t xsize, uint32_t ysize, const JxlPixelFormat&
   xsize_ = xsize;
   ysize_ = ysize;
   pixelFormat_ = format;
+  alphaFill_.reset();
   filename_.clear();
   decoder_.reset();
 }
 
 void Pixmap::setPixelsFile(std::string filename, size_t frameIdx,
-                           const JxlPixelFormat& format) {
+                           const JxlPixelFormat& format, uint32_t decoderFlags,
+                           uint32_t decoderHints) {
   pixels_.reset();
   xsize_ = 0;
   ysize_ = 0;
   pixelFormat_ = format;
+  alphaFill_.reset();
   filename_ = std::move(filename);
-  decoder_ = std::make_unique<jxlazy::Decoder>();
+  // Opened on demand by ensureDecoder_
+  decoder_.reset();
   decoderFrameIdx_ = frameIdx;
+  decoderFlags_ = decoderFlags;
+  decoderHints_ = decoderHints;
 }
 
 void Pixmap::setPixelsDecoder(std::unique_ptr<jxlazy::Decoder>&& decoder,
-                              size_t frameIdx, const JxlPixelFormat& format) {
+                              size_t frameIdx, const JxlPixelFormat& format,
+                              std::string filename, uint32_t decoderFlags,
+                              uint32_t decoderHints) {
   pixels_.reset();
   xsize_ = 0;
   ysize_ = 0;
   pixelFormat_ = format;
-  filename_.clear();
+  alphaFill_.reset();
+  filename_ = std::move(filename);
   decoder_ = std::move(decoder);
   decoderFrameIdx_ = frameIdx;
+  decoderFlags_ = decoderFlags;
+  decoderHints_ = decoderHints;
 }
 
 bool Pixmap::addInterleavedAlpha() {
@@ -361,6 +537,10 @@ bool Pixmap::addInterleavedAlpha() {
     return jxltk::isFullyOpaque(reinterpret_cast<const float*>(pixels),
                                 format, xsize, ysize, 1.f);
   }
+  if (format.data_type == JXL_TYPE_FLOAT16) {
+    return jxltk::isFullyOpaque(reinterpret_cast<const Float16*>(pixels),
+                                format, xsize, ysize, floatToHalf(1.f));
+  }
   throw NotImplemented(
         "Checking for opacity for this data type (%s) is not implemented",
         dataTypeName(format.data_type));
@@ -383,8 +563,9 @@ void Pixmap::ensureDecoder_() const {
     if (filename_.empty()) {
       throw JxltkError("No pixels buffered, and no file to read pixels from");
     }
-    decoder_ = std::make_unique<jxlazy::Decoder>();
-    decoder_->openFile(filename_.c_str());
+    auto decoder = std::make_unique<jxlazy::Decoder>(makeDecoder());
+    decoder->openFile(filename_.c_str(), decoderFlags_, decoderHints_);
+    decoder_ = std::move(decoder);
   }
 }
 
@@ -398,6 +579,7 @@ void Pixmap::ensureBuffered() const {
   pixels_ = makePixelPtr(xsize_, ysize_, pixelFormat_);
   size_t size = getBufferSize();
   decoder_->getFramePixels(decoderFrameIdx_, pixelFormat_, pixels_.get(), size);
+  applyAlphaFill_(pixels_.get(), xsize_, ysize_);
 }
 
 const JxlPixelFormat& Pixmap::getPixelFormat() const {
@@ -409,6 +591,7 @@ void Pixmap::setPixelFormat(const JxlPixelFormat &format) {
     throw jxltk::JxltkError("Too late to set pixel format");
   }
   pixelFormat_ = format;
+  alphaFill_.reset();
 }
 
 uint32_t Pixmap::getXsize() const {
@@ -464,7 +647,7 @@ PixelPtr&& Pixmap::releasePixels() {
 }
 
 bool Pixmap::sourceHasAlpha() {
-  if (pixels_ && !decoder_) {
+  if (pixels_ && !decoder_ && filename_.empty()) {
     return pixelFormat_.num_channels == 2 || pixelFormat_.num_channels == 4;
   }
   ensureDecoder_();
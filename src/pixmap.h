@@ -8,11 +8,13 @@
 #define JXLTK_PIXMAP_H_
 
 #include <memory>
+#include <optional>
 #include <ostream>
 
 #include <jxl/encode.h>
 
 #include "../contrib/jxlazy/include/jxlazy/decoder.h"
+#include "pixelalloc.h"
 #include "util.h"
 
 namespace jxltk {
@@ -24,12 +26,11 @@ constexpr JxlPixelFormat kDefaultPixelFormat = {
   .align = 0,
 };
 
-using PixelPtr = std::unique_ptr<void, void(*)(void*)>;
-
 /**
  * Allocate a buffer for pixels and return a std::unique_ptr to it.
  *
- * Memory is allocated using `malloc` and automatically deallocated later using `free`.
+ * Memory comes from pixelMemoryManager() (`malloc` by default) and is automatically
+ * returned to the same manager later.
  */
 PixelPtr makePixelPtr(uint32_t xsize, uint32_t ysize, const JxlPixelFormat& format);
 
@@ -81,11 +82,23 @@ class Pixmap {
    *
    * @param[in] filename Path to the file to read (must be JXL)
    * @param[in] frameIdx Index of the (coalesced) frame to decode.
+   * @param[in] decoderFlags,decoderHints Passed to jxlazy::Decoder::openFile.
    */
-  Pixmap(std::string filename, size_t frameIdx, const JxlPixelFormat& format);
+  Pixmap(std::string filename, size_t frameIdx, const JxlPixelFormat& format,
+         uint32_t decoderFlags = 0,
+         uint32_t decoderHints = jxlazy::DecoderHint::MapFile);
 
+  /**
+   * Construct a Pixmap that decodes its pixels from an already-open Decoder.
+   *
+   * If @p filename is given, it must be the file @p decoder was opened from, using
+   * @p decoderFlags and @p decoderHints.  This lets the Decoder be closed with
+   * @ref closeDecoder and reopened later when needed.
+   */
   Pixmap(std::unique_ptr<jxlazy::Decoder>&& decoder, size_t frameIdx,
-         const JxlPixelFormat& format);
+         const JxlPixelFormat& format, std::string filename = {},
+         uint32_t decoderFlags = 0,
+         uint32_t decoderHints = jxlazy::DecoderHint::MapFile);
 
   Pixmap(Pixmap&& move) = default;
   Pixmap& operator=(Pixmap&& move) = default;
@@ -99,26 +112,55 @@ class Pixmap {
   void close();
 
   /**
-   * Buffer all pixels and set all alpha samples to @p fill.
+   * Set all alpha samples to @p fill, adding an alpha channel to the pixel format if
+   * necessary.
+   *
+   * If the pixels haven't been decoded yet, this only changes the pixel format, and
+   * the fill is applied when they are, so no second buffer or copy is needed.  Frames
+   * that are already buffered without alpha are copied to a new buffer.
    *
    * @param[in] fill The desired alpha value, with nominal range [0..1] (regardless
    *   of what pixel format we're using).
    */
   void alphaFill(float fill);
 
+  /**
+   * Frames at least this large (in bytes, uncropped) are auto-cropped without buffering
+   * the whole frame.  Below this, decoding once and cropping in place is cheaper than
+   * decoding twice.
+   */
+  static constexpr size_t kMinStreamingCropBytes = size_t{64} << 20;
+
   /**
    * Buffer all pixels and crop borders.
    *
    * If the crop would remove all pixels, this frame becomes a single pixel with all
    * samples set to 0, and @p crop will have width = height = 0 on return.
    *
+   * If the pixels haven't been decoded yet and the uncropped frame would need at least
+   * @p minStreamingBytes, the frame is first decoded row by row to find the crop region,
+   * then decoded again keeping only that region.  This avoids ever holding the uncropped
+   * frame in memory.
+   *
+   * After alphaFill on undecoded pixels, a nonzero fill means nothing can be cropped,
+   * and a zero fill with @p alphaCrop means everything is cropped; neither needs to
+   * decode anything.
+   *
    * @param[in] alphaCrop If true, crop borders where alpha = 0, else crop borders where
    *   every channel is 0.
    * @param[out] crop The region of pixels remaining.
+   * @param[in] minStreamingBytes Size threshold for decoding only the cropped region.
    *
    * @return Whether any crop was applied.
    */
-  bool autoCrop(bool alphaCrop, CropRegion* crop);
+  bool autoCrop(bool alphaCrop, CropRegion* crop,
+                size_t minStreamingBytes = kMinStreamingCropBytes);
+
+  /**
+   * Buffer all pixels and crop them to @p region, which must be a non-empty part of the
+   * frame.
+   */
+  void crop(const CropRegion& region);
 
   /**
    * Identical to @ref close, but IF this object owns a Decoder,
@@ -127,6 +169,19 @@ class Pixmap {
    */
   std::unique_ptr<jxlazy::Decoder> releaseDecoder();
 
+  /**
+   * Destroy the internal Decoder (freeing its input buffer and file handle), if it
+   * can be reopened later from a file name.  Any buffered pixels are kept.
+   *
+   * @return Whether a Decoder was closed.
+   */
+  bool closeDecoder();
+
+  /**
+   * Return whether this object currently holds an open Decoder.
+   */
+  bool hasOpenDecoder() const;
+
   /**
    * Return the pixel format currently being used to store the pixels in this object.
    */
@@ -157,10 +212,13 @@ class Pixmap {
                      PixelPtr&& pixels);
 
   void setPixelsFile(std::string filename, size_t frameIdx,
-                     const JxlPixelFormat& format);
+                     const JxlPixelFormat& format, uint32_t decoderFlags = 0,
+                     uint32_t decoderHints = jxlazy::DecoderHint::MapFile);
 
   void setPixelsDecoder(std::unique_ptr<jxlazy::Decoder>&& decoder, size_t frameIdx,
-                        const JxlPixelFormat& format);
+                        const JxlPixelFormat& format, std::string filename = {},
+                        uint32_t decoderFlags = 0,
+                        uint32_t decoderHints = jxlazy::DecoderHint::MapFile);
 
   /**
    * Add a fully-opaque alpha channel to this Pixmap, if it doesn't have alpha already.
@@ -235,7 +293,7 @@ class Pixmap {
  private:
 
   // Mutable to support lazy loading
-  mutable PixelPtr pixels_{nullptr, free};
+  mutable PixelPtr pixels_{};
   JxlPixelFormat pixelFormat_{kDefaultPixelFormat};
   mutable uint32_t xsize_{0};
   mutable uint32_t ysize_{0};
@@ -243,6 +301,10 @@ class Pixmap {
   std::string filename_{};
   mutable std::unique_ptr<jxlazy::Decoder> decoder_{};
   size_t decoderFrameIdx_{0};
+  uint32_t decoderFlags_{0};
+  uint32_t decoderHints_{jxlazy::DecoderHint::MapFile};
+  // Alpha value to set when the pixels are decoded
+  std::optional<float> alphaFill_{};
 
   void close_();
   /**
@@ -255,6 +317,8 @@ class Pixmap {
    */
   void unbuffer_();
   void ensureDecoder_() const;
+  bool autoCropStreaming_(bool alphaCrop, CropRegion* crop);
+  void applyAlphaFill_(void* pixels, uint32_t xsize, uint32_t ysize) const;
 };
 
 /**
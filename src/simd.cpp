@@ -0,0 +1,654 @@
+/*
+ * Copyright (c) Alistair Barrow. All rights reserved.
+ *
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cmath>
+#include <type_traits>
+
+#include "simd.h"
+
+#ifdef JXLTK_HAVE_X86_DISPATCH
+#include <immintrin.h>
+#endif
+
+namespace jxltk {
+
+namespace {
+
+using SampleKernel = void (*)(float*, const float*, size_t);
+using FindKernel = size_t (*)(const float*, const float*, size_t, float);
+using ToHalfKernel = void (*)(Float16*, const float*, size_t);
+using ToFloatKernel = void (*)(float*, const Float16*, size_t);
+
+template<class T>
+struct NonZeroKernels {
+  size_t (*first)(const T*, size_t, size_t, bool);
+  size_t (*last)(const T*, size_t, size_t, bool);
+};
+
+struct SampleKernels {
+  SimdLevel level;
+  SampleKernel add;
+  SampleKernel subtract;
+  FindKernel findDifferent;
+  NonZeroKernels<uint8_t> nonZero8;
+  NonZeroKernels<uint16_t> nonZero16;
+  NonZeroKernels<float> nonZeroFloat;
+  NonZeroKernels<Float16> nonZeroHalf;
+  ToHalfKernel toHalf;
+  ToFloatKernel toFloat;
+};
+
+template<bool kAdd>
+void arithScalar(float* dst, const float* src, size_t count) {
+  for (size_t i = 0; i < count; ++i) {
+    if constexpr (kAdd) {
+      dst[i] += src[i];
+    } else {
+      dst[i] -= src[i];
+    }
+  }
+}
+
+size_t findDifferentScalar(const float* left, const float* right, size_t count,
+                           float epsilon) {
+  for (size_t i = 0; i < count; ++i) {
+    if (std::fabs(left[i] - right[i]) >= epsilon) {
+      return i;
+    }
+  }
+  return count;
+}
+
+template<class T>
+bool isNonZero(T sample) {
+  if constexpr (std::is_same_v<T, Float16>) {
+    // Ignore the sign bit, so -0.0 is zero
+    return (static_cast<uint16_t>(sample) & 0x7fff) != 0;
+  } else {
+    return sample != 0;
+  }
+}
+
+template<class T>
+size_t findNonZeroPixelScalar(const T* samples, size_t numPixels, size_t numChannels,
+                              bool alphaOnly) {
+  const size_t firstChannel = alphaOnly ? numChannels - 1 : 0;
+  for (size_t i = 0; i < numPixels; ++i, samples += numChannels) {
+    for (size_t c = firstChannel; c < numChannels; ++c) {
+      if (isNonZero(samples[c])) {
+        return i;
+      }
+    }
+  }
+  return numPixels;
+}
+
+template<class T>
+size_t findLastNonZeroPixelScalar(const T* samples, size_t numPixels,
+                                  size_t numChannels, bool alphaOnly) {
+  const size_t firstChannel = alphaOnly ? numChannels - 1 : 0;
+  for (size_t i = numPixels; i-- > 0; ) {
+    const T* pixel = samples + i * numChannels;
+    for (size_t c = firstChannel; c < numChannels; ++c) {
+      if (isNonZero(pixel[c])) {
+        return i + 1;
+      }
+    }
+  }
+  return 0;
+}
+
+Float16 floatToHalfScalar(float value) {
+  const uint32_t bits = std::bit_cast<uint32_t>(value);
+  const uint16_t sign = static_cast<uint16_t>((bits >> 16) & 0x8000);
+  const uint32_t magnitude = bits & 0x7fffffff;
+  if (magnitude > 0x7f800000) {
+    // NaN: keep the top of the payload, and make sure it stays a (quiet) NaN
+    return Float16(sign | 0x7e00 | ((magnitude >> 13) & 0x3ff));
+  }
+  if (magnitude >= 0x47800000) {
+    // At least 65536, or infinity
+    return Float16(sign | 0x7c00);
+  }
+  if (magnitude >= 0x38800000) {
+    // Normal: rebias the exponent and round the mantissa.  Rounding up can carry into
+    // the exponent, which is still correct, up to infinity.
+    uint32_t rebiased = magnitude - 0x38000000;
+    rebiased += 0xfff + ((rebiased >> 13) & 1);
+    return Float16(sign | (rebiased >> 13));
+  }
+  const uint32_t exponent = magnitude >> 23;
+  if (exponent < 102) {
+    // Less than half the smallest subnormal
+    return Float16(sign);
+  }
+  // Subnormal: a multiple of 2^-24
+  const uint32_t mantissa = (magnitude & 0x7fffff) | 0x800000;
+  const uint32_t shift = 126 - exponent;
+  uint32_t result = mantissa >> shift;
+  const uint32_t remainder = mantissa & ((1u << shift) - 1);
+  const uint32_t halfway = 1u << (shift - 1);
+  if (remainder > halfway || (remainder == halfway && (result & 1))) {
+    ++result;
+  }
+  return Float16(sign | result);
+}
+
+float halfToFloatScalar(Float16 value) {
+  const uint32_t bits = static_cast<uint16_t>(value);
+  const uint32_t sign = (bits & 0x8000) << 16;
+  const uint32_t exponent = (bits >> 10) & 0x1f;
+  const uint32_t mantissa = bits & 0x3ff;
+  if (exponent == 0x1f) {
+    // Infinity or NaN.  NaNs are made quiet, like F16C does.
+    const uint32_t quiet = mantissa ? 0x400000 : 0;
+    return std::bit_cast<float>(sign | 0x7f800000 | quiet | (mantissa << 13));
+  }
+  if (exponent != 0) {
+    return std::bit_cast<float>(sign | ((exponent + 112) << 23) | (mantissa << 13));
+  }
+  // Zero or subnormal
+  const float magnitude = std::ldexp(static_cast<float>(mantissa), -24);
+  return sign ? -magnitude : magnitude;
+}
+
+void toHalfScalar(Float16* dst, const float* src, size_t count) {
+  for (size_t i = 0; i < count; ++i) {
+    dst[i] = floatToHalfScalar(src[i]);
+  }
+}
+
+void toFloatScalar(float* dst, const Float16* src, size_t count) {
+  for (size_t i = 0; i < count; ++i) {
+    dst[i] = halfToFloatScalar(src[i]);
+  }
+}
+
+#ifdef JXLTK_HAVE_X86_DISPATCH
+
+template<bool kAdd>
+__attribute__((target("sse2")))
+void arithSSE2(float* dst, const float* src, size_t count) {
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128 a = _mm_loadu_ps(dst + i);
+    __m128 b = _mm_loadu_ps(src + i);
+    _mm_storeu_ps(dst + i, kAdd ? _mm_add_ps(a, b) : _mm_sub_ps(a, b));
+  }
+  arithScalar<kAdd>(dst + i, src + i, count - i);
+}
+
+template<bool kAdd>
+__attribute__((target("avx2")))
+void arithAVX2(float* dst, const float* src, size_t count) {
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    __m256 a0 = _mm256_loadu_ps(dst + i);
+    __m256 a1 = _mm256_loadu_ps(dst + i + 8);
+    __m256 b0 = _mm256_loadu_ps(src + i);
+    __m256 b1 = _mm256_loadu_ps(src + i + 8);
+    _mm256_storeu_ps(dst + i, kAdd ? _mm256_add_ps(a0, b0) : _mm256_sub_ps(a0, b0));
+    _mm256_storeu_ps(dst + i + 8, kAdd ? _mm256_add_ps(a1, b1) : _mm256_sub_ps(a1, b1));
+  }
+  for (; i + 8 <= count; i += 8) {
+    __m256 a = _mm256_loadu_ps(dst + i);
+    __m256 b = _mm256_loadu_ps(src + i);
+    _mm256_storeu_ps(dst + i, kAdd ? _mm256_add_ps(a, b) : _mm256_sub_ps(a, b));
+  }
+  arithScalar<kAdd>(dst + i, src + i, count - i);
+}
+
+template<bool kAdd>
+__attribute__((target("avx512f")))
+void arithAVX512(float* dst, const float* src, size_t count) {
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    __m512 a = _mm512_loadu_ps(dst + i);
+    __m512 b = _mm512_loadu_ps(src + i);
+    _mm512_storeu_ps(dst + i, kAdd ? _mm512_add_ps(a, b) : _mm512_sub_ps(a, b));
+  }
+  // Finish with a masked operation rather than a scalar loop
+  if (i < count) {
+    __mmask16 mask = static_cast<__mmask16>((1u << (count - i)) - 1);
+    __m512 a = _mm512_maskz_loadu_ps(mask, dst + i);
+    __m512 b = _mm512_maskz_loadu_ps(mask, src + i);
+    _mm512_mask_storeu_ps(dst + i, mask,
+                          kAdd ? _mm512_add_ps(a, b) : _mm512_sub_ps(a, b));
+  }
+}
+
+// For the vector versions of findDifferent, clear the sign bit to get the absolute
+// difference, and use ordered comparisons so NaN never compares >= epsilon.
+
+__attribute__((target("sse2")))
+size_t findDifferentSSE2(const float* left, const float* right, size_t count,
+                         float epsilon) {
+  const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+  const __m128 eps = _mm_set1_ps(epsilon);
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128 diff = _mm_and_ps(_mm_sub_ps(_mm_loadu_ps(left + i), _mm_loadu_ps(right + i)),
+                             absMask);
+    if (_mm_movemask_ps(_mm_cmpge_ps(diff, eps)) != 0) {
+      break;
+    }
+  }
+  return i + findDifferentScalar(left + i, right + i, count - i, epsilon);
+}
+
+__attribute__((target("avx2")))
+size_t findDifferentAVX2(const float* left, const float* right, size_t count,
+                         float epsilon) {
+  const __m256 absMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+  const __m256 eps = _mm256_set1_ps(epsilon);
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256 diff = _mm256_and_ps(_mm256_sub_ps(_mm256_loadu_ps(left + i),
+                                              _mm256_loadu_ps(right + i)),
+                                absMask);
+    if (_mm256_movemask_ps(_mm256_cmp_ps(diff, eps, _CMP_GE_OQ)) != 0) {
+      break;
+    }
+  }
+  return i + findDifferentScalar(left + i, right + i, count - i, epsilon);
+}
+
+__attribute__((target("avx512f")))
+size_t findDifferentAVX512(const float* left, const float* right, size_t count,
+                           float epsilon) {
+  const __m512 eps = _mm512_set1_ps(epsilon);
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    __m512 diff = _mm512_abs_ps(_mm512_sub_ps(_mm512_loadu_ps(left + i),
+                                              _mm512_loadu_ps(right + i)));
+    if (_mm512_cmp_ps_mask(diff, eps, _CMP_GE_OQ) != 0) {
+      break;
+    }
+  }
+  return i + findDifferentScalar(left + i, right + i, count - i, epsilon);
+}
+
+// The non-zero pixel searches work on a bitmask with one bit per byte of a vector, set
+// for the bytes of non-zero samples.  When only alpha matters, the mask is ANDed with a
+// pattern selecting the bytes of the last channel, which requires a whole number of
+// pixels per vector; other layouts fall back to scalar code.  In all-channel mode the
+// samples are just searched as one contiguous array.
+
+template<class T>
+__attribute__((target("sse2")))
+uint32_t nonZeroMaskSSE2(const T* p) {
+  const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+  if constexpr (std::is_same_v<T, uint8_t>) {
+    return ~_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) & 0xffffu;
+  } else if constexpr (std::is_same_v<T, uint16_t>) {
+    return ~_mm_movemask_epi8(_mm_cmpeq_epi16(v, _mm_setzero_si128())) & 0xffffu;
+  } else if constexpr (std::is_same_v<T, Float16>) {
+    const __m128i magnitude = _mm_and_si128(v, _mm_set1_epi16(0x7fff));
+    return ~_mm_movemask_epi8(_mm_cmpeq_epi16(magnitude, _mm_setzero_si128())) & 0xffffu;
+  } else {
+    // Unordered comparison, so NaN is non-zero
+    return _mm_movemask_epi8(_mm_castps_si128(_mm_cmpneq_ps(_mm_castsi128_ps(v),
+                                                            _mm_setzero_ps())));
+  }
+}
+
+template<class T>
+__attribute__((target("avx2")))
+uint32_t nonZeroMaskAVX2(const T* p) {
+  const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+  if constexpr (std::is_same_v<T, uint8_t>) {
+    return ~static_cast<uint32_t>(
+        _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_setzero_si256())));
+  } else if constexpr (std::is_same_v<T, uint16_t>) {
+    return ~static_cast<uint32_t>(
+        _mm256_movemask_epi8(_mm256_cmpeq_epi16(v, _mm256_setzero_si256())));
+  } else if constexpr (std::is_same_v<T, Float16>) {
+    const __m256i magnitude = _mm256_and_si256(v, _mm256_set1_epi16(0x7fff));
+    return ~static_cast<uint32_t>(
+        _mm256_movemask_epi8(_mm256_cmpeq_epi16(magnitude, _mm256_setzero_si256())));
+  } else {
+    __m256 nonZero = _mm256_cmp_ps(_mm256_castsi256_ps(v), _mm256_setzero_ps(),
+                                   _CMP_NEQ_UQ);
+    return static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_castps_si256(nonZero)));
+  }
+}
+
+/**
+ * Return the byte mask to apply to a vector of @p vectorBytes bytes, or 0 if the pixel
+ * layout isn't supported.
+ */
+template<class T>
+uint32_t pixelByteMask(size_t vectorBytes, size_t numChannels, bool alphaOnly) {
+  const uint32_t all = vectorBytes >= 32 ? ~0u : (1u << vectorBytes) - 1;
+  if (!alphaOnly || numChannels == 1) {
+    return all;
+  }
+  const size_t pixelBytes = numChannels * sizeof(T);
+  if (vectorBytes % pixelBytes != 0) {
+    return 0;
+  }
+  uint32_t mask = 0;
+  for (size_t b = pixelBytes - sizeof(T); b < vectorBytes; b += pixelBytes) {
+    mask |= ((1u << sizeof(T)) - 1) << b;
+  }
+  return mask;
+}
+
+template<class T>
+__attribute__((target("sse2")))
+size_t findNonZeroPixelSSE2(const T* samples, size_t numPixels, size_t numChannels,
+                            bool alphaOnly) {
+  const uint32_t byteMask = pixelByteMask<T>(16, numChannels, alphaOnly);
+  if (byteMask == 0) {
+    return findNonZeroPixelScalar(samples, numPixels, numChannels, alphaOnly);
+  }
+  constexpr size_t kLanes = 16 / sizeof(T);
+  const size_t pixelBytes = numChannels * sizeof(T);
+  const size_t count = numPixels * numChannels;
+  size_t i = 0;
+  for (; i + kLanes <= count; i += kLanes) {
+    uint32_t mask = nonZeroMaskSSE2(samples + i) & byteMask;
+    if (mask != 0) {
+      return (i * sizeof(T) + std::countr_zero(mask)) / pixelBytes;
+    }
+  }
+  // The remainder may start part way through a pixel
+  const size_t pixel = i / numChannels;
+  return pixel + findNonZeroPixelScalar(samples + pixel * numChannels, numPixels - pixel,
+                                        numChannels, alphaOnly);
+}
+
+template<class T>
+__attribute__((target("sse2")))
+size_t findLastNonZeroPixelSSE2(const T* samples, size_t numPixels,
+                                size_t numChannels, bool alphaOnly) {
+  const uint32_t byteMask = pixelByteMask<T>(16, numChannels, alphaOnly);
+  if (byteMask == 0) {
+    return findLastNonZeroPixelScalar(samples, numPixels, numChannels, alphaOnly);
+  }
+  constexpr size_t kLanes = 16 / sizeof(T);
+  const size_t pixelBytes = numChannels * sizeof(T);
+  // Vectors stay aligned with the start of the array so byteMask lines up with pixels.
+  // Check the remainder first.
+  const size_t vectorEnd = numPixels * numChannels / kLanes * kLanes;
+  const size_t tailPixel = vectorEnd / numChannels;
+  size_t found = findLastNonZeroPixelScalar(samples + tailPixel * numChannels,
+                                            numPixels - tailPixel, numChannels,
+                                            alphaOnly);
+  if (found != 0) {
+    return tailPixel + found;
+  }
+  for (size_t i = vectorEnd; i > 0; ) {
+    i -= kLanes;
+    uint32_t mask = nonZeroMaskSSE2(samples + i) & byteMask;
+    if (mask != 0) {
+      return (i * sizeof(T) + std::bit_width(mask) - 1) / pixelBytes + 1;
+    }
+  }
+  return 0;
+}
+
+template<class T>
+__attribute__((target("avx2")))
+size_t findNonZeroPixelAVX2(const T* samples, size_t numPixels, size_t numChannels,
+                            bool alphaOnly) {
+  const uint32_t byteMask = pixelByteMask<T>(32, numChannels, alphaOnly);
+  if (byteMask == 0) {
+    return findNonZeroPixelScalar(samples, numPixels, numChannels, alphaOnly);
+  }
+  constexpr size_t kLanes = 32 / sizeof(T);
+  const size_t pixelBytes = numChannels * sizeof(T);
+  const size_t count = numPixels * numChannels;
+  size_t i = 0;
+  for (; i + kLanes <= count; i += kLanes) {
+    uint32_t mask = nonZeroMaskAVX2(samples + i) & byteMask;
+    if (mask != 0) {
+      return (i * sizeof(T) + std::countr_zero(mask)) / pixelBytes;
+    }
+  }
+  // The remainder may start part way through a pixel
+  const size_t pixel = i / numChannels;
+  return pixel + findNonZeroPixelScalar(samples + pixel * numChannels, numPixels - pixel,
+                                        numChannels, alphaOnly);
+}
+
+template<class T>
+__attribute__((target("avx2")))
+size_t findLastNonZeroPixelAVX2(const T* samples, size_t numPixels,
+                                size_t numChannels, bool alphaOnly) {
+  const uint32_t byteMask = pixelByteMask<T>(32, numChannels, alphaOnly);
+  if (byteMask == 0) {
+    return findLastNonZeroPixelScalar(samples, numPixels, numChannels, alphaOnly);
+  }
+  constexpr size_t kLanes = 32 / sizeof(T);
+  const size_t pixelBytes = numChannels * sizeof(T);
+  const size_t vectorEnd = numPixels * numChannels / kLanes * kLanes;
+  const size_t tailPixel = vectorEnd / numChannels;
+  size_t found = findLastNonZeroPixelScalar(samples + tailPixel * numChannels,
+                                            numPixels - tailPixel, numChannels,
+                                            alphaOnly);
+  if (found != 0) {
+    return tailPixel + found;
+  }
+  for (size_t i = vectorEnd; i > 0; ) {
+    i -= kLanes;
+    uint32_t mask = nonZeroMaskAVX2(samples + i) & byteMask;
+    if (mask != 0) {
+      return (i * sizeof(T) + std::bit_width(mask) - 1) / pixelBytes + 1;
+    }
+  }
+  return 0;
+}
+
+template<class T>
+constexpr NonZeroKernels<T> kNonZeroSSE2 = {
+  findNonZeroPixelSSE2<T>, findLastNonZeroPixelSSE2<T>,
+};
+
+template<class T>
+constexpr NonZeroKernels<T> kNonZeroAVX2 = {
+  findNonZeroPixelAVX2<T>, findLastNonZeroPixelAVX2<T>,
+};
+
+// Every CPU with AVX2 also has F16C, but detectSimdLevel checks anyway.
+
+__attribute__((target("avx2,f16c")))
+void toHalfF16C(Float16* dst, const float* src, size_t count) {
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    const __m128i half = _mm256_cvtps_ph(_mm256_loadu_ps(src + i),
+                                         _MM_FROUND_TO_NEAREST_INT);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), half);
+  }
+  toHalfScalar(dst + i, src + i, count - i);
+}
+
+__attribute__((target("avx2,f16c")))
+void toFloatF16C(float* dst, const Float16* src, size_t count) {
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    const __m128i half = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+    _mm256_storeu_ps(dst + i, _mm256_cvtph_ps(half));
+  }
+  toFloatScalar(dst + i, src + i, count - i);
+}
+
+#endif  // JXLTK_HAVE_X86_DISPATCH
+
+template<class T>
+constexpr NonZeroKernels<T> kNonZeroScalar = {
+  findNonZeroPixelScalar<T>, findLastNonZeroPixelScalar<T>,
+};
+
+// AVX-512 has no byte movemask, and the non-zero searches are memory bound anyway, so
+// that level reuses the AVX2 versions.
+// Half conversions are only vectorized with F16C, and AVX-512 reuses its 256-bit
+// versions.
+constexpr SampleKernels kKernels[] = {
+  { SimdLevel::Scalar, arithScalar<true>, arithScalar<false>, findDifferentScalar,
+    kNonZeroScalar<uint8_t>, kNonZeroScalar<uint16_t>, kNonZeroScalar<float>,
+    kNonZeroScalar<Float16>, toHalfScalar, toFloatScalar },
+#ifdef JXLTK_HAVE_X86_DISPATCH
+  { SimdLevel::SSE2, arithSSE2<true>, arithSSE2<false>, findDifferentSSE2,
+    kNonZeroSSE2<uint8_t>, kNonZeroSSE2<uint16_t>, kNonZeroSSE2<float>,
+    kNonZeroSSE2<Float16>, toHalfScalar, toFloatScalar },
+  { SimdLevel::AVX2, arithAVX2<true>, arithAVX2<false>, findDifferentAVX2,
+    kNonZeroAVX2<uint8_t>, kNonZeroAVX2<uint16_t>, kNonZeroAVX2<float>,
+    kNonZeroAVX2<Float16>, toHalfF16C, toFloatF16C },
+  { SimdLevel::AVX512, arithAVX512<true>, arithAVX512<false>, findDifferentAVX512,
+    kNonZeroAVX2<uint8_t>, kNonZeroAVX2<uint16_t>, kNonZeroAVX2<float>,
+    kNonZeroAVX2<Float16>, toHalfF16C, toFloatF16C },
+#endif
+};
+
+const SampleKernels* kernelsFor(SimdLevel level) {
+  const SampleKernels* best = &kKernels[0];
+  for (const SampleKernels& k : kKernels) {
+    if (k.level <= level) {
+      best = &k;
+    }
+  }
+  return best;
+}
+
+std::atomic<const SampleKernels*> activeKernels{nullptr};
+
+const SampleKernels& kernels() {
+  const SampleKernels* k = activeKernels.load(std::memory_order_acquire);
+  if (!k) {
+    k = kernelsFor(detectSimdLevel());
+    activeKernels.store(k, std::memory_order_release);
+  }
+  return *k;
+}
+
+template<class T>
+const NonZeroKernels<T>& nonZeroKernels() {
+  if constexpr (std::is_same_v<T, uint8_t>) {
+    return kernels().nonZero8;
+  } else if constexpr (std::is_same_v<T, uint16_t>) {
+    return kernels().nonZero16;
+  } else if constexpr (std::is_same_v<T, Float16>) {
+    return kernels().nonZeroHalf;
+  } else {
+    return kernels().nonZeroFloat;
+  }
+}
+
+}  // namespace
+
+const char* simdLevelName(SimdLevel level) {
+  switch (level) {
+  case SimdLevel::Scalar: return "scalar";
+  case SimdLevel::SSE2: return "SSE2";
+  case SimdLevel::AVX2: return "AVX2";
+  case SimdLevel::AVX512: return "AVX-512";
+  }
+  return "unknown";
+}
+
+SimdLevel detectSimdLevel() {
+#ifdef JXLTK_HAVE_X86_DISPATCH
+  __builtin_cpu_init();
+  // The AVX2 and AVX-512 levels also use F16C
+  const bool f16c = __builtin_cpu_supports("f16c");
+  if (f16c && __builtin_cpu_supports("avx512f")) {
+    return SimdLevel::AVX512;
+  }
+  if (f16c && __builtin_cpu_supports("avx2")) {
+    return SimdLevel::AVX2;
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    return SimdLevel::SSE2;
+  }
+#endif
+  return SimdLevel::Scalar;
+}
+
+SimdLevel simdLevel() {
+  return kernels().level;
+}
+
+SimdLevel setSimdLevel(SimdLevel level) {
+  const SampleKernels* k = kernelsFor(std::min(level, detectSimdLevel()));
+  activeKernels.store(k, std::memory_order_release);
+  return k->level;
+}
+
+void addSamples(float* dst, const float* src, size_t count) {
+  kernels().add(dst, src, count);
+}
+
+void subtractSamples(float* dst, const float* src, size_t count) {
+  kernels().subtract(dst, src, count);
+}
+
+size_t findDifferentSample(const float* left, const float* right, size_t count,
+                           float epsilon) {
+  return kernels().findDifferent(left, right, count, epsilon);
+}
+
+size_t findNonZeroPixel(const uint8_t* samples, size_t numPixels, size_t numChannels,
+                        bool alphaOnly) {
+  return nonZeroKernels<uint8_t>().first(samples, numPixels, numChannels, alphaOnly);
+}
+
+size_t findNonZeroPixel(const uint16_t* samples, size_t numPixels, size_t numChannels,
+                        bool alphaOnly) {
+  return nonZeroKernels<uint16_t>().first(samples, numPixels, numChannels, alphaOnly);
+}
+
+size_t findNonZeroPixel(const float* samples, size_t numPixels, size_t numChannels,
+                        bool alphaOnly) {
+  return nonZeroKernels<float>().first(samples, numPixels, numChannels, alphaOnly);
+}
+
+size_t findNonZeroPixel(const Float16* samples, size_t numPixels, size_t numChannels,
+                        bool alphaOnly) {
+  return nonZeroKernels<Float16>().first(samples, numPixels, numChannels, alphaOnly);
+}
+
+size_t findLastNonZeroPixel(const uint8_t* samples, size_t numPixels,
+                            size_t numChannels, bool alphaOnly) {
+  return nonZeroKernels<uint8_t>().last(samples, numPixels, numChannels, alphaOnly);
+}
+
+size_t findLastNonZeroPixel(const uint16_t* samples, size_t numPixels,
+                            size_t numChannels, bool alphaOnly) {
+  return nonZeroKernels<uint16_t>().last(samples, numPixels, numChannels, alphaOnly);
+}
+
+size_t findLastNonZeroPixel(const float* samples, size_t numPixels,
+                            size_t numChannels, bool alphaOnly) {
+  return nonZeroKernels<float>().last(samples, numPixels, numChannels, alphaOnly);
+}
+
+size_t findLastNonZeroPixel(const Float16* samples, size_t numPixels,
+                            size_t numChannels, bool alphaOnly) {
+  return nonZeroKernels<Float16>().last(samples, numPixels, numChannels, alphaOnly);
+}
+
+Float16 floatToHalf(float value) {
+  return floatToHalfScalar(value);
+}
+
+float halfToFloat(Float16 value) {
+  return halfToFloatScalar(value);
+}
+
+void floatToHalf(Float16* dst, const float* src, size_t count) {
+  kernels().toHalf(dst, src, count);
+}
+
+void halfToFloat(float* dst, const Float16* src, size_t count) {
+  kernels().toFloat(dst, src, count);
+}
+
+}  // namespace jxltk
@@ -0,0 +1,132 @@
+/*
+ * Copyright (c) Alistair Barrow. All rights reserved.
+ *
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file.
+ */
+#ifndef JXLTK_SIMD_H_
+#define JXLTK_SIMD_H_
+
+#include <cstddef>
+#include <cstdint>
+
+// Whether we can build x86 kernels for specific instruction sets and choose between
+// them at runtime
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__GNUC__) || defined(__clang__))
+#define JXLTK_HAVE_X86_DISPATCH 1
+#endif
+
+namespace jxltk {
+
+/**
+ * An IEEE 754 half-precision sample, as stored in JXL_TYPE_FLOAT16 buffers.  It's a
+ * distinct type so overloads can tell it apart from uint16_t.
+ */
+enum class Float16 : uint16_t {};
+
+/**
+ * Instruction sets that sample kernels can be specialised for, in ascending order of
+ * preference.
+ */
+enum class SimdLevel {
+  Scalar,
+  SSE2,
+  AVX2,
+  AVX512,
+};
+
+const char* simdLevelName(SimdLevel level);
+
+/**
+ * Return the best SimdLevel supported by this build and the CPU it's running on.
+ */
+SimdLevel detectSimdLevel();
+
+/**
+ * Return the SimdLevel currently used by the sample kernels.
+ * This is detectSimdLevel() unless overridden by setSimdLevel().
+ */
+SimdLevel simdLevel();
+
+/**
+ * Restrict the sample kernels to @p level, or the best supported level if that's lower.
+ * Mainly useful for testing the fallbacks.  Not thread safe with respect to running
+ * kernels.
+ * @return The level actually selected.
+ */
+SimdLevel setSimdLevel(SimdLevel level);
+
+/**
+ * `dst[i] += src[i]` for `i` in `[0, count)`.
+ *
+ * The arrays mustn't partially overlap, but @p dst may equal @p src.  No alignment
+ * is required.
+ */
+void addSamples(float* dst, const float* src, size_t count);
+
+/**
+ * `dst[i] -= src[i]` for `i` in `[0, count)`.
+ *
+ * The arrays mustn't partially overlap, but @p dst may equal @p src.  No alignment
+ * is required.
+ */
+void subtractSamples(float* dst, const float* src, size_t count);
+
+/**
+ * Return the index of the first `i` in `[0, count)` where
+ * `fabs(left[i] - right[i]) >= epsilon`, or @p count if there isn't one.
+ *
+ * NaN differences never count as different.  No alignment is required.
+ */
+size_t findDifferentSample(const float* left, const float* right, size_t count,
+                           float epsilon);
+
+/**
+ * Return the index of the first pixel in `[0, numPixels)` that has a non-zero sample, or
+ * @p numPixels if there isn't one.
+ *
+ * @param[in] samples `numPixels * numChannels` interleaved samples.
+ * @param[in] alphaOnly If true, only the last channel of each pixel is checked.
+ *
+ * -0.0 counts as zero and NaN counts as non-zero.  No alignment is required.
+ */
+size_t findNonZeroPixel(const uint8_t* samples, size_t numPixels, size_t numChannels,
+                        bool alphaOnly);
+size_t findNonZeroPixel(const uint16_t* samples, size_t numPixels, size_t numChannels,
+                        bool alphaOnly);
+size_t findNonZeroPixel(const float* samples, size_t numPixels, size_t numChannels,
+                        bool alphaOnly);
+size_t findNonZeroPixel(const Float16* samples, size_t numPixels, size_t numChannels,
+                        bool alphaOnly);
+
+/**
+ * Like findNonZeroPixel, but return the index one past the @e last pixel that has a
+ * non-zero sample, or 0 if there isn't one.
+ */
+size_t findLastNonZeroPixel(const uint8_t* samples, size_t numPixels,
+                            size_t numChannels, bool alphaOnly);
+size_t findLastNonZeroPixel(const uint16_t* samples, size_t numPixels,
+                            size_t numChannels, bool alphaOnly);
+size_t findLastNonZeroPixel(const float* samples, size_t numPixels,
+                            size_t numChannels, bool alphaOnly);
+size_t findLastNonZeroPixel(const Float16* samples, size_t numPixels,
+                            size_t numChannels, bool alphaOnly);
+
+/**
+ * Convert one sample, rounding to the nearest representable half (ties to even).
+ * Values too large for a half become infinity.
+ */
+Float16 floatToHalf(float value);
+float halfToFloat(Float16 value);
+
+/**
+ * Convert @p count samples, with the same rounding as the single-sample versions.
+ * Uses F16C at the AVX2 level and above.  No alignment is required.
+ */
+void floatToHalf(Float16* dst, const float* src, size_t count);
+void halfToFloat(float* dst, const Float16* src, size_t count);
+
+}  // namespace jxltk
+
+#endif  // JXLTK_SIMD_H_
@@ -0,0 +1,220 @@
+/**
+ * Copyright (c) Alistair Barrow. All rights reserved.
+ *
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file.
+ */
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <random>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "simd.h"
+
+TEST(SampleArithmetic, AllLevelsMatchScalar) {
+  std::mt19937 rng(1234);
+  std::uniform_real_distribution<float> dist(-4.f, 4.f);
+  const jxltk::SimdLevel levels[] = {
+    jxltk::SimdLevel::Scalar, jxltk::SimdLevel::SSE2, jxltk::SimdLevel::AVX2,
+    jxltk::SimdLevel::AVX512,
+  };
+  const jxltk::SimdLevel best = jxltk::detectSimdLevel();
+
+  // Lengths either side of each vector width, plus an offset start to check unaligned
+  // access
+  for (size_t count : {0, 1, 3, 4, 5, 7, 8, 9, 15, 16, 17, 31, 32, 33, 100, 1031}) {
+    std::vector<float> left(count + 1), right(count + 1);
+    for (size_t i = 0; i <= count; ++i) {
+      left[i] = dist(rng);
+      right[i] = dist(rng);
+    }
+    std::vector<float> expectSum(left), expectDiff(left);
+    for (size_t i = 1; i <= count; ++i) {
+      expectSum[i] += right[i];
+      expectDiff[i] -= right[i];
+    }
+
+    for (jxltk::SimdLevel level : levels) {
+      SCOPED_TRACE(testing::Message() << "count=" << count << " level="
+                                      << jxltk::simdLevelName(level));
+      jxltk::SimdLevel actual = jxltk::setSimdLevel(level);
+      EXPECT_LE(actual, best);
+      EXPECT_EQ(jxltk::simdLevel(), actual);
+
+      std::vector<float> sum(left), diff(left);
+      jxltk::addSamples(sum.data() + 1, right.data() + 1, count);
+      jxltk::subtractSamples(diff.data() + 1, right.data() + 1, count);
+      EXPECT_EQ(sum, expectSum);
+      EXPECT_EQ(diff, expectDiff);
+    }
+  }
+  jxltk::setSimdLevel(best);
+}
+
+TEST(SampleArithmetic, FindDifferentSample) {
+  const jxltk::SimdLevel levels[] = {
+    jxltk::SimdLevel::Scalar, jxltk::SimdLevel::SSE2, jxltk::SimdLevel::AVX2,
+    jxltk::SimdLevel::AVX512,
+  };
+  const jxltk::SimdLevel best = jxltk::detectSimdLevel();
+  const float epsilon = 0.01f;
+
+  for (size_t count : {0, 1, 5, 8, 16, 17, 33, 100}) {
+    std::vector<float> left(count), right(count);
+    for (size_t i = 0; i < count; ++i) {
+      left[i] = static_cast<float>(i) / 7.f;
+      // Differences just under epsilon don't count
+      right[i] = left[i] + (i % 2 ? 0.009f : -0.009f);
+    }
+    for (jxltk::SimdLevel level : levels) {
+      jxltk::setSimdLevel(level);
+      SCOPED_TRACE(testing::Message() << "count=" << count << " level="
+                                      << jxltk::simdLevelName(jxltk::simdLevel()));
+      EXPECT_EQ(jxltk::findDifferentSample(left.data(), right.data(), count, epsilon),
+                count);
+      if (count > 2) {
+        // NaN is ignored; the first real difference is reported
+        std::vector<float> changed(right);
+        changed[0] = std::numeric_limits<float>::quiet_NaN();
+        changed[count - 2] = left[count - 2] - 0.5f;
+        changed[count - 1] = left[count - 1] + 0.5f;
+        EXPECT_EQ(jxltk::findDifferentSample(left.data(), changed.data(), count, epsilon),
+                  count - 2);
+      }
+    }
+  }
+  jxltk::setSimdLevel(best);
+}
+
+TEST(SampleArithmetic, FindNonZeroPixel) {
+  const jxltk::SimdLevel levels[] = {
+    jxltk::SimdLevel::SSE2, jxltk::SimdLevel::AVX2, jxltk::SimdLevel::AVX512,
+  };
+  const jxltk::SimdLevel best = jxltk::detectSimdLevel();
+  std::mt19937 rng(4321);
+
+  // Every level must agree with the scalar version, for layouts the vector code handles
+  // and those it doesn't
+  for (size_t numChannels : {1, 2, 3, 4}) {
+    for (size_t numPixels : {0, 1, 3, 8, 15, 16, 17, 33, 100}) {
+      for (int trial = 0; trial < 20; ++trial) {
+        std::vector<float> samples(numPixels * numChannels);
+        for (float& sample : samples) {
+          sample = rng() % 8 == 0 ? 1.f : rng() % 8 == 0 ? -0.f : 0.f;
+        }
+        std::vector<uint8_t> samples8(samples.begin(), samples.end());
+        std::vector<uint16_t> samples16(samples.begin(), samples.end());
+        std::vector<jxltk::Float16> samplesHalf(samples.size());
+        for (size_t i = 0; i < samples.size(); ++i) {
+          samplesHalf[i] = jxltk::floatToHalf(samples[i]);
+        }
+        for (bool alphaOnly : {false, true}) {
+          jxltk::setSimdLevel(jxltk::SimdLevel::Scalar);
+          size_t expectFirst = jxltk::findNonZeroPixel(samples.data(), numPixels,
+                                                       numChannels, alphaOnly);
+          size_t expectLast = jxltk::findLastNonZeroPixel(samples.data(), numPixels,
+                                                          numChannels, alphaOnly);
+          for (jxltk::SimdLevel level : levels) {
+            jxltk::setSimdLevel(level);
+            SCOPED_TRACE(testing::Message() << numPixels << "x" << numChannels
+                                            << " alphaOnly=" << alphaOnly << " level="
+                                            << jxltk::simdLevelName(jxltk::simdLevel()));
+            EXPECT_EQ(jxltk::findNonZeroPixel(samples.data(), numPixels, numChannels,
+                                              alphaOnly), expectFirst);
+            EXPECT_EQ(jxltk::findNonZeroPixel(samples8.data(), numPixels, numChannels,
+                                              alphaOnly), expectFirst);
+            EXPECT_EQ(jxltk::findNonZeroPixel(samples16.data(), numPixels, numChannels,
+                                              alphaOnly), expectFirst);
+            EXPECT_EQ(jxltk::findLastNonZeroPixel(samples.data(), numPixels, numChannels,
+                                                  alphaOnly), expectLast);
+            EXPECT_EQ(jxltk::findLastNonZeroPixel(samples8.data(), numPixels,
+                                                  numChannels, alphaOnly), expectLast);
+            EXPECT_EQ(jxltk::findLastNonZeroPixel(samples16.data(), numPixels,
+                                                  numChannels, alphaOnly), expectLast);
+            EXPECT_EQ(jxltk::findNonZeroPixel(samplesHalf.data(), numPixels,
+                                              numChannels, alphaOnly), expectFirst);
+            EXPECT_EQ(jxltk::findLastNonZeroPixel(samplesHalf.data(), numPixels,
+                                                  numChannels, alphaOnly), expectLast);
+          }
+        }
+      }
+    }
+  }
+  jxltk::setSimdLevel(best);
+}
+
+TEST(SampleArithmetic, HalfConversion) {
+  const jxltk::SimdLevel levels[] = {
+    jxltk::SimdLevel::Scalar, jxltk::SimdLevel::SSE2, jxltk::SimdLevel::AVX2,
+    jxltk::SimdLevel::AVX512,
+  };
+  const jxltk::SimdLevel best = jxltk::detectSimdLevel();
+
+  // Every half converts to float and back unchanged, except that NaNs become quiet
+  std::vector<jxltk::Float16> halves(65536);
+  for (size_t i = 0; i < halves.size(); ++i) {
+    halves[i] = static_cast<jxltk::Float16>(i);
+  }
+  for (jxltk::Float16 half : halves) {
+    float value = jxltk::halfToFloat(half);
+    uint16_t bits = static_cast<uint16_t>(half);
+    if (std::isnan(value)) {
+      bits |= 0x200;
+    }
+    EXPECT_EQ(static_cast<uint16_t>(jxltk::floatToHalf(value)), bits) << bits;
+  }
+  EXPECT_EQ(jxltk::halfToFloat(static_cast<jxltk::Float16>(0x3c00)), 1.f);
+  EXPECT_EQ(jxltk::halfToFloat(static_cast<jxltk::Float16>(0x0001)),
+            std::ldexp(1.f, -24));
+
+  // Rounding, overflow and underflow
+  const std::pair<float, uint16_t> cases[] = {
+    {0.f, 0x0000}, {-0.f, 0x8000}, {1.f, 0x3c00}, {-2.f, 0xc000},
+    {65504.f, 0x7bff}, {65519.f, 0x7bff}, {65520.f, 0x7c00}, {1e10f, 0x7c00},
+    {-std::numeric_limits<float>::infinity(), 0xfc00},
+    {1.f + std::ldexp(1.f, -11), 0x3c00},  // Tie, rounds to even
+    {1.f + 3 * std::ldexp(1.f, -11), 0x3c02},  // Tie, rounds to even
+    {std::ldexp(1.f, -25), 0x0000},  // Tie with the smallest subnormal
+    {std::ldexp(1.5f, -25), 0x0001},
+    {std::ldexp(3.f, -25), 0x0002},  // Tie, rounds to even
+    {std::ldexp(1023.5f, -24), 0x0400},  // Rounds up to the smallest normal
+  };
+  for (const auto& [value, bits] : cases) {
+    EXPECT_EQ(static_cast<uint16_t>(jxltk::floatToHalf(value)), bits) << value;
+  }
+
+  // The vector versions must match the scalar ones, including NaN payloads
+  std::mt19937 rng(5678);
+  std::vector<float> floats(1031);
+  for (float& value : floats) {
+    uint32_t bits = static_cast<uint32_t>(rng());
+    // Mostly values in the range of a half
+    if (rng() % 4 != 0) {
+      bits = (bits & 0x807fffff) | ((100 + rng() % 44) << 23);
+    }
+    memcpy(&value, &bits, sizeof bits);
+  }
+  for (jxltk::SimdLevel level : levels) {
+    jxltk::setSimdLevel(level);
+    SCOPED_TRACE(jxltk::simdLevelName(jxltk::simdLevel()));
+    for (size_t count : {0, 1, 7, 8, 9, 1031}) {
+      std::vector<jxltk::Float16> gotHalves(count);
+      jxltk::floatToHalf(gotHalves.data(), floats.data(), count);
+      for (size_t i = 0; i < count; ++i) {
+        ASSERT_EQ(gotHalves[i], jxltk::floatToHalf(floats[i])) << floats[i];
+      }
+      std::vector<float> gotFloats(count);
+      jxltk::halfToFloat(gotFloats.data(), halves.data() + 0x7bf0, count);
+      for (size_t i = 0; i < count; ++i) {
+        float expect = jxltk::halfToFloat(halves[0x7bf0 + i]);
+        ASSERT_EQ(memcmp(&gotFloats[i], &expect, sizeof expect), 0) << i;
+      }
+    }
+  }
+  jxltk::setSimdLevel(best);
+}
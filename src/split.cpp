@@ -4,13 +4,20 @@
  * Use of this source code is governed by an MIT-style
  * license that can be found in the LICENSE file.
  */
+#include <algorithm>
 #include <cinttypes>
 #include <cmath>
+#include <condition_variable>
 #include <cstring>
+#include <deque>
+#include <exception>
 #include <filesystem>
+#include <functional>
 #include <fstream>
 #include <iostream>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <jxl/encode_cxx.h>
@@ -20,7 +27,11 @@
 #include "except.h"
 #include "log.h"
 #include "mergeconfig.h"
+#include "pixelalloc.h"
 #include "pixmap.h"
+#include "split.h"
+#include "stats.h"
+#include "trace.h"
 #include "util.h"
 
 using std::optional;
@@ -46,16 +57,179 @@ bool shouldDefaultToFloat(const jxlazy::FrameInfo& frameInfo) {
   return false;
 }
 
+/**
+ * A decoded frame waiting to be encoded to its own file.
+ */
+struct SplitFrameJob {
+  size_t frameIndex{0};
+  std::string filePath{};
+  uint32_t xsize{0};
+  uint32_t ysize{0};
+  JxlBlendMode blendMode{JXL_BLEND_REPLACE};
+  JxlPixelFormat format{};
+  // Buffers come from pixelMemoryManager(), so they can be recycled by a BufferPool.
+  PixelPtr pixels{};
+  size_t pixelsSize{0};
+  // Each request's target points into the corresponding element of ecBuffers.
+  // (Moving the job doesn't invalidate these pointers.)
+  vector<jxlazy::ExtraChannelRequest> ecRequests{};
+  vector<PixelPtr> ecBuffers{};
+};
+
+/**
+ * Fixed-capacity FIFO for handing work from one thread to others.
+ */
+template<typename T>
+class BoundedQueue {
+ public:
+  explicit BoundedQueue(size_t capacity) : capacity_(std::max<size_t>(capacity, 1)) {}
+
+  /**
+   * Append @p item, blocking while the queue is full.
+   * @return false if the queue was closed, in which case @p item is discarded.
+   */
+  bool push(T&& item) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    notFull_.wait(lock, [this] { return closed_ || items_.size() < capacity_; });
+    if (closed_) {
+      return false;
+    }
+    items_.push_back(std::move(item));
+    notEmpty_.notify_one();
+    return true;
+  }
+
+  /**
+   * Remove the oldest item, blocking while the queue is empty.
+   * @return The item, or an empty optional if the queue is closed and drained.
+   */
+  optional<T> pop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    notEmpty_.wait(lock, [this] { return closed_ || !items_.empty(); });
+    if (items_.empty()) {
+      return {};
+    }
+    optional<T> item(std::move(items_.front()));
+    items_.pop_front();
+    notFull_.notify_one();
+    return item;
+  }
+
+  /**
+   * Stop accepting new items.  Items already queued can still be popped.
+   * If @p discard is true, drop them instead.
+   */
+  void close(bool discard = false) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    closed_ = true;
+    if (discard) {
+      items_.clear();
+    }
+    notEmpty_.notify_all();
+    notFull_.notify_all();
+  }
+
+ private:
+  const size_t capacity_;
+  std::mutex mutex_{};
+  std::condition_variable notEmpty_{};
+  std::condition_variable notFull_{};
+  std::deque<T> items_{};
+  bool closed_{false};
+};
+
+/**
+ * A set of threads, each with its own encoder, that encode queued frames in parallel.
+ */
+class SplitEncoderPool {
+ public:
+  using EncodeFunc = std::function<void(SplitFrameJob, JxlEncoder*)>;
+
+  /**
+   * Start @p numEncoders threads that each call @p encode for queued jobs.
+   *
+   * @param[in] numThreads Passed to makeThreadedEncoder for each encoder.
+   */
+  SplitEncoderPool(size_t numEncoders, size_t numThreads, EncodeFunc encode)
+      : queue_(numEncoders), encode_(std::move(encode)) {
+    threads_.reserve(numEncoders);
+    for (size_t i = 0; i < numEncoders; ++i) {
+      threads_.emplace_back(&SplitEncoderPool::run_, this, numThreads);
+    }
+  }
+  SplitEncoderPool(const SplitEncoderPool&) = delete;
+  SplitEncoderPool& operator=(const SplitEncoderPool&) = delete;
+
+  /**
+   * Abandon any queued jobs and wait for the threads to exit.
+   */
+  ~SplitEncoderPool() {
+    queue_.close(true);
+    join_();
+  }
+
+  /**
+   * Queue a job, blocking while all encoders are busy and the queue is full.
+   * @return false if an encoder has failed, so no more jobs will be accepted.
+   */
+  bool push(SplitFrameJob&& job) { return queue_.push(std::move(job)); }
+
+  /**
+   * Wait for all queued jobs to be encoded, then rethrow the first exception raised
+   * by any encoder, if there was one.
+   */
+  void finish() {
+    queue_.close();
+    join_();
+    if (error_) {
+      std::rethrow_exception(error_);
+    }
+  }
+
+ private:
+  BoundedQueue<SplitFrameJob> queue_;
+  EncodeFunc encode_;
+  vector<std::thread> threads_{};
+  std::mutex errorMutex_{};
+  std::exception_ptr error_{};
+
+  void run_(size_t numThreads) {
+    try {
+      JxlEncoderPtr enc = makeThreadedEncoder(nullptr, numThreads);
+      while (optional<SplitFrameJob> job = queue_.pop()) {
+        encode_(std::move(*job), enc.get());
+      }
+    } catch (...) {
+      {
+        std::lock_guard<std::mutex> lock(errorMutex_);
+        if (!error_) {
+          error_ = std::current_exception();
+        }
+      }
+      queue_.close(true);
+    }
+  }
+
+  void join_() {
+    for (std::thread& t : threads_) {
+      if (t.joinable()) {
+        t.join();
+      }
+    }
+  }
+};
+
 }  // namespace
 
 void split(std::string_view input, std::string_view poutputDir,
            bool coalesce, size_t numThreads, const FrameConfig& frameConfig,
            const std::optional<JxlDataType>& forceDataType, bool wantPixels,
-           bool wantBoxes, MergeConfig* mergeCfg, bool useTicks, bool full) {
+           bool wantBoxes, MergeConfig* mergeCfg, bool useTicks, bool full,
+           size_t numEncoders) {
   JXLTK_TRACE("Entered %s", __func__);
   uint32_t decoderFlags = coalesce ? 0 :
                               static_cast<uint32_t>(jxlazy::DecoderFlag::NoCoalesce);
-  uint32_t decoderHints = 0;
+  uint32_t decoderHints = jxlazy::DecoderHint::MapFile;
   if (!wantPixels) {
     decoderHints |= jxlazy::DecoderHint::NoPixels;
   }
@@ -64,7 +238,7 @@ void split(std::string_view input, std::string_view poutputDir,
     decoderHints |= jxlazy::DecoderHint::WantBoxes;
   }
 
-  jxlazy::Decoder dec;
+  jxlazy::Decoder dec = makeDecoder(numThreads);
   dec.openFile(std::string(input).c_str(), decoderFlags, decoderHints);
 
   const JxlBasicInfo decInfo = dec.getBasicInfo();
@@ -122,15 +296,8 @@ void split(std::string_view input, std::string_view poutputDir,
     std::filesystem::create_directories(outputDir);
   }
 
-  // Init encoder if needed
-  JxlEncoderPtr encp;
-  JxlThreadParallelRunnerPtr runner;
-  if (wantPixels) {
-    std::tie(encp, runner) = makeThreadedEncoder(nullptr, numThreads);
-  }
-
   // Check for non-main-alpha extra channels.
-  // Create the right number of buffers, but don't set sizes - it varies for each frame.
+  // Create the right number of requests, but don't set sizes - it varies for each frame.
   const vector<jxlazy::ExtraChannelInfo> decEcInfo = dec.getExtraChannelInfo();
   if (decEcInfo.size() != decInfo.num_extra_channels) {
     throw JxltkError("%s: Have %" PRIu32 " extra channels, but only %zu extra channel infos",
@@ -140,10 +307,8 @@ void split(std::string_view input, std::string_view poutputDir,
   const size_t numNonAlphaExtraChannels =
     decInfo.num_extra_channels - (decInfo.alpha_bits > 0 ? 1 : 0);
   vector<jxlazy::ExtraChannelRequest> ecRequests;
-  vector<vector<uint8_t> > ecBuffers;
   if (wantPixels) {
     ecRequests.reserve(numNonAlphaExtraChannels);
-    ecBuffers.resize(numNonAlphaExtraChannels);
     for (size_t ec = 0; ec < decEcInfo.size(); ++ec) {
       const jxlazy::ExtraChannelInfo& thisEcInfo = decEcInfo[ec];
       if (!alphaEcIndex && thisEcInfo.info.type == JXL_CHANNEL_ALPHA) {
@@ -169,12 +334,147 @@ void split(std::string_view input, std::string_view poutputDir,
     suggestedDataType = decFormat.data_type;
   }
 
+  // Encode a decoded frame to its own file.  This only reads state shared with the
+  // decoding thread, so it's safe to call from several encoder threads at once.
+  auto encodeFrame = [&](SplitFrameJob job, JxlEncoder* enc) {
+    const size_t frameIndex = job.frameIndex;
+    JxlEncoderReset(enc);
+    if (numThreads != 1) {
+      setSharedParallelRunner(enc);
+    }
+    EncoderOutput out(job.filePath.c_str());
+    out.attach(enc);
+
+    JxlPixelFormat encFormat = job.format;
+    JxlBasicInfo encInfo = decInfo;
+    encInfo.xsize = job.xsize;
+    encInfo.ysize = job.ysize;
+    encInfo.have_animation = JXL_FALSE;
+    encInfo.have_preview = JXL_FALSE;
+    encInfo.intrinsic_xsize = encInfo.intrinsic_ysize = 0;
+    encInfo.uses_original_profile =
+      frameConfig.distance.value_or(*kJxltkDefaultFrameConfig.distance)
+        < kLosslessDistanceThreshold ? JXL_TRUE : JXL_FALSE;
+
+    // Check for and remove redundant alpha channel
+    if (alphaEcIndex && decEcInfo[*alphaEcIndex].name.empty() &&
+        (job.blendMode == JXL_BLEND_REPLACE || job.blendMode == JXL_BLEND_BLEND) &&
+        Pixmap::isFullyOpaque(job.pixels.get(), job.xsize, job.ysize, job.format)) {
+      if (removeInterleavedChannel(job.pixels.get(), job.xsize, job.ysize, job.format,
+                                   job.format.num_channels - 1)) {
+        throw JxltkError("%s: Failed to remove interleaved alpha for frame %zu",
+                         __func__, frameIndex);
+      }
+      JXLTK_DEBUG("Removed redundant alpha channel from frame %zu", frameIndex);
+      encInfo.alpha_bits = 0;
+      encInfo.alpha_exponent_bits = 0;
+      encInfo.num_extra_channels--;
+      encFormat.num_channels--;
+      // Convert the channel indexes in ecRequests from input to output indexes.
+      // i.e., shift them down to account for the missing alpha index.
+      for (auto ecr = job.ecRequests.begin() + *alphaEcIndex;
+           ecr != job.ecRequests.end();
+           ++ecr) {
+        --ecr->channelIndex;
+      }
+    }
+
+    if (jxltkLogThreshold >= LogLevel::Trace) {
+      std::ostringstream biStr;
+      biStr << encInfo;
+      JXLTK_TRACE("Writing basic info: %s", biStr.str().c_str());
+    }
+    if (JxlEncoderSetBasicInfo(enc, &encInfo) != JXL_ENC_SUCCESS) {
+      throw JxltkError("%s: Failed to set basic info for frame %zu",
+                       __func__, frameIndex);
+    }
+
+    JXLTK_TRACE("Setting extra channel info.");
+    for (const auto& thisEcReq : job.ecRequests) {
+      const jxlazy::ExtraChannelInfo& thisEcInfo = decEcInfo[thisEcReq.channelIndex];
+      JXLTK_TRACE("Frame %zu: Setting extra channel %zu info (%s)(%s)", frameIndex,
+                  thisEcReq.channelIndex, channelTypeName(thisEcInfo.info.type),
+                  thisEcInfo.name.c_str());
+      if (JxlEncoderSetExtraChannelInfo(enc, thisEcReq.channelIndex, &thisEcInfo.info)
+          != JXL_ENC_SUCCESS) {
+        throw JxltkError("%s: Failed to set extra channel info for frame %zu, "
+                         "channel %zu", __func__, frameIndex, thisEcReq.channelIndex);
+      }
+      if (!thisEcInfo.name.empty() &&
+          JxlEncoderSetExtraChannelName(enc, thisEcReq.channelIndex,
+                                        thisEcInfo.name.c_str(), thisEcInfo.name.size())
+              != JXL_ENC_SUCCESS) {
+        throw JxltkError("%s: Failed to set extra channel info for frame %zu, "
+                         "channel %zu", __func__, frameIndex, thisEcReq.channelIndex);
+      }
+      // TODO: should also get ExtraChannelBlendInfo and write it to the merge config
+    }
+
+    if (icc.empty()) {
+      if (JxlEncoderSetColorEncoding(enc, &colorEncoding) != JXL_ENC_SUCCESS) {
+        throw JxltkError("%s: Failed to set color encoding for frame %zu",
+                         __func__, frameIndex);
+      }
+    } else {
+      if (JxlEncoderSetICCProfile(enc, icc.data(), icc.size()) != JXL_ENC_SUCCESS) {
+        throw JxltkError("%s: Failed to set ICC for frame %zu",
+                         __func__, frameIndex);
+      }
+    }
+
+    JxlEncoderFrameSettings* settings =
+        frameConfigToJxlEncoderFrameSettings(enc, encInfo, frameConfig,
+                                             1, 1, job.xsize, job.ysize);
+    {
+      TraceSpan addSpan("addFrame", static_cast<int64_t>(frameIndex));
+      if (JxlEncoderAddImageFrame(settings, &encFormat, job.pixels.get(),
+                                  job.pixelsSize) != JXL_ENC_SUCCESS) {
+        throw JxltkError("%s: Failed to add frame %zu", __func__, frameIndex);
+      }
+      for (const auto& thisEcReq : job.ecRequests) {
+        JXLTK_TRACE("Frame %zu: Adding extra channel %zu", frameIndex,
+                    thisEcReq.channelIndex);
+        if (JxlEncoderSetExtraChannelBuffer(settings, &thisEcReq.format, thisEcReq.target,
+                                            thisEcReq.capacity, thisEcReq.channelIndex)
+            != JXL_ENC_SUCCESS) {
+          throw JxltkError("%s: Failed to add extra channel %zu for frame %zu", __func__,
+                           thisEcReq.channelIndex, frameIndex);
+        }
+      }
+    }
+    countPixelsEncoded(uint64_t{job.xsize} * job.ysize);
+    JxlEncoderCloseInput(enc);
+
+    JxlEncoderStatus st = out.flush(enc);
+    if (st != JXL_ENC_SUCCESS) {
+      throw JxltkError("%s: Unexpected encoder status while writing frame %zu: %s",
+                       __func__, frameIndex, encoderStatusName(st));
+    }
+    JXLTK_INFO("Wrote %s.", shellQuote(job.filePath, true).c_str());
+  };
+
+  // Init encoder(s) if needed.
+  // With a single encoder, frames are encoded inline as soon as they're decoded.
+  // Otherwise, this thread keeps decoding and hands frames to a pool of independent
+  // encoders through a bounded queue, which limits how many decoded frames are held in
+  // memory.
+  // Output file names and the merge config are decided here, in frame order, so the
+  // results don't depend on which encoder finishes first.
+  // All the encoders share one thread pool, so running several doesn't multiply the
+  // number of threads.
+  JxlEncoderPtr encp;
+  optional<SplitEncoderPool> encoders;
+  if (wantPixels && numEncoders <= 1) {
+    encp = makeThreadedEncoder(nullptr, numThreads);
+  } else if (wantPixels) {
+    JXLTK_DEBUG("Using %zu encoders.", numEncoders);
+    encoders.emplace(numEncoders, numThreads, encodeFrame);
+  }
+
   size_t frameCount = dec.frameCount();
   int filenameDigits = static_cast<int>(
                            floorf(log10f(static_cast<float>(frameCount) - 1))) + 1;
   size_t frameIndex = 0;
-  vector<uint8_t> frameBuffer;
-  vector<uint8_t> jxlBuffer;
   for (jxlazy::FrameInfo frameInfo : dec) {
     const JxlLayerInfo& layerInfo = frameInfo.header.layer_info;
 
@@ -226,161 +526,52 @@ void split(std::string_view input, std::string_view poutputDir,
       mergeCfg->frames.push_back(std::move(jsonFrameConfig));
     }
 
-    // Decode this frame's pixels and encode to a new file
+    // Decode this frame's pixels and queue it to be encoded to a new file
     if (wantPixels) {
-
-      decFormat.data_type = suggestedDataType;
-      if (!forceDataType && !coalesce && decFormat.data_type != JXL_TYPE_FLOAT &&
+      SplitFrameJob job;
+      job.frameIndex = frameIndex;
+      job.filePath = (outputDir / frameBaseName).string();
+      job.xsize = layerInfo.xsize;
+      job.ysize = layerInfo.ysize;
+      job.blendMode = layerInfo.blend_info.blendmode;
+      job.format = decFormat;
+      job.format.data_type = suggestedDataType;
+      if (!forceDataType && !coalesce && job.format.data_type != JXL_TYPE_FLOAT &&
           shouldDefaultToFloat(frameInfo)) {
         JXLTK_TRACE("Defaulting to f32 due to blend modes.");
-        decFormat.data_type = JXL_TYPE_FLOAT;
+        job.format.data_type = JXL_TYPE_FLOAT;
       }
 
-      JxlEncoder* enc = encp.get();
-      JxlEncoderReset(enc);
-      if (runner &&
-          JxlEncoderSetParallelRunner(enc, JxlThreadParallelRunner, runner.get())
-          != JXL_ENC_SUCCESS) {
-        throw JxltkError("%s: Failed to set parallel runner for encoder", __func__);
-      }
-
-      // Allocate main frame buffer
-      size_t bufferSize = dec.getFrameBufferSize(frameIndex, decFormat);
-      frameBuffer.clear();
-      frameBuffer.resize(bufferSize);
+      // Allocate main frame buffer.  The decoder overwrites all of it.
+      job.pixelsSize = dec.getFrameBufferSize(frameIndex, job.format);
+      job.pixels = allocPixels(job.pixelsSize);
 
       // Allocate non-main-alpha extra channel buffers.
-      // Update pointers in ecRequests as the buffers might move.
-      // Reset extra channel indexes, as we might have shifted them on the previous loop
-      for (size_t req = 0; req < ecRequests.size(); ++req) {
-        jxlazy::ExtraChannelRequest& thisEcReq = ecRequests[req];
-        vector<uint8_t>& thisEcBuffer = ecBuffers[req];
+      job.ecRequests = ecRequests;
+      job.ecBuffers.reserve(ecRequests.size());
+      for (jxlazy::ExtraChannelRequest& thisEcReq : job.ecRequests) {
         thisEcReq.capacity = dec.getFrameBufferSize(frameIndex, thisEcReq.format);
-        thisEcBuffer.clear();
-        thisEcBuffer.resize(thisEcReq.capacity);
-        thisEcReq.target = thisEcBuffer.data();
-        thisEcReq.channelIndex = req + (alphaEcIndex && req >= *alphaEcIndex ? 1 : 0);
-      }
-
-      dec.getFramePixels(frameIndex, decFormat, frameBuffer.data(), bufferSize,
-                         ecRequests);
-
-      JxlPixelFormat encFormat = decFormat;
-      JxlBasicInfo encInfo = decInfo;
-      encInfo.xsize = layerInfo.xsize;
-      encInfo.ysize = layerInfo.ysize;
-      encInfo.have_animation = JXL_FALSE;
-      encInfo.have_preview = JXL_FALSE;
-      encInfo.intrinsic_xsize = encInfo.intrinsic_ysize = 0;
-      encInfo.uses_original_profile =
-        frameConfig.distance.value_or(*kJxltkDefaultFrameConfig.distance)
-          < kLosslessDistanceThreshold ? JXL_TRUE : JXL_FALSE;
-
-      // Check for and remove redundant alpha channel
-      if (alphaEcIndex && decEcInfo[*alphaEcIndex].name.empty() &&
-          (layerInfo.blend_info.blendmode == JXL_BLEND_REPLACE ||
-           layerInfo.blend_info.blendmode == JXL_BLEND_BLEND) &&
-          Pixmap::isFullyOpaque(frameBuffer.data(), layerInfo.xsize,
-                                layerInfo.ysize, decFormat)) {
-        if (removeInterleavedChannel(frameBuffer.data(), layerInfo.xsize,
-                                     layerInfo.ysize, decFormat,
-                                     decFormat.num_channels - 1)) {
-          throw JxltkError("%s: Failed to remove interleaved alpha for frame %zu",
-                           __func__, frameIndex);
-        }
-        JXLTK_DEBUG("Removed redundant alpha channel from frame %zu", frameIndex);
-        encInfo.alpha_bits = 0;
-        encInfo.alpha_exponent_bits = 0;
-        encInfo.num_extra_channels--;
-        encFormat.num_channels--;
-        // Convert the channel indexes in ecRequests from input to output indexes.
-        // i.e., shift them down to account for the missing alpha index.
-        for (auto ecr = ecRequests.begin() + *alphaEcIndex;
-             ecr != ecRequests.end();
-             ++ecr) {
-          --ecr->channelIndex;
-        }
+        job.ecBuffers.push_back(allocPixels(thisEcReq.capacity));
+        thisEcReq.target = job.ecBuffers.back().get();
       }
 
-      if (jxltkLogThreshold >= LogLevel::Trace) {
-        std::ostringstream biStr;
-        biStr << encInfo;
-        JXLTK_TRACE("Writing basic info: %s", biStr.str().c_str());
-      }
-      if (JxlEncoderSetBasicInfo(enc, &encInfo) != JXL_ENC_SUCCESS) {
-        throw JxltkError("%s: Failed to set basic info for frame %zu",
-                         __func__, frameIndex);
-      }
-
-      JXLTK_TRACE("Setting extra channel info.");
-      for (const auto& thisEcReq : ecRequests) {
-        const jxlazy::ExtraChannelInfo& thisEcInfo = decEcInfo[thisEcReq.channelIndex];
-        JXLTK_TRACE("Frame %zu: Setting extra channel %zu info (%s)(%s)", frameIndex,
-                    thisEcReq.channelIndex, channelTypeName(thisEcInfo.info.type),
-                    thisEcInfo.name.c_str());
-        if (JxlEncoderSetExtraChannelInfo(enc, thisEcReq.channelIndex, &thisEcInfo.info)
-            != JXL_ENC_SUCCESS) {
-          throw JxltkError("%s: Failed to set extra channel info for frame %zu, "
-                           "channel %zu", __func__, frameIndex, thisEcReq.channelIndex);
-        }
-        if (!thisEcInfo.name.empty() &&
-            JxlEncoderSetExtraChannelName(enc, thisEcReq.channelIndex,
-                                          thisEcInfo.name.c_str(), thisEcInfo.name.size())
-                != JXL_ENC_SUCCESS) {
-          throw JxltkError("%s: Failed to set extra channel info for frame %zu, "
-                           "channel %zu", __func__, frameIndex, thisEcReq.channelIndex);
-        }
-        // TODO: should also get ExtraChannelBlendInfo and write it to the merge config
-      }
+      dec.getFramePixels(frameIndex, job.format, job.pixels.get(), job.pixelsSize,
+                         job.ecRequests);
 
-      if (icc.empty()) {
-        if (JxlEncoderSetColorEncoding(enc, &colorEncoding) != JXL_ENC_SUCCESS) {
-          throw JxltkError("%s: Failed to set color encoding for frame %zu",
-                           __func__, frameIndex);
+      if (encoders) {
+        if (!encoders->push(std::move(job))) {
+          break;  // An encoder failed; finish() will rethrow its error
         }
       } else {
-        if (JxlEncoderSetICCProfile(enc, icc.data(), icc.size()) != JXL_ENC_SUCCESS) {
-          throw JxltkError("%s: Failed to set ICC for frame %zu",
-                           __func__, frameIndex);
-        }
+        encodeFrame(std::move(job), encp.get());
       }
-
-      JxlEncoderFrameSettings* settings =
-          frameConfigToJxlEncoderFrameSettings(enc, encInfo, frameConfig,
-                                               1, 1, frameInfo.header.layer_info.xsize,
-                                               frameInfo.header.layer_info.ysize);
-      if (JxlEncoderAddImageFrame(settings, &encFormat, frameBuffer.data(),
-                                  bufferSize) != JXL_ENC_SUCCESS) {
-        throw JxltkError("%s: Failed to add frame %zu", __func__, frameIndex);
-      }
-      for (const auto& thisEcReq : ecRequests) {
-        JXLTK_TRACE("Frame %zu: Adding extra channel %zu", frameIndex,
-                    thisEcReq.channelIndex);
-        if (JxlEncoderSetExtraChannelBuffer(settings, &thisEcReq.format, thisEcReq.target,
-                                            thisEcReq.capacity, thisEcReq.channelIndex)
-            != JXL_ENC_SUCCESS) {
-          throw JxltkError("%s: Failed to add extra channel %zu for frame %zu", __func__,
-                           thisEcReq.channelIndex, frameIndex);
-        }
-      }
-      JxlEncoderCloseInput(enc);
-
-      std::string filePath = (outputDir / frameBaseName).string();
-      std::ofstream outFile(filePath, std::ios::binary);
-      if (jxlBuffer.empty()) {
-        jxlBuffer.resize(kDefaultIOBufferSize);
-      }
-      JxlEncoderStatus st = encodeUntilSuccess(enc, jxlBuffer.data(),
-                                               jxlBuffer.size(), &outFile);
-      if (st != JXL_ENC_SUCCESS) {
-        throw JxltkError("%s: Unexpected encoder status while writing frame %zu: %s",
-                         __func__, frameIndex, encoderStatusName(st));
-      }
-      JXLTK_INFO("Wrote %s.", shellQuote(filePath, true).c_str());
     }
 
     ++frameIndex;
   }
+  if (encoders) {
+    encoders->finish();
+  }
 
   // Read jxll box if applicable
   if (decInfo.have_container && mergeCfg) {
@@ -27,8 +27,8 @@ namespace jxltk {
  * doesn't exist).
  * @param[in] coalesce If true, blend layers together and output only full-sized
  * animation frames.
- * @param[in] numThreads Maximum threads to use for encoding/decoding, or 0 to use
- * the default.
+ * @param[in] numThreads 1 to encode and decode on the calling thread, or any other
+ * value to use the shared thread pool (see setSharedThreadPoolSize).
  * @param[in] frameConfig Encoding settings for all output files.
  * @param[in] forceDataType Force a specific data type to be used during
  * processing.
@@ -42,6 +42,9 @@ namespace jxltk {
  * If false, use milliseconds (possibly rounded).
  * @param[in] full If true, the merge config is written in a more verbose way,
  * with fewer implied defaults.
+ * @param[in] numEncoders Number of frames to encode concurrently, each with its own
+ * encoder.  Frames are still decoded in order on the calling thread, and all the
+ * encoders share the same thread pool.  Output is the same regardless of this setting.
  */
 void split(std::string_view input, std::string_view poutputDir,
            bool coalesce = false, size_t numThreads = 0,
@@ -49,7 +52,8 @@ void split(std::string_view input, std::string_view poutputDir,
            const std::optional<JxlDataType>& forceDataType = {},
            bool wantPixels = true, bool wantBoxes = true,
            MergeConfig* mergeCfg = nullptr,
-           bool useTicks = true, bool full = false);
+           bool useTicks = true, bool full = false,
+           size_t numEncoders = 1);
 
 }  // namespace jxltk
 
@@ -0,0 +1,87 @@
+/**
+ * Copyright (c) Alistair Barrow. All rights reserved.
+ *
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file.
+ */
+
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <sstream>
+#include <string>
+#include <string_view>
+
+#include <gtest/gtest.h>
+
+#include "merge.h"
+#include "mergeconfig.h"
+#include "split.h"
+#include "util.h"
+
+static std::string getPath(std::string_view s) {
+  return std::string(JXLTK_TEST_DIR) + '/' + std::string(s);
+}
+
+/** Read every file in @p dir, keyed by filename. */
+static std::map<std::string, std::string> readDir(const std::filesystem::path& dir) {
+  std::map<std::string, std::string> files;
+  for (const auto& entry : std::filesystem::directory_iterator(dir)) {
+    std::ifstream in(entry.path(), std::ios::binary);
+    files[entry.path().filename().string()].assign(std::istreambuf_iterator<char>(in),
+                                                   std::istreambuf_iterator<char>());
+  }
+  return files;
+}
+
+TEST(Split, NumEncoders) {
+  // A multi-frame input with a box, so both frames and boxes are extracted
+  jxltk::TempFile boxFile;
+  boxFile.open();
+  boxFile.file << "<x:xmpmeta xmlns:x='adobe:ns:meta/'></x:xmpmeta>";
+  boxFile.close();
+  jxltk::MergeConfig mergeCfg;
+  mergeCfg.frameDefaults.effort = 1;
+  mergeCfg.frameDefaults.durationMs = 100;
+  for (const char* file : {"gray256_horizontal.jxl", "gray256_vertical.jxl",
+                           "gray256_h+v.jxl", "gray256_v-h.jxl"}) {
+    mergeCfg.frames.emplace_back().file = getPath(file);
+  }
+  jxltk::BoxConfig& box = mergeCfg.boxes.emplace_back();
+  box.file = boxFile.path;
+  box.compress = false;
+  memcpy(box.type, "xml ", 4);
+
+  jxltk::TempFile input;
+  input.open();
+  jxltk::merge(mergeCfg, input.file);
+  input.close();
+
+  std::map<std::string, std::string> files[2];
+  std::string json[2];
+  const size_t numEncoders[2] = {1, 3};
+  for (size_t i = 0; i < 2; ++i) {
+    const std::filesystem::path outputDir =
+        input.path + ".split" + std::to_string(numEncoders[i]);
+    jxltk::MergeConfig splitCfg;
+    jxltk::split(input.path, outputDir.string(), false, 0, {}, {}, true, true,
+                 &splitCfg, true, false, numEncoders[i]);
+    std::ostringstream oss;
+    splitCfg.toJson(oss);
+    json[i] = oss.str();
+    files[i] = readDir(outputDir);
+    std::filesystem::remove_all(outputDir);
+  }
+
+  // One file per frame, plus the box
+  EXPECT_EQ(files[0].size(), mergeCfg.frames.size() + 1);
+  EXPECT_EQ(json[1], json[0]);
+  ASSERT_EQ(files[1].size(), files[0].size());
+  for (const auto& [name, content] : files[0]) {
+    auto it = files[1].find(name);
+    ASSERT_NE(it, files[1].end()) << name;
+    EXPECT_EQ(it->second, content) << name;
+  }
+}
@@ -0,0 +1,222 @@
+/*
+ * Copyright (c) Alistair Barrow. All rights reserved.
+ *
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file.
+ */
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <string_view>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+// Version 2 is in kernel32, so there's no need to link psapi.lib
+#ifndef PSAPI_VERSION
+#define PSAPI_VERSION 2
+#endif
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+#include "../contrib/jxlazy/include/jxlazy/decoder.h"
+#include "../contrib/nlohmann/json.hpp"
+
+#include "stats.h"
+#include "trace.h"
+
+namespace jxltk {
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct PhaseTotals {
+  uint64_t count{0};
+  double wallUs{0};
+  double cpuUs{0};
+};
+
+std::atomic<bool> enabled{false};
+Clock::time_point startTime{};
+jxlazy::DecoderCounters startDecoderCounters{};
+std::atomic<uint64_t> bytesWritten{0};
+std::atomic<uint64_t> pixelsEncoded{0};
+std::atomic<uint64_t> jxlAllocated{0};
+std::atomic<uint64_t> jxlPeakAllocated{0};
+
+std::mutex phaseMutex;
+std::map<std::string, PhaseTotals, std::less<> > phases;
+
+// Allocations are prefixed with their size, in a header that keeps the rest aligned.
+constexpr size_t kAllocHeader = alignof(std::max_align_t);
+static_assert(kAllocHeader >= sizeof(size_t));
+
+void* countingAlloc(void* /*opaque*/, size_t size) {
+  void* block = malloc(size + kAllocHeader);
+  if (!block) return nullptr;
+  memcpy(block, &size, sizeof size);
+  uint64_t now = jxlAllocated.fetch_add(size, std::memory_order_relaxed) + size;
+  uint64_t peak = jxlPeakAllocated.load(std::memory_order_relaxed);
+  while (now > peak &&
+         !jxlPeakAllocated.compare_exchange_weak(peak, now, std::memory_order_relaxed)) {
+  }
+  return static_cast<uint8_t*>(block) + kAllocHeader;
+}
+
+void countingFree(void* /*opaque*/, void* address) {
+  if (!address) return;
+  uint8_t* block = static_cast<uint8_t*>(address) - kAllocHeader;
+  size_t size;
+  memcpy(&size, block, sizeof size);
+  jxlAllocated.fetch_sub(size, std::memory_order_relaxed);
+  free(block);
+}
+
+const JxlMemoryManager countingMemoryManager = {
+  .opaque = nullptr,
+  .alloc = countingAlloc,
+  .free = countingFree,
+};
+
+struct ProcessUsage {
+  std::optional<double> userSeconds{};
+  std::optional<double> systemSeconds{};
+  std::optional<uint64_t> peakRssBytes{};
+};
+
+ProcessUsage getProcessUsage() {
+  ProcessUsage usage;
+#if defined(_WIN32)
+  FILETIME creation, exit, kernel, user;
+  if (GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user)) {
+    ULARGE_INTEGER k{{kernel.dwLowDateTime, kernel.dwHighDateTime}};
+    ULARGE_INTEGER u{{user.dwLowDateTime, user.dwHighDateTime}};
+    usage.userSeconds = static_cast<double>(u.QuadPart) / 1e7;
+    usage.systemSeconds = static_cast<double>(k.QuadPart) / 1e7;
+  }
+  PROCESS_MEMORY_COUNTERS counters;
+  if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof counters)) {
+    usage.peakRssBytes = counters.PeakWorkingSetSize;
+  }
+#else
+  struct rusage ru;
+  if (getrusage(RUSAGE_SELF, &ru) == 0) {
+    usage.userSeconds = static_cast<double>(ru.ru_utime.tv_sec) +
+                        static_cast<double>(ru.ru_utime.tv_usec) / 1e6;
+    usage.systemSeconds = static_cast<double>(ru.ru_stime.tv_sec) +
+                          static_cast<double>(ru.ru_stime.tv_usec) / 1e6;
+#if defined(__APPLE__)
+    usage.peakRssBytes = static_cast<uint64_t>(ru.ru_maxrss);
+#else
+    usage.peakRssBytes = static_cast<uint64_t>(ru.ru_maxrss) * 1024;
+#endif
+  }
+#endif
+  return usage;
+}
+
+/** JSON null if @p value is empty. */
+template <typename T>
+nlohmann::ordered_json toJson(const std::optional<T>& value) {
+  return value ? nlohmann::ordered_json(*value) : nlohmann::ordered_json();
+}
+
+}  // namespace
+
+
+void enableStats() {
+  if (enabled.exchange(true)) return;
+  startTime = Clock::now();
+  startDecoderCounters = jxlazy::getDecoderCounters();
+  detail::setSpanSink(detail::SpanSink::Stats, true);
+}
+
+bool statsEnabled() {
+  return enabled.load(std::memory_order_relaxed);
+}
+
+void countBytesWritten(uint64_t bytes) {
+  if (statsEnabled()) bytesWritten.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+void countPixelsEncoded(uint64_t pixels) {
+  if (statsEnabled()) pixelsEncoded.fetch_add(pixels, std::memory_order_relaxed);
+}
+
+const JxlMemoryManager* statsMemoryManager() {
+  return statsEnabled() ? &countingMemoryManager : nullptr;
+}
+
+void writeStats(std::ostream& out, std::string_view mode) {
+  const double wallSeconds =
+      std::chrono::duration<double>(Clock::now() - startTime).count();
+  const jxlazy::DecoderCounters decoder = jxlazy::getDecoderCounters();
+  const ProcessUsage usage = getProcessUsage();
+  const double mpDecoded =
+      static_cast<double>(decoder.pixelsDecoded - startDecoderCounters.pixelsDecoded) /
+      1e6;
+  const double mpEncoded = static_cast<double>(pixelsEncoded.load()) / 1e6;
+
+  nlohmann::ordered_json json;
+  json["mode"] = mode;
+  json["wallSeconds"] = wallSeconds;
+  json["userCpuSeconds"] = toJson(usage.userSeconds);
+  json["systemCpuSeconds"] = toJson(usage.systemSeconds);
+  json["peakRssBytes"] = toJson(usage.peakRssBytes);
+  json["peakLibjxlAllocatedBytes"] = jxlPeakAllocated.load();
+  json["bytesRead"] = decoder.inputBytes - startDecoderCounters.inputBytes;
+  json["bytesWritten"] = bytesWritten.load();
+  json["megapixelsDecoded"] = mpDecoded;
+  json["megapixelsDecodedPerSecond"] = wallSeconds > 0 ? mpDecoded / wallSeconds : 0.;
+  json["megapixelsEncoded"] = mpEncoded;
+  json["megapixelsEncodedPerSecond"] = wallSeconds > 0 ? mpEncoded / wallSeconds : 0.;
+  json["decoderRewinds"] = decoder.rewinds - startDecoderCounters.rewinds;
+  json["inputRefills"] = decoder.refills - startDecoderCounters.refills;
+
+  nlohmann::ordered_json& phasesJson = json["phases"] = nlohmann::ordered_json::object();
+  {
+    std::lock_guard<std::mutex> lock(phaseMutex);
+    for (const auto& [name, totals] : phases) {
+      phasesJson[name] = {
+        {"count", totals.count},
+        {"wallSeconds", totals.wallUs / 1e6},
+        {"cpuSeconds", totals.cpuUs / 1e6},
+      };
+    }
+  }
+  out << json.dump(2) << '\n';
+}
+
+namespace detail {
+
+void recordSpan(const char* name, double wallUs, double cpuUs) {
+  std::lock_guard<std::mutex> lock(phaseMutex);
+  auto it = phases.find(std::string_view(name));
+  if (it == phases.end()) {
+    it = phases.emplace(name, PhaseTotals{}).first;
+  }
+  ++it->second.count;
+  it->second.wallUs += wallUs;
+  it->second.cpuUs += cpuUs;
+}
+
+}  // namespace detail
+
+}  // namespace jxltk
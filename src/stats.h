@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) Alistair Barrow. All rights reserved.
+ *
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file.
+ */
+#ifndef JXLTK_STATS_H_
+#define JXLTK_STATS_H_
+
+#include <cstdint>
+#include <ostream>
+#include <string_view>
+
+#include <jxl/memory_manager.h>
+
+namespace jxltk {
+
+/**
+ * Start collecting the process-wide statistics reported by writeStats: time spent in
+ * each kind of TraceSpan, bytes and pixels processed, decoder rewinds and refills, and
+ * memory use.  Call this before creating any encoders or decoders, so that they use
+ * statsMemoryManager().
+ */
+void enableStats();
+
+/**
+ * Return whether enableStats() has been called.
+ */
+bool statsEnabled();
+
+/**
+ * Add to the number of bytes of encoded output, if stats are enabled.
+ */
+void countBytesWritten(uint64_t bytes);
+
+/**
+ * Add to the number of pixels passed to encoders, if stats are enabled.
+ */
+void countPixelsEncoded(uint64_t pixels);
+
+/**
+ * Return a memory manager that records how many bytes libjxl has allocated through it,
+ * or nullptr (meaning libjxl's default) if stats aren't enabled.
+ */
+const JxlMemoryManager* statsMemoryManager();
+
+/**
+ * Write everything collected since enableStats() to @p out as a JSON object.
+ *
+ * @param[in] mode Command line mode, recorded in the output.
+ */
+void writeStats(std::ostream& out, std::string_view mode);
+
+namespace detail {
+/**
+ * Add one finished span to the per-phase totals.  Called by TraceSpan.
+ */
+void recordSpan(const char* name, double wallUs, double cpuUs);
+}  // namespace detail
+
+}  // namespace jxltk
+
+#endif  // JXLTK_STATS_H_
@@ -0,0 +1,50 @@
+/**
+ * Copyright (c) Alistair Barrow. All rights reserved.
+ *
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file.
+ */
+
+#include <sstream>
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include "../contrib/nlohmann/json.hpp"
+
+#include "stats.h"
+#include "trace.h"
+
+TEST(Stats, Report) {
+  { jxltk::TraceSpan ignored("beforeStats"); }
+  jxltk::enableStats();
+  ASSERT_TRUE(jxltk::statsEnabled());
+  { jxltk::TraceSpan span("phase"); }
+  { jxltk::TraceSpan span("phase", 1); }
+  jxltk::countBytesWritten(1000);
+  jxltk::countPixelsEncoded(2'000'000);
+
+  const JxlMemoryManager* mm = jxltk::statsMemoryManager();
+  ASSERT_NE(mm, nullptr);
+  void* block = mm->alloc(mm->opaque, 12345);
+  ASSERT_NE(block, nullptr);
+  mm->free(mm->opaque, block);
+  mm->free(mm->opaque, nullptr);
+
+  std::ostringstream out;
+  jxltk::writeStats(out, "test");
+  nlohmann::ordered_json json = nlohmann::ordered_json::parse(out.str());
+  EXPECT_EQ(json["mode"], "test");
+  EXPECT_GE(json["wallSeconds"].get<double>(), 0);
+  EXPECT_GE(json["bytesWritten"].get<uint64_t>(), 1000);
+  EXPECT_GE(json["megapixelsEncoded"].get<double>(), 2.);
+  EXPECT_GE(json["peakLibjxlAllocatedBytes"].get<uint64_t>(), 12345);
+  for (const char* key : {"userCpuSeconds", "systemCpuSeconds", "peakRssBytes",
+                          "bytesRead", "megapixelsDecoded", "decoderRewinds",
+                          "inputRefills"}) {
+    EXPECT_TRUE(json.contains(key)) << key;
+  }
+  ASSERT_TRUE(json["phases"].contains("phase"));
+  EXPECT_EQ(json["phases"]["phase"]["count"], 2);
+  EXPECT_FALSE(json["phases"].contains("beforeStats"));
+}
@@ -0,0 +1,378 @@
+/*
+ * Copyright (c) Alistair Barrow. All rights reserved.
+ *
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file.
+ */
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <jxl/color_encoding.h>
+#include <jxl/encode.h>
+
+#include "common.h"
+#include "enums.h"
+#include "except.h"
+#include "log.h"
+#include "mergeconfig.h"
+#include "simd.h"
+#include "stats.h"
+#include "synth.h"
+#include "util.h"
+
+using std::string;
+using std::vector;
+
+namespace jxltk {
+
+namespace {
+
+constexpr uint32_t kTpsNumerator = 10;
+constexpr uint32_t kTpsDenominator = 1;
+
+uint32_t mix(uint32_t a) {
+  a ^= a >> 16;
+  a *= 0x7feb352dU;
+  a ^= a >> 15;
+  a *= 0x846ca68bU;
+  a ^= a >> 16;
+  return a;
+}
+
+JxlDataType sampleType(const SynthConfig& config) {
+  if (config.floatSamples) {
+    return config.bitsPerSample == 16 ? JXL_TYPE_FLOAT16 : JXL_TYPE_FLOAT;
+  }
+  return config.bitsPerSample <= 8 ? JXL_TYPE_UINT8 : JXL_TYPE_UINT16;
+}
+
+template <typename T>
+void fillRegion(const SynthConfig& config, size_t frame, size_t firstChannel,
+                size_t numChannels, uint32_t x0, uint32_t y0, uint32_t xsize,
+                uint32_t ysize, T* samples) {
+  for (uint32_t y = y0; y < y0 + ysize; ++y) {
+    for (uint32_t x = x0; x < x0 + xsize; ++x) {
+      for (size_t c = firstChannel; c < firstChannel + numChannels; ++c) {
+        float value = synthSample(config, frame, c, x, y);
+        if constexpr (std::is_same_v<T, float>) {
+          *samples++ = value;
+        } else {
+          *samples++ = static_cast<T>(value * std::numeric_limits<T>::max() + .5f);
+        }
+      }
+    }
+  }
+}
+
+/**
+ * Allocate a buffer with new[] and fill it with a region of synthetic samples.
+ */
+uint8_t* makeRegion(const SynthConfig& config, size_t frame, size_t firstChannel,
+                    size_t numChannels, uint32_t x0, uint32_t y0, uint32_t xsize,
+                    uint32_t ysize, size_t* size) {
+  const JxlDataType dataType = sampleType(config);
+  *size = static_cast<size_t>(xsize) * ysize * bytesPerPixel(dataType, numChannels);
+  uint8_t* buf = new uint8_t[*size];
+  if (dataType == JXL_TYPE_FLOAT) {
+    fillRegion(config, frame, firstChannel, numChannels, x0, y0, xsize, ysize,
+               reinterpret_cast<float*>(buf));
+  } else if (dataType == JXL_TYPE_FLOAT16) {
+    // Generate a row of floats at a time and convert it
+    vector<float> row(static_cast<size_t>(xsize) * numChannels);
+    Float16* out = reinterpret_cast<Float16*>(buf);
+    for (uint32_t y = y0; y < y0 + ysize; ++y, out += row.size()) {
+      fillRegion(config, frame, firstChannel, numChannels, x0, y, xsize, 1, row.data());
+      floatToHalf(out, row.data(), row.size());
+    }
+  } else if (dataType == JXL_TYPE_UINT16) {
+    fillRegion(config, frame, firstChannel, numChannels, x0, y0, xsize, ysize,
+               reinterpret_cast<uint16_t*>(buf));
+  } else {
+    fillRegion(config, frame, firstChannel, numChannels, x0, y0, xsize, ysize, buf);
+  }
+  return buf;
+}
+
+#ifdef JXLTK_HAVE_CHUNKED_FRAMES
+/**
+ * Lets JxlEncoderAddChunkedFrame generate rectangles of a synthetic frame on demand.
+ * The callbacks may be called concurrently, so they don't modify this object.
+ */
+class SynthChunkSource {
+ public:
+  SynthChunkSource(const SynthConfig& config, size_t frame)
+    : config_(config), frame_(frame) {}
+  SynthChunkSource(const SynthChunkSource&) = delete;
+  SynthChunkSource& operator=(const SynthChunkSource&) = delete;
+
+  JxlChunkedFrameInputSource get() {
+    return {
+      .opaque = this,
+      .get_color_channels_pixel_format = getColorPixelFormat_,
+      .get_color_channel_data_at = getColorData_,
+      .get_extra_channel_pixel_format = getExtraPixelFormat_,
+      .get_extra_channel_data_at = getExtraData_,
+      .release_buffer = releaseBuffer_,
+    };
+  }
+
+ private:
+  const SynthConfig& config_;
+  size_t frame_;
+
+  static void getColorPixelFormat_(void* opaque, JxlPixelFormat* pixelFormat) {
+    const SynthChunkSource* self = static_cast<SynthChunkSource*>(opaque);
+    *pixelFormat = {self->config_.numColorChannels, sampleType(self->config_),
+                    JXL_NATIVE_ENDIAN, 0};
+  }
+
+  static const void* getColorData_(void* opaque, size_t xpos, size_t ypos,
+                                   size_t xsize, size_t ysize, size_t* rowOffset) {
+    const SynthChunkSource* self = static_cast<SynthChunkSource*>(opaque);
+    size_t size;
+    uint8_t* buf = makeRegion(self->config_, self->frame_, 0,
+                              self->config_.numColorChannels,
+                              static_cast<uint32_t>(xpos), static_cast<uint32_t>(ypos),
+                              static_cast<uint32_t>(xsize), static_cast<uint32_t>(ysize),
+                              &size);
+    *rowOffset = size / ysize;
+    return buf;
+  }
+
+  static void getExtraPixelFormat_(void* opaque, size_t /*ecIndex*/,
+                                   JxlPixelFormat* pixelFormat) {
+    const SynthChunkSource* self = static_cast<SynthChunkSource*>(opaque);
+    *pixelFormat = {1, sampleType(self->config_), JXL_NATIVE_ENDIAN, 0};
+  }
+
+  static const void* getExtraData_(void* opaque, size_t ecIndex, size_t xpos,
+                                   size_t ypos, size_t xsize, size_t ysize,
+                                   size_t* rowOffset) {
+    const SynthChunkSource* self = static_cast<SynthChunkSource*>(opaque);
+    size_t size;
+    uint8_t* buf = makeRegion(self->config_, self->frame_,
+                              self->config_.numColorChannels + ecIndex, 1,
+                              static_cast<uint32_t>(xpos), static_cast<uint32_t>(ypos),
+                              static_cast<uint32_t>(xsize), static_cast<uint32_t>(ysize),
+                              &size);
+    *rowOffset = size / ysize;
+    return buf;
+  }
+
+  static void releaseBuffer_(void* /*opaque*/, const void* buf) {
+    delete[] static_cast<const uint8_t*>(buf);
+  }
+};
+#endif
+
+/**
+ * Deterministic, moderately compressible box content.
+ */
+string makeBoxContent(const SynthConfig& config, size_t index) {
+  string content = "<synth seed=\"" + std::to_string(config.seed) + "\" box=\"" +
+                   std::to_string(index) + "\">\n";
+  uint32_t state = mix(config.seed ^ static_cast<uint32_t>(index * 0x9e3779b9U));
+  char line[64];
+  for (uint32_t row = 0; content.size() < config.boxSize; ++row) {
+    state = mix(state + row);
+    snprintf(line, sizeof line, "  <row n=\"%" PRIu32 "\" v=\"%08" PRIx32 "\"/>\n", row,
+             state & 0xffff0fffU);
+    content += line;
+  }
+  content.resize(config.boxSize);
+  return content;
+}
+
+void flushOrThrow(JxlEncoder* enc, EncoderOutput& out, const char* what) {
+  JxlEncoderStatus st = out.flush(enc);
+  if (st != JXL_ENC_SUCCESS) {
+    throw JxltkError("synthesize: Unexpected encoder status while writing %s: %s", what,
+                     encoderStatusName(st));
+  }
+}
+
+}  // namespace
+
+
+string SynthConfig::name() const {
+  string name = std::to_string(xsize) + "x" + std::to_string(ysize) + "_" +
+                std::to_string(numFrames) + "f_" + (floatSamples ? "f" : "u") +
+                std::to_string(bitsPerSample) + "_" +
+                (numColorChannels == 1 ? "gray" : "rgb") + (alpha ? "a" : "");
+  if (numExtraChannels > 0) name += "_" + std::to_string(numExtraChannels) + "ec";
+  if (border > 0) name += "_border" + std::to_string(border);
+  if (numBoxes > 0) {
+    name += "_" + std::to_string(numBoxes) + (compressBoxes ? "brob" : "box") +
+            std::to_string(boxSize);
+  }
+  return name + "_s" + std::to_string(seed);
+}
+
+float synthSample(const SynthConfig& config, size_t frame, size_t channel, uint32_t x,
+                  uint32_t y) {
+  const uint32_t border = config.border;
+  if (x < border || y < border || x >= config.xsize - std::min(border, config.xsize) ||
+      y >= config.ysize - std::min(border, config.ysize)) {
+    return 0.f;
+  }
+  const size_t numColor = config.numColorChannels;
+  if (config.alpha && channel == numColor) {
+    return 1.f;
+  }
+
+  const uint32_t squareSize = std::max<uint32_t>(1, std::min(config.xsize,
+                                                             config.ysize) / 8);
+  const uint32_t f = static_cast<uint32_t>(frame);
+  const uint32_t squareX = (f * 37 + config.seed * 11) %
+                           std::max<uint32_t>(1, config.xsize - squareSize);
+  const uint32_t squareY = (f * 23 + config.seed * 7) %
+                           std::max<uint32_t>(1, config.ysize - squareSize);
+  float base;
+  if (x - squareX < squareSize && y - squareY < squareSize) {
+    base = channel == 0 ? 1.f : 0.f;
+  } else if (channel < numColor) {
+    base = static_cast<float>((x + 2 * y + 64 * channel) & 255) / 255.f;
+  } else {
+    base = static_cast<float>((x ^ y) & 255) / 255.f;
+  }
+  uint32_t noise = mix(x * 0x9e3779b1U ^ mix(y ^ mix(f * 0x85ebca77U +
+                                                      config.seed * 0xc2b2ae3dU +
+                                                      static_cast<uint32_t>(channel))));
+  return std::clamp(base + static_cast<float>(noise & 31) / 1024.f, 0.f, 1.f);
+}
+
+void synthesize(const SynthConfig& config, EncoderOutput& out,
+                const FrameConfig& frameConfig, size_t numThreads,
+                std::optional<int16_t> brotliEffort) {
+  if (config.xsize == 0 || config.ysize == 0 || config.numFrames == 0 ||
+      (config.numColorChannels != 1 && config.numColorChannels != 3) ||
+      (config.floatSamples ? config.bitsPerSample != 16 && config.bitsPerSample != 32
+                           : config.bitsPerSample < 1 || config.bitsPerSample > 16)) {
+    throw JxltkError("%s: Invalid synthetic image settings: %s", __func__,
+                     config.name().c_str());
+  }
+  JxlEncoderPtr encp = makeThreadedEncoder(nullptr, numThreads);
+  JxlEncoder* enc = encp.get();
+  out.attach(enc);
+
+  JxlBasicInfo info;
+  JxlEncoderInitBasicInfo(&info);
+  info.xsize = config.xsize;
+  info.ysize = config.ysize;
+  info.num_color_channels = config.numColorChannels;
+  info.bits_per_sample = config.bitsPerSample;
+  info.exponent_bits_per_sample = !config.floatSamples ? 0 :
+                                  config.bitsPerSample == 16 ? 5 : 8;
+  info.num_extra_channels = (config.alpha ? 1 : 0) + config.numExtraChannels;
+  if (config.alpha) {
+    info.alpha_bits = info.bits_per_sample;
+    info.alpha_exponent_bits = info.exponent_bits_per_sample;
+  }
+  info.uses_original_profile = JXL_TRUE;
+  if (config.numFrames > 1) {
+    info.have_animation = JXL_TRUE;
+    info.animation.tps_numerator = kTpsNumerator;
+    info.animation.tps_denominator = kTpsDenominator;
+  }
+  if (config.numBoxes > 0 && JxlEncoderUseBoxes(enc) != JXL_ENC_SUCCESS) {
+    throw JxltkError("%s: Failed to enable container format", __func__);
+  }
+  JXLTK_INFO("Writing basic info: %s", toString(info).c_str());
+  if (JxlEncoderSetBasicInfo(enc, &info) != JXL_ENC_SUCCESS) {
+    throw JxltkError("%s: Failed in JxlEncoderSetBasicInfo", __func__);
+  }
+  for (uint32_t i = 0; i < info.num_extra_channels; ++i) {
+    bool isAlpha = config.alpha && i == 0;
+    JxlExtraChannelInfo ecInfo;
+    JxlEncoderInitExtraChannelInfo(isAlpha ? JXL_CHANNEL_ALPHA : JXL_CHANNEL_OPTIONAL,
+                                   &ecInfo);
+    ecInfo.bits_per_sample = info.bits_per_sample;
+    ecInfo.exponent_bits_per_sample = info.exponent_bits_per_sample;
+    if (JxlEncoderSetExtraChannelInfo(enc, i, &ecInfo) != JXL_ENC_SUCCESS) {
+      throw JxltkError("%s: Failed in JxlEncoderSetExtraChannelInfo", __func__);
+    }
+    if (!isAlpha) {
+      string name = "synth" + std::to_string(i);
+      if (JxlEncoderSetExtraChannelName(enc, i, name.c_str(), name.size())
+          != JXL_ENC_SUCCESS) {
+        throw JxltkError("%s: Failed in JxlEncoderSetExtraChannelName", __func__);
+      }
+    }
+  }
+  JxlColorEncoding color;
+  JxlColorEncodingSetToSRGB(&color, config.numColorChannels == 1 ? JXL_TRUE : JXL_FALSE);
+  if (JxlEncoderSetColorEncoding(enc, &color) != JXL_ENC_SUCCESS) {
+    throw JxltkError("%s: Failed in JxlEncoderSetColorEncoding", __func__);
+  }
+
+  for (size_t i = 0; i < config.numBoxes; ++i) {
+    static const JxlBoxType kBoxType = {'x', 'm', 'l', ' '};
+    string content = makeBoxContent(config, i);
+    JXLTK_DEBUG("Writing box [%zu/%zu]", i + 1, config.numBoxes);
+    if (JxlEncoderAddBox(enc, kBoxType, reinterpret_cast<const uint8_t*>(content.data()),
+                         content.size(), config.compressBoxes ? JXL_TRUE : JXL_FALSE)
+        != JXL_ENC_SUCCESS) {
+      throw JxltkError("%s: Failed to add box %zu", __func__, i);
+    }
+    if (i == config.numBoxes - 1) {
+      JxlEncoderCloseBoxes(enc);
+    }
+    flushOrThrow(enc, out, "a box");
+  }
+
+  FrameConfig frameCfg = frameConfig;
+  if (!frameCfg.distance) frameCfg.distance = 0.f;
+  if (config.numFrames > 1 && !frameCfg.durationMs && !frameCfg.durationTicks) {
+    frameCfg.durationTicks = 1;
+  }
+  for (size_t frame = 0; frame < config.numFrames; ++frame) {
+    JXLTK_INFO("Writing frame [%zu/%zu]", frame + 1, config.numFrames);
+    JxlEncoderFrameSettings* settings =
+        frameConfigToJxlEncoderFrameSettings(enc, info, frameCfg, kTpsNumerator,
+                                             kTpsDenominator, config.xsize,
+                                             config.ysize, brotliEffort);
+    bool isLastFrame = frame == config.numFrames - 1;
+#ifdef JXLTK_HAVE_CHUNKED_FRAMES
+    SynthChunkSource source(config, frame);
+    if (JxlEncoderAddChunkedFrame(settings, isLastFrame ? JXL_TRUE : JXL_FALSE,
+                                  source.get()) != JXL_ENC_SUCCESS) {
+      throw JxltkError("%s: Failed to add frame %zu", __func__, frame);
+    }
+#else
+    // Without chunked frames, generate the whole frame up front.
+    const JxlPixelFormat colorFormat = {config.numColorChannels, sampleType(config),
+                                        JXL_NATIVE_ENDIAN, 0};
+    const JxlPixelFormat ecFormat = {1, sampleType(config), JXL_NATIVE_ENDIAN, 0};
+    size_t size;
+    std::unique_ptr<uint8_t[]> pixels(makeRegion(config, frame, 0,
+                                                 config.numColorChannels, 0, 0,
+                                                 config.xsize, config.ysize, &size));
+    if (JxlEncoderAddImageFrame(settings, &colorFormat, pixels.get(), size)
+        != JXL_ENC_SUCCESS) {
+      throw JxltkError("%s: Failed to add frame %zu", __func__, frame);
+    }
+    for (uint32_t ec = 0; ec < info.num_extra_channels; ++ec) {
+      pixels.reset(makeRegion(config, frame, config.numColorChannels + ec, 1, 0, 0,
+                              config.xsize, config.ysize, &size));
+      if (JxlEncoderSetExtraChannelBuffer(settings, &ecFormat, pixels.get(), size, ec)
+          != JXL_ENC_SUCCESS) {
+        throw JxltkError("%s: Failed to add extra channel %" PRIu32 " of frame %zu",
+                         __func__, ec, frame);
+      }
+    }
+    if (isLastFrame) {
+      JxlEncoderCloseFrames(enc);
+    }
+#endif
+    countPixelsEncoded(uint64_t{config.xsize} * config.ysize);
+    flushOrThrow(enc, out, "a frame");
+  }
+}
+
+}  // namespace jxltk
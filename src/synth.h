@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) Alistair Barrow. All rights reserved.
+ *
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file.
+ */
+#ifndef JXLTK_SYNTH_H_
+#define JXLTK_SYNTH_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+
+#include "common.h"
+#include "mergeconfig.h"
+
+namespace jxltk {
+
+/**
+ * Description of a synthetic JXL, for benchmarks and load tests.
+ *
+ * The same settings always produce the same pixels and boxes.  Frames are a noisy
+ * gradient with a small square that moves from frame to frame, surrounded by
+ * @ref border zero pixels (which are transparent if there's alpha).
+ */
+struct SynthConfig {
+  uint32_t xsize{256};
+  uint32_t ysize{256};
+  size_t numFrames{1};
+  /** 1-16 for integer samples; 16 or 32 for float samples. */
+  uint32_t bitsPerSample{8};
+  bool floatSamples{false};
+  /** 1 for grayscale or 3 for color. */
+  uint32_t numColorChannels{3};
+  bool alpha{false};
+  /** Number of extra channels in addition to alpha. */
+  uint32_t numExtraChannels{0};
+  uint32_t border{0};
+  /** Number of metadata boxes, which forces the container format when non-zero. */
+  size_t numBoxes{0};
+  size_t boxSize{4096};
+  bool compressBoxes{false};
+  uint32_t seed{0};
+
+  /**
+   * Return a short name summarizing these settings, suitable for a file name.
+   */
+  std::string name() const;
+};
+
+/**
+ * Return the value of one sample of a synthetic frame, between 0 and 1.
+ *
+ * @param[in] channel Index of the channel: color channels first, then alpha (if any),
+ *   then the other extra channels.
+ */
+float synthSample(const SynthConfig& config, size_t frame, size_t channel, uint32_t x,
+                  uint32_t y);
+
+/**
+ * Encode the JXL described by @p config.
+ *
+ * Frames are generated a region at a time as libjxl asks for them when possible, so
+ * very large frames don't need to be held in memory.
+ *
+ * @param[in] frameConfig Encoding settings for every frame.  Unless they say otherwise,
+ *   frames are lossless, and animation frames last 1 tick at 10 ticks per second.
+ * @param[in] numThreads 1 to encode on the calling thread, or any other value to use the
+ *   shared thread pool.
+ */
+void synthesize(const SynthConfig& config, EncoderOutput& out,
+                const FrameConfig& frameConfig = {}, size_t numThreads = 0,
+                std::optional<int16_t> brotliEffort = {});
+
+}  // namespace jxltk
+
+#endif  // JXLTK_SYNTH_H_
@@ -0,0 +1,100 @@
+/**
+ * Copyright (c) Alistair Barrow. All rights reserved.
+ *
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file.
+ */
+
+#include <cstdint>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <jxlazy/decoder.h>
+
+#include "common.h"
+#include "synth.h"
+
+TEST(Synth, SamplesAreReproducible) {
+  jxltk::SynthConfig config;
+  config.xsize = 64;
+  config.ysize = 48;
+  config.alpha = true;
+  config.border = 4;
+
+  EXPECT_EQ(jxltk::synthSample(config, 2, 1, 20, 30),
+            jxltk::synthSample(config, 2, 1, 20, 30));
+  // Border is zero in every channel, alpha is opaque inside it
+  for (size_t c = 0; c < 4; ++c) {
+    EXPECT_EQ(jxltk::synthSample(config, 0, c, 3, 10), 0.f);
+    EXPECT_EQ(jxltk::synthSample(config, 0, c, 10, 44), 0.f);
+  }
+  EXPECT_EQ(jxltk::synthSample(config, 0, 3, 4, 4), 1.f);
+  EXPECT_EQ(jxltk::synthSample(config, 0, 3, 59, 43), 1.f);
+
+  // A different seed changes the image
+  size_t differences = 0;
+  jxltk::SynthConfig reseeded = config;
+  reseeded.seed = 1;
+  for (uint32_t x = 4; x < 60; ++x) {
+    differences += jxltk::synthSample(config, 0, 0, x, 20) !=
+                   jxltk::synthSample(reseeded, 0, 0, x, 20);
+  }
+  EXPECT_GT(differences, 0);
+}
+
+TEST(Synth, Encode) {
+  jxltk::SynthConfig config;
+  config.xsize = 40;
+  config.ysize = 30;
+  config.numFrames = 3;
+  config.bitsPerSample = 16;
+  config.alpha = true;
+  config.numExtraChannels = 2;
+  config.numBoxes = 2;
+  config.boxSize = 1000;
+  config.compressBoxes = true;
+
+  std::string jxlBytes;
+  {
+    std::ostringstream oss;
+    jxltk::EncoderOutput out(&oss);
+    jxltk::synthesize(config, out);
+    jxlBytes = oss.str();
+  }
+
+  jxlazy::Decoder dec;
+  dec.openMemory(reinterpret_cast<const uint8_t*>(jxlBytes.data()), jxlBytes.size(),
+                 jxlazy::DecoderFlag::NoCoalesce, jxlazy::DecoderHint::NoColorProfile);
+  JxlBasicInfo info = dec.getBasicInfo();
+  EXPECT_EQ(info.xsize, 40);
+  EXPECT_EQ(info.ysize, 30);
+  EXPECT_EQ(info.bits_per_sample, 16);
+  EXPECT_EQ(info.num_color_channels, 3);
+  EXPECT_EQ(info.num_extra_channels, 3);
+  EXPECT_EQ(info.alpha_bits, 16);
+  EXPECT_EQ(dec.frameCount(), 3);
+  std::vector<jxlazy::ExtraChannelInfo> ecInfo = dec.getExtraChannelInfo();
+  ASSERT_EQ(ecInfo.size(), 3);
+  EXPECT_EQ(ecInfo[0].info.type, JXL_CHANNEL_ALPHA);
+  EXPECT_EQ(ecInfo[2].name, "synth2");
+
+  ASSERT_EQ(dec.boxCount(), 2);
+  std::vector<uint8_t> content;
+  EXPECT_TRUE(dec.getBoxInfo(1).compressed);
+  EXPECT_EQ(memcmp(dec.getBoxInfo(1).type, "xml ", 4), 0);
+  EXPECT_TRUE(dec.getBoxContent(1, &content));
+  EXPECT_EQ(content.size(), 1000);
+
+  // Lossless by default
+  JxlPixelFormat format = {4, JXL_TYPE_UINT16, JXL_NATIVE_ENDIAN, 0};
+  std::vector<uint16_t> pixels(40 * 30 * 4);
+  dec.getFramePixels(2, format, pixels.data(), pixels.size() * sizeof pixels[0]);
+  for (uint32_t c = 0; c < 4; ++c) {
+    float expected = jxltk::synthSample(config, 2, c, 11, 7);
+    EXPECT_EQ(pixels[(7 * 40 + 11) * 4 + c], static_cast<uint16_t>(expected * 65535 + .5f));
+  }
+}
@@ -0,0 +1,238 @@
+/*
+ * Copyright (c) Alistair Barrow. All rights reserved.
+ *
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <mutex>
+
+#include <jxl/thread_parallel_runner.h>
+
+#include "log.h"
+#include "threadpool.h"
+
+namespace jxltk {
+
+/**
+ * One call to ThreadPool::run.  Values are claimed with an atomic counter by the caller
+ * and any workers that join.
+ */
+struct ThreadPool::Job {
+  JxlParallelRunFunction func;
+  void* opaque;
+  uint32_t end;
+  size_t numThreads;
+  // Wider than the values so claiming past the end can't wrap
+  std::atomic<uint64_t> next;
+  std::atomic<uint32_t> remaining;
+  // Next thread ID to give a joining worker; guarded by the pool's mutex.
+  size_t nextThreadId{1};
+  std::mutex doneMutex{};
+  std::condition_variable done{};
+
+  Job(JxlParallelRunFunction func, void* opaque, uint32_t start, uint32_t end,
+      size_t numThreads)
+      : func(func), opaque(opaque), end(end), numThreads(numThreads), next(start),
+        remaining(end - start) {}
+
+  bool hasWork() const { return next.load(std::memory_order_relaxed) < end; }
+
+  /** Run values as @p threadId until there are none left to claim. */
+  void work(size_t threadId) {
+    uint32_t finished = 0;
+    for (uint64_t value; (value = next.fetch_add(1)) < end; ++finished) {
+      func(opaque, static_cast<uint32_t>(value), threadId);
+    }
+    if (finished > 0 && remaining.fetch_sub(finished) == finished) {
+      std::lock_guard<std::mutex> lock(doneMutex);
+      done.notify_all();
+    }
+  }
+};
+
+ThreadPool::ThreadPool(size_t numWorkers) {
+  workers_.reserve(numWorkers);
+  for (size_t i = 0; i < numWorkers; ++i) {
+    workers_.emplace_back(&ThreadPool::workerMain_, this);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  wake_.notify_all();
+  for (std::thread& worker : workers_) {
+    worker.join();
+  }
+}
+
+JxlParallelRetCode ThreadPool::run(void* runnerOpaque, void* jpegxlOpaque,
+                                   JxlParallelRunInit init, JxlParallelRunFunction func,
+                                   uint32_t startRange, uint32_t endRange) {
+  ThreadPool* pool = static_cast<ThreadPool*>(runnerOpaque);
+  if (startRange > endRange) {
+    return -1;
+  }
+  const size_t numThreads = std::clamp<size_t>(endRange - startRange, 1,
+                                               pool->numWorkers() + 1);
+  JxlParallelRetCode ret = init(jpegxlOpaque, numThreads);
+  if (ret != 0) {
+    return ret;
+  }
+  if (numThreads == 1) {
+    for (uint32_t value = startRange; value < endRange; ++value) {
+      func(jpegxlOpaque, value, 0);
+    }
+    return 0;
+  }
+
+  auto job = std::make_shared<Job>(func, jpegxlOpaque, startRange, endRange, numThreads);
+  {
+    std::lock_guard<std::mutex> lock(pool->mutex_);
+    pool->jobs_.push_back(job);
+  }
+  pool->wake_.notify_all();
+  job->work(0);
+
+  // Take the job off the queue if workers haven't already, then wait for any of them
+  // that are still running values.
+  {
+    std::lock_guard<std::mutex> lock(pool->mutex_);
+    auto queued = std::find(pool->jobs_.begin(), pool->jobs_.end(), job);
+    if (queued != pool->jobs_.end()) {
+      pool->jobs_.erase(queued);
+    }
+  }
+  std::unique_lock<std::mutex> lock(job->doneMutex);
+  job->done.wait(lock, [&job]() { return job->remaining.load() == 0; });
+  return 0;
+}
+
+void ThreadPool::parallelFor(uint32_t count,
+                             const std::function<void(uint32_t)>& func) {
+  struct Call {
+    const std::function<void(uint32_t)>& func;
+    std::mutex errorMutex{};
+    std::exception_ptr error{};
+  } call{func};
+  auto init = [](void*, size_t) -> JxlParallelRetCode { return 0; };
+  auto runValue = [](void* opaque, uint32_t value, size_t) {
+    Call* call = static_cast<Call*>(opaque);
+    try {
+      call->func(value);
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(call->errorMutex);
+      if (!call->error) call->error = std::current_exception();
+    }
+  };
+  run(this, &call, init, runValue, 0, count);
+  if (call.error) std::rethrow_exception(call.error);
+}
+
+void ThreadPool::workerMain_() {
+  for (;;) {
+    std::shared_ptr<Job> job;
+    size_t threadId;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      wake_.wait(lock, [this]() { return stopping_ || !jobs_.empty(); });
+      if (stopping_) {
+        return;
+      }
+      job = jobs_.front();
+      threadId = job->nextThreadId++;
+      // Once a job has all the threads it can use, or nothing left to hand out, leave it
+      // to the threads already working on it.
+      if (job->nextThreadId >= job->numThreads || !job->hasWork()) {
+        jobs_.pop_front();
+      }
+      if (threadId >= job->numThreads) {
+        continue;
+      }
+    }
+    job->work(threadId);
+  }
+}
+
+BackgroundWorker::BackgroundWorker() : thread_(&BackgroundWorker::workerMain_, this) {}
+
+BackgroundWorker::~BackgroundWorker() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+    tasks_.clear();
+  }
+  wake_.notify_all();
+  thread_.join();
+}
+
+std::future<void> BackgroundWorker::post(std::function<void()> task) {
+  std::packaged_task<void()> packaged(std::move(task));
+  std::future<void> result = packaged.get_future();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    tasks_.push_back(std::move(packaged));
+  }
+  wake_.notify_one();
+  return result;
+}
+
+void BackgroundWorker::workerMain_() {
+  for (;;) {
+    std::packaged_task<void()> task;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      wake_.wait(lock, [this]() { return stopping_ || !tasks_.empty(); });
+      if (stopping_) {
+        return;
+      }
+      task = std::move(tasks_.front());
+      tasks_.pop_front();
+    }
+    task();
+  }
+}
+
+namespace {
+
+std::mutex sharedPoolMutex;
+std::atomic<size_t> sharedPoolThreads{0};
+std::unique_ptr<ThreadPool> sharedPool;
+
+size_t sharedPoolWorkers(size_t numThreads) {
+  return numThreads > 0 ? numThreads - 1 :
+                          JxlThreadParallelRunnerDefaultNumWorkerThreads();
+}
+
+}  // namespace
+
+bool setSharedThreadPoolSize(size_t numThreads) {
+  std::lock_guard<std::mutex> lock(sharedPoolMutex);
+  if (sharedPool) {
+    if (sharedPool->numWorkers() != sharedPoolWorkers(numThreads)) {
+      JXLTK_WARNING("Shared thread pool already has %zu workers.",
+                    sharedPool->numWorkers());
+      return false;
+    }
+    return true;
+  }
+  sharedPoolThreads = numThreads;
+  return true;
+}
+
+ThreadPool& sharedThreadPool() {
+  std::lock_guard<std::mutex> lock(sharedPoolMutex);
+  if (!sharedPool) {
+    sharedPool = std::make_unique<ThreadPool>(sharedPoolWorkers(sharedPoolThreads));
+    JXLTK_DEBUG("Started shared thread pool with %zu workers.", sharedPool->numWorkers());
+  }
+  return *sharedPool;
+}
+
+}  // namespace jxltk
@@ -0,0 +1,129 @@
+/*
+ * Copyright (c) Alistair Barrow. All rights reserved.
+ *
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file.
+ */
+#ifndef JXLTK_THREADPOOL_H_
+#define JXLTK_THREADPOOL_H_
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <jxl/parallel_runner.h>
+
+namespace jxltk {
+
+/**
+ * A fixed set of worker threads implementing libjxl's JxlParallelRunner interface.
+ *
+ * Unlike JxlThreadParallelRunner, one pool can be shared by any number of encoders and
+ * decoders running at the same time.  Each call to @ref run is queued as a job; idle
+ * workers join the oldest job that still has work and claim values from it one at a
+ * time, so the load balances itself.  The calling thread always works on its own job
+ * too, so a job completes even when every worker is busy elsewhere, and nested calls
+ * can't deadlock.
+ */
+class ThreadPool {
+ public:
+  /**
+   * Start @p numWorkers threads.  With 0 workers, every job runs on the calling thread.
+   */
+  explicit ThreadPool(size_t numWorkers);
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  /**
+   * Wait for the workers to exit.  There must be no jobs running.
+   */
+  ~ThreadPool();
+
+  size_t numWorkers() const { return workers_.size(); }
+
+  /**
+   * JxlParallelRunner implementation.  @p runnerOpaque must point to a ThreadPool.
+   */
+  static JxlParallelRetCode run(void* runnerOpaque, void* jpegxlOpaque,
+                                JxlParallelRunInit init, JxlParallelRunFunction func,
+                                uint32_t startRange, uint32_t endRange);
+
+  /**
+   * Call @p func for every value in `[0, count)`, on the calling thread and any idle
+   * workers, returning when every call has finished.  If any calls throw, the first
+   * exception is rethrown.
+   */
+  void parallelFor(uint32_t count, const std::function<void(uint32_t)>& func);
+
+ private:
+  struct Job;
+
+  std::vector<std::thread> workers_{};
+  std::mutex mutex_{};
+  std::condition_variable wake_{};
+  std::deque<std::shared_ptr<Job> > jobs_{};
+  bool stopping_{false};
+
+  void workerMain_();
+};
+
+/**
+ * A single thread that runs tasks one at a time, in the order they're posted.
+ *
+ * For work that has to overlap with the caller, rather than be split across the pool.
+ */
+class BackgroundWorker {
+ public:
+  BackgroundWorker();
+  BackgroundWorker(const BackgroundWorker&) = delete;
+  BackgroundWorker& operator=(const BackgroundWorker&) = delete;
+
+  /**
+   * Wait for the running task, if any, to finish.  Tasks that haven't started are
+   * dropped, and their futures report std::future_errc::broken_promise.
+   */
+  ~BackgroundWorker();
+
+  /**
+   * Queue @p task.  The returned future becomes ready when it has run, and rethrows
+   * anything it threw.
+   */
+  std::future<void> post(std::function<void()> task);
+
+ private:
+  std::mutex mutex_{};
+  std::condition_variable wake_{};
+  std::deque<std::packaged_task<void()> > tasks_{};
+  bool stopping_{false};
+  std::thread thread_{};
+
+  void workerMain_();
+};
+
+/**
+ * Set the number of threads in the pool returned by sharedThreadPool().
+ *
+ * This only has an effect before the pool is first used.
+ *
+ * @param[in] numThreads Maximum number of threads each libjxl call can use, including
+ *   the calling thread, or 0 to choose automatically.  The pool has one fewer worker
+ *   than this, so 1 means everything runs on the calling threads.
+ * @return false if the pool already exists with a different size.
+ */
+bool setSharedThreadPoolSize(size_t numThreads);
+
+/**
+ * Return the process-wide thread pool, creating it if necessary.
+ */
+ThreadPool& sharedThreadPool();
+
+}  // namespace jxltk
+
+#endif  // JXLTK_THREADPOOL_H_
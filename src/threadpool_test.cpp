@@ -0,0 +1,171 @@
+/**
+ * Copyright (c) Alistair Barrow. All rights reserved.
+ *
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "threadpool.h"
+
+namespace {
+
+struct RunState {
+  size_t numThreads{0};
+  std::vector<std::atomic<int> > counts;
+  std::atomic<bool> badThreadId{false};
+
+  explicit RunState(size_t size) : counts(size) {}
+
+  static JxlParallelRetCode init(void* opaque, size_t numThreads) {
+    static_cast<RunState*>(opaque)->numThreads = numThreads;
+    return 0;
+  }
+  static void func(void* opaque, uint32_t value, size_t threadId) {
+    RunState* state = static_cast<RunState*>(opaque);
+    if (threadId >= state->numThreads) {
+      state->badThreadId = true;
+    }
+    ++state->counts[value];
+  }
+};
+
+}  // namespace
+
+TEST(ThreadPool, RunsEveryValueOnce) {
+  for (size_t numWorkers : {0, 1, 4}) {
+    SCOPED_TRACE(testing::Message() << "numWorkers=" << numWorkers);
+    jxltk::ThreadPool pool(numWorkers);
+    EXPECT_EQ(pool.numWorkers(), numWorkers);
+
+    RunState state(1000);
+    EXPECT_EQ(jxltk::ThreadPool::run(&pool, &state, RunState::init, RunState::func,
+                                     10, 1000), 0);
+    EXPECT_GE(state.numThreads, 1);
+    EXPECT_LE(state.numThreads, numWorkers + 1);
+    EXPECT_FALSE(state.badThreadId);
+    for (size_t i = 0; i < state.counts.size(); ++i) {
+      EXPECT_EQ(state.counts[i], i < 10 ? 0 : 1) << "value " << i;
+    }
+
+    // Empty range
+    RunState empty(1);
+    EXPECT_EQ(jxltk::ThreadPool::run(&pool, &empty, RunState::init, RunState::func,
+                                     0, 0), 0);
+    EXPECT_EQ(empty.counts[0], 0);
+  }
+}
+
+TEST(ThreadPool, ConcurrentCallers) {
+  // Many callers sharing a small pool must all complete
+  jxltk::ThreadPool pool(2);
+  std::vector<std::unique_ptr<RunState> > states;
+  std::vector<std::future<JxlParallelRetCode> > results;
+  for (int i = 0; i < 16; ++i) {
+    RunState& state = *states.emplace_back(std::make_unique<RunState>(5000));
+    results.push_back(std::async(std::launch::async, [&pool, &state]() {
+      return jxltk::ThreadPool::run(&pool, &state, RunState::init, RunState::func,
+                                    0, 5000);
+    }));
+  }
+  for (size_t i = 0; i < results.size(); ++i) {
+    EXPECT_EQ(results[i].get(), 0);
+    EXPECT_FALSE(states[i]->badThreadId);
+    for (const std::atomic<int>& count : states[i]->counts) {
+      ASSERT_EQ(count, 1);
+    }
+  }
+}
+
+TEST(ThreadPool, InitFailure) {
+  jxltk::ThreadPool pool(2);
+  RunState state(10);
+  auto failInit = [](void*, size_t) -> JxlParallelRetCode { return -5; };
+  EXPECT_EQ(jxltk::ThreadPool::run(&pool, &state, failInit, RunState::func, 0, 10), -5);
+  for (const std::atomic<int>& count : state.counts) {
+    EXPECT_EQ(count, 0);
+  }
+}
+
+TEST(ThreadPool, ParallelFor) {
+  for (size_t numWorkers : {0, 3}) {
+    SCOPED_TRACE(testing::Message() << "numWorkers=" << numWorkers);
+    jxltk::ThreadPool pool(numWorkers);
+    std::vector<std::atomic<int> > counts(100);
+    pool.parallelFor(100, [&counts](uint32_t value) { ++counts[value]; });
+    for (const std::atomic<int>& count : counts) {
+      EXPECT_EQ(count, 1);
+    }
+    pool.parallelFor(0, [](uint32_t) { FAIL(); });
+
+    // Every value still runs, and the exception reaches the caller
+    std::atomic<int> ran{0};
+    EXPECT_THROW(pool.parallelFor(10, [&ran](uint32_t value) {
+      ++ran;
+      if (value == 5) throw std::runtime_error("value 5");
+    }), std::runtime_error);
+    EXPECT_EQ(ran, 10);
+  }
+}
+
+TEST(BackgroundWorker, RunsTasksInOrder) {
+  std::vector<int> order;
+  std::vector<std::future<void> > results;
+  {
+    jxltk::BackgroundWorker worker;
+    for (int i = 0; i < 20; ++i) {
+      results.push_back(worker.post([&order, i]() { order.push_back(i); }));
+    }
+    results.push_back(worker.post([]() { throw std::runtime_error("task failed"); }));
+    for (size_t i = 0; i + 1 < results.size(); ++i) {
+      results[i].get();
+    }
+    EXPECT_THROW(results.back().get(), std::runtime_error);
+  }
+  ASSERT_EQ(order.size(), 20);
+  for (int i = 0; i < 20; ++i) {
+    EXPECT_EQ(order[i], i);
+  }
+}
+
+TEST(BackgroundWorker, DropsQueuedTasks) {
+  std::promise<void> release;
+  std::shared_future<void> released = release.get_future().share();
+  std::promise<void> started;
+  std::atomic<int> ran{0};
+  std::future<void> first, second;
+  std::thread releaser;
+  {
+    jxltk::BackgroundWorker worker;
+    first = worker.post([&]() {
+      started.set_value();
+      released.wait();
+      ++ran;
+    });
+    second = worker.post([&]() { ++ran; });
+    started.get_future().wait();
+    // The destructor waits for the running task, but not the queued one
+    releaser = std::thread([&release]() {
+      std::this_thread::sleep_for(std::chrono::milliseconds(20));
+      release.set_value();
+    });
+  }
+  releaser.join();
+  EXPECT_EQ(ran, 1);
+  first.get();
+  try {
+    second.get();
+    FAIL();
+  } catch (const std::future_error& e) {
+    EXPECT_EQ(e.code(), std::future_errc::broken_promise);
+  }
+}
@@ -0,0 +1,182 @@
+/*
+ * Copyright (c) Alistair Barrow. All rights reserved.
+ *
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file.
+ */
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#endif
+
+#include "../contrib/jxlazy/include/jxlazy/decoder.h"
+
+#include "except.h"
+#include "stats.h"
+#include "trace.h"
+
+namespace jxltk {
+
+namespace detail {
+std::atomic<unsigned> spanSinks{0};
+}
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+const Clock::time_point epoch = Clock::now();
+
+std::mutex traceMutex;
+FILE* traceFile = nullptr;
+bool firstEvent = true;
+double traceStartUs = 0;
+
+std::mutex sinkMutex;
+
+std::atomic<uint32_t> nextThreadId{1};
+
+/** Small, stable number identifying the calling thread in the trace. */
+uint32_t currentThreadId() {
+  thread_local uint32_t id = nextThreadId++;
+  return id;
+}
+
+double nowUs() {
+  return std::chrono::duration<double, std::micro>(Clock::now() - epoch).count();
+}
+
+/** CPU time used by the calling thread, or 0 if unknown. */
+double threadCpuUs() {
+#if defined(_WIN32)
+  FILETIME creation, exit, kernel, user;
+  if (!GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user)) return 0;
+  ULARGE_INTEGER k{{kernel.dwLowDateTime, kernel.dwHighDateTime}};
+  ULARGE_INTEGER u{{user.dwLowDateTime, user.dwHighDateTime}};
+  return static_cast<double>(k.QuadPart + u.QuadPart) / 10.;
+#elif defined(CLOCK_THREAD_CPUTIME_ID)
+  struct timespec ts;
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0) return 0;
+  return static_cast<double>(ts.tv_sec) * 1e6 + static_cast<double>(ts.tv_nsec) / 1e3;
+#else
+  return 0;
+#endif
+}
+
+void writeEvent(const char* name, double startUs, double endUs, int64_t index) {
+  const uint32_t tid = currentThreadId();
+  const char* category = strncmp(name, "jxlazy::", 8) == 0 ? "jxlazy" : "jxltk";
+  std::lock_guard<std::mutex> lock(traceMutex);
+  if (!traceFile) return;
+  fprintf(traceFile, "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,"
+          "\"dur\":%.3f,\"pid\":1,\"tid\":%" PRIu32, firstEvent ? "" : ",\n", name,
+          category, startUs - traceStartUs, endUs - startUs, tid);
+  if (index >= 0) {
+    fprintf(traceFile, ",\"args\":{\"index\":%" PRId64 "}", index);
+  }
+  fputc('}', traceFile);
+  firstEvent = false;
+}
+
+/** Report a finished span to every sink. */
+void endSpan(const char* name, int64_t index, double startUs, double startCpuUs) {
+  const unsigned sinks = detail::spanSinks.load(std::memory_order_relaxed);
+  const double endUs = nowUs();
+  if ((sinks & detail::SpanSink::Stats)) {
+    detail::recordSpan(name, endUs - startUs, threadCpuUs() - startCpuUs);
+  }
+  if ((sinks & detail::SpanSink::Trace)) {
+    writeEvent(name, startUs, endUs, index);
+  }
+}
+
+// Decoder operations reported by jxlazy on this thread that haven't ended yet:
+// (name, start time, start CPU time).
+thread_local std::vector<std::tuple<const char*, double, double> > decoderSpans;
+
+void beginDecoderSpan(const char* name) {
+  decoderSpans.emplace_back(name, nowUs(), threadCpuUs());
+}
+
+void endDecoderSpan() {
+  if (decoderSpans.empty()) return;
+  const auto [name, startUs, startCpuUs] = decoderSpans.back();
+  decoderSpans.pop_back();
+  endSpan(name, -1, startUs, startCpuUs);
+}
+
+}  // namespace
+
+
+namespace detail {
+
+void setSpanSink(SpanSink sink, bool enabled) {
+  std::lock_guard<std::mutex> lock(sinkMutex);
+  const unsigned before = spanSinks.load();
+  const unsigned after = enabled ? before | sink : before & ~static_cast<unsigned>(sink);
+  if (before == 0 && after != 0) {
+    jxlazy::setTraceHandler({.begin = beginDecoderSpan, .end = endDecoderSpan});
+  }
+  spanSinks.store(after);
+  if (before != 0 && after == 0) {
+    jxlazy::setTraceHandler({});
+  }
+}
+
+}  // namespace detail
+
+void startTrace(const std::string& path) {
+  {
+    std::lock_guard<std::mutex> lock(traceMutex);
+    if (traceFile) {
+      throw JxltkError("%s: A trace is already running.", __func__);
+    }
+    traceFile = fopen(path.c_str(), "wb");
+    if (!traceFile) {
+      throw JxltkError("%s: Can't create %s: %s", __func__, path.c_str(),
+                       strerror(errno));
+    }
+    fputs("[\n", traceFile);
+    firstEvent = true;
+    traceStartUs = nowUs();
+  }
+  detail::setSpanSink(detail::SpanSink::Trace, true);
+}
+
+void stopTrace() {
+  detail::setSpanSink(detail::SpanSink::Trace, false);
+  std::lock_guard<std::mutex> lock(traceMutex);
+  if (!traceFile) return;
+  fputs("\n]\n", traceFile);
+  fclose(traceFile);
+  traceFile = nullptr;
+}
+
+void TraceSpan::start_() {
+  started_ = true;
+  startUs_ = nowUs();
+  startCpuUs_ = threadCpuUs();
+}
+
+void TraceSpan::finish_() const {
+  endSpan(name_, index_, startUs_, startCpuUs_);
+}
+
+}  // namespace jxltk
@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) Alistair Barrow. All rights reserved.
+ *
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file.
+ */
+#ifndef JXLTK_TRACE_H_
+#define JXLTK_TRACE_H_
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+namespace jxltk {
+
+/**
+ * Start recording TraceSpans (and jxlazy decoder operations) as a timeline in Chrome's
+ * trace event format, which can be opened in Perfetto or chrome://tracing.  Events are
+ * appended to @p path as each span ends.  Throws JxltkError if the file can't be
+ * created.
+ */
+void startTrace(const std::string& path);
+
+/**
+ * Finish the trace file started by startTrace.  Spans still running are dropped.
+ */
+void stopTrace();
+
+/**
+ * Starts a trace on construction and finishes it on destruction.
+ */
+class ScopedTrace {
+ public:
+  explicit ScopedTrace(const std::string& path) { startTrace(path); }
+  ScopedTrace(const ScopedTrace&) = delete;
+  ScopedTrace& operator=(const ScopedTrace&) = delete;
+  ~ScopedTrace() { stopTrace(); }
+};
+
+namespace detail {
+/** Consumers of TraceSpans, combined in spanSinks. */
+enum SpanSink : unsigned {
+  Trace = 1,
+  Stats = 2,
+};
+extern std::atomic<unsigned> spanSinks;
+
+/**
+ * Add or remove @p sink from spanSinks, and keep the jxlazy trace handler installed
+ * while there's any sink.
+ */
+void setSpanSink(SpanSink sink, bool enabled);
+}  // namespace detail
+
+/**
+ * Records the time between construction and destruction as a span on the current
+ * thread, if a trace is running or stats are being collected (see stats.h).  Otherwise
+ * this costs one atomic load.
+ */
+class TraceSpan {
+ public:
+  /**
+   * @param[in] name Name of the span, which must outlive the trace (normally a string
+   *   literal).  It's written to the trace without escaping.
+   * @param[in] index Frame or box index to attach to the span, or -1 for none.
+   */
+  explicit TraceSpan(const char* name, int64_t index = -1) : name_(name), index_(index) {
+    if (detail::spanSinks.load(std::memory_order_relaxed) != 0) start_();
+  }
+  TraceSpan(const TraceSpan&) = delete;
+  TraceSpan& operator=(const TraceSpan&) = delete;
+  ~TraceSpan() {
+    if (started_) finish_();
+  }
+
+ private:
+  const char* name_;
+  int64_t index_;
+  bool started_{false};
+  double startUs_{0};
+  double startCpuUs_{0};
+
+  void start_();
+  void finish_() const;
+};
+
+}  // namespace jxltk
+
+#endif  // JXLTK_TRACE_H_
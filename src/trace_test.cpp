@@ -0,0 +1,56 @@
+/**
+ * Copyright (c) Alistair Barrow. All rights reserved.
+ *
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file.
+ */
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "except.h"
+#include "trace.h"
+#include "util.h"
+
+static size_t countOf(const std::string& haystack, const std::string& needle) {
+  size_t count = 0;
+  for (size_t pos = haystack.find(needle); pos != std::string::npos;
+       pos = haystack.find(needle, pos + 1)) {
+    ++count;
+  }
+  return count;
+}
+
+TEST(Trace, WritesCompleteEvents) {
+  { jxltk::TraceSpan ignored("beforeTrace"); }
+
+  jxltk::TempFile tmp;
+  tmp.open();
+  tmp.close();
+  {
+    jxltk::ScopedTrace trace(tmp.path);
+    EXPECT_THROW(jxltk::startTrace(tmp.path), jxltk::JxltkError);
+    {
+      jxltk::TraceSpan outer("outer");
+      jxltk::TraceSpan inner("inner", 7);
+    }
+    std::thread([] { jxltk::TraceSpan span("otherThread"); }).join();
+  }
+  { jxltk::TraceSpan ignored("afterTrace"); }
+
+  std::vector<uint8_t> bytes;
+  jxltk::loadFile(tmp.path, &bytes);
+  std::string json(bytes.begin(), bytes.end());
+  EXPECT_EQ(json.front(), '[');
+  EXPECT_TRUE(json.ends_with("}\n]\n"));
+  EXPECT_EQ(countOf(json, "\"ph\":\"X\""), 3);
+  EXPECT_EQ(countOf(json, "\"name\":\"outer\""), 1);
+  EXPECT_EQ(countOf(json, "\"name\":\"inner\""), 1);
+  EXPECT_EQ(countOf(json, "\"args\":{\"index\":7}"), 1);
+  EXPECT_EQ(countOf(json, "\"name\":\"otherThread\""), 1);
+  EXPECT_EQ(countOf(json, "beforeTrace"), 0);
+  EXPECT_EQ(countOf(json, "afterTrace"), 0);
+}
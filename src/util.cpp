@@ -4,6 +4,8 @@
  * Use of this source code is governed by an MIT-style
  * license that can be found in the LICENSE file.
 */
+#include <algorithm>
+#include <atomic>
 #include <cinttypes>
 #include <cmath>
 #include <cstring>
@@ -11,10 +13,13 @@
 #include <fstream>
 #include <iostream>
 #include <numeric>
+#include <optional>
 #include <sstream>
 #include <stdexcept>
 #include <string>
 #include <string_view>
+#include <tuple>
+#include <utility>
 #include <vector>
 
 #include <jxl/types.h>
@@ -22,6 +27,9 @@
 #include "../contrib/jxlazy/include/jxlazy/decoder.h"
 
 #include "log.h"
+#include "pixelalloc.h"
+#include "simd.h"
+#include "threadpool.h"
 #include "util.h"
 
 using std::cerr;
@@ -29,6 +37,7 @@ using std::cin;
 using std::ifstream;
 using std::istream;
 using std::ofstream;
+using std::optional;
 using std::ostream;
 using std::ostringstream;
 using std::string;
@@ -175,6 +184,35 @@ std::optional<std::pair<uint32_t,uint32_t> > parseRational(const char* s) {
            static_cast<uint32_t>(tpsDenominator)}};
 }
 
+std::optional<size_t> parseByteSize(const char* s) {
+  if (*s < '0' || *s > '9') {
+    return {};
+  }
+  char* endptr;
+  errno = 0;
+  unsigned long long value = strtoull(s, &endptr, 10);
+  if (errno != 0 || value > SIZE_MAX) {
+    return {};
+  }
+  size_t result = static_cast<size_t>(value);
+  int shift = 0;
+  switch (*endptr) {
+    case '\0': break;
+    case 'k': case 'K': shift = 10; break;
+    case 'm': case 'M': shift = 20; break;
+    case 'g': case 'G': shift = 30; break;
+    case 't': case 'T': shift = 40; break;
+    default: return {};
+  }
+  if (shift > 0 && *++endptr != '\0') {
+    return {};
+  }
+  if (!safeMul(result, size_t{1} << shift, &result)) {
+    return {};
+  }
+  return result;
+}
+
 int removeInterleavedChannel(void* pixels, uint32_t xsize, uint32_t ysize,
                              const JxlPixelFormat& inFormat, uint32_t index) {
   if (index >= inFormat.num_channels) {
@@ -226,6 +264,43 @@ float getEpsilon(uint32_t bits) {
   return static_cast<float>(1.0 / (2 * (pow(2, bits) - 1)));
 }
 
+size_t findDifferentSampleParallel(const float* left, const float* right, size_t count,
+                                   float epsilon, size_t numBands, size_t minBandSize) {
+  // Number of samples each band checks between looking for a result from other bands
+  constexpr size_t kStepSize = 1 << 14;
+
+  if (numBands == 0) {
+    numBands = sharedThreadPool().numWorkers() + 1;
+  }
+  numBands = std::min(numBands, count / std::max<size_t>(minBandSize, 1));
+  if (numBands <= 1) {
+    return findDifferentSample(left, right, count, epsilon);
+  }
+  const size_t bandSize = (count + numBands - 1) / numBands;
+
+  std::atomic<size_t> result{count};
+  auto checkBand = [&](size_t start) {
+    const size_t end = std::min(start + bandSize, count);
+    for (size_t pos = start; pos < end; pos += kStepSize) {
+      if (result.load(std::memory_order_relaxed) != count) {
+        return;
+      }
+      size_t stepCount = std::min(kStepSize, end - pos);
+      size_t found = findDifferentSample(left + pos, right + pos, stepCount, epsilon);
+      if (found < stepCount) {
+        size_t expected = count;
+        result.compare_exchange_strong(expected, pos + found);
+        return;
+      }
+    }
+  };
+
+  sharedThreadPool().parallelFor(static_cast<uint32_t>(numBands), [&](uint32_t band) {
+    checkBand(band * bandSize);
+  });
+  return result.load();
+}
+
 /**
  * Given two open Decoders, check that every pixel in every channel of every frame matches
  *
@@ -234,9 +309,14 @@ float getEpsilon(uint32_t bits) {
  * were opened.  Channels depths can be different, but each channel is compared at the
  * higher depth.
  *
+ * Both inputs are decoded one frame at a time, concurrently when the shared thread pool
+ * has a spare worker, and each channel is compared in up to @p numThreads bands on the
+ * pool, stopping as soon as any difference is found.
+ *
  * @return true if all pixels match, else false.
  */
-bool haveSamePixels(jxlazy::Decoder& leftImage, jxlazy::Decoder& rightImage) {
+bool haveSamePixels(jxlazy::Decoder& leftImage, jxlazy::Decoder& rightImage,
+                    size_t numThreads) {
   JxlBasicInfo leftInfo = leftImage.getBasicInfo();
   JxlBasicInfo rightInfo = rightImage.getBasicInfo();
   if (leftInfo.num_color_channels != rightInfo.num_color_channels) {
@@ -306,55 +386,98 @@ bool haveSamePixels(jxlazy::Decoder& leftImage, jxlazy::Decoder& rightImage) {
                 ecEpsilons[eci]);
   }
 
-  jxlazy::FramePixels<float> leftFrame, rightFrame;
+  PixelFrame<float> leftFrame = makePixelFrame<float>();
+  PixelFrame<float> rightFrame = makePixelFrame<float>();
   for (size_t frameIdx = 0; frameIdx < frameCount; ++frameIdx) {
-    leftImage.getFramePixels(&leftFrame, frameIdx, leftInfo.num_color_channels,
-                             std::span<const int>({-1}));
-    rightImage.getFramePixels(&rightFrame, frameIdx, rightInfo.num_color_channels,
-                              std::span<const int>({-1}));
-
-    const float* thisLeftColorData = leftFrame.color.data();
-    const float* thisRightColorData = rightFrame.color.data();
-    for (size_t sampleIdx = 0; sampleIdx < leftFrame.color.size(); ++sampleIdx) {
-      float diff = std::fabs(*thisLeftColorData++ - *thisRightColorData++);
-      if (diff >= colorEpsilon) {
-        size_t pixelIndex = sampleIdx / leftInfo.num_color_channels;
-        JXLTK_DEBUG("Color samples in frame %zu at pixel %zux%zu channel %zu differ "
-                    "when decoded with %" PRIu32 "-bit precision", frameIdx,
-                    pixelIndex % frameLayerInfos[frameIdx].ysize,
-                    pixelIndex / frameLayerInfos[frameIdx].ysize,
-                    sampleIdx % leftInfo.num_color_channels, colorBitsPerSample);
-        return false;
+    // Decode both frames concurrently if the pool has a spare worker - the decoders
+    // are independent.
+    sharedThreadPool().parallelFor(2, [&, frameIdx](uint32_t side) {
+      if (side == 0) {
+        leftImage.getFramePixels(&leftFrame, frameIdx, leftInfo.num_color_channels,
+                                 std::span<const int>({-1}));
+      } else {
+        rightImage.getFramePixels(&rightFrame, frameIdx, rightInfo.num_color_channels,
+                                  std::span<const int>({-1}));
       }
+    });
+
+    const uint32_t frameXsize = frameLayerInfos[frameIdx].xsize;
+    size_t sampleIdx = findDifferentSampleParallel(leftFrame.color.data(),
+                                                   rightFrame.color.data(),
+                                                   leftFrame.color.size(),
+                                                   colorEpsilon, numThreads);
+    if (sampleIdx < leftFrame.color.size()) {
+      size_t pixelIndex = sampleIdx / leftInfo.num_color_channels;
+      JXLTK_DEBUG("Color samples in frame %zu at pixel %zux%zu channel %zu differ "
+                  "when decoded with %" PRIu32 "-bit precision", frameIdx,
+                  pixelIndex % frameXsize, pixelIndex / frameXsize,
+                  sampleIdx % leftInfo.num_color_channels, colorBitsPerSample);
+      return false;
     }
     auto leftEcIter = leftFrame.ecs.cbegin();
     auto rightEcIter = rightFrame.ecs.cbegin();
     for (size_t ec = 0; ec < leftFrame.ecs.size(); ++ec) {
-      const std::vector<float>& leftEc = (leftEcIter++)->second;
-      const std::vector<float>& rightEc = (rightEcIter++)->second;
-      const float* leftEcData = leftEc.data();
-      const float* rightEcData = rightEc.data();
-      for (size_t sampleIdx = 0; sampleIdx < leftEc.size(); ++sampleIdx) {
-        float diff = std::fabs(*leftEcData++ - *rightEcData++);
-        if (diff >= ecEpsilons[ec]) {
-          size_t pixelIndex = sampleIdx;
-          JXLTK_DEBUG("Extra channel samples in frame %zu at pixel %zux%zu channel %zu"
-                      " differ.", frameIdx,
-                      pixelIndex / frameLayerInfos[frameIdx].ysize,
-                      pixelIndex % frameLayerInfos[frameIdx].ysize,
-                      ec);
-          return false;
-        }
+      const PixelVector<float>& leftEc = (leftEcIter++)->second;
+      const PixelVector<float>& rightEc = (rightEcIter++)->second;
+      size_t pixelIndex = findDifferentSampleParallel(leftEc.data(), rightEc.data(),
+                                                      leftEc.size(), ecEpsilons[ec],
+                                                      numThreads);
+      if (pixelIndex < leftEc.size()) {
+        JXLTK_DEBUG("Extra channel samples in frame %zu at pixel %zux%zu channel %zu"
+                    " differ.", frameIdx,
+                    pixelIndex % frameXsize, pixelIndex / frameXsize,
+                    ec);
+        return false;
       }
     }
   }
   return true;
 }
 
+namespace {
+
+/**
+ * Searches rows of interleaved samples for non-zero pixels.
+ */
+template<class T>
+struct RowScanner {
+  const T* samples;
+  uint32_t xsize;
+  size_t numChannels;
+  bool alphaOnly;
+
+  /** Return the first non-zero pixel in `[begin, end)` of row @p y, or @p end. */
+  uint32_t first(uint32_t y, uint32_t begin, uint32_t end) const {
+    return begin + static_cast<uint32_t>(findNonZeroPixel(at(y, begin), end - begin,
+                                                          numChannels, alphaOnly));
+  }
+  /** Return one past the last non-zero pixel in `[begin, end)` of row @p y, or @p begin. */
+  uint32_t last(uint32_t y, uint32_t begin, uint32_t end) const {
+    return begin + static_cast<uint32_t>(findLastNonZeroPixel(at(y, begin), end - begin,
+                                                              numChannels, alphaOnly));
+  }
+  const T* at(uint32_t y, uint32_t x) const {
+    return samples + (size_t{y} * xsize + x) * numChannels;
+  }
+};
+
+/**
+ * A row found to contain non-zero pixels, and the span they occupy.
+ */
+struct OccupiedRow {
+  uint32_t y;
+  uint32_t x0;
+  uint32_t x1;
+};
+
+}  // namespace
+
 template<class T>
 int findCropRegion(const T* psamples, uint32_t xsize, uint32_t ysize,
                    size_t numChannels, bool alphaCrop, CropRegion* cropRegion,
-                   const CropRegion* protectRegion) {
+                   const CropRegion* protectRegion, size_t numThreads) {
+  // Not worth splitting the work for less than this many samples each
+  constexpr size_t kMinBandSize = 1 << 18;
 
   JXLTK_TRACE("%" PRIu32 "x%" PRIu32 "; %zu channels; alphaCrop=%d", xsize, ysize,
               numChannels, alphaCrop ? 1 : 0);
@@ -363,12 +486,12 @@ int findCropRegion(const T* psamples, uint32_t xsize, uint32_t ysize,
     cropRegion->x0 = cropRegion->y0 = cropRegion->width = cropRegion->height = 0;
     return -1;
   }
-  const size_t startChannel = alphaCrop ? numChannels - 1 : 0;
+  const RowScanner<T> scan{psamples, xsize, numChannels, alphaCrop && numChannels > 1};
 
-  // x0 is the coordinate of the first pixel and x1 is the coordinate PAST the last pixel.
-  // Set x0 and y0 to their respective upper bounds (inclusive).
-  // Set x1 and y1 to their respective lower bounds (inclusive).
-  uint32_t x0 = xsize - 1, y0 = ysize - 1, x1 = 0, y1 = 0;
+  // x0 and y0 are the coordinates of the first pixel; x1 and y1 are the coordinates PAST
+  // the last pixel.  Rows in [y0, y1) don't need to be checked by the edge searches,
+  // and pixels in [x0, x1) don't need to be checked by the margin search.
+  uint32_t x0 = xsize, y0 = ysize, x1 = 0, y1 = 0;
   if (protectRegion) {
     if (protectRegion->width > xsize ||
         protectRegion->x0 > xsize - protectRegion->width ||
@@ -380,155 +503,221 @@ int findCropRegion(const T* psamples, uint32_t xsize, uint32_t ysize,
                   protectRegion->y0, xsize, ysize);
       return -1;
     }
-    x0 = protectRegion->x0;
-    x1 = protectRegion->x0 + protectRegion->width;
-    y0 = protectRegion->y0;
-    y1 = protectRegion->y0 + protectRegion->height;
-    JXLTK_TRACE("Preserve region %" PRIu32 "x%" PRIu32 "+%" PRIu32 "+%" PRIu32 ", "
-                "so x0 <= %" PRIu32 ", y0 <= %" PRIu32 ", x1 >= %" PRIu32 ", "
-                "y1 >= %" PRIu32 "",
-                protectRegion->width,
-                protectRegion->height,
-                protectRegion->x0,
-                protectRegion->y0,
-                x0, y0, x1, y1);
-  }
-
-  // Find top non-zero pixel (y0)
-  const T* samples = psamples;
-  bool foundPixel = false;
-  for (uint32_t y = 0; y < ysize && !foundPixel; ++y) {
-    if (y == y0) {
-      // Reached caller's upper bound on y0, so have it exactly.
-      JXLTK_TRACE("Searching down reached y0 upper bound, so break; "
-                  "x0 <= %" PRIu32 " y0 = %" PRIu32 ", x1 >= %" PRIu32 ", y1 >= %" PRIu32,
-                  x0, y0, x1, y1);
-      foundPixel = true;
-      break;
-    }
-    for (uint32_t x = 0; x < xsize && !foundPixel; ++x, samples += numChannels) {
-      for (uint32_t c = startChannel; c < numChannels; ++c) {
-        if (samples[c] != 0) {
-          x0 = (x < x0) ? x : x0; // decrease upper bound
-          y0 = y; // exact
-          x1 = (x >= x1) ? x + 1 : x1; // increase lower bound
-          y1 = (y >= y1) ? y + 1 : y1; // increase lower bound
-          JXLTK_TRACE("Searching down: found pixel at (%" PRIu32 ",%" PRIu32 ");"
-                      " so... x0 <= %" PRIu32 " y0 = %" PRIu32 ", x1 >= %" PRIu32 ", "
-                      "y1 >= %" PRIu32 "",
-                      x, y, x0, y0, x1, y1);
-          foundPixel = true;
-          break;
-        }
-      }
+    if (protectRegion->width > 0 && protectRegion->height > 0) {
+      x0 = protectRegion->x0;
+      x1 = protectRegion->x0 + protectRegion->width;
+      y0 = protectRegion->y0;
+      y1 = protectRegion->y0 + protectRegion->height;
+      JXLTK_TRACE("Preserve region %" PRIu32 "x%" PRIu32 "+%" PRIu32 "+%" PRIu32,
+                  protectRegion->width, protectRegion->height, protectRegion->x0,
+                  protectRegion->y0);
     }
   }
 
-  if (!foundPixel) {
-    JXLTK_INFO("No non-zero pixels");
-    cropRegion->x0 = cropRegion->y0 = cropRegion->width = cropRegion->height = 0;
-    return 0;
-  }
-
-  // Scan rows from bottom to top to find y1
-  foundPixel = false;
-  for (uint32_t y = ysize; y-- > 0 && !foundPixel; ) {
-    if (y == y1 - 1) {
-      // Reached known lower bound on y1, so have it exactly.
-      JXLTK_TRACE("Searching up: %" PRIu32 " <= y1 < %" PRIu32 ", so stop", y1, y + 1);
-      break;
-    }
-    for (uint32_t x = 0; x < xsize && !foundPixel; ++x) {
-      samples = &psamples[numChannels * (y*xsize + x)];
-      for (uint32_t c = startChannel; c < numChannels; ++c) {
-        if (samples[c] != 0) {
-          y1 = y + 1; // exact
-          x0 = (x < x0) ? x : x0; // upper bound
-          x1 = (x >= x1) ? x + 1 : x1; // lower bound
-          JXLTK_TRACE("Searching up: found pixel at (%" PRIu32 ",%" PRIu32 ");"
-                      " so... x0 <= %" PRIu32 ", x1 >= %" PRIu32 ", y1 = %" PRIu32 "",
-                      x, y, x0, x1, y1);
-          foundPixel = true;
-          break;
-        }
+  ThreadPool& pool = sharedThreadPool();
+  if (numThreads == 0) {
+    numThreads = pool.numWorkers() + 1;
+  }
+  const size_t rowSamples = size_t{xsize} * numChannels;
+  const bool parallel = numThreads > 1 && size_t{ysize} * rowSamples >= 2 * kMinBandSize;
+
+  // Find the first and last occupied rows by searching down from the top and up from the
+  // bottom.  Each edge search stops when it reaches rows already known to be occupied or
+  // already checked by the other search, so on large frames the two run concurrently.
+  const uint32_t topLimit = std::min(y0, ysize);
+  const uint32_t bottomLimit = y1;
+  std::atomic<uint32_t> topNext{0};
+  std::atomic<uint32_t> bottomNext{ysize};
+  auto searchDown = [&]() -> optional<OccupiedRow> {
+    for (uint32_t y = 0; y < topLimit && y < bottomNext.load(); ++y) {
+      uint32_t first = scan.first(y, 0, xsize);
+      if (first < xsize) {
+        topNext.store(y);
+        return OccupiedRow{y, first, scan.last(y, first, xsize)};
       }
+      topNext.store(y + 1);
     }
-  }
-
-  // Scan columns from left to find x0
-  // x0 is currently an upper bound - if we find no pixels, it's now exact
-  foundPixel = false;
-  for (uint32_t x = 0; x < x0 && !foundPixel; x++) {
-    for (uint32_t y = y0 + 1; y < y1 && !foundPixel; y++) {
-      samples = &psamples[numChannels * (y*xsize + x)];
-      for (uint32_t c = startChannel; c < numChannels; ++c) {
-        if (samples[c] != 0) {
-          x0 = x; // exact
-          JXLTK_TRACE("Searching left->right: found pixel at (%" PRIu32 ",%" PRIu32 ");"
-                      " so... x0 = %" PRIu32 ", x1 >= %" PRIu32 "", x, y, x0, x1);
-          foundPixel = true;
-          break;
-        }
+    return std::nullopt;
+  };
+  auto searchUp = [&]() -> optional<OccupiedRow> {
+    for (uint32_t y = ysize; y-- > bottomLimit && y >= topNext.load(); ) {
+      uint32_t first = scan.first(y, 0, xsize);
+      if (first < xsize) {
+        bottomNext.store(y);
+        return OccupiedRow{y, first, scan.last(y, first, xsize)};
       }
+      bottomNext.store(y);
     }
-  }
-
-  // Scan columns from right to find x1
-  foundPixel = false;
-  for (uint32_t x = xsize; x-- > 0 && !foundPixel; ) {
-    if (x == x1 - 1) {
-      // Reached known lower bound on x1, so have it exactly.
-      JXLTK_TRACE("Searching right->left: %" PRIu32 " <= x1 < %" PRIu32 ", so stop",
-                  x1, x + 1);
-      break;
-    }
-    for (uint32_t y = y0; y < y1 && !foundPixel; y++) {
-      samples = &psamples[numChannels * (y*xsize + x)];
-      for (uint32_t c = startChannel; c < numChannels; ++c) {
-        if (samples[c] != 0) {
-          x1 = x + 1; // exact
-          JXLTK_TRACE("Searching right->left: found pixel at (%" PRIu32 ",%" PRIu32 ");"
-                      " so... x1 = %" PRIu32 "", x, y, x1);
-          foundPixel = true;
-          break;
-        }
+    return std::nullopt;
+  };
+  optional<OccupiedRow> top, bottom;
+  if (parallel) {
+    pool.parallelFor(2, [&](uint32_t edge) {
+      if (edge == 0) {
+        top = searchDown();
+      } else {
+        bottom = searchUp();
       }
+    });
+  } else {
+    top = searchDown();
+    bottom = searchUp();
+  }
+  for (const optional<OccupiedRow>& row : {top, bottom}) {
+    if (row) {
+      y0 = std::min(y0, row->y);
+      y1 = std::max(y1, row->y + 1);
+      x0 = std::min(x0, row->x0);
+      x1 = std::max(x1, row->x1);
     }
   }
-
-  if (x0 >= xsize || y0 >= ysize || x1 <= x0 || y1 <= y0) {
+  if (y0 >= y1) {
+    JXLTK_INFO("No non-zero pixels");
     cropRegion->x0 = cropRegion->y0 = cropRegion->width = cropRegion->height = 0;
     return 0;
   }
+  JXLTK_TRACE("Edge searches: y0 = %" PRIu32 ", y1 = %" PRIu32 ", "
+              "x0 <= %" PRIu32 ", x1 >= %" PRIu32, y0, y1, x0, x1);
+
+  // Widen [x0, x1) to cover the rest of the rows in between, checking only the margins
+  // that are still outside it.  Large frames are split into bands of rows that are
+  // searched concurrently.
+  auto searchMargins = [&scan, xsize](uint32_t yBegin, uint32_t yEnd,
+                                      uint32_t bandX0, uint32_t bandX1) {
+    for (uint32_t y = yBegin; y < yEnd && (bandX0 > 0 || bandX1 < xsize); ++y) {
+      bandX0 = scan.first(y, 0, bandX0);
+      bandX1 = scan.last(y, bandX1, xsize);
+    }
+    return std::make_pair(bandX0, bandX1);
+  };
+  const size_t numBands = parallel ?
+      std::min(numThreads, (y1 - y0) * rowSamples / kMinBandSize) : 1;
+  if (numBands <= 1) {
+    std::tie(x0, x1) = searchMargins(y0, y1, x0, x1);
+  } else {
+    const uint32_t bandRows = static_cast<uint32_t>((y1 - y0 + numBands - 1) / numBands);
+    const uint32_t bandCount = (y1 - y0 + bandRows - 1) / bandRows;
+    vector<std::pair<uint32_t, uint32_t> > spans(bandCount);
+    pool.parallelFor(bandCount, [&](uint32_t band) {
+      const uint32_t begin = y0 + band * bandRows;
+      spans[band] = searchMargins(begin, std::min(begin + bandRows, y1), x0, x1);
+    });
+    for (const std::pair<uint32_t, uint32_t>& span : spans) {
+      x0 = std::min(x0, span.first);
+      x1 = std::max(x1, span.second);
+    }
+  }
+
   cropRegion->x0 = x0;
   cropRegion->y0 = y0;
-  cropRegion->width = (x1 > x0 ? x1 - x0 : 0);
-  cropRegion->height = (y1 > y0 ? y1 - y0 : 0);
+  cropRegion->width = x1 - x0;
+  cropRegion->height = y1 - y0;
   return 0;
 }
 
 int findCropRegion(const void* psamples, uint32_t xsize, uint32_t ysize,
                    JxlDataType dataType, size_t numChannels, bool alphaCrop,
-                   CropRegion* cropRegion, const CropRegion* protectRegion) {
+                   CropRegion* cropRegion, const CropRegion* protectRegion,
+                   size_t numThreads) {
   if (dataType == JXL_TYPE_UINT8) {
     return findCropRegion<uint8_t>(static_cast<const uint8_t*>(psamples),
                                    xsize, ysize, numChannels, alphaCrop, cropRegion,
-                                   protectRegion);
+                                   protectRegion, numThreads);
   }
   if (dataType == JXL_TYPE_UINT16) {
     return findCropRegion<uint16_t>(static_cast<const uint16_t*>(psamples),
                                     xsize, ysize, numChannels, alphaCrop, cropRegion,
-                                    protectRegion);
+                                    protectRegion, numThreads);
   }
   if (dataType == JXL_TYPE_FLOAT) {
     return findCropRegion<float>(static_cast<const float*>(psamples),
                                  xsize, ysize, numChannels, alphaCrop, cropRegion,
-                                 protectRegion);
+                                 protectRegion, numThreads);
+  }
+  if (dataType == JXL_TYPE_FLOAT16) {
+    return findCropRegion<Float16>(static_cast<const Float16*>(psamples),
+                                   xsize, ysize, numChannels, alphaCrop, cropRegion,
+                                   protectRegion, numThreads);
+  }
+  JXLTK_ERROR("Unsupported data type: %d", static_cast<int>(dataType));
+  return -1;
+}
+
+template<class T>
+static void findNonZeroSpan(const RowScanner<T>& scan, uint32_t* begin, uint32_t* end) {
+  *begin = scan.first(0, 0, scan.xsize);
+  *end = *begin < scan.xsize ? scan.last(0, *begin, scan.xsize) : 0;
+  if (*end == 0) {
+    *begin = 0;
+  }
+}
+
+int findNonZeroSpan(const void* psamples, uint32_t numPixels, JxlDataType dataType,
+                    size_t numChannels, bool alphaCrop, uint32_t* begin, uint32_t* end) {
+  const bool alphaOnly = alphaCrop && numChannels > 1;
+  if (dataType == JXL_TYPE_UINT8) {
+    findNonZeroSpan(RowScanner<uint8_t>{static_cast<const uint8_t*>(psamples), numPixels,
+                                        numChannels, alphaOnly}, begin, end);
+    return 0;
+  }
+  if (dataType == JXL_TYPE_UINT16) {
+    findNonZeroSpan(RowScanner<uint16_t>{static_cast<const uint16_t*>(psamples),
+                                         numPixels, numChannels, alphaOnly},
+                    begin, end);
+    return 0;
+  }
+  if (dataType == JXL_TYPE_FLOAT) {
+    findNonZeroSpan(RowScanner<float>{static_cast<const float*>(psamples), numPixels,
+                                      numChannels, alphaOnly}, begin, end);
+    return 0;
+  }
+  if (dataType == JXL_TYPE_FLOAT16) {
+    findNonZeroSpan(RowScanner<Float16>{static_cast<const Float16*>(psamples), numPixels,
+                                        numChannels, alphaOnly}, begin, end);
+    return 0;
   }
   JXLTK_ERROR("Unsupported data type: %d", static_cast<int>(dataType));
   return -1;
 }
 
+int findChangedRegion(const void* pprev, const void* pnext, uint32_t xsize,
+                      uint32_t ysize, size_t bytesPerPixel, CropRegion* region) {
+  if (bytesPerPixel == 0 || !region) {
+    JXLTK_ERROR("Invalid arguments");
+    return -1;
+  }
+  *region = {0, 0, 0, 0};
+  const size_t stride = xsize * bytesPerPixel;
+  const uint8_t* prev = static_cast<const uint8_t*>(pprev);
+  const uint8_t* next = static_cast<const uint8_t*>(pnext);
+  auto rowDiffers = [&](size_t y) {
+    return memcmp(prev + y * stride, next + y * stride, stride) != 0;
+  };
+
+  uint32_t top = 0;
+  while (top < ysize && !rowDiffers(top)) ++top;
+  if (top == ysize) return 0;
+  uint32_t bottom = ysize;
+  while (!rowDiffers(bottom - 1)) --bottom;
+
+  // Each row only needs checking outside the columns already known to differ.
+  size_t left = stride, right = 0;
+  for (size_t y = top; y < bottom; ++y) {
+    const uint8_t* prevRow = prev + y * stride;
+    const uint8_t* nextRow = next + y * stride;
+    left = std::mismatch(prevRow, prevRow + left, nextRow).first - prevRow;
+    size_t end = stride;
+    while (end > right && prevRow[end - 1] == nextRow[end - 1]) --end;
+    right = std::max(right, end);
+  }
+  region->x0 = static_cast<uint32_t>(left / bytesPerPixel);
+  region->y0 = top;
+  region->width = static_cast<uint32_t>((right + bytesPerPixel - 1) / bytesPerPixel) -
+                  region->x0;
+  region->height = bottom - top;
+  return 0;
+}
+
 int cropInPlace(void* psamples, uint32_t width, uint32_t height,
                 JxlDataType dataType, size_t numChannels, const CropRegion& cropRegion) {
   uint32_t x1, y1;
@@ -120,6 +120,14 @@ uint32_t greatestCommonDivisor(const std::span<uint32_t>& numbers);
  */
 std::optional<std::pair<uint32_t,uint32_t> > parseRational(const char* s);
 
+/**
+ * Parse a size in bytes from a string of the form `[0-9]+[KMGT]?`, where the optional
+ * suffix multiplies the number by the corresponding power of 1024.  e.g. "512M".
+ * Returns an empty std::optional if the string couldn't be parsed or the result
+ * doesn't fit in a size_t.
+ */
+std::optional<size_t> parseByteSize(const char* s);
+
 /**
  * Multiply two unsigned values and return true if no overflow occurred.
  *
@@ -175,6 +183,21 @@ constexpr size_t bytesPerPixel(JxlDataType t, uint32_t numChannels) {
 int removeInterleavedChannel(void* pixels, uint32_t xsize, uint32_t ysize,
                              const JxlPixelFormat& format, uint32_t index);
 
+/**
+ * Like findDifferentSample, but split the arrays into contiguous bands (i.e. groups of
+ * rows) that are checked in parallel on the shared thread pool.  All bands stop as soon
+ * as any of them finds a difference, so the returned index isn't necessarily the first
+ * difference.
+ *
+ * @param[in] numBands Maximum number of bands, or 0 for one per thread in the shared
+ *   pool.
+ * @param[in] minBandSize Fewer bands are used if they'd have fewer samples than this.
+ * @return The index of a sample that differs by more than @p epsilon, or @p count.
+ */
+size_t findDifferentSampleParallel(const float* left, const float* right, size_t count,
+                                   float epsilon, size_t numBands = 0,
+                                   size_t minBandSize = size_t{1} << 16);
+
 /**
  * Given two open Decoders, check that every pixel in every channel of every frame matches
  *
@@ -182,8 +205,13 @@ int removeInterleavedChannel(void* pixels, uint32_t xsize, uint32_t ysize,
  * Whether frames are compared coalesced is determined by the options used when the inputs
  * were opened. Channel depths can be different, but each channel is compared at the
  * higher depth.
+ *
+ * @param[in] numThreads Maximum number of bands each channel is split into for
+ *   comparison, or 0 for one per thread in the shared pool.  The work runs on the shared
+ *   pool, which also decodes the two inputs concurrently when it has a spare worker.
  */
-bool haveSamePixels(jxlazy::Decoder& leftImage, jxlazy::Decoder& rightImage);
+bool haveSamePixels(jxlazy::Decoder& leftImage, jxlazy::Decoder& rightImage,
+                    size_t numThreads = 0);
 
 
 
@@ -212,11 +240,42 @@ struct CropRegion {
  *   This may be useful when checking multiple planar channels, as you might already know
  *   that a certain area must be preserved. This is allowed to be the same pointer as
  *   @p cropRegion.
+ * @param[in] numThreads Maximum number of bands to split large frames into, or 0 for
+ *   one per thread in the shared pool.  The bands are searched on the shared pool, so
+ *   no more threads are used than it has.
  * @return 0 on success.
  */
 int findCropRegion(const void* psamples, uint32_t xsize, uint32_t ysize,
                    JxlDataType dataType, size_t numChannels, bool alphaCrop,
-                   CropRegion* cropRegion, const CropRegion* protectRegion = nullptr);
+                   CropRegion* cropRegion, const CropRegion* protectRegion = nullptr,
+                   size_t numThreads = 0);
+
+/**
+ * Find the span of pixels in a single row that have non-zero samples.
+ *
+ * @param[in] psamples Array of `numPixels * numChannels` samples.
+ * @param[in] alphaCrop If true, consider only the last sample of each pixel.
+ * @param[out] begin,end Index of the first non-zero pixel, and one past the last.  Both
+ *   are 0 if there are no non-zero pixels.
+ * @return 0 on success.
+ */
+int findNonZeroSpan(const void* psamples, uint32_t numPixels, JxlDataType dataType,
+                    size_t numChannels, bool alphaCrop, uint32_t* begin, uint32_t* end);
+
+/**
+ * Find the smallest rectangular region containing every pixel that differs between two
+ * frames of the same size and format.
+ *
+ * Pixels are compared byte by byte, so for float samples, 0 and -0 count as different.
+ * If the frames are identical, the region will be 0x0+0+0.
+ *
+ * @param[in] pprev,pnext Arrays of `xsize * ysize` pixels, each @p bytesPerPixel bytes,
+ *   with no row padding.
+ * @param[out] region Result region.
+ * @return 0 on success.
+ */
+int findChangedRegion(const void* pprev, const void* pnext, uint32_t xsize,
+                      uint32_t ysize, size_t bytesPerPixel, CropRegion* region);
 
 
 /**
@@ -0,0 +1,130 @@
+/**
+ * Copyright (c) Alistair Barrow. All rights reserved.
+ *
+ * Use of this source code is governed by an MIT-style
+ * license that can be found in the LICENSE file.
+ */
+
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "bench_util.h"
+#include "pixmap.h"
+#include "util.h"
+
+// Each benchmark takes the frame width/height and an index into kFormats as arguments.
+
+static const JxlPixelFormat kFormats[] = {
+  {4, JXL_TYPE_UINT8, JXL_NATIVE_ENDIAN, 0},
+  {4, JXL_TYPE_UINT16, JXL_NATIVE_ENDIAN, 0},
+  {4, JXL_TYPE_FLOAT, JXL_NATIVE_ENDIAN, 0},
+  {4, JXL_TYPE_FLOAT16, JXL_NATIVE_ENDIAN, 0},
+};
+
+static void sizeAndFormatArgs(benchmark::internal::Benchmark* b) {
+  for (int64_t size : {256, 1024, 4096}) {
+    for (int64_t format = 0; format < std::ssize(kFormats); ++format) {
+      b->Args({size, format});
+    }
+  }
+}
+
+static void setBytesProcessed(benchmark::State& state, size_t bytes) {
+  state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * bytes));
+}
+
+static void BM_FindCropRegion(benchmark::State& state) {
+  const uint32_t size = static_cast<uint32_t>(state.range(0));
+  const JxlPixelFormat& format = kFormats[state.range(1)];
+  std::vector<uint8_t> pixels = jxltk::makeSyntheticPixels(size, size, format, 0,
+                                                           size / 4);
+  for (auto _ : state) {
+    jxltk::CropRegion region;
+    jxltk::findCropRegion(pixels.data(), size, size, format.data_type,
+                          format.num_channels, true, &region);
+    benchmark::DoNotOptimize(region);
+  }
+  setBytesProcessed(state, pixels.size());
+}
+BENCHMARK(BM_FindCropRegion)->Apply(sizeAndFormatArgs)->UseRealTime();
+
+static void BM_CropInPlace(benchmark::State& state) {
+  const uint32_t size = static_cast<uint32_t>(state.range(0));
+  const JxlPixelFormat& format = kFormats[state.range(1)];
+  const std::vector<uint8_t> original = jxltk::makeSyntheticPixels(size, size, format, 0);
+  std::vector<uint8_t> pixels(original.size());
+  const jxltk::CropRegion region = {size / 2, size / 2, size / 4, size / 4};
+  for (auto _ : state) {
+    state.PauseTiming();
+    memcpy(pixels.data(), original.data(), pixels.size());
+    state.ResumeTiming();
+    jxltk::cropInPlace(pixels.data(), size, size, format.data_type, format.num_channels,
+                       region);
+    benchmark::ClobberMemory();
+  }
+  setBytesProcessed(state, pixels.size() / 4);
+}
+BENCHMARK(BM_CropInPlace)->Apply(sizeAndFormatArgs);
+
+static void BM_RemoveInterleavedChannel(benchmark::State& state) {
+  const uint32_t size = static_cast<uint32_t>(state.range(0));
+  const JxlPixelFormat& format = kFormats[state.range(1)];
+  const std::vector<uint8_t> original = jxltk::makeSyntheticPixels(size, size, format, 0);
+  std::vector<uint8_t> pixels(original.size());
+  for (auto _ : state) {
+    state.PauseTiming();
+    memcpy(pixels.data(), original.data(), pixels.size());
+    state.ResumeTiming();
+    jxltk::removeInterleavedChannel(pixels.data(), size, size, format, 3);
+    benchmark::ClobberMemory();
+  }
+  setBytesProcessed(state, pixels.size());
+}
+BENCHMARK(BM_RemoveInterleavedChannel)->Apply(sizeAndFormatArgs);
+
+static void BM_AlphaFill(benchmark::State& state) {
+  const uint32_t size = static_cast<uint32_t>(state.range(0));
+  const JxlPixelFormat& format = kFormats[state.range(1)];
+  const std::vector<uint8_t> original = jxltk::makeSyntheticPixels(size, size, format, 0);
+  jxltk::Pixmap pixmap(size, size, format, original.data(), original.size());
+  for (auto _ : state) {
+    pixmap.alphaFill(0.5f);
+    benchmark::ClobberMemory();
+  }
+  setBytesProcessed(state, original.size());
+}
+BENCHMARK(BM_AlphaFill)->Apply(sizeAndFormatArgs);
+
+static void BM_IsFullyOpaque(benchmark::State& state) {
+  const uint32_t size = static_cast<uint32_t>(state.range(0));
+  const JxlPixelFormat& format = kFormats[state.range(1)];
+  // Fully opaque, so every pixel has to be checked
+  const std::vector<uint8_t> pixels = jxltk::makeSyntheticPixels(size, size, format, 0);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(jxltk::Pixmap::isFullyOpaque(pixels.data(), size, size,
+                                                          format));
+  }
+  setBytesProcessed(state, pixels.size());
+}
+BENCHMARK(BM_IsFullyOpaque)->Apply(sizeAndFormatArgs);
+
+static void BM_FindChangedRegion(benchmark::State& state) {
+  const uint32_t size = static_cast<uint32_t>(state.range(0));
+  const JxlPixelFormat& format = kFormats[state.range(1)];
+  // Identical frames, so every row is compared in full
+  const std::vector<uint8_t> prev = jxltk::makeSyntheticPixels(size, size, format, 0);
+  const std::vector<uint8_t> next = jxltk::makeSyntheticPixels(size, size, format, 0);
+  for (auto _ : state) {
+    jxltk::CropRegion region;
+    jxltk::findChangedRegion(prev.data(), next.data(), size, size,
+                             jxltk::bytesPerPixel(format.data_type, format.num_channels),
+                             &region);
+    benchmark::DoNotOptimize(region);
+  }
+  setBytesProcessed(state, prev.size() * 2);
+}
+BENCHMARK(BM_FindChangedRegion)->Apply(sizeAndFormatArgs);
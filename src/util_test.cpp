@@ -5,6 +5,10 @@
  * license that can be found in the LICENSE file.
  */
 
+#include <algorithm>
+#include <utility>
+#include <vector>
+
 #include <gtest/gtest.h>
 
 #include "util.h"
@@ -48,6 +52,20 @@ TEST(SplitString, Works) {
   }
 }
 
+TEST(ParseByteSize, Works) {
+  EXPECT_EQ(jxltk::parseByteSize("0"), 0);
+  EXPECT_EQ(jxltk::parseByteSize("1234"), 1234);
+  EXPECT_EQ(jxltk::parseByteSize("2k"), 2048);
+  EXPECT_EQ(jxltk::parseByteSize("3M"), 3 << 20);
+  EXPECT_EQ(jxltk::parseByteSize("1G"), size_t{1} << 30);
+  EXPECT_FALSE(jxltk::parseByteSize(""));
+  EXPECT_FALSE(jxltk::parseByteSize("-1"));
+  EXPECT_FALSE(jxltk::parseByteSize("M"));
+  EXPECT_FALSE(jxltk::parseByteSize("1MB"));
+  EXPECT_FALSE(jxltk::parseByteSize("1.5G"));
+  EXPECT_FALSE(jxltk::parseByteSize("99999999999999999999"));
+}
+
 TEST(FindCropRegion, ReturnsEmptyRegionForFullyTransparent) {
   uint8_t samples[16] = {0};
   jxltk::CropRegion cropRegion = { 1, 2, 3, 4 };
@@ -158,6 +176,138 @@ TEST(FindCropRegion, ReturnsSubRegion) {
   EXPECT_EQ(cropRegion.height, 3);
 }
 
+TEST(FindCropRegion, LargeFrame) {
+  // Big enough to be searched in parallel
+  constexpr uint32_t xsize = 1500, ysize = 1000;
+  std::vector<uint16_t> rgba(size_t{xsize} * ysize * 4);
+  jxltk::CropRegion cropRegion;
+  for (size_t numThreads : {1, 2, 8}) {
+    SCOPED_TRACE(testing::Message() << "numThreads=" << numThreads);
+    std::fill(rgba.begin(), rgba.end(), 0);
+    EXPECT_EQ(jxltk::findCropRegion(rgba.data(), xsize, ysize, JXL_TYPE_UINT16, 4, false,
+                                    &cropRegion, nullptr, numThreads), 0);
+    EXPECT_EQ(cropRegion.width, 0);
+    EXPECT_EQ(cropRegion.height, 0);
+
+    // Color that should be ignored by alphaCrop
+    rgba[(size_t{2} * xsize + 1) * 4] = 1;
+    // Extremes of visible pixels at (700,300), (1234,400), (200,500), (900,800)
+    for (auto [x, y] : {std::pair<size_t, size_t>{700, 300}, {1234, 400}, {200, 500},
+                        {900, 800}}) {
+      rgba[(y * xsize + x) * 4 + 3] = 1;
+    }
+    EXPECT_EQ(jxltk::findCropRegion(rgba.data(), xsize, ysize, JXL_TYPE_UINT16, 4, true,
+                                    &cropRegion, nullptr, numThreads), 0);
+    EXPECT_EQ(cropRegion.x0, 200);
+    EXPECT_EQ(cropRegion.y0, 300);
+    EXPECT_EQ(cropRegion.width, 1035);
+    EXPECT_EQ(cropRegion.height, 501);
+
+    EXPECT_EQ(jxltk::findCropRegion(rgba.data(), xsize, ysize, JXL_TYPE_UINT16, 4, false,
+                                    &cropRegion, nullptr, numThreads), 0);
+    EXPECT_EQ(cropRegion.x0, 1);
+    EXPECT_EQ(cropRegion.y0, 2);
+    EXPECT_EQ(cropRegion.width, 1234);
+    EXPECT_EQ(cropRegion.height, 799);
+  }
+}
+
+TEST(FindCropRegion, Float16) {
+  // -0.0 (0x8000) counts as zero; the smallest subnormal (0x0001) doesn't
+  constexpr uint16_t ga[] = { 0x8000,0x8000,  0,0x0000,  0,0,
+                              0x3c00,0x8000,  0,0x0001,  0,0,
+                              0x8000,0x0000,  0,0x8000,  0,0, };
+  jxltk::CropRegion cropRegion;
+  EXPECT_EQ(jxltk::findCropRegion(ga, 3, 3, JXL_TYPE_FLOAT16, 2, false, &cropRegion), 0);
+  EXPECT_EQ(cropRegion.x0, 0);
+  EXPECT_EQ(cropRegion.y0, 1);
+  EXPECT_EQ(cropRegion.width, 2);
+  EXPECT_EQ(cropRegion.height, 1);
+  EXPECT_EQ(jxltk::findCropRegion(ga, 3, 3, JXL_TYPE_FLOAT16, 2, true, &cropRegion), 0);
+  EXPECT_EQ(cropRegion.x0, 1);
+  EXPECT_EQ(cropRegion.y0, 1);
+  EXPECT_EQ(cropRegion.width, 1);
+  EXPECT_EQ(cropRegion.height, 1);
+
+  uint32_t begin = 99, end = 99;
+  EXPECT_EQ(jxltk::findNonZeroSpan(ga + 12, 3, JXL_TYPE_FLOAT16, 2, false, &begin, &end),
+            0);
+  EXPECT_EQ(begin, 0);
+  EXPECT_EQ(end, 0);
+}
+
+TEST(FindNonZeroSpan, Works) {
+  constexpr uint8_t ga[] = { 0,0,  5,0,  0,0,  0,7,  0,0,  3,0,  0,0 };
+  uint32_t begin = 99, end = 99;
+  EXPECT_EQ(jxltk::findNonZeroSpan(ga, 7, JXL_TYPE_UINT8, 2, false, &begin, &end), 0);
+  EXPECT_EQ(begin, 1);
+  EXPECT_EQ(end, 6);
+  EXPECT_EQ(jxltk::findNonZeroSpan(ga, 7, JXL_TYPE_UINT8, 2, true, &begin, &end), 0);
+  EXPECT_EQ(begin, 3);
+  EXPECT_EQ(end, 4);
+  EXPECT_EQ(jxltk::findNonZeroSpan(ga, 1, JXL_TYPE_UINT8, 2, false, &begin, &end), 0);
+  EXPECT_EQ(begin, 0);
+  EXPECT_EQ(end, 0);
+}
+
+TEST(FindChangedRegion, Works) {
+  // 5x4 frame of 2-byte pixels
+  uint8_t prev[40] = {0}, next[40] = {0};
+  jxltk::CropRegion region = { 9, 9, 9, 9 };
+  EXPECT_EQ(jxltk::findChangedRegion(prev, next, 5, 4, 2, &region), 0);
+  EXPECT_EQ(region.width, 0);
+  EXPECT_EQ(region.height, 0);
+
+  // Second byte of pixel (1,1), first byte of pixel (3,2)
+  next[1 * 10 + 1 * 2 + 1] = 1;
+  next[2 * 10 + 3 * 2] = 1;
+  EXPECT_EQ(jxltk::findChangedRegion(prev, next, 5, 4, 2, &region), 0);
+  EXPECT_EQ(region.width, 3);
+  EXPECT_EQ(region.height, 2);
+  EXPECT_EQ(region.x0, 1);
+  EXPECT_EQ(region.y0, 1);
+
+  next[39] = 1;
+  EXPECT_EQ(jxltk::findChangedRegion(prev, next, 5, 4, 2, &region), 0);
+  EXPECT_EQ(region.width, 4);
+  EXPECT_EQ(region.height, 3);
+  EXPECT_EQ(region.x0, 1);
+  EXPECT_EQ(region.y0, 1);
+}
+
+TEST(FindDifferentSampleParallel, Works) {
+  // Lower the minimum band size so this is split into 4 bands of 25000 samples, each
+  // checked in several steps
+  constexpr size_t count = 100000;
+  std::vector<float> left(count), right(count);
+  for (size_t i = 0; i < count; ++i) {
+    left[i] = right[i] = static_cast<float>(i % 256) / 255;
+  }
+  for (size_t numBands : {0, 1, 4}) {
+    SCOPED_TRACE(testing::Message() << "numBands=" << numBands);
+    std::vector<float> changed = right;
+    EXPECT_EQ(jxltk::findDifferentSampleParallel(left.data(), changed.data(), count,
+                                                 0.001f, numBands, 1000), count);
+    // Within epsilon
+    changed[80000] += 0.0005f;
+    EXPECT_EQ(jxltk::findDifferentSampleParallel(left.data(), changed.data(), count,
+                                                 0.001f, numBands, 1000), count);
+    // In the last band, and not in its first step
+    changed[95000] += 0.01f;
+    EXPECT_EQ(jxltk::findDifferentSampleParallel(left.data(), changed.data(), count,
+                                                 0.001f, numBands, 1000), 95000);
+    // Either difference may be reported
+    changed[30000] -= 0.01f;
+    size_t found = jxltk::findDifferentSampleParallel(left.data(), changed.data(), count,
+                                                      0.001f, numBands, 1000);
+    EXPECT_TRUE(found == 30000 || found == 95000) << found;
+    // Default band size
+    found = jxltk::findDifferentSampleParallel(left.data(), changed.data(), count,
+                                               0.001f, numBands);
+    EXPECT_TRUE(found == 30000 || found == 95000) << found;
+  }
+}
+
 TEST(FindCropRegion, ProtectsSpecifiedRegion) {
   uint8_t samples[16] = {0};
   jxltk::CropRegion protectRegion = { 2, 2, 1, 1 };